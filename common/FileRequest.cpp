@@ -0,0 +1,122 @@
+#include "FileRequest.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+constexpr uint64_t FileRequest::kToEndOfFile;
+
+bool parseFileRequest(const std::string& message, FileRequest& request) {
+  request = FileRequest();
+
+  // everything before the first '?' is the filename
+  const auto queryStart = message.find('?');
+  request.filename = message.substr(0, queryStart);
+  if (queryStart == std::string::npos) {
+    return true;
+  }
+
+  // the rest is a list of key=value pairs, separated by '&'
+  std::size_t fieldStart = queryStart + 1;
+  while (fieldStart <= message.length()) {
+    auto fieldEnd = message.find('&', fieldStart);
+    if (fieldEnd == std::string::npos) {
+      fieldEnd = message.length();
+    }
+    const auto field = message.substr(fieldStart, fieldEnd - fieldStart);
+    fieldStart = fieldEnd + 1;
+
+    const auto equals = field.find('=');
+    if (equals == std::string::npos) {
+      return false;
+    }
+    const auto key = field.substr(0, equals);
+    const auto value = field.substr(equals + 1);
+    if (key == "offset") {
+      if (not parseUint64(value, request.offset)) {
+        return false;
+      }
+      request.hasRange = true;
+    } else if (key == "length") {
+      if (not parseUint64(value, request.length)) {
+        return false;
+      }
+      request.hasRange = true;
+    } else if (key == "compress") {
+      // zstd is the only compression we support
+      if (value != "zstd") {
+        return false;
+      }
+      request.compress = true;
+    } else if (key == "checksum") {
+      // CRC32C is the only checksum we support
+      if (value != "crc32c") {
+        return false;
+      }
+      request.checksum = true;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string formatFileRequest(const FileRequest& request) {
+  std::vector<std::string> fields;
+  if (request.hasRange) {
+    fields.push_back("offset=" + std::to_string(request.offset));
+    if (request.length != FileRequest::kToEndOfFile) {
+      fields.push_back("length=" + std::to_string(request.length));
+    }
+  }
+  if (request.compress) {
+    fields.push_back("compress=zstd");
+  }
+  if (request.checksum) {
+    fields.push_back("checksum=crc32c");
+  }
+
+  std::string message = request.filename;
+  for (std::size_t i = 0; i < fields.size(); i++) {
+    message += (i == 0 ? "?" : "&") + fields[i];
+  }
+  return message;
+}
+
+bool parseUint64(const std::string& str, uint64_t& value) {
+  if (str.empty() || str.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  errno = 0;
+  value = std::strtoull(str.c_str(), nullptr, 10);
+  return errno == 0;
+}
+
+std::string formatChecksum(const uint32_t checksum) {
+  char hexDigits[9];
+  std::snprintf(
+      hexDigits, sizeof(hexDigits), "%08x", static_cast<unsigned>(checksum));
+  return hexDigits;
+}
+
+bool parseChecksum(const std::string& message, uint32_t& checksum) {
+  if (message.size() != 8 ||
+      message.find_first_not_of("0123456789abcdef") != std::string::npos) {
+    return false;
+  }
+  checksum = static_cast<uint32_t>(std::strtoul(message.c_str(), nullptr, 16));
+  return true;
+}
+
+std::string formatBusyResponse(const uint64_t retryAfterMs) {
+  return kBusyResponsePrefix + std::to_string(retryAfterMs);
+}
+
+bool parseBusyResponse(const std::string& message, uint64_t& retryAfterMs) {
+  const auto prefixLength = kBusyResponsePrefix.length();
+  if (message.compare(0, prefixLength, kBusyResponsePrefix) != 0) {
+    return false;
+  }
+  return parseUint64(message.substr(prefixLength), retryAfterMs);
+}
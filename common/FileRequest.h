@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+/**
+ * A client's request for (part of) a file.
+ *
+ * On the wire, a request is a filename optionally followed by a byte range,
+ * for example "linux.jpg?offset=1024&length=4096". Either key may be left out:
+ * the offset defaults to the start of the file and the length to the rest of
+ * the file.
+ *
+ * The server answers a plain request with the header "<bytes>#", and a byte
+ * range request with "<bytes>/<file size>#", so that clients can learn the
+ * size of the whole file (e.g., to split it across several connections).
+ *
+ * A request may also ask for the response to be compressed, by adding
+ * "compress=zstd" (e.g., "log.txt?compress=zstd"). If the server agrees, it
+ * appends ";zstd" to the header (e.g., "<bytes>;zstd#", where <bytes> is the
+ * uncompressed size), and sends the compressed bytes as a series of chunks,
+ * each preceded by its size and a delimiter ("<chunk bytes>#"). A chunk of
+ * size zero ends the response.
+ *
+ * A request may also ask for a checksum of the response, by adding
+ * "checksum=crc32c". If the server agrees, it appends ";crc32c" to the header
+ * (after ";zstd", if both), and follows the response (after the empty chunk
+ * of a compressed response) with the CRC32C of the file's bytes it sent
+ * (uncompressed), as 8 hex digits and a delimiter, e.g. "e3069283#". Clients
+ * can check the bytes as they arrive, instead of reading the file back once
+ * it has been saved. A checksum is only sent for files that were found.
+ *
+ * A server that is too busy to take a connection answers it with
+ * "busy:<milliseconds>#" instead, before (and instead of) any response, and
+ * closes it; the client may connect again after that many milliseconds. The
+ * busy response is sent as text even with binary framing, since the server
+ * doesn't know which framing the client uses yet; clients recognize it by its
+ * first byte, which can't start a header or a frame.
+ */
+struct FileRequest {
+  // length used when the request doesn't limit the number of bytes sent
+  static constexpr uint64_t kToEndOfFile = UINT64_MAX;
+
+  // filename requested
+  std::string filename;
+
+  // whether the request carried a byte range
+  bool hasRange = false;
+
+  // offset of the first byte requested
+  uint64_t offset = 0;
+
+  // number of bytes requested, starting at offset
+  uint64_t length = kToEndOfFile;
+
+  // whether the client asked for the response to be compressed with zstd
+  bool compress = false;
+
+  // whether the client asked for a CRC32C checksum following the response
+  bool checksum = false;
+};
+
+/**
+ * Parse a request message (without the delimiter) into request.
+ *
+ * Returns false if the byte range (or any other option) is malformed.
+ */
+bool parseFileRequest(const std::string& message, FileRequest& request);
+
+/**
+ * Format a request as a message to send (without the delimiter).
+ */
+std::string formatFileRequest(const FileRequest& request);
+
+/**
+ * Parse a decimal string into value; rejects empty strings, signs, and
+ * trailing garbage.
+ */
+bool parseUint64(const std::string& str, uint64_t& value);
+
+/**
+ * Format the checksum following a response (without the delimiter).
+ */
+std::string formatChecksum(const uint32_t checksum);
+
+/**
+ * Parse the checksum following a response (without the delimiter).
+ *
+ * Returns false if the message is not a valid checksum.
+ */
+bool parseChecksum(const std::string& message, uint32_t& checksum);
+
+// start of the response to a connection the server is too busy to take
+const std::string kBusyResponsePrefix = "busy:";
+
+/**
+ * Format the busy response asking a client to retry after retryAfterMs
+ * milliseconds (without the delimiter).
+ */
+std::string formatBusyResponse(const uint64_t retryAfterMs);
+
+/**
+ * Parse a busy response (without the delimiter) into retryAfterMs.
+ *
+ * Returns false if the message is not a valid busy response.
+ */
+bool parseBusyResponse(const std::string& message, uint64_t& retryAfterMs);
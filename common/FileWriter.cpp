@@ -0,0 +1,196 @@
+#include "FileWriter.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+constexpr std::size_t FileWriter::kDirectIoAlignment;
+constexpr std::size_t FileWriter::kDirectIoBufferBytes;
+
+namespace {
+
+/**
+ * Return an error_code for the current value of errno.
+ */
+boost::system::error_code lastError() {
+  return boost::system::error_code(errno, boost::system::system_category());
+}
+
+} // namespace
+
+FileWriter::FileWriter() : directBuffer_(nullptr, std::free) {}
+
+FileWriter::~FileWriter() {
+  boost::system::error_code ignoredError;
+  close(ignoredError);
+}
+
+void FileWriter::open(
+    const std::string& path,
+    const bool truncate,
+    const uint64_t offset,
+    const uint64_t numBytes,
+    const FileWriterOptions& options,
+    boost::system::error_code& error) {
+  error.clear();
+  fd_ = ::open(
+      path.c_str(),
+      O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0),
+      0644);
+  if (fd_ < 0) {
+    error = lastError();
+    return;
+  }
+  nextOffset_ = offset;
+  bytesWritten_ = 0;
+
+  // reserve the range's blocks without changing the file's size, so that the
+  // size still shows how much of a download has arrived if it's cut short
+  if (options.preallocate && numBytes > 0 &&
+      fallocate(fd_, FALLOC_FL_KEEP_SIZE, offset, numBytes) != 0) {
+    if (errno != EOPNOTSUPP && errno != ENOSYS) {
+      error = lastError();
+      return;
+    }
+    LOG(INFO) << "File system can't preallocate " << path << ", skipping";
+  }
+
+  // O_DIRECT writes must start at an aligned offset; the range can still be
+  // written to, just through the page cache
+  if (options.directIo) {
+    if (offset % kDirectIoAlignment != 0) {
+      LOG(INFO)
+          << "Offset " << offset << " isn't aligned for O_DIRECT, writing "
+          << path << " through the page cache";
+      return;
+    }
+    boost::system::error_code directIoError;
+    setDirectIo(true, directIoError);
+    if (directIoError) {
+      LOG(INFO)
+          << "File system can't write " << path << " with O_DIRECT ("
+          << directIoError.message() << "), writing through the page cache";
+      return;
+    }
+    directBuffer_.reset(static_cast<char*>(
+        std::aligned_alloc(kDirectIoAlignment, kDirectIoBufferBytes)));
+    directBufferBytes_ = 0;
+    if (not directBuffer_) {
+      error = boost::system::errc::make_error_code(
+          boost::system::errc::not_enough_memory);
+    }
+  }
+}
+
+void FileWriter::write(
+    const char* data,
+    const std::size_t numBytes,
+    boost::system::error_code& error) {
+  error.clear();
+  if (not directBuffer_) {
+    writeAt(data, numBytes, nextOffset_, error);
+    nextOffset_ += numBytes;
+    bytesWritten_ += numBytes;
+    return;
+  }
+
+  // gather the bytes into whole buffers, each written with a single
+  // (aligned) write
+  std::size_t bytesCopied = 0;
+  while (bytesCopied < numBytes) {
+    const auto copyBytes = std::min(
+        numBytes - bytesCopied, kDirectIoBufferBytes - directBufferBytes_);
+    std::memcpy(
+        directBuffer_.get() + directBufferBytes_, data + bytesCopied,
+        copyBytes);
+    directBufferBytes_ += copyBytes;
+    bytesCopied += copyBytes;
+    bytesWritten_ += copyBytes;
+    if (directBufferBytes_ == kDirectIoBufferBytes) {
+      writeAt(directBuffer_.get(), directBufferBytes_, nextOffset_, error);
+      if (error) {
+        return;
+      }
+      nextOffset_ += directBufferBytes_;
+      directBufferBytes_ = 0;
+    }
+  }
+}
+
+void FileWriter::close(boost::system::error_code& error) {
+  error.clear();
+  if (fd_ < 0) {
+    return;
+  }
+
+  // the whole blocks left in the buffer still go out with O_DIRECT; the tail
+  // of the file can't, since it isn't a whole block
+  if (directBuffer_ && directBufferBytes_ > 0) {
+    const auto alignedBytes =
+        directBufferBytes_ - directBufferBytes_ % kDirectIoAlignment;
+    writeAt(directBuffer_.get(), alignedBytes, nextOffset_, error);
+    if (not error && alignedBytes < directBufferBytes_) {
+      setDirectIo(false, error);
+    }
+    if (not error) {
+      writeAt(
+          directBuffer_.get() + alignedBytes,
+          directBufferBytes_ - alignedBytes, nextOffset_ + alignedBytes,
+          error);
+    }
+    nextOffset_ += directBufferBytes_;
+    directBufferBytes_ = 0;
+  }
+  directBuffer_.reset();
+
+  if (::close(fd_) != 0 && not error) {
+    error = lastError();
+  }
+  fd_ = -1;
+}
+
+uint64_t FileWriter::getBytesWritten() const {
+  return bytesWritten_;
+}
+
+bool FileWriter::isDirectIo() const {
+  return directBuffer_ != nullptr;
+}
+
+void FileWriter::writeAt(
+    const char* data,
+    const std::size_t numBytes,
+    const uint64_t offset,
+    boost::system::error_code& error) {
+  // pwrite may write fewer bytes than asked for
+  std::size_t bytesWritten = 0;
+  while (bytesWritten < numBytes) {
+    const auto result = pwrite(
+        fd_, data + bytesWritten, numBytes - bytesWritten,
+        offset + bytesWritten);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result < 0) {
+      error = lastError();
+      return;
+    }
+    bytesWritten += result;
+  }
+}
+
+void FileWriter::setDirectIo(
+    const bool directIo,
+    boost::system::error_code& error) {
+  const int flags = fcntl(fd_, F_GETFL);
+  if (flags < 0 ||
+      fcntl(fd_, F_SETFL, directIo ? flags | O_DIRECT : flags & ~O_DIRECT) !=
+          0) {
+    error = lastError();
+  }
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <boost/system/error_code.hpp>
+
+/**
+ * How a FileWriter writes to its file.
+ */
+struct FileWriterOptions {
+  // reserve the disk space for all of the bytes when the file is opened, with
+  // fallocate(2), so that the file isn't fragmented by being extended a chunk
+  // at a time and a full disk is noticed before the transfer starts (ignored
+  // if the file system doesn't support it)
+  bool preallocate = false;
+
+  // write with O_DIRECT, bypassing the page cache, so that a large download
+  // doesn't evict everything else from memory (the file falls back to
+  // buffered writes if the file system doesn't support it, or the offset
+  // isn't aligned)
+  bool directIo = false;
+};
+
+/**
+ * Writes a stream of bytes to consecutive offsets of a file as they arrive,
+ * so that a download never has to be held in memory.
+ *
+ * With O_DIRECT, the bytes are gathered in an aligned buffer and written a
+ * whole number of blocks at a time; the unaligned tail is written by close.
+ */
+class FileWriter {
+ public:
+  FileWriter();
+  ~FileWriter();
+
+  FileWriter(const FileWriter&) = delete;
+  FileWriter& operator=(const FileWriter&) = delete;
+
+  /**
+   * Open (or create) a file to write numBytes bytes to, starting at offset.
+   *
+   * If truncate is set, the file's previous contents are discarded; otherwise
+   * the bytes outside of the range written are kept (e.g., to resume a
+   * partial download, or to have several writers fill in different ranges of
+   * the same file at once).
+   */
+  void open(
+      const std::string& path,
+      const bool truncate,
+      const uint64_t offset,
+      const uint64_t numBytes,
+      const FileWriterOptions& options,
+      boost::system::error_code& error);
+
+  /**
+   * Write the next numBytes bytes of the range.
+   */
+  void write(
+      const char* data,
+      const std::size_t numBytes,
+      boost::system::error_code& error);
+
+  /**
+   * Write any bytes still buffered, and close the file. Called by the
+   * destructor, ignoring errors, if not called before.
+   */
+  void close(boost::system::error_code& error);
+
+  /**
+   * Return the bytes passed to write so far.
+   */
+  uint64_t getBytesWritten() const;
+
+  /**
+   * Return whether the file is being written with O_DIRECT.
+   */
+  bool isDirectIo() const;
+
+  // alignment of O_DIRECT buffers, offsets and lengths (the largest logical
+  // block size in common use), and size of the buffer gathering them
+  static constexpr std::size_t kDirectIoAlignment = 4096;
+  static constexpr std::size_t kDirectIoBufferBytes = 1024 * 1024;
+
+ private:
+  /**
+   * Write numBytes bytes at offset with pwrite, retrying until all of them
+   * have been written.
+   */
+  void writeAt(
+      const char* data,
+      const std::size_t numBytes,
+      const uint64_t offset,
+      boost::system::error_code& error);
+
+  /**
+   * Turn O_DIRECT on or off for fd_.
+   */
+  void setDirectIo(const bool directIo, boost::system::error_code& error);
+
+  // file descriptor (-1 if not open)
+  int fd_ = -1;
+
+  // offset the next write to the file goes to, and bytes passed to write so
+  // far
+  //
+  // with O_DIRECT, that's where the bytes in directBuffer_ go once it's full
+  uint64_t nextOffset_ = 0;
+  uint64_t bytesWritten_ = 0;
+
+  // aligned buffer gathering bytes for O_DIRECT writes (null without
+  // O_DIRECT), and the bytes in it
+  std::unique_ptr<char, void (*)(void*)> directBuffer_;
+  std::size_t directBufferBytes_ = 0;
+};
@@ -0,0 +1,79 @@
+#include "ProgressMeter.h"
+
+#include <cstdio>
+
+constexpr std::chrono::milliseconds ProgressMeter::kUpdateInterval;
+
+namespace {
+
+constexpr double kBytesPerMib = 1024.0 * 1024.0;
+
+} // namespace
+
+ProgressMeter::ProgressMeter(
+    const std::string& label,
+    const uint64_t totalBytes,
+    const bool enabled)
+  : label_(label),
+    totalBytes_(totalBytes),
+    enabled_(enabled),
+    startTime_(std::chrono::steady_clock::now()),
+    bytes_(0),
+    lastPrintTime_(startTime_) {}
+
+void ProgressMeter::add(const uint64_t numBytes) {
+  bytes_ += numBytes;
+  if (not enabled_) {
+    return;
+  }
+
+  // another thread printing right now will show our bytes too
+  std::unique_lock<std::mutex> lock(printMutex_, std::try_to_lock);
+  if (not lock.owns_lock()) {
+    return;
+  }
+  const auto now = std::chrono::steady_clock::now();
+  if (now - lastPrintTime_ >= kUpdateInterval) {
+    lastPrintTime_ = now;
+    print(false);
+  }
+}
+
+void ProgressMeter::finish() {
+  if (enabled_) {
+    std::lock_guard<std::mutex> guard(printMutex_);
+    print(true);
+  }
+}
+
+uint64_t ProgressMeter::getBytes() const {
+  return bytes_.load();
+}
+
+double ProgressMeter::getElapsedSeconds() const {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now() - startTime_)
+      .count();
+}
+
+double ProgressMeter::getMibPerSecond() const {
+  const auto seconds = getElapsedSeconds();
+  return seconds > 0 ? getBytes() / kBytesPerMib / seconds : 0;
+}
+
+void ProgressMeter::print(const bool final) {
+  // \r returns to the start of the line, so that each update overwrites the
+  // last one; stderr isn't buffered, so the update shows up right away
+  const auto bytes = getBytes();
+  if (totalBytes_ > 0) {
+    std::fprintf(
+        stderr, "\r%s: %.1f of %.1f MiB (%d%%), %.1f MiB/s%s", label_.c_str(),
+        bytes / kBytesPerMib, totalBytes_ / kBytesPerMib,
+        static_cast<int>(bytes * 100 / totalBytes_), getMibPerSecond(),
+        final ? "\n" : "");
+  } else {
+    std::fprintf(
+        stderr, "\r%s: %.1f MiB, %.1f MiB/s%s", label_.c_str(),
+        bytes / kBytesPerMib, getMibPerSecond(), final ? "\n" : "");
+  }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+/**
+ * Counts the bytes of a transfer as they arrive, and (if enabled) keeps a
+ * line on stderr up to date with its progress and throughput, e.g.
+ *
+ *   huge.bin: 412.0 of 1024.0 MiB (40%), 118.3 MiB/s
+ *
+ * add may be called from several threads at once (e.g., one per connection
+ * of a parallel download); it never blocks on another thread's printing.
+ */
+class ProgressMeter {
+ public:
+  /**
+   * Start measuring a transfer of totalBytes bytes (0 if unknown).
+   */
+  ProgressMeter(
+      const std::string& label,
+      const uint64_t totalBytes,
+      const bool enabled);
+
+  ProgressMeter(const ProgressMeter&) = delete;
+  ProgressMeter& operator=(const ProgressMeter&) = delete;
+
+  /**
+   * Count numBytes more bytes, and update the line if it hasn't been updated
+   * for kUpdateInterval.
+   */
+  void add(const uint64_t numBytes);
+
+  /**
+   * Update the line one last time, and end it.
+   */
+  void finish();
+
+  /**
+   * Return the bytes counted so far.
+   */
+  uint64_t getBytes() const;
+
+  /**
+   * Return the seconds since the meter was created.
+   */
+  double getElapsedSeconds() const;
+
+  /**
+   * Return the average throughput so far, in MiB/s.
+   */
+  double getMibPerSecond() const;
+
+  // how often the line is updated at most, so that printing doesn't slow
+  // down the transfer
+  static constexpr auto kUpdateInterval = std::chrono::milliseconds(250);
+
+ private:
+  /**
+   * Print the line, ending it with a newline if final is set.
+   *
+   * Must be called with printMutex_ held.
+   */
+  void print(const bool final);
+
+  const std::string label_;
+  const uint64_t totalBytes_;
+  const bool enabled_;
+  const std::chrono::steady_clock::time_point startTime_;
+
+  std::atomic<uint64_t> bytes_;
+
+  // hold this mutex when printing or accessing lastPrintTime_
+  std::mutex printMutex_;
+  std::chrono::steady_clock::time_point lastPrintTime_;
+};
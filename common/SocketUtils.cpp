@@ -0,0 +1,548 @@
+#include "SocketUtils.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include <glog/logging.h>
+
+void encodeFrameHeader(const FrameHeader& header, EncodedFrameHeader& data) {
+  // encode byte by byte, so that the result is little endian no matter which
+  // byte order the host uses
+  data[0] = static_cast<char>(header.type);
+  data[1] = static_cast<char>(header.flags);
+  data[2] = '\0';
+  data[3] = '\0';
+  for (int i = 0; i < 4; i++) {
+    data[4 + i] = static_cast<char>((header.requestId >> (8 * i)) & 0xff);
+  }
+  for (int i = 0; i < 8; i++) {
+    data[8 + i] = static_cast<char>((header.length >> (8 * i)) & 0xff);
+  }
+}
+
+
+void appendFrameHeader(std::string& str, const FrameHeader& header) {
+  EncodedFrameHeader data;
+  encodeFrameHeader(header, data);
+  str.append(data.data(), data.size());
+}
+
+
+bool decodeFrameHeader(std::string_view data, FrameHeader& header) {
+  if (data.size() < kFrameHeaderBytes) {
+    return false;
+  }
+
+  // reject types we don't know about, and headers using the reserved bytes
+  const auto type = static_cast<uint8_t>(data[0]);
+  switch (static_cast<FrameType>(type)) {
+    case FrameType::kRequest:
+    case FrameType::kResponse:
+    case FrameType::kError:
+    case FrameType::kMessage:
+    case FrameType::kChunk:
+    case FrameType::kChecksum:
+    case FrameType::kHello:
+      break;
+    default:
+      return false;
+  }
+  if (data[2] != '\0' || data[3] != '\0') {
+    return false;
+  }
+
+  header.type = static_cast<FrameType>(type);
+  header.flags = static_cast<uint8_t>(data[1]);
+  header.requestId = decodeUint32(data.data() + 4);
+  header.length = decodeUint64(data.data() + 8);
+  return true;
+}
+
+
+void appendUint64(std::string& str, const uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    str.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+
+uint64_t decodeUint64(const char* data) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value |= static_cast<uint64_t>(static_cast<uint8_t>(data[i])) << (8 * i);
+  }
+  return value;
+}
+
+
+void appendUint32(std::string& str, const uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    str.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+
+uint32_t decodeUint32(const char* data) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) {
+    value |= static_cast<uint32_t>(static_cast<uint8_t>(data[i])) << (8 * i);
+  }
+  return value;
+}
+
+
+void sendBytes(
+    boost::asio::ip::tcp::socket& socket,
+    const std::string& message,
+    boost::system::error_code& error) {
+  sendBytes(socket, boost::asio::buffer(message), error);
+}
+
+
+void sendBytes(
+    boost::asio::ip::tcp::socket& socket,
+    const std::string& message) {
+  boost::system::error_code error;
+  sendBytes(socket, message, error);
+  if (error) {
+    LOG(FATAL)
+        << "Send error: "
+        << boost::system::system_error(error).what();
+  }
+}
+
+
+void sendBytes(
+    boost::asio::ip::tcp::socket& socket,
+    const boost::asio::const_buffer& buffer,
+    boost::system::error_code& error) {
+  boost::asio::write(socket, buffer, boost::asio::transfer_all(), error);
+  if (error) {
+    // error during send, return
+    // the caller should check error before acting on the return value
+    return;
+  }
+}
+
+
+void sendBytes(
+    boost::asio::ip::tcp::socket& socket,
+    const boost::asio::const_buffer& buffer) {
+  boost::system::error_code error;
+  sendBytes(socket, buffer, error);
+  if (error) {
+    LOG(FATAL)
+        << "Send error: "
+        << boost::system::system_error(error).what();
+  }
+}
+
+
+std::size_t sendFile(
+    boost::asio::ip::tcp::socket& socket,
+    const int fileFd,
+    const uint64_t offset,
+    const std::size_t numBytes,
+    boost::system::error_code& error) {
+  error = boost::system::error_code();
+  off_t fileOffset = offset;
+  for (;;) {
+    const auto bytesSent =
+        ::sendfile(socket.native_handle(), fileFd, &fileOffset, numBytes);
+    if (bytesSent >= 0) {
+      return bytesSent;
+    }
+
+    // retry if we were interrupted by a signal before sending anything
+    if (errno == EINTR) {
+      continue;
+    }
+
+    // error during send, return zero bytes sent
+    // the caller should check error before acting on the return value
+    error = boost::system::error_code(errno, boost::system::system_category());
+    return 0;
+  }
+}
+
+
+void setTcpCork(
+    boost::asio::ip::tcp::socket& socket,
+    const bool cork,
+    boost::system::error_code& error) {
+  error = boost::system::error_code();
+  const int value = cork ? 1 : 0;
+  if (::setsockopt(
+          socket.native_handle(), IPPROTO_TCP, TCP_CORK,
+          &value, sizeof(value)) != 0) {
+    error = boost::system::error_code(errno, boost::system::system_category());
+  }
+}
+
+
+void setReusePort(
+    boost::asio::ip::tcp::acceptor& acceptor,
+    const bool reusePort,
+    boost::system::error_code& error) {
+  error = boost::system::error_code();
+  const int value = reusePort ? 1 : 0;
+  if (::setsockopt(
+          acceptor.native_handle(), SOL_SOCKET, SO_REUSEPORT,
+          &value, sizeof(value)) != 0) {
+    error = boost::system::error_code(errno, boost::system::system_category());
+  }
+}
+
+
+std::string readUntilDelimiter(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const std::string& delimiter,
+    boost::system::error_code& error) {
+  std::string readString;
+  readUntilDelimiter(socket, rcvBuffer, delimiter, readString, error);
+  return readString;
+}
+
+
+std::string readUntilDelimiter(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const std::string& delimiter) {
+  boost::system::error_code error;
+  const auto rcvStr = readUntilDelimiter(socket, rcvBuffer, delimiter, error);
+  if (error) {
+    LOG(FATAL)
+        << "Read error: "
+        << boost::system::system_error(error).what();
+  }
+  return rcvStr;
+}
+
+
+void readUntilDelimiter(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const std::string& delimiter,
+    std::string& message,
+    boost::system::error_code& error) {
+  const auto view = peekUntilDelimiter(socket, rcvBuffer, delimiter, error);
+  if (error) {
+    // error during read, return empty message
+    // the caller should check error before acting on message
+    message.clear();
+    return;
+  }
+
+  // copy the message out in one go, then consume all of the data (including
+  // the delimiter) from our read buffer
+  //
+  // there may be additional data left in the buffer, see readBytes comments
+  message.assign(view.data(), view.size());
+  rcvBuffer.consume(view.size() + delimiter.length());
+}
+
+
+std::string_view peekUntilDelimiter(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const std::string& delimiter,
+    boost::system::error_code& error) {
+  // blocking read on the socket until the delimiter
+  const auto bytesTransferred =
+      boost::asio::read_until(socket, rcvBuffer, delimiter, error);
+  if (error) {
+    // error during read, return empty view
+    // the caller should check error before acting on the return value
+    return std::string_view();
+  }
+
+  // read_until may read more data into the buffer (past our delimiter)
+  // so we need to extract based on the bytesTransferred value
+  return peekBytes(rcvBuffer, bytesTransferred - delimiter.length());
+}
+
+
+std::string_view peekBytes(
+    const boost::asio::streambuf& rcvBuffer,
+    const std::size_t numBytes) {
+  // a streambuf keeps its readable bytes in a single contiguous block, so we
+  // can point straight at them instead of walking buffers_begin iterators
+  const auto data = rcvBuffer.data();
+  return std::string_view(static_cast<const char*>(data.data()), numBytes);
+}
+
+
+std::string readBytes(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const std::size_t numBytesToRead,
+    boost::system::error_code& error) {
+  // allocate the string once at its final size and read straight into it,
+  // see readBytes(4) with a caller supplied buffer
+  std::string readString(numBytesToRead, '\0');
+  readBytes(
+      socket, rcvBuffer,
+      boost::asio::buffer(&readString[0], readString.size()), error);
+  if (error) {
+    // error during read, return empty string
+    // the caller should check error before acting on the return value
+    return "";
+  }
+  return readString;
+}
+
+
+std::string readBytes(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const std::size_t numBytesToRead) {
+  boost::system::error_code error;
+  const auto rcvStr = readBytes(socket, rcvBuffer, numBytesToRead, error);
+  if (error) {
+    LOG(FATAL)
+        << "Read error: "
+        << boost::system::system_error(error).what();
+  }
+  return rcvStr;
+}
+
+
+std::size_t readBytes(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const boost::asio::mutable_buffer& buffer,
+    boost::system::error_code& error) {
+  // When using read_until with a delimiter, more bytes than necessary may be
+  // read into the streambuf. For instance, if we want to read until a "#", and
+  // the stream is "abcde#fghij", the buffer may actually end up containing
+  // "abcde#fg" (two more bytes than what we needed to capture to get the
+  // delimiter). read_until automatically takes care of this when called again
+  // (it checks if the streambuf already has an instance of the delimiter).
+  //
+  // However, this "overreading" becomes a problem if we subsequently call
+  // "read" with a "transfer_exactly" parameter. For instance, we may expect
+  // 64 bytes (due to a variable in a header, such as CONTENT LENGTH). If the
+  // buffer already contains two bytes (due to the previous overread), then
+  // we'll end up waiting forever (as the server will only send 62 more bytes),
+  // or we'll end up with a corrupt message that contains two bytes of the next
+  // message.
+  //
+  // To handle this, we first check how many bytes the buffer contains, and
+  // subtract this from the number that we need to wait for. It's possible that
+  // the buffer already contains everything, in which case we don't need to call
+  // read() at all.
+
+  // copy out whatever the buffer already contains, up to the bytes requested
+  const auto numBytesFromBuffer = boost::asio::buffer_copy(
+      buffer, rcvBuffer.data());
+  rcvBuffer.consume(numBytesFromBuffer);
+
+  // then read the rest straight from the socket into the caller's buffer,
+  // instead of into rcvBuffer and copying them out again
+  //
+  // we may not even need to read if the buffer already contained enough data
+  std::size_t numBytesFromSocket = 0;
+  if (numBytesFromBuffer < buffer.size()) {
+    // on an error, this returns the bytes read so far
+    // the caller should check error before acting on the return value
+    numBytesFromSocket = boost::asio::read(
+        socket, buffer + numBytesFromBuffer,
+        boost::asio::transfer_all(), error);
+  }
+  return numBytesFromBuffer + numBytesFromSocket;
+}
+
+
+std::size_t readBytes(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const boost::asio::mutable_buffer& buffer) {
+  boost::system::error_code error;
+  const auto numBytesRead = readBytes(socket, rcvBuffer, buffer, error);
+  if (error) {
+    LOG(FATAL)
+        << "Read error: "
+        << boost::system::system_error(error).what();
+  }
+  return numBytesRead;
+}
+
+
+bool isBinaryFraming(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    boost::system::error_code& error) {
+  // wait for at least one byte, unless we already have some
+  error = boost::system::error_code();
+  if (rcvBuffer.size() == 0) {
+    boost::asio::read(
+        socket, rcvBuffer, boost::asio::transfer_at_least(1), error);
+    if (error) {
+      // error during read, report ASCII framing
+      // the caller should check error before acting on the return value
+      return false;
+    }
+  }
+  return static_cast<uint8_t>(peekBytes(rcvBuffer, 1)[0]) ==
+      static_cast<uint8_t>(FrameType::kHello);
+}
+
+
+void sendFrame(
+    boost::asio::ip::tcp::socket& socket,
+    const FrameHeader& header,
+    const boost::asio::const_buffer& payload,
+    boost::system::error_code& error) {
+  // the header is encoded on the stack, and gathered with the payload from a
+  // fixed size array, so sending a frame doesn't allocate
+  EncodedFrameHeader headerData;
+  encodeFrameHeader(header, headerData);
+  const std::array<boost::asio::const_buffer, 2> buffers = {{
+      boost::asio::buffer(headerData), payload}};
+  sendBytes(socket, buffers, error);
+}
+
+
+void sendFrame(
+    boost::asio::ip::tcp::socket& socket,
+    const FrameHeader& header,
+    const boost::asio::const_buffer& payload) {
+  boost::system::error_code error;
+  sendFrame(socket, header, payload, error);
+  if (error) {
+    LOG(FATAL)
+        << "Send error: "
+        << boost::system::system_error(error).what();
+  }
+}
+
+
+FrameHeader readFrameHeader(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    boost::system::error_code& error) {
+  // the header has a fixed size, so there is nothing to scan for
+  char data[kFrameHeaderBytes];
+  FrameHeader header;
+  readBytes(socket, rcvBuffer, boost::asio::buffer(data), error);
+  if (error) {
+    // error during read, return an empty header
+    // the caller should check error before acting on the return value
+    return header;
+  }
+  if (not decodeFrameHeader(std::string_view(data, sizeof(data)), header)) {
+    error = boost::asio::error::invalid_argument;
+  }
+  return header;
+}
+
+
+FrameHeader readFrameHeader(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer) {
+  boost::system::error_code error;
+  const auto header = readFrameHeader(socket, rcvBuffer, error);
+  if (error) {
+    LOG(FATAL)
+        << "Read error: "
+        << boost::system::system_error(error).what();
+  }
+  return header;
+}
+
+
+std::vector<boost::asio::ip::tcp::endpoint> parseEndpoints(
+    const std::string& endpoints,
+    const uint16_t defaultPort,
+    boost::system::error_code& error) {
+  error = boost::system::error_code();
+  std::vector<boost::asio::ip::tcp::endpoint> parsedEndpoints;
+  std::size_t entryStart = 0;
+  while (entryStart <= endpoints.size()) {
+    auto entryEnd = endpoints.find(',', entryStart);
+    if (entryEnd == std::string::npos) {
+      entryEnd = endpoints.size();
+    }
+    const auto entry = endpoints.substr(entryStart, entryEnd - entryStart);
+    entryStart = entryEnd + 1;
+
+    // split the entry into an address and a port; an IPv6 address without
+    // brackets has more than one ':', and no port
+    std::string addressStr = entry;
+    std::string portStr;
+    if (not entry.empty() && entry.front() == '[') {
+      const auto bracketEnd = entry.find(']');
+      if (bracketEnd == std::string::npos ||
+          (bracketEnd + 1 < entry.size() && entry[bracketEnd + 1] != ':')) {
+        error = boost::asio::error::invalid_argument;
+        return {};
+      }
+      addressStr = entry.substr(1, bracketEnd - 1);
+      if (bracketEnd + 1 < entry.size()) {
+        portStr = entry.substr(bracketEnd + 2);
+      }
+    } else if (std::count(entry.begin(), entry.end(), ':') == 1) {
+      const auto colon = entry.find(':');
+      addressStr = entry.substr(0, colon);
+      portStr = entry.substr(colon + 1);
+    }
+
+    // make_address only accepts numeric addresses, so it never resolves
+    const auto address = boost::asio::ip::make_address(addressStr, error);
+    if (error) {
+      error = boost::asio::error::invalid_argument;
+      return {};
+    }
+    uint16_t port = defaultPort;
+    if (not portStr.empty() || entry.back() == ':') {
+      if (portStr.empty() || portStr.size() > 5 ||
+          not std::all_of(
+              portStr.begin(), portStr.end(),
+              [](const char c) { return c >= '0' && c <= '9'; }) ||
+          std::stoul(portStr) > 65535) {
+        error = boost::asio::error::invalid_argument;
+        return {};
+      }
+      port = std::stoul(portStr);
+    }
+    parsedEndpoints.emplace_back(address, port);
+  }
+  return parsedEndpoints;
+}
+
+
+std::vector<boost::asio::ip::tcp::endpoint> parseEndpoints(
+    const std::string& endpoints,
+    const uint16_t defaultPort) {
+  boost::system::error_code error;
+  auto parsedEndpoints = parseEndpoints(endpoints, defaultPort, error);
+  if (error) {
+    LOG(FATAL)
+        << "Invalid list of endpoints \"" << endpoints << "\": "
+        << boost::system::system_error(error).what();
+  }
+  return parsedEndpoints;
+}
+
+
+bool isDualStack(
+    const std::vector<boost::asio::ip::tcp::endpoint>& endpoints,
+    const boost::asio::ip::tcp::endpoint& endpoint) {
+  if (not endpoint.address().is_v6() ||
+      not endpoint.address().to_v6().is_unspecified()) {
+    return false;
+  }
+  for (const auto& otherEndpoint : endpoints) {
+    if (otherEndpoint.address().is_v4() &&
+        otherEndpoint.port() == endpoint.port()) {
+      return false;
+    }
+  }
+  return true;
+}
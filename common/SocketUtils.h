@@ -0,0 +1,443 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <boost/asio.hpp>
+#include <glog/logging.h>
+
+// Binary framing
+//
+// Besides the ASCII protocols (messages ending with a '#' delimiter), the
+// programs can exchange binary frames. Each frame starts with a fixed-width
+// header, followed by header.length bytes of payload:
+//
+//   byte  0      type (FrameType)
+//   byte  1      flags
+//   bytes 2-3    reserved, must be zero
+//   bytes 4-7    request ID (little endian)
+//   bytes 8-15   payload length (little endian)
+//
+// A client asks for binary framing by sending a kHello frame as the very
+// first bytes on the connection; servers answer it with a kHello frame of
+// their own. 0xB1 can never start a UTF-8 (or ASCII) string, so servers can
+// tell the two protocols apart by peeking at the first byte.
+//
+// Requests and responses carry a request ID chosen by the client, so that a
+// client pipelining several requests can match each response to its request.
+
+/**
+ * Type of a binary frame.
+ */
+enum class FrameType : uint8_t {
+  // request for a file (payload = filename, optionally with a byte range)
+  kRequest = 0x01,
+
+  // response with the file's bytes
+  kResponse = 0x02,
+
+  // the request could not be served (file not found, invalid request)
+  kError = 0x03,
+
+  // message for a server to reverse (see pa2-sockets)
+  kMessage = 0x04,
+
+  // piece of a compressed response (an empty chunk ends the response)
+  kChunk = 0x05,
+
+  // checksum of a response's file bytes, following the response (payload =
+  // CRC32C of the uncompressed bytes, 4 bytes little endian)
+  kChecksum = 0x06,
+
+  // first frame on a connection using binary framing (no payload)
+  kHello = 0xB1,
+};
+
+// payload of a response begins with the size of the whole file (8 bytes,
+// little endian), followed by the requested byte range
+const uint8_t kFrameFlagFileSize = 0x01;
+
+// response is compressed: its payload holds (after the file size, if present)
+// the number of uncompressed bytes in the range (8 bytes, little endian), and
+// the compressed bytes follow in kChunk frames
+const uint8_t kFrameFlagCompressed = 0x02;
+
+// response is followed by a kChecksum frame (after the last kChunk frame, if
+// compressed)
+const uint8_t kFrameFlagChecksum = 0x04;
+
+// number of bytes in an encoded FrameHeader
+const std::size_t kFrameHeaderBytes = 16;
+
+/**
+ * Header of a binary frame.
+ */
+struct FrameHeader {
+  FrameType type = FrameType::kMessage;
+  uint8_t flags = 0;
+  uint32_t requestId = 0;
+
+  // number of payload bytes following the header
+  uint64_t length = 0;
+};
+
+// an encoded FrameHeader
+using EncodedFrameHeader = std::array<char, kFrameHeaderBytes>;
+
+/**
+ * Encode a frame header into data.
+ */
+void encodeFrameHeader(const FrameHeader& header, EncodedFrameHeader& data);
+
+/**
+ * Append a frame header to str, encoded as by encodeFrameHeader.
+ */
+void appendFrameHeader(std::string& str, const FrameHeader& header);
+
+/**
+ * Decode a frame header from the first kFrameHeaderBytes bytes of data.
+ *
+ * Returns false if data is too short or doesn't hold a valid header.
+ */
+bool decodeFrameHeader(std::string_view data, FrameHeader& header);
+
+/**
+ * Append value to str as 8 little endian bytes.
+ */
+void appendUint64(std::string& str, const uint64_t value);
+
+/**
+ * Decode 8 little endian bytes into a value.
+ */
+uint64_t decodeUint64(const char* data);
+
+/**
+ * Append value to str as 4 little endian bytes.
+ */
+void appendUint32(std::string& str, const uint32_t value);
+
+/**
+ * Decode 4 little endian bytes into a value.
+ */
+uint32_t decodeUint32(const char* data);
+
+/**
+ * Send bytes onto the socket.
+ */
+void sendBytes(
+    boost::asio::ip::tcp::socket& socket,
+    const std::string& message,
+    boost::system::error_code& error);
+
+/**
+ * Send bytes onto the socket.
+ *
+ * Same as sendBytes(3), but calls LOG(FATAL) on an error.
+ */
+void sendBytes(
+    boost::asio::ip::tcp::socket& socket,
+    const std::string& message);
+
+/**
+ * Send the bytes in a buffer onto the socket.
+ *
+ * Unlike sendBytes(3), the bytes don't have to be held in a std::string.
+ */
+void sendBytes(
+    boost::asio::ip::tcp::socket& socket,
+    const boost::asio::const_buffer& buffer,
+    boost::system::error_code& error);
+
+/**
+ * Send the bytes in a buffer onto the socket.
+ *
+ * Same as sendBytes(3), but calls LOG(FATAL) on an error.
+ */
+void sendBytes(
+    boost::asio::ip::tcp::socket& socket,
+    const boost::asio::const_buffer& buffer);
+
+/**
+ * Send the bytes in several buffers onto the socket, in order.
+ *
+ * The buffers are passed to a single gathering write, so a header and a body
+ * kept in separate buffers don't have to be copied into one string first.
+ * Any asio ConstBufferSequence will do; a std::array of buffers keeps the
+ * send from allocating.
+ */
+template <typename ConstBufferSequence>
+void sendBytes(
+    boost::asio::ip::tcp::socket& socket,
+    const ConstBufferSequence& buffers,
+    boost::system::error_code& error) {
+  // write() keeps calling the socket's (gathering) send until all of the
+  // buffers have been sent
+  //
+  // on an error, the caller should check error before acting on the result
+  boost::asio::write(socket, buffers, boost::asio::transfer_all(), error);
+}
+
+/**
+ * Send the bytes in several buffers onto the socket, in order.
+ *
+ * Same as sendBytes(3), but calls LOG(FATAL) on an error.
+ */
+template <typename ConstBufferSequence>
+void sendBytes(
+    boost::asio::ip::tcp::socket& socket,
+    const ConstBufferSequence& buffers) {
+  boost::system::error_code error;
+  sendBytes(socket, buffers, error);
+  if (error) {
+    LOG(FATAL)
+        << "Send error: "
+        << boost::system::system_error(error).what();
+  }
+}
+
+/**
+ * Send bytes from a file onto the socket using sendfile(2).
+ *
+ * The kernel copies the bytes from the page cache straight to the socket, so
+ * they never pass through user space. Sends at most numBytes bytes starting
+ * at offset in the file and returns the number of bytes sent, which may be
+ * fewer than requested.
+ *
+ * If the socket is in non-blocking mode and its send buffer is full, error is
+ * set to boost::asio::error::would_block. If the file does not support
+ * sendfile, error is set to EINVAL or ENOSYS and the caller should fall back
+ * to another method.
+ */
+std::size_t sendFile(
+    boost::asio::ip::tcp::socket& socket,
+    const int fileFd,
+    const uint64_t offset,
+    const std::size_t numBytes,
+    boost::system::error_code& error);
+
+/**
+ * Enable or disable TCP_CORK on the socket.
+ *
+ * While a socket is corked, the kernel only sends full segments, so a header
+ * and the body that follows it share segments even when they are sent with
+ * separate calls. Uncorking sends whatever is left right away.
+ */
+void setTcpCork(
+    boost::asio::ip::tcp::socket& socket,
+    const bool cork,
+    boost::system::error_code& error);
+
+/**
+ * Enable or disable SO_REUSEPORT on an (open, not yet bound) acceptor.
+ *
+ * Several sockets with SO_REUSEPORT set may be bound to the same address and
+ * port; the kernel then spreads incoming connections across them, by a hash
+ * of each connection's addresses and ports.
+ */
+void setReusePort(
+    boost::asio::ip::tcp::acceptor& acceptor,
+    const bool reusePort,
+    boost::system::error_code& error);
+
+/**
+ * Read from a socket up until a delimiter.
+ *
+ * Note that this function may actually overread from the socket. Left over
+ * bytes will be kept in the streambuf object that is passed in.
+ */
+std::string readUntilDelimiter(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const std::string& delimiter,
+    boost::system::error_code& error);
+
+/**
+ * Read from a socket up until a delimiter.
+ *
+ * Same as readUntilDelimiter(4), but calls LOG(FATAL) on an error.
+ */
+std::string readUntilDelimiter(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const std::string& delimiter);
+
+/**
+ * Read from a socket up until a delimiter, storing the bytes before the
+ * delimiter in message.
+ *
+ * The bytes are copied straight into message, reusing its storage; calling
+ * this in a loop with the same string doesn't allocate once the string has
+ * grown to the size of the largest message.
+ */
+void readUntilDelimiter(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const std::string& delimiter,
+    std::string& message,
+    boost::system::error_code& error);
+
+/**
+ * Read from a socket up until a delimiter, without copying the message.
+ *
+ * Returns a view of the bytes before the delimiter, which are left in
+ * rcvBuffer. The view is only valid until rcvBuffer is next changed; once done
+ * with it, call rcvBuffer.consume(view.size() + delimiter.length()).
+ */
+std::string_view peekUntilDelimiter(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const std::string& delimiter,
+    boost::system::error_code& error);
+
+/**
+ * Return a view of the first numBytes bytes in a streambuf, without copying.
+ *
+ * The view is only valid until the streambuf is next changed (e.g., through
+ * consume or a read). numBytes must not exceed rcvBuffer.size().
+ */
+std::string_view peekBytes(
+    const boost::asio::streambuf& rcvBuffer,
+    const std::size_t numBytes);
+
+/**
+ * Read the specified number of bytes from socket or buffer.
+ *
+ * The buffer will be drained first before any new bytes are pulled from the
+ * socket. This ensures that we cleanup / recoup any existing bytes from the
+ * buffer. See note on read_until below.
+ */
+std::string readBytes(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const std::size_t numBytesToRead,
+    boost::system::error_code& error);
+
+/**
+ * Read the specified number of bytes from socket or buffer.
+ *
+ * Same as readBytes(4), but calls LOG(FATAL) on an error.
+ */
+std::string readBytes(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const std::size_t numBytesToRead);
+
+/**
+ * Read exactly buffer.size() bytes from socket or rcvBuffer into a buffer
+ * supplied by the caller.
+ *
+ * Bytes already in rcvBuffer are copied out first, and the rest are read
+ * straight from the socket into buffer, so nothing is allocated. Returns the
+ * number of bytes read.
+ */
+std::size_t readBytes(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const boost::asio::mutable_buffer& buffer,
+    boost::system::error_code& error);
+
+/**
+ * Read exactly buffer.size() bytes into a buffer supplied by the caller.
+ *
+ * Same as readBytes(4), but calls LOG(FATAL) on an error.
+ */
+std::size_t readBytes(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const boost::asio::mutable_buffer& buffer);
+
+/**
+ * Wait for the first bytes on a connection and check whether the client asked
+ * for binary framing.
+ *
+ * The bytes stay in rcvBuffer, to be read by the next read call.
+ */
+bool isBinaryFraming(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    boost::system::error_code& error);
+
+/**
+ * Send a frame: the header, followed by the payload.
+ *
+ * Both go out in a single gathering write. header.length must match the size
+ * of the payload.
+ */
+void sendFrame(
+    boost::asio::ip::tcp::socket& socket,
+    const FrameHeader& header,
+    const boost::asio::const_buffer& payload,
+    boost::system::error_code& error);
+
+/**
+ * Send a frame: the header, followed by the payload.
+ *
+ * Same as sendFrame(4), but calls LOG(FATAL) on an error.
+ */
+void sendFrame(
+    boost::asio::ip::tcp::socket& socket,
+    const FrameHeader& header,
+    const boost::asio::const_buffer& payload);
+
+/**
+ * Read a frame header from socket or rcvBuffer.
+ *
+ * Sets error to boost::asio::error::invalid_argument if the bytes read don't
+ * hold a valid header.
+ */
+FrameHeader readFrameHeader(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    boost::system::error_code& error);
+
+/**
+ * Read a frame header from socket or rcvBuffer.
+ *
+ * Same as readFrameHeader(3), but calls LOG(FATAL) on an error.
+ */
+FrameHeader readFrameHeader(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer);
+
+/**
+ * Parse a comma separated list of endpoints to listen on, e.g.,
+ * "0.0.0.0,[::]:8080".
+ *
+ * Each entry is a numeric IPv4 or IPv6 address, optionally followed by
+ * ":<port>" (an IPv6 address followed by a port must be in brackets); entries
+ * without a port use defaultPort. Addresses are never looked up with DNS, so
+ * this doesn't block on a slow resolver.
+ *
+ * Sets error to boost::asio::error::invalid_argument if an entry can't be
+ * parsed, or if the list is empty.
+ */
+std::vector<boost::asio::ip::tcp::endpoint> parseEndpoints(
+    const std::string& endpoints,
+    const uint16_t defaultPort,
+    boost::system::error_code& error);
+
+/**
+ * Parse a comma separated list of endpoints to listen on.
+ *
+ * Same as parseEndpoints(3), but calls LOG(FATAL) on an error.
+ */
+std::vector<boost::asio::ip::tcp::endpoint> parseEndpoints(
+    const std::string& endpoints,
+    const uint16_t defaultPort);
+
+/**
+ * Return whether an acceptor for one of a list of endpoints to listen on
+ * should be dual-stack, i.e., an IPv6 acceptor that also accepts IPv4
+ * connections (as IPv4-mapped IPv6 addresses).
+ *
+ * That's the case for the IPv6 wildcard address ([::]), unless the list also
+ * has an IPv4 endpoint on the same port, which a dual-stack acceptor would
+ * keep from being bound. IPv6 acceptors should be set to IPv6 only
+ * (boost::asio::ip::v6_only) otherwise, rather than depending on the system's
+ * default.
+ */
+bool isDualStack(
+    const std::vector<boost::asio::ip::tcp::endpoint>& endpoints,
+    const boost::asio::ip::tcp::endpoint& endpoint);
@@ -0,0 +1,107 @@
+# Build profiles, shared by the Makefiles of all of the programs
+#
+#   make                  debug build (-g -O0), the default
+#   make BUILD=release    optimized build: -O2, link time optimization and
+#                         -march=native
+#   make BUILD=pgo-gen    release build instrumented to record a profile of
+#                         where the program spends its time
+#   make BUILD=pgo-use    release build optimized using the recorded profile
+#
+# OPT and MARCH tune the release profiles, e.g. `OPT=-O3` or
+# `MARCH=x86-64-v3`; `MARCH=` leaves out -march altogether, for binaries that
+# have to run on any machine of the same architecture. Profiles are recorded
+# in PGO_DIR.
+#
+# Objects are built in a directory of their own for each profile, inside the
+# program's directory: build/debug/main.o for ./main.cpp, and
+# build/debug/common/SocketUtils.o for ../common/SocketUtils.cpp. The programs
+# sharing ../common each build their own copies of its objects, so building
+# one program (with any profile) never changes the objects another one links,
+# and `make clean` only removes the program's own objects.
+#
+# Include this file before the Makefile's rules, and use objectFiles to name
+# the objects of its sources; the Makefile's first rule stays the default
+# goal.
+
+BUILD ?= debug
+OPT ?= -O2
+MARCH ?= native
+PGO_DIR ?= $(CURDIR)/pgo-data
+
+RELEASE_FLAGS := $(OPT) -g -DNDEBUG -flto=auto $(if $(MARCH),-march=$(MARCH))
+
+ifeq ($(BUILD),debug)
+  BUILD_FLAGS := -g -O0
+else ifeq ($(BUILD),release)
+  BUILD_FLAGS := $(RELEASE_FLAGS)
+else ifeq ($(BUILD),pgo-gen)
+  # the programs are multithreaded, so the counters have to be updated
+  # atomically for the profile to be accurate
+  BUILD_FLAGS := $(RELEASE_FLAGS) \
+	-fprofile-generate=$(PGO_DIR) -fprofile-update=atomic
+else ifeq ($(BUILD),pgo-use)
+  # -fprofile-correction tolerates the small inconsistencies that remain in
+  # profiles of multithreaded programs; code that didn't run while the
+  # profile was recorded is optimized as usual
+  BUILD_FLAGS := $(RELEASE_FLAGS) \
+	-fprofile-use=$(PGO_DIR) -fprofile-correction -Wno-missing-profile
+else
+  $(error Unknown BUILD "$(BUILD)" (use debug, release, pgo-gen or pgo-use))
+endif
+
+# link time optimization and profiling happen in the linker too, so it needs
+# the same flags as the compiler
+CXXFLAGS += $(BUILD_FLAGS)
+LDFLAGS += $(BUILD_FLAGS)
+
+# pgo-gen and pgo-use share a directory: gcc finds an object's profile by the
+# path of the object file, so the optimized objects must be built where the
+# instrumented ones were
+ifneq ($(filter pgo-%,$(BUILD)),)
+  OBJ_DIR := build/pgo
+else
+  OBJ_DIR := build/$(BUILD)
+endif
+
+# $(call objectFiles,<sources>) returns the object file of each source
+objectFiles = $(addprefix $(OBJ_DIR)/,$(addsuffix .o,$(basename \
+	$(patsubst ../%,%,$(patsubst ./%,%,$(1))))))
+
+# objects built with different flags must not be mixed, so the flags are
+# recorded in BUILD_FLAGS_FILE, next to the objects, which is only rewritten
+# (making everything that depends on it out of date) when they change, e.g.
+# with another OPT or MARCH
+#
+# LINK_FLAGS_FILE records the flags the programs were last linked with, so
+# that switching to another profile relinks them from that profile's objects,
+# even if those are older than the programs
+BUILD_FLAGS_FILE := $(OBJ_DIR)/.build-flags
+LINK_FLAGS_FILE := .link-flags
+BUILD_FLAGS_LINE := $(CXX) $(CXXFLAGS) | $(LDFLAGS)
+
+$(BUILD_FLAGS_FILE) $(LINK_FLAGS_FILE): FORCE
+	@mkdir -p $(@D)
+	@echo '$(BUILD_FLAGS_LINE)' | cmp -s - $@ || \
+		echo '$(BUILD_FLAGS_LINE)' > $@
+
+# $(call compileRules,<object dir>,<source dir>) defines the rules building
+# the objects in $(OBJ_DIR)/<object dir> from the sources in <source dir>
+define compileRules
+$(OBJ_DIR)/$(1)%.o: $(2)%.cpp $(BUILD_FLAGS_FILE)
+	@mkdir -p $$(@D)
+	$$(COMPILE.cc) $$(OUTPUT_OPTION) $$<
+$(OBJ_DIR)/$(1)%.o: $(2)%.c $(BUILD_FLAGS_FILE)
+	@mkdir -p $$(@D)
+	$$(COMPILE.c) $$(OUTPUT_OPTION) $$<
+$(OBJ_DIR)/$(1)%.o: $(2)%.s $(BUILD_FLAGS_FILE)
+	@mkdir -p $$(@D)
+	$$(COMPILE.s) $$(OUTPUT_OPTION) $$<
+endef
+$(eval $(call compileRules,common/,../common/))
+$(eval $(call compileRules,,))
+
+.PHONY: FORCE
+FORCE:
+
+# the rules above don't count as the Makefile's first rule
+.DEFAULT_GOAL :=
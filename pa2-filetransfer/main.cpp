@@ -1,11 +1,30 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
 #include <chrono>
+#include <cstdlib>
 #include <iomanip>
 #include <iostream>
-#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <boost/asio.hpp>
 #include <glog/logging.h>
 
+#include "FileRequest.h"
+#include "FileWriter.h"
+#include "ProgressMeter.h"
+#include "SocketUtils.h"
+
 using namespace std;
 using namespace boost::asio;
 
@@ -20,23 +39,96 @@ DEFINE_bool(
     "Whether to operate in server or client mode (true = server)");
 DEFINE_string(
     filename, "",
-    "Filename to capture from remote server");
+    "Filename to capture from remote server (a comma separated list requests "
+    "several files over one connection)");
+DEFINE_uint64(
+    offset, 0,
+    "Offset of the first byte of the file(s) to request");
+DEFINE_int64(
+    length, -1,
+    "Number of bytes of the file(s) to request (-1 = to the end of the file)");
+DEFINE_string(
+    output_file, "",
+    "File to save a single requested file to; byte ranges are written at "
+    "their offset without truncating the file, so a partial download can be "
+    "resumed (default = <filename>.<timestamp>)");
+DEFINE_bool(
+    zero_copy, true,
+    "Send files with sendfile() instead of reading them into memory first");
+DEFINE_bool(
+    keep_alive, true,
+    "Keep serving requests on a connection until the client closes it");
+DEFINE_bool(
+    tcp_nodelay, true,
+    "Set TCP_NODELAY on client sockets, so that the last segment of a "
+    "response isn't held back by Nagle's algorithm");
+DEFINE_int32(
+    server_threads, 8,
+    "Number of clients the server serves at once, each on a thread of its "
+    "own (1 = one client at a time)");
+DEFINE_bool(
+    binary_framing, false,
+    "Use binary length-prefixed frames instead of delimited messages (client "
+    "only; the server detects which framing each client uses)");
+DEFINE_uint64(
+    receive_chunk_bytes, 1024 * 1024,
+    "Bytes the client reads from the socket and writes to the output file at "
+    "a time, so that a download never has to fit in memory");
+DEFINE_bool(
+    preallocate, false,
+    "Reserve the disk space for a download before receiving it, with "
+    "fallocate(), so that the output file isn't fragmented (client only)");
+DEFINE_bool(
+    direct_io, false,
+    "Write downloads with O_DIRECT, bypassing the page cache, so that a large "
+    "download doesn't evict everything else from memory (client only; falls "
+    "back to buffered writes where unsupported)");
+DEFINE_bool(
+    progress, false,
+    "Show the progress and throughput of each download on stderr (client "
+    "only)");
 
 // value used as delimiter / for marking the end of a message
 const string kDelimiter = "#";
 
+// largest request frame payload the server accepts (a filename and range)
+const uint64_t kMaxRequestFrameBytes = 64 * 1024;
+
 void runServer();
+void acceptClients(
+    io_service& ioService,
+    ip::tcp::acceptor& acceptor,
+    std::mutex& acceptMutex);
+void serveClient(ip::tcp::socket& socket);
 void runClient();
-void sendBytes(
+bool readRequestFrame(
     boost::asio::ip::tcp::socket& socket,
-    const string& message);
-string readUntilDelimiter(
+    boost::asio::streambuf& rcvBuffer,
+    string& message,
+    uint32_t& requestId,
+    boost::system::error_code& error);
+void serveFile(
     boost::asio::ip::tcp::socket& socket,
-    boost::asio::streambuf& rcvBuffer);
-string readBytes(
+    const string& message,
+    const bool binaryFraming,
+    const uint32_t requestId,
+    boost::system::error_code& error);
+void receiveFile(
     boost::asio::ip::tcp::socket& socket,
     boost::asio::streambuf& rcvBuffer,
-    const int numBytesToRead);
+    const FileRequest& request,
+    const uint32_t requestId);
+void sendBytes(
+    boost::asio::ip::tcp::socket& socket,
+    const string& message,
+    const socket_base::message_flags flags,
+    boost::system::error_code& error);
+void sendFileRange(
+    boost::asio::ip::tcp::socket& socket,
+    const int fileFd,
+    const uint64_t startOffset,
+    const uint64_t numBytes,
+    boost::system::error_code& error);
 
 int main(int argc, char *argv[]) {
   // setup Google logging and flags
@@ -76,65 +168,376 @@ void runServer() {
       << "Server is running at "
       << localEndpoint.address() << ":" << localEndpoint.port();
 
-  // keep processing connections forever
+  // a client that goes away in the middle of a sendfile() would otherwise
+  // kill the whole server with SIGPIPE, instead of failing the send
+  signal(SIGPIPE, SIG_IGN);
+
+  // serve clients with a fixed pool of threads, each accepting a connection
+  // and serving it until it closes, then accepting the next one
+  //
+  // every thread blocks on its own client, so a slow client only holds up
+  // its own thread; once all threads are busy, new connections wait in the
+  // listen backlog until a thread is free. This thread is one of the pool.
+  const int numThreads = max(FLAGS_server_threads, 1);
+  LOG(INFO) << "Serving up to " << numThreads << " client(s) at once";
+  std::mutex acceptMutex;
+  vector<std::thread> serverThreads;
+  for (int i = 1; i < numThreads; i++) {
+    serverThreads.emplace_back(
+        acceptClients,
+        std::ref(ioService), std::ref(acceptor), std::ref(acceptMutex));
+  }
+  acceptClients(ioService, acceptor, acceptMutex);
+}
+
+/**
+ * Keep accepting connections and serving them, one at a time, forever.
+ *
+ * Several threads may run this with the same acceptor; acceptMutex makes
+ * sure they take turns calling accept (the acceptor isn't thread safe).
+ */
+void acceptClients(
+    io_service& ioService,
+    ip::tcp::acceptor& acceptor,
+    std::mutex& acceptMutex) {
   for (;;) {
     // setup a socket and wait on a client connection
     ip::tcp::socket socket(ioService);
-
     LOG(INFO) << "Waiting for client to connect";
-    acceptor.accept(socket);
+    boost::system::error_code error;
+    {
+      std::lock_guard<std::mutex> guard(acceptMutex);
+      acceptor.accept(socket, error);
+    }
+    if (error) {
+      // e.g., we ran out of file descriptors; give other connections a
+      // chance to close before trying again
+      LOG(ERROR)
+          << "Accept error: "
+          << boost::system::system_error(error).what();
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      continue;
+    }
+    serveClient(socket);
+  }
+}
 
-    // log the address of the remote client
-    const auto remoteEndpoint = socket.remote_endpoint();
-    LOG(INFO)
-        << "Connected to client ("
-        << remoteEndpoint.address() << ":" << remoteEndpoint.port() << ")";
+/**
+ * Serve the requests of a connected client until it closes the connection.
+ *
+ * Errors only end this connection, since other threads may be serving other
+ * clients.
+ */
+void serveClient(ip::tcp::socket& socket) {
+  // log the address of the remote client
+  boost::system::error_code error;
+  const auto remoteEndpoint = socket.remote_endpoint(error);
+  if (error) {
+    LOG(ERROR)
+        << "Unable to get remote endpoint: "
+        << boost::system::system_error(error).what();
+    return;
+  }
+  LOG(INFO)
+      << "Connected to client ("
+      << remoteEndpoint.address() << ":" << remoteEndpoint.port() << ")";
 
+  // each response goes out in as few writes as possible, so Nagle's
+  // algorithm would only ever delay its last segment
+  if (FLAGS_tcp_nodelay) {
+    socket.set_option(ip::tcp::no_delay(true), error);
+    if (error) {
+      LOG(ERROR)
+          << "Unable to set TCP_NODELAY: "
+          << boost::system::system_error(error).what();
+      error = boost::system::error_code();
+    }
+  }
+
+  // the receive buffer lives as long as the connection: a client may send
+  // several requests back-to-back without waiting for our replies, in which
+  // case read_until will have pulled the following requests into the buffer
+  // already, and the next readUntilDelimiter call picks them up from there
+  boost::asio::streambuf rcvBuffer;
+
+  // a client that wants binary framing starts with a kHello frame, whose
+  // first byte can't start a filename; peek at it to pick the framing
+  const bool binaryFraming = isBinaryFraming(socket, rcvBuffer, error);
+  if (binaryFraming) {
+    LOG(INFO) << "Client is using binary framing";
+  }
+  while (!error) {
     // wait for a message from the client
     LOG(INFO) << "Waiting for message from client";
-    boost::asio::streambuf rcvBuffer;
-    const auto filename = readUntilDelimiter(socket, rcvBuffer);
+    string message;
+    uint32_t requestId = 0;
+    if (binaryFraming) {
+      readRequestFrame(socket, rcvBuffer, message, requestId, error);
+    } else {
+      readUntilDelimiter(socket, rcvBuffer, kDelimiter, message, error);
+    }
+    if (error == boost::asio::error::eof && rcvBuffer.size() == 0) {
+      // the client closed the connection between requests
+      LOG(INFO) << "Client closed connection";
+      break;
+    } else if (error) {
+      LOG(ERROR)
+          << "Read error: "
+          << boost::system::system_error(error).what();
+      break;
+    }
     LOG(INFO)
         << "Message received from client (should be a filename) = "
-        << filename.empty() ? ("(empty)") : filename;
-
-    // the message should be a filename for us to read from
-    string inputFileBuf;
-    ifstream inputFile(filename, ios::in | ios::binary);
-    if (inputFile.is_open()) {
-      LOG(INFO) << "Opened file \"" << filename << "\"";
-      inputFileBuf = string(
-          istreambuf_iterator<char>(inputFile),
-          istreambuf_iterator<char>());
-    } else {
-      LOG(INFO) << "Unable to open file \"" << filename << "\"";
+        << (message.empty() ? "(empty)" : message);
+
+    // answer the request; replies go out in the order requests came in
+    serveFile(socket, message, binaryFraming, requestId, error);
+    if (error) {
+      LOG(ERROR)
+          << "Unable to send response: "
+          << boost::system::system_error(error).what();
+      break;
+    }
+
+    // without keep alive, only one request is served per connection
+    if (!FLAGS_keep_alive) {
+      break;
+    }
+  }
+
+  // we're done
+  LOG(INFO) << "Disconnected client";
+}
+
+/**
+ * Read the next request frame from a client using binary framing.
+ *
+ * kHello frames are acknowledged along the way. Sets message to the request's
+ * payload and requestId to its ID; returns false and sets error if the
+ * connection failed or the client sent something other than a request.
+ */
+bool readRequestFrame(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    string& message,
+    uint32_t& requestId,
+    boost::system::error_code& error) {
+  for (;;) {
+    const auto header = readFrameHeader(socket, rcvBuffer, error);
+    if (error) {
+      return false;
+    }
+    if (header.length > kMaxRequestFrameBytes) {
+      LOG(ERROR) << "Request frame too large (" << header.length << " bytes)";
+      error = boost::asio::error::message_size;
+      return false;
     }
-    inputFile.close();
+    message = readBytes(socket, rcvBuffer, header.length, error);
+    if (error) {
+      return false;
+    }
+
+    switch (header.type) {
+      case FrameType::kHello: {
+        // acknowledge the client's request for binary framing
+        FrameHeader helloHeader;
+        helloHeader.type = FrameType::kHello;
+        sendFrame(socket, helloHeader, const_buffer(), error);
+        if (error) {
+          return false;
+        }
+        continue;
+      }
+      case FrameType::kRequest:
+        requestId = header.requestId;
+        return true;
+      default:
+        LOG(ERROR)
+            << "Unexpected frame type "
+            << static_cast<int>(static_cast<uint8_t>(header.type));
+        error = boost::asio::error::invalid_argument;
+        return false;
+    }
+  }
+}
 
-    // first send a message with the # of bytes in the file and a delimiter
-    // then send the actual bytes in the file (no delimiter)
-    // if we weren't able to read the file, inputFileBuf will be empty
-    sendBytes(socket, to_string(inputFileBuf.size()) + "#");
-    sendBytes(socket, inputFileBuf);
+/**
+ * Send a response for the requested file onto the socket.
+ *
+ * The response is a header with the # of bytes being sent and a delimiter,
+ * followed by the actual bytes in the file (no delimiter). If we aren't able
+ * to open the file, the header will be zero and no bytes follow.
+ *
+ * With binary framing, the header is a kResponse frame header carrying the
+ * request's ID instead, or a kError frame header (and no bytes) if we aren't
+ * able to open the file.
+ *
+ * The message may carry a byte range after the filename, see FileRequest. In
+ * that case only the bytes in the range are sent, and the header also holds
+ * the size of the whole file ("<bytes>/<file size>"; with binary framing, the
+ * frame's payload starts with the size as a 64-bit integer).
+ *
+ * Sets error if the response could not be sent (or the file could not be
+ * read), in which case the connection should be closed.
+ */
+void serveFile(
+    boost::asio::ip::tcp::socket& socket,
+    const string& message,
+    const bool binaryFraming,
+    const uint32_t requestId,
+    boost::system::error_code& error) {
+  // a malformed range is answered like a file that doesn't exist
+  FileRequest request;
+  const bool validRequest = parseFileRequest(message, request);
+  if (!validRequest) {
+    LOG(INFO) << "Invalid byte range in request";
+  }
+  const auto& filename = request.filename;
+
+  // the message should be a filename for us to read from
+  // only regular files can be sent (not directories, devices, etc.)
+  uint64_t fileSize = 0;
+  const int fileFd =
+      validRequest ? open(filename.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+  struct stat fileStat;
+  const bool foundFile = fileFd >= 0 && fstat(fileFd, &fileStat) == 0 &&
+      S_ISREG(fileStat.st_mode);
+  if (foundFile) {
+    LOG(INFO) << "Opened file \"" << filename << "\"";
+    fileSize = fileStat.st_size;
+  } else {
+    LOG(INFO) << "Unable to open file \"" << filename << "\"";
+  }
+
+  // clamp the requested range to the file; a range starting past the end of
+  // the file is answered with zero bytes
+  const auto offset = min(request.offset, fileSize);
+  const auto rangeBytes = min(request.length, fileSize - offset);
+  if (request.hasRange) {
     LOG(INFO)
-        << "Sent header + " << inputFileBuf.size()
-        << " bytes of data to client";
+        << "Sending " << rangeBytes << " bytes starting at offset " << offset;
+  }
 
-    // we're done
-    LOG(INFO) << "Disconnected client";
+  // first send a message with the # of bytes we're sending and a delimiter
+  string header;
+  if (binaryFraming) {
+    FrameHeader frameHeader;
+    frameHeader.type = foundFile ? FrameType::kResponse : FrameType::kError;
+    frameHeader.requestId = requestId;
+    if (foundFile && request.hasRange) {
+      frameHeader.flags = kFrameFlagFileSize;
+      frameHeader.length = sizeof(uint64_t);
+    }
+    frameHeader.length += rangeBytes;
+    appendFrameHeader(header, frameHeader);
+    if (frameHeader.flags & kFrameFlagFileSize) {
+      appendUint64(header, fileSize);
+    }
+  } else {
+    header = to_string(rangeBytes);
+    if (request.hasRange) {
+      header += "/" + to_string(fileSize);
+    }
+    header += kDelimiter;
+  }
+
+  // in zero copy mode, we send the file straight from the page cache with
+  // sendfile(), so it never has to fit in memory; the header is sent with
+  // MSG_MORE, so the kernel holds it until it can share a segment with the
+  // file's bytes
+  //
+  // otherwise, read the range into memory and send it from there, along with
+  // the header in a single gathering write
+  if (rangeBytes == 0) {
+    sendBytes(socket, header, error);
+  } else if (FLAGS_zero_copy) {
+    sendBytes(socket, header, MSG_MORE, error);
+    if (!error) {
+      sendFileRange(socket, fileFd, offset, rangeBytes, error);
+    }
+  } else {
+    // pread() may return fewer bytes than asked for, keep reading until we
+    // have the whole range
+    string inputFileBuf(rangeBytes, '\0');
+    uint64_t bytesRead = 0;
+    while (bytesRead < rangeBytes) {
+      const auto result = pread(
+          fileFd, &inputFileBuf[bytesRead], rangeBytes - bytesRead,
+          offset + bytesRead);
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+      if (result <= 0) {
+        // the file shrunk since we sent its size, or it can't be read; the
+        // client can't tell a short response apart, so we have to hang up
+        LOG(ERROR) << "Unable to read file \"" << filename << "\"";
+        if (result == 0) {
+          error = boost::asio::error::make_error_code(boost::asio::error::eof);
+        } else {
+          error = boost::system::error_code(
+              errno, boost::system::system_category());
+        }
+        break;
+      }
+      bytesRead += result;
+    }
+    if (!error) {
+      sendBytes(
+          socket,
+          array<const_buffer, 2>{{buffer(header), buffer(inputFileBuf)}},
+          error);
+    }
+  }
+  if (fileFd >= 0) {
+    close(fileFd);
   }
+  if (error) {
+    return;
+  }
+  LOG(INFO)
+      << "Sent header + " << rangeBytes
+      << " bytes of data to client";
 }
 
 void runClient() {
   // create local variables for readability
-  const auto filename = FLAGS_filename;
   const auto remoteIp = FLAGS_ip_address;
   const auto remotePort = FLAGS_port;
 
+  // the filename flag may hold a comma separated list of files, which are all
+  // requested over the same connection
+  vector<string> filenames;
+  stringstream filenameStream(FLAGS_filename);
+  string filename;
+  while (getline(filenameStream, filename, ',')) {
+    if (!filename.empty()) {
+      filenames.push_back(filename);
+    }
+  }
+
   // verify that the filename is not empty
-  if (filename.empty()) {
+  if (filenames.empty()) {
     LOG(FATAL) << "Filename that client is requesting must be set";
   }
+  if (!FLAGS_output_file.empty() && filenames.size() > 1) {
+    LOG(FATAL) << "An output file can only be set when requesting one file";
+  }
+
+  // build a request for each file, restricting it to a byte range if one was
+  // set by flag
+  vector<FileRequest> requests;
+  for (const auto& requestFilename : filenames) {
+    FileRequest request;
+    request.filename = requestFilename;
+    if (FLAGS_offset > 0 || FLAGS_length >= 0) {
+      request.hasRange = true;
+      request.offset = FLAGS_offset;
+      if (FLAGS_length >= 0) {
+        request.length = FLAGS_length;
+      }
+    }
+    requests.push_back(request);
+  }
 
   // create an ASIO instance and a socket
   io_service ioService;
@@ -152,151 +555,245 @@ void runClient() {
   }
   LOG(INFO) << "Connected to remote endpoint";
 
-  // send the filename that we want to receive
-  LOG(INFO) << "Requesting file " << filename;
-  sendBytes(socket, filename + "#");
+  // send all of the requests back-to-back in a single write, without waiting
+  // for replies; the server answers them in the same order
+  //
+  // with binary framing, the requests are preceded by a kHello frame, and each
+  // request's ID is its position in the list, starting at one
+  string requestMessages;
+  if (FLAGS_binary_framing) {
+    FrameHeader helloHeader;
+    helloHeader.type = FrameType::kHello;
+    appendFrameHeader(requestMessages, helloHeader);
+  }
+  for (size_t i = 0; i < requests.size(); i++) {
+    const auto message = formatFileRequest(requests[i]);
+    LOG(INFO) << "Requesting file " << message;
+    if (FLAGS_binary_framing) {
+      FrameHeader header;
+      header.type = FrameType::kRequest;
+      header.requestId = i + 1;
+      header.length = message.size();
+      appendFrameHeader(requestMessages, header);
+      requestMessages += message;
+    } else {
+      requestMessages += message + kDelimiter;
+    }
+  }
+  sendBytes(socket, requestMessages);
 
-  // listen for a message containing the # of bytes the server is sending
+  // the responses arrive back-to-back too, so the same receive buffer has to
+  // be used for all of them (it may hold the start of the next response)
   boost::asio::streambuf rcvBuffer;
-  const auto header = readUntilDelimiter(socket, rcvBuffer);
-  int numBytes = 0;
-  try {
-    numBytes = stoi(header);
-  } catch (const invalid_argument& ia) {
-     LOG(FATAL)
-        << "Invalid header (" << header << "), cannot convert to numBytes";
+  for (size_t i = 0; i < requests.size(); i++) {
+    receiveFile(socket, rcvBuffer, requests[i], i + 1);
   }
-  if (numBytes < 0) {
-    LOG(FATAL) << "Invalid header, numBytes = " << numBytes;
+}
+
+/**
+ * Receive one response from the server and save it to a file.
+ */
+void receiveFile(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const FileRequest& request,
+    const uint32_t requestId) {
+  const auto& filename = request.filename;
+
+  // listen for a message containing the # of bytes the server is sending
+  //
+  // for byte range requests, the header also holds the size of the whole file
+  // ("<bytes>/<file size>")
+  uint64_t numBytes = 0;
+  if (FLAGS_binary_framing) {
+    // the server acknowledges binary framing before its first response
+    auto header = readFrameHeader(socket, rcvBuffer);
+    if (header.type == FrameType::kHello) {
+      header = readFrameHeader(socket, rcvBuffer);
+    }
+    if (header.requestId != requestId) {
+      LOG(FATAL)
+          << "Response for request ID " << header.requestId
+          << ", expected " << requestId;
+    }
+    if (header.type != FrameType::kResponse &&
+        header.type != FrameType::kError) {
+      LOG(FATAL)
+          << "Unexpected frame type "
+          << static_cast<int>(static_cast<uint8_t>(header.type));
+    }
+    numBytes = header.length;
+    if (header.flags & kFrameFlagFileSize) {
+      char fileSizeData[sizeof(uint64_t)];
+      if (numBytes < sizeof(fileSizeData)) {
+        LOG(FATAL) << "Invalid response frame, length = " << numBytes;
+      }
+      readBytes(socket, rcvBuffer, buffer(fileSizeData));
+      LOG(INFO) << "Whole file is " << decodeUint64(fileSizeData) << " bytes";
+      numBytes -= sizeof(fileSizeData);
+    }
+  } else {
+    // parsed as 64 bits, so that files of 2 GiB and more can be received
+    const auto header = readUntilDelimiter(socket, rcvBuffer, kDelimiter);
+    const auto headerPos = header.find('/');
+    if (!parseUint64(header.substr(0, headerPos), numBytes)) {
+      LOG(FATAL)
+          << "Invalid header (" << header << "), cannot convert to numBytes";
+    }
+    if (headerPos != string::npos) {
+      LOG(INFO) << "Whole file is " << header.substr(headerPos + 1) << " bytes";
+    }
   }
   if (numBytes == 0) {
-    LOG(FATAL) << "Server is returning 0 bytes (maybe could not find file)";
+    // not fatal, other requests on this connection can still succeed
+    LOG(ERROR)
+        << "Server is returning 0 bytes for \"" << filename
+        << "\" (maybe could not find file)";
+    return;
   }
   LOG(INFO) << "Server is responding with " << numBytes << " bytes";
 
-  // receive the specified # of bytes
-  const auto outputFileBuf = readBytes(socket, rcvBuffer, numBytes);
-
-  // write the bytes to a file, appended with current timestamp
-  const auto now = chrono::system_clock::now();
-  const auto timeSinceEpoch =
-      chrono::duration_cast<chrono::seconds>(now.time_since_epoch());
-  const string localFilename =
-      filename + "." + to_string(timeSinceEpoch.count());
-  ofstream outputFile(
-      localFilename, ios::out | ios::binary | ios::trunc);
-  if (outputFile.is_open()) {
-    LOG(INFO) << "Saving to file \"" << localFilename << "\"";
-    outputFile << outputFileBuf;
-    outputFile.close();
-    LOG(INFO)
-        << "Wrote " << outputFileBuf.size()
-        << " bytes to file \"" << localFilename << "\"";
+  // write the bytes to the output file if one was set, otherwise to a file
+  // named after the requested file, appended with current timestamp
+  //
+  // a byte range is written at its offset in the output file, keeping the
+  // bytes already in it, so that a partial download can be resumed
+  string localFilename = FLAGS_output_file;
+  if (localFilename.empty()) {
+    const auto now = std::chrono::system_clock::now();
+    const auto timeSinceEpoch =
+        std::chrono::duration_cast<std::chrono::seconds>(
+            now.time_since_epoch());
+    localFilename = filename + "." + to_string(timeSinceEpoch.count());
+  }
+  const bool resume = request.hasRange && !FLAGS_output_file.empty();
+  FileWriterOptions writerOptions;
+  writerOptions.preallocate = FLAGS_preallocate;
+  writerOptions.directIo = FLAGS_direct_io;
+  FileWriter outputFile;
+  boost::system::error_code error;
+  outputFile.open(
+      localFilename, !resume, resume ? request.offset : 0, numBytes,
+      writerOptions, error);
+  if (error) {
+    // the bytes still have to be read, so that the next response on the
+    // connection can be parsed
+    LOG(ERROR)
+        << "Unable to save to file \"" << localFilename << "\": "
+        << error.message();
   } else {
-    LOG(INFO) << "Unable to save to file \"" << filename << "\"";
+    LOG(INFO) << "Saving to file \"" << localFilename << "\"";
+  }
+  const bool saving = !error;
+
+  // receive the bytes a chunk at a time, writing each chunk to the file as
+  // soon as it arrives, so that only one chunk is ever held in memory
+  vector<char> chunk(max<uint64_t>(
+      min<uint64_t>(FLAGS_receive_chunk_bytes, numBytes), 1));
+  ProgressMeter progress(filename, numBytes, FLAGS_progress);
+  while (progress.getBytes() < numBytes) {
+    const auto chunkBytes =
+        min<uint64_t>(chunk.size(), numBytes - progress.getBytes());
+    readBytes(socket, rcvBuffer, buffer(chunk.data(), chunkBytes));
+    if (saving) {
+      outputFile.write(chunk.data(), chunkBytes, error);
+      if (error) {
+        LOG(FATAL)
+            << "Unable to write to file \"" << localFilename << "\": "
+            << error.message();
+      }
+    }
+    progress.add(chunkBytes);
+  }
+  progress.finish();
+  if (!saving) {
+    return;
   }
-}
 
-/**
- * Send bytes onto the socket.
- */
-void sendBytes(
-    boost::asio::ip::tcp::socket& socket,
-    const string& message) {
-  boost::system::error_code error;
-  write(socket, buffer(message), transfer_all(), error);
+  outputFile.close(error);
   if (error) {
     LOG(FATAL)
-        << "Send error: "
-        << boost::system::system_error(error).what();
+        << "Unable to write to file \"" << localFilename << "\": "
+        << error.message();
   }
+  LOG(INFO)
+      << "Wrote " << outputFile.getBytesWritten() << " bytes to file \""
+      << localFilename << "\" in " << fixed << setprecision(3)
+      << progress.getElapsedSeconds() << " s (" << setprecision(1)
+      << progress.getMibPerSecond() << " MiB/s)";
 }
 
 /**
- * Read from a socket up until a delimiter.
- *
- * Note that this function may actually overread from the socket. Left over
- * bytes will be kept in the streambuf object that is passed in.
+ * Send bytes onto the socket, passing flags (e.g., MSG_MORE) to send(2).
  */
-string readUntilDelimiter(
+void sendBytes(
     boost::asio::ip::tcp::socket& socket,
-    boost::asio::streambuf& rcvBuffer) {
-  // blocking read on the socket until the delimiter
-  boost::system::error_code error;
-  const auto bytesTransferred = read_until(
-      socket, rcvBuffer, kDelimiter, error);
-  if (error) {
-    LOG(FATAL)
-        << "Read error: "
-        << boost::system::system_error(error).what();
+    const string& message,
+    const socket_base::message_flags flags,
+    boost::system::error_code& error) {
+  // send() may send only part of the message, keep going until all of it is
+  // sent
+  size_t bytesSent = 0;
+  while (bytesSent < message.size()) {
+    bytesSent += socket.send(buffer(message) + bytesSent, flags, error);
+    if (error) {
+      return;
+    }
   }
-
-  // read_until may read more data into the buffer (past our delimiter)
-  // so we need to extract based on the bytesTransferred value
-  const string readString(
-      buffers_begin(rcvBuffer.data()),
-      buffers_begin(rcvBuffer.data()) +
-      bytesTransferred - kDelimiter.length());
-  // consume all of the data (including the delimiter) from our read buffer
-  rcvBuffer.consume(bytesTransferred);
-  return readString;
 }
 
 /**
- * Read the specified number of bytes from socket or buffer.
+ * Send a range of a file onto the socket.
  *
- * The buffer will be drained first before any new bytes are pulled from the
- * socket. This ensures that we cleanup / recoup any existing bytes from the
- * buffer. See note on read_until below.
+ * Sends numBytes bytes starting at startOffset in the file, with sendFile()
+ * from SocketUtils, which copies the bytes from the page cache straight to
+ * the socket without passing them through user space. If the file does not
+ * support sendfile(), falls back to mapping the file into memory and writing
+ * from the mapping.
  */
-string readBytes(
+void sendFileRange(
     boost::asio::ip::tcp::socket& socket,
-    boost::asio::streambuf& readBuffer,
-    const int numBytesToRead) {
-  // When using read_until with a delimiter, more bytes than necessary may be
-  // read into the streambuf. For instance, if we want to read until a "#", and
-  // the stream is "abcde#fghij", the buffer may actually end up containing
-  // "abcde#fg" (two more bytes than what we needed to capture to get the
-  // delimiter). read_until automatically takes care of this when called again
-  // (it checks if the streambuf already has an instance of the delimiter).
-  //
-  // However, this "overreading" becomes a problem if we subsequently call
-  // "read" with a "transfer_exactly" parameter. For instance, we may expect
-  // 64 bytes (due to a variable in a header, such as CONTENT LENGTH). If the
-  // buffer already contains two bytes (due to the previous overread), then
-  // we'll end up waiting forever (as the server will only send 62 more bytes),
-  // or we'll end up with a corrupt message that contains two bytes of the next
-  // message.
-  //
-  // To handle this, we first check how many bytes the buffer contains, and
-  // subtract this from the number that we need to wait for. It's possible that
-  // the buffer already contains everything, in which case we don't need to call
-  // read() at all.
-
-  // check how many bytes the buffer already contains
-  const int numBytesInBuffer = readBuffer.size();
-  const int numBytesToReadFromSocket = numBytesToRead - numBytesInBuffer;
-
-  // we may not even need to read if the buffer already contains enough data
-  if (numBytesToReadFromSocket > 0) {
-    // blocking read on the socket until the delimiter
-    boost::system::error_code error;
-    read(
-        socket, readBuffer,
-        boost::asio::transfer_exactly(numBytesToReadFromSocket), error);
-    if (error) {
-      LOG(FATAL)
-          << "Read error: "
-          << boost::system::system_error(error).what();
+    const int fileFd,
+    const uint64_t startOffset,
+    const uint64_t numBytes,
+    boost::system::error_code& error) {
+  // the socket is in blocking mode, so sendfile() blocks until it has sent at
+  // least some bytes; keep calling it until the whole range has been sent
+  const uint64_t endOffset = startOffset + numBytes;
+  uint64_t offset = startOffset;
+  while (offset < endOffset) {
+    const auto bytesSent =
+        sendFile(socket, fileFd, offset, endOffset - offset, error);
+    if (!error && bytesSent > 0) {
+      offset += bytesSent;
+      continue;
+    }
+
+    // sendfile() not supported for this file, fall back to mmap()
+    if (error == boost::system::errc::invalid_argument ||
+        error == boost::system::errc::function_not_supported) {
+      LOG(INFO) << "sendfile() not supported for file, falling back to mmap()";
+      void* fileData =
+          mmap(nullptr, endOffset, PROT_READ, MAP_PRIVATE, fileFd, 0);
+      if (fileData == MAP_FAILED) {
+        error = boost::system::error_code(
+            errno, boost::system::system_category());
+        return;
+      }
+      write(
+          socket,
+          buffer(static_cast<const char*>(fileData) + offset,
+                 endOffset - offset),
+          transfer_all(), error);
+      munmap(fileData, endOffset);
+      return;
     }
-  }
 
-  // extract numBytesToRead from buffer into string and remove it from buffer
-  // buffer could contain more data -- depends on previous read operations
-  const string readBytes(
-      buffers_begin(readBuffer.data()),
-      buffers_begin(readBuffer.data()) +
-      numBytesToRead);
-  readBuffer.consume(numBytesToRead);
-  return readBytes;
+    // the file shrunk while we were sending it (sendfile() sent nothing), or
+    // the send failed
+    if (!error) {
+      error = boost::asio::error::make_error_code(boost::asio::error::eof);
+    }
+    return;
+  }
 }
@@ -1,10 +1,15 @@
+#include <array>
 #include <chrono>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <glog/logging.h>
 
+#include "SocketUtils.h"
+
 using namespace std;
 using namespace boost::asio;
 
@@ -17,34 +22,38 @@ DEFINE_string(
 DEFINE_bool(
     server, false,
     "Whether to operate in server or client mode (true = server)");
+DEFINE_string(
+    listen, "0.0.0.0",
+    "Comma separated list of addresses the server listens on, each optionally "
+    "with a port (default = --port), e.g. 0.0.0.0,[::1]:9000; the IPv6 "
+    "wildcard address [::] also accepts IPv4 connections, unless an IPv4 "
+    "address is listed with the same port");
 DEFINE_string(
     message, "",
     "Message for client to send to remote server");
 DEFINE_bool(
     header_mode, false,
     "Whether to use a header with the number of bytes as the first message");
+DEFINE_bool(
+    binary_framing, false,
+    "Use binary length-prefixed frames instead of delimited messages (client "
+    "only; the server detects which framing each client uses)");
 
 // value used as delimiter / for marking the end of a message
 const std::string kDelimiter = "#";
 
 void runServer();
+void acceptClient(ip::tcp::acceptor& acceptor);
+void serveClient(ip::tcp::socket& socket);
 void runClient();
 void sendMessage(
     boost::asio::ip::tcp::socket& socket,
-    const std::string& message);
-void sendBytes(
-    boost::asio::ip::tcp::socket& socket,
-    const std::string& message);
+    const std::string& message,
+    const bool binaryFraming);
 string readMessage(
-    boost::asio::ip::tcp::socket& socket,
-    boost::asio::streambuf& rcvBuffer);
-string readUntilDelimiter(
-    boost::asio::ip::tcp::socket& socket,
-    boost::asio::streambuf& rcvBuffer);
-string readBytes(
     boost::asio::ip::tcp::socket& socket,
     boost::asio::streambuf& rcvBuffer,
-    const int numBytesToRead);
+    const bool binaryFraming);
 string getTimestamp();
 
 int main(int argc, char *argv[]) {
@@ -78,62 +87,110 @@ int main(int argc, char *argv[]) {
 void runServer() {
   io_service ioService;
 
-  // resolve my hostname into an IP address
+  // parse the addresses to listen on
+  //
+  // they must be numeric, so that starting the server never waits on a DNS
+  // lookup (looking up our own hostname can take as long as the resolver
+  // takes to time out, if it's misconfigured)
+  const auto endpoints = parseEndpoints(FLAGS_listen, FLAGS_port);
+
+  // accept connections on each of the addresses
   //
-  // flag explanation:
-  //   - address_configured (AI_ADDRCONFIG): ignore loopback addrs (127.0.0.1)
-  //     Only return IPv4 addresses if a non-loopback IPv4 address is
-  //     configured for the system. Only return IPv6 addresses if a non-loopback
-  //     IPv6 address is configured for the system.
-  //   - numeric_service (AI_NUMERICSERV): service is a interger port #
-  //     Service name should be treated as a numeric string defining a port
-  //     number and no name resolution should be attempted.
-  const auto queryFlags = (
-      ip::resolver_query_base::address_configured |
-      ip::resolver_query_base::numeric_service);
-  const auto hostname = ip::host_name();
-  ip::tcp::resolver resolver(ioService);
-  ip::tcp::resolver::query query(hostname, to_string(FLAGS_port), queryFlags);
-  ip::tcp::resolver::iterator queryIt = resolver.resolve(query);
-  ip::tcp::resolver::iterator endIt;
-  if (queryIt == endIt) {
-    LOG(FATAL) << "Could not resolve local hostname to an IP address";
+  // an IPv6 acceptor either accepts IPv4 connections too (dual-stack) or
+  // only IPv6 ones; see isDualStack in SocketUtils.h
+  std::vector<ip::tcp::acceptor> acceptors;
+  acceptors.reserve(endpoints.size());
+  for (const auto& endpoint : endpoints) {
+    acceptors.emplace_back(ioService);
+    auto& acceptor = acceptors.back();
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
+    if (endpoint.address().is_v6()) {
+      acceptor.set_option(ip::v6_only(not isDualStack(endpoints, endpoint)));
+    }
+    acceptor.bind(endpoint);
+    acceptor.listen();
+    const auto localEndpoint = acceptor.local_endpoint();
+    LOG(INFO)
+        << "Server is running at "
+        << localEndpoint.address() << ":" << localEndpoint.port();
   }
 
-  // accept connections on the first resolved address
-  ip::tcp::acceptor acceptor(ioService, *queryIt);
-  const auto localEndpoint = acceptor.local_endpoint();
-  LOG(INFO)
-      << "Server is running at "
-      << localEndpoint.address() << ":" << localEndpoint.port();
+  // wait on a client connection on all acceptors at once
+  //
+  // each acceptor has an async_accept registered with the io_service, whose
+  // handler serves the client and then registers the next one; run() calls
+  // the handlers one at a time, so clients are still served one after the
+  // other, whichever address they connected to
+  for (auto& acceptor : acceptors) {
+    acceptClient(acceptor);
+  }
 
   // keep processing connections forever
-  for (;;) {
-    // setup a socket and wait on a client connection
-    ip::tcp::socket socket(ioService);
+  LOG(INFO) << "Waiting for client to connect";
+  ioService.run();
+}
 
-    LOG(INFO) << "Waiting for client to connect";
-    acceptor.accept(socket);
+/**
+ * Register an async_accept on the acceptor, serving the client once it has
+ * connected and then waiting for the next one.
+ */
+void acceptClient(ip::tcp::acceptor& acceptor) {
+  acceptor.async_accept(
+      [&acceptor](
+          const boost::system::error_code& error,
+          ip::tcp::socket socket) {
+        if (error) {
+          LOG(ERROR)
+              << "Accept error: "
+              << boost::system::system_error(error).what();
+        } else {
+          serveClient(socket);
+        }
+        acceptClient(acceptor);
+      });
+}
 
-    // log the address of the remote client
-    const auto remoteEndpoint = socket.remote_endpoint();
-    LOG(INFO)
-        << "Connected to client ("
-        << remoteEndpoint.address() << ":" << remoteEndpoint.port() << ")";
+/**
+ * Read a message from a newly connected client, and send it back reversed.
+ */
+void serveClient(ip::tcp::socket& socket) {
+  // log the address of the remote client
+  const auto remoteEndpoint = socket.remote_endpoint();
+  LOG(INFO)
+      << "Connected to client ("
+      << remoteEndpoint.address() << ":" << remoteEndpoint.port() << ")";
+
+  // a client that wants binary framing starts with a kHello frame, whose
+  // first byte can't start a message in the other modes; answer it with a
+  // kHello frame of our own, so the client knows we understood
+  boost::asio::streambuf rcvBuffer;
+  boost::system::error_code error;
+  const bool binaryFraming = isBinaryFraming(socket, rcvBuffer, error);
+  if (error) {
+    LOG(ERROR)
+        << "Read error: "
+        << boost::system::system_error(error).what();
+    return;
+  }
+  if (binaryFraming) {
+    LOG(INFO) << "Client is using binary framing";
+    const auto helloHeader = readFrameHeader(socket, rcvBuffer);
+    readBytes(socket, rcvBuffer, helloHeader.length);
+    sendFrame(socket, helloHeader, const_buffer());
+  }
 
-    // wait for a message from the client
-    LOG(INFO) << "Waiting for message from client";
-    boost::asio::streambuf rcvBuffer;
-    const auto message = readMessage(socket, rcvBuffer);
+  // wait for a message from the client
+  LOG(INFO) << "Waiting for message from client";
+  const auto message = readMessage(socket, rcvBuffer, binaryFraming);
 
-    // reverse the message and send it back
-    const auto responseMessage = string(message.rbegin(), message.rend());
-    sendMessage(socket, responseMessage);
-    LOG(INFO) << "Sent message \"" << responseMessage << "\"";
+  // reverse the message and send it back
+  const auto responseMessage = string(message.rbegin(), message.rend());
+  sendMessage(socket, responseMessage, binaryFraming);
+  LOG(INFO) << "Sent message \"" << responseMessage << "\"";
 
-    // we're done
-    LOG(INFO) << "Disconnected client";
-  }
+  // we're done
+  LOG(INFO) << "Disconnected client";
 }
 
 void runClient() {
@@ -164,67 +221,104 @@ void runClient() {
   LOG(INFO) << "Connected to remote endpoint";
 
   // send a message to the server
-  sendMessage(socket, message);
+  sendMessage(socket, message, FLAGS_binary_framing);
   LOG(INFO) << "Sent message \"" << message << "\"";
 
   // wait for a reply
   LOG(INFO) << "Waiting for response from server";
   boost::asio::streambuf rcvBuffer;
-  const auto responseMessage = readMessage(socket, rcvBuffer);
+  const auto responseMessage =
+      readMessage(socket, rcvBuffer, FLAGS_binary_framing);
   LOG(INFO) << "Received message \"" << responseMessage << "\"";
 }
 
 /**
- * Send a message, handling header mode or non-header mode.
+ * Send a message, handling binary framing, header mode or non-header mode.
  */
 void sendMessage(
     boost::asio::ip::tcp::socket& socket,
-    const std::string& message) {
+    const std::string& message,
+    const bool binaryFraming) {
+  // with binary framing, the message is sent as a kMessage frame: a fixed size
+  // header holding its length, followed by the message itself (see
+  // SocketUtils.h); a client also has to ask for binary framing with a kHello
+  // frame in front of its first message
+  if (binaryFraming) {
+    std::string frameHeaders;
+    if (not FLAGS_server) {
+      FrameHeader helloHeader;
+      helloHeader.type = FrameType::kHello;
+      appendFrameHeader(frameHeaders, helloHeader);
+    }
+    FrameHeader header;
+    header.type = FrameType::kMessage;
+    header.length = message.size();
+    appendFrameHeader(frameHeaders, header);
+    sendBytes(
+        socket,
+        array<const_buffer, 2>{{buffer(frameHeaders), buffer(message)}});
+    return;
+  }
+
   // if we're in header_mode, we need to send the following:
   //   - a header (delimiter at the end) with number of bytes in the message
   //   - the actual message to the client (no delimiter at the end)
   //
   // if we're not in header_mode, then we just send a message with a delimiter
+  //
+  // either way, the pieces are sent with a single gathering write, instead of
+  // being copied into one string or sent with separate calls (which could put
+  // them in separate TCP segments)
   if (FLAGS_header_mode) {
-    sendBytes(socket, std::to_string(message.size()) + kDelimiter);
-    sendBytes(socket, message);
+    const auto header = std::to_string(message.size()) + kDelimiter;
+    sendBytes(
+        socket, array<const_buffer, 2>{{buffer(header), buffer(message)}});
   } else {
-    sendBytes(socket, message + kDelimiter);
+    sendBytes(
+        socket, array<const_buffer, 2>{{buffer(message), buffer(kDelimiter)}});
   }
 }
 
 /**
- * Send bytes onto the socket.
+ * Read a message, handling binary framing, header-mode or non-header mode.
  */
-void sendBytes(
+string readMessage(
     boost::asio::ip::tcp::socket& socket,
-    const std::string& message) {
-  boost::system::error_code error;
-  write(socket, buffer(message), transfer_all(), error);
-  if (error) {
-    LOG(FATAL)
-        << "Send error: "
-        << boost::system::system_error(error).what();
+    boost::asio::streambuf& rcvBuffer,
+    const bool binaryFraming) {
+  // with binary framing, we get a kMessage frame, which a server acknowledging
+  // binary framing precedes with a kHello frame
+  if (binaryFraming) {
+    auto header = readFrameHeader(socket, rcvBuffer);
+    while (header.type == FrameType::kHello) {
+      readBytes(socket, rcvBuffer, header.length);
+      header = readFrameHeader(socket, rcvBuffer);
+    }
+    if (header.type != FrameType::kMessage) {
+      LOG(FATAL)
+          << "Unexpected frame type "
+          << static_cast<int>(static_cast<uint8_t>(header.type));
+    }
+    if (header.length > static_cast<uint64_t>(numeric_limits<int>::max())) {
+      LOG(FATAL) << "Invalid frame header, length = " << header.length;
+    }
+    LOG(INFO)
+        << "Received frame header, message is " << header.length << " bytes";
+    return readBytes(socket, rcvBuffer, header.length);
   }
-}
 
-/**
- * Read a message, handling header-mode or non-header mode.
- */
-string readMessage(
-    boost::asio::ip::tcp::socket& socket,
-    boost::asio::streambuf& rcvBuffer) {
   // if we're in header_mode, we get the following:
   //   - a header (delimiter at the end) with number of bytes in the message
   //   - the actual message from the client (no delimiter at the end)
   //
   // if we're not in header_mode, then we just get a message with a delimiter
   if (not FLAGS_header_mode) {
-    return readUntilDelimiter(socket, rcvBuffer);
+    return readUntilDelimiter(socket, rcvBuffer, kDelimiter);
   }
 
   // get the header
-  const std::string messageHeader = readUntilDelimiter(socket, rcvBuffer);
+  const std::string messageHeader =
+      readUntilDelimiter(socket, rcvBuffer, kDelimiter);
 
   // the header message tells us the number of bytes in the message
   int numBytes;
@@ -242,95 +336,6 @@ string readMessage(
   return readBytes(socket, rcvBuffer, numBytes);
 }
 
-/**
- * Read from a socket up until a delimiter.
- *
- * Note that this function may actually overread from the socket. Left over
- * bytes will be kept in the streambuf object that is passed in.
- */
-string readUntilDelimiter(
-    boost::asio::ip::tcp::socket& socket,
-    boost::asio::streambuf& rcvBuffer) {
-  // blocking read on the socket until the delimiter
-  boost::system::error_code error;
-  const auto bytesTransferred = read_until(
-      socket, rcvBuffer, kDelimiter, error);
-  if (error) {
-    LOG(FATAL)
-        << "Read error: "
-        << boost::system::system_error(error).what();
-  }
-
-  // read_until may read more data into the buffer (past our delimiter)
-  // so we need to extract based on the bytesTransferred value
-  const string readString(
-      buffers_begin(rcvBuffer.data()),
-      buffers_begin(rcvBuffer.data()) +
-      bytesTransferred - kDelimiter.length());
-  // consume all of the data (including the delimiter) from our read buffer
-  rcvBuffer.consume(bytesTransferred);
-  return readString;
-}
-
-/**
- * Read the specified number of bytes from socket or buffer.
- *
- * The buffer will be drained first before any new bytes are pulled from the
- * socket. This ensures that we cleanup / recoup any existing bytes from the
- * buffer. See note on read_until below.
- */
-string readBytes(
-    boost::asio::ip::tcp::socket& socket,
-    boost::asio::streambuf& readBuffer,
-    const int numBytesToRead) {
-  // When using read_until with a delimiter, more bytes than necessary may be
-  // read into the streambuf. For instance, if we want to read until a "#", and
-  // the stream is "abcde#fghij", the buffer may actually end up containing
-  // "abcde#fg" (two more bytes than what we needed to capture to get the
-  // delimiter). read_until automatically takes care of this when called again
-  // (it checks if the streambuf already has an instance of the delimiter).
-  //
-  // However, this "overreading" becomes a problem if we subsequently call
-  // "read" with a "transfer_exactly" parameter. For instance, we may expect
-  // 64 bytes (due to a variable in a header, such as CONTENT LENGTH). If the
-  // buffer already contains two bytes (due to the previous overread), then
-  // we'll end up waiting forever (as the server will only send 62 more bytes),
-  // or we'll end up with a corrupt message that contains two bytes of the next
-  // message.
-  //
-  // To handle this, we first check how many bytes the buffer contains, and
-  // subtract this from the number that we need to wait for. It's possible that
-  // the buffer already contains everything, in which case we don't need to call
-  // read() at all.
-
-  // check how many bytes the buffer already contains
-  const int numBytesInBuffer = readBuffer.size();
-  const int numBytesToReadFromSocket = numBytesToRead - numBytesInBuffer;
-
-  // we may not even need to read if the buffer already contains enough data
-  if (numBytesToReadFromSocket > 0) {
-    // blocking read on the socket until the delimiter
-    boost::system::error_code error;
-    read(
-        socket, readBuffer,
-        boost::asio::transfer_exactly(numBytesToReadFromSocket), error);
-    if (error) {
-      LOG(FATAL)
-          << "Read error: "
-          << boost::system::system_error(error).what();
-    }
-  }
-
-  // extract numBytesToRead from buffer into string and remove it from buffer
-  // buffer could contain more data -- depends on previous read operations
-  const string readBytes(
-      buffers_begin(readBuffer.data()),
-      buffers_begin(readBuffer.data()) +
-      numBytesToRead);
-  readBuffer.consume(numBytesToRead);
-  return readBytes;
-}
-
 /**
  * Return a string containing the current time with millisecond resolution.
  */
@@ -0,0 +1,365 @@
+#include "AsyncFileReader.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+// number of entries requested for the submission ring (the kernel sizes the
+// completion ring at twice this)
+const unsigned kRingEntries = 256;
+
+// thin wrappers around the io_uring system calls, which libc doesn't wrap
+int ioUringSetup(const unsigned entries, struct io_uring_params* params) {
+  return ::syscall(__NR_io_uring_setup, entries, params);
+}
+
+int ioUringEnter(const int ringFd, const unsigned toSubmit) {
+  return ::syscall(__NR_io_uring_enter, ringFd, toSubmit, 0, 0, nullptr, 0);
+}
+
+int ioUringRegister(
+    const int ringFd,
+    const unsigned opcode,
+    void* arg,
+    const unsigned numArgs) {
+  return ::syscall(__NR_io_uring_register, ringFd, opcode, arg, numArgs);
+}
+
+} // namespace
+
+AsyncFileReader::AsyncFileReader(
+    boost::asio::io_service& ioService,
+    const Backend backend,
+    const unsigned int numThreads)
+  : ioService_(ioService),
+    backend_(backend) {
+  if (backend_ == Backend::kIoUring && not setupIoUring()) {
+    backend_ = Backend::kThreadPool;
+  }
+  if (backend_ == Backend::kThreadPool) {
+    for (unsigned int i = 0; i < std::max(numThreads, 1u); i++) {
+      threads_.emplace_back([this]() { runThread(); });
+    }
+  }
+}
+
+AsyncFileReader::~AsyncFileReader() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stopping_ = true;
+  }
+  pendingReadsCondition_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+  closeIoUring();
+}
+
+void AsyncFileReader::read(
+    const int fd,
+    char* data,
+    const std::size_t numBytes,
+    const uint64_t offset,
+    ReadHandler handler) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::unique_ptr<Read> read;
+  if (freeReads_.empty()) {
+    read.reset(new Read());
+  } else {
+    read = std::move(freeReads_.back());
+    freeReads_.pop_back();
+  }
+  read->fd = fd;
+  read->iov = {data, numBytes};
+  read->offset = offset;
+  read->handler = std::move(handler);
+  read->work.emplace(ioService_);
+
+  if (backend_ == Backend::kThreadPool) {
+    pendingReads_.push_back(std::move(read));
+    lock.unlock();
+    pendingReadsCondition_.notify_one();
+    return;
+  }
+
+  // if the completion ring could overflow, hold the read back until some of
+  // the reads in flight have completed
+  if (numReadsInFlight_ >= maxReadsInFlight_) {
+    pendingReads_.push_back(std::move(read));
+    return;
+  }
+  startRead(std::move(read));
+}
+
+AsyncFileReader::Backend AsyncFileReader::getBackend() const {
+  return backend_;
+}
+
+std::string AsyncFileReader::getBackendName(const Backend backend) {
+  switch (backend) {
+    case Backend::kIoUring:
+      return "io_uring";
+    case Backend::kThreadPool:
+      return "threads";
+  }
+  return "unknown";
+}
+
+bool AsyncFileReader::setupIoUring() {
+  struct io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  ringFd_ = ioUringSetup(kRingEntries, &params);
+  if (ringFd_ < 0) {
+    return false;
+  }
+
+  // map the rings shared with the kernel; newer kernels put both rings in a
+  // single mapping
+  sqRingBytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingBytes_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  const bool singleMapping = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (singleMapping) {
+    sqRingBytes_ = cqRingBytes_ = std::max(sqRingBytes_, cqRingBytes_);
+  }
+  sqRing_ = ::mmap(
+      nullptr, sqRingBytes_, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+  if (sqRing_ == MAP_FAILED) {
+    sqRing_ = nullptr;
+    closeIoUring();
+    return false;
+  }
+  if (singleMapping) {
+    cqRing_ = sqRing_;
+  } else {
+    cqRing_ = ::mmap(
+        nullptr, cqRingBytes_, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING);
+    if (cqRing_ == MAP_FAILED) {
+      cqRing_ = nullptr;
+      closeIoUring();
+      return false;
+    }
+  }
+  sqesBytes_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes_ = ::mmap(
+      nullptr, sqesBytes_, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES);
+  if (sqes_ == MAP_FAILED) {
+    sqes_ = nullptr;
+    closeIoUring();
+    return false;
+  }
+
+  auto* sq = static_cast<char*>(sqRing_);
+  sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sqMask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  auto* cq = static_cast<char*>(cqRing_);
+  cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cqMask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = cq + params.cq_off.cqes;
+
+  // every read is submitted as soon as it's queued, so the submission ring
+  // never fills up; the completion ring limits how many can be in flight
+  maxReadsInFlight_ = params.cq_entries;
+  readsInFlight_.resize(maxReadsInFlight_);
+  for (std::size_t slot = maxReadsInFlight_; slot > 0; slot--) {
+    freeSlots_.push_back(slot - 1);
+  }
+
+  // have the kernel signal an eventfd whenever a read completes, so that the
+  // io_service can wait for completions along with everything else
+  const int eventFd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (eventFd < 0) {
+    closeIoUring();
+    return false;
+  }
+  int eventFdArg = eventFd;
+  if (ioUringRegister(ringFd_, IORING_REGISTER_EVENTFD, &eventFdArg, 1) != 0) {
+    ::close(eventFd);
+    closeIoUring();
+    return false;
+  }
+  eventDescriptor_.reset(
+      new boost::asio::posix::stream_descriptor(ioService_, eventFd));
+  return true;
+}
+
+void AsyncFileReader::closeIoUring() {
+  // closes the eventfd
+  eventDescriptor_.reset();
+  if (sqes_ != nullptr) {
+    ::munmap(sqes_, sqesBytes_);
+    sqes_ = nullptr;
+  }
+  if (cqRing_ != nullptr && cqRing_ != sqRing_) {
+    ::munmap(cqRing_, cqRingBytes_);
+  }
+  cqRing_ = nullptr;
+  if (sqRing_ != nullptr) {
+    ::munmap(sqRing_, sqRingBytes_);
+    sqRing_ = nullptr;
+  }
+  if (ringFd_ >= 0) {
+    ::close(ringFd_);
+    ringFd_ = -1;
+  }
+}
+
+void AsyncFileReader::startRead(std::unique_ptr<Read> read) {
+  // there's a free slot, since no more than maxReadsInFlight_ reads are
+  // started at once
+  read->slot = freeSlots_.back();
+
+  // fill in the next submission queue entry, then publish it to the kernel by
+  // advancing the tail
+  const unsigned tail = *sqTail_;
+  const unsigned index = tail & sqMask_;
+  auto* sqe = static_cast<struct io_uring_sqe*>(sqes_) + index;
+  std::memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = read->fd;
+  sqe->addr = reinterpret_cast<uint64_t>(&read->iov);
+  sqe->len = 1;
+  sqe->off = read->offset;
+  sqe->user_data = read->slot;
+  sqArray_[index] = index;
+  __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+
+  int result;
+  do {
+    result = ioUringEnter(ringFd_, 1);
+  } while (result < 0 && errno == EINTR);
+  if (result != 1) {
+    // the kernel didn't take the entry, take it back
+    const int error = result < 0 ? errno : EAGAIN;
+    __atomic_store_n(sqTail_, tail, __ATOMIC_RELEASE);
+    postHandler(std::move(read), -error);
+    return;
+  }
+  const auto slot = read->slot;
+  freeSlots_.pop_back();
+  numReadsInFlight_++;
+  readsInFlight_[slot] = std::move(read);
+  waitForCompletions();
+}
+
+void AsyncFileReader::postHandler(
+    std::unique_ptr<Read> read,
+    const ssize_t result) {
+  // io_service::post wants a handler it can copy, so the read is passed as a
+  // plain pointer, and taken back by the handler (a read whose handler never
+  // runs, because the io_service is stopped for good, is leaked)
+  auto& handlerMemory = read->handlerMemory;
+  ioService_.post(makeAllocHandler(
+      handlerMemory, [this, rawRead = read.release(), result]() {
+    std::unique_ptr<Read> read(rawRead);
+    if (result < 0) {
+      read->handler(
+          boost::system::error_code(-result, boost::system::system_category()),
+          0);
+    } else {
+      read->handler(boost::system::error_code(), result);
+    }
+
+    // the handler (and whatever it holds) is released right away, without
+    // waiting for the read to be reused
+    read->handler = nullptr;
+    read->work.reset();
+    std::lock_guard<std::mutex> guard(mutex_);
+    freeReads_.push_back(std::move(read));
+  }));
+}
+
+void AsyncFileReader::waitForCompletions() {
+  if (waitingForCompletions_) {
+    return;
+  }
+
+  // only wait while reads are in flight, so that the wait doesn't keep the
+  // io_service's run() from returning once the server has stopped
+  waitingForCompletions_ = true;
+  eventDescriptor_->async_wait(
+      boost::asio::posix::stream_descriptor::wait_read,
+      [this](const boost::system::error_code& error) {
+        if (error == boost::asio::error::operation_aborted) {
+          return;
+        }
+        handleCompletions();
+      });
+}
+
+void AsyncFileReader::handleCompletions() {
+  // reset the eventfd before reaping, so that completions arriving while we
+  // reap signal it again
+  uint64_t eventCount;
+  const auto ignored = ::read(
+      eventDescriptor_->native_handle(), &eventCount, sizeof(eventCount));
+  (void) ignored;
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  waitingForCompletions_ = false;
+
+  // the kernel advances the tail as reads complete, we advance the head once
+  // we're done with their entries
+  //
+  // posting a handler doesn't run it, so the handlers can be posted with the
+  // mutex held
+  unsigned head = *cqHead_;
+  const unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    const auto& cqe = static_cast<struct io_uring_cqe*>(cqes_)[head & cqMask_];
+    if (cqe.user_data < readsInFlight_.size() &&
+        readsInFlight_[cqe.user_data]) {
+      auto read = std::move(readsInFlight_[cqe.user_data]);
+      freeSlots_.push_back(cqe.user_data);
+      numReadsInFlight_--;
+      postHandler(std::move(read), cqe.res);
+    }
+  }
+  __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+
+  // submit reads that were held back, now that there's room
+  while (not pendingReads_.empty() && numReadsInFlight_ < maxReadsInFlight_) {
+    auto read = std::move(pendingReads_.front());
+    pendingReads_.pop_front();
+    startRead(std::move(read));
+  }
+  if (numReadsInFlight_ > 0) {
+    waitForCompletions();
+  }
+}
+
+void AsyncFileReader::runThread() {
+  for (;;) {
+    std::unique_ptr<Read> read;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      pendingReadsCondition_.wait(lock, [this]() {
+        return stopping_ || not pendingReads_.empty();
+      });
+      if (stopping_) {
+        return;
+      }
+      read = std::move(pendingReads_.front());
+      pendingReads_.pop_front();
+    }
+
+    ssize_t result;
+    do {
+      result = ::pread(
+          read->fd, read->iov.iov_base, read->iov.iov_len, read->offset);
+    } while (result < 0 && errno == EINTR);
+    postHandler(std::move(read), result < 0 ? -errno : result);
+  }
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include <boost/asio.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+
+#include "HandlerMemory.h"
+
+/**
+ * Reads from files without blocking the io_service's threads.
+ *
+ * A read that misses the page cache can take milliseconds, during which a
+ * worker thread calling pread would not service any of its other clients.
+ * Instead, reads are handed to the kernel through an io_uring, whose
+ * completions wake up the io_service through an eventfd. If io_uring is not
+ * available (old kernels, or blocked by a sandbox), reads are done by a small
+ * pool of threads of our own instead.
+ *
+ * Either way many reads can be in flight at once, and each read's handler is
+ * posted to the io_service once the read completes. The buffer passed to read
+ * must stay valid until then, even if the file is closed in the meantime.
+ *
+ * The state of a read is recycled once its handler has run, so reading
+ * doesn't allocate once the reader has warmed up, as long as the handler fits
+ * in a std::function without allocating (e.g., a lambda capturing a couple of
+ * pointers).
+ */
+class AsyncFileReader {
+ public:
+  /**
+   * How reads are carried out.
+   */
+  enum class Backend {
+    // submit reads to an io_uring, falling back to kThreadPool if io_uring is
+    // not supported
+    kIoUring,
+
+    // do reads on a pool of threads, with blocking pread calls
+    kThreadPool,
+  };
+
+  /**
+   * Handler called once a read completes, with the number of bytes read (zero
+   * at the end of the file).
+   */
+  using ReadHandler = std::function<void(
+      const boost::system::error_code& error,
+      const std::size_t bytesRead)>;
+
+  /**
+   * Create a reader posting its handlers to ioService.
+   *
+   * numThreads is the size of the thread pool, when using kThreadPool (or
+   * falling back to it).
+   */
+  AsyncFileReader(
+      boost::asio::io_service& ioService,
+      const Backend backend,
+      const unsigned int numThreads);
+  ~AsyncFileReader();
+
+  AsyncFileReader(const AsyncFileReader&) = delete;
+  AsyncFileReader& operator=(const AsyncFileReader&) = delete;
+
+  /**
+   * Start reading up to numBytes bytes at offset in the file into data.
+   *
+   * May read fewer bytes than asked for, like pread. Thread safe.
+   */
+  void read(
+      const int fd,
+      char* data,
+      const std::size_t numBytes,
+      const uint64_t offset,
+      ReadHandler handler);
+
+  /**
+   * Return the backend actually in use.
+   */
+  Backend getBackend() const;
+
+  /**
+   * Return a printable name for a backend.
+   */
+  static std::string getBackendName(const Backend backend);
+
+ private:
+  // a read that has been started, but whose handler hasn't run yet
+  struct Read {
+    int fd = -1;
+    struct iovec iov = {};
+    uint64_t offset = 0;
+    ReadHandler handler;
+
+    // keeps the io_service's run() from returning while the read is in flight
+    std::optional<boost::asio::io_service::work> work;
+
+    // index in readsInFlight_ while submitted to the io_uring
+    std::size_t slot = 0;
+
+    // for posting the handler to the io_service, see postHandler
+    HandlerMemory handlerMemory;
+  };
+
+  /**
+   * Set up the io_uring and its eventfd. Returns false if io_uring is not
+   * available.
+   */
+  bool setupIoUring();
+
+  /**
+   * Release the io_uring, if set up.
+   */
+  void closeIoUring();
+
+  /**
+   * Queue a read in the io_uring's submission ring and submit it; if that
+   * fails, post its handler with the error.
+   *
+   * Must be called with mutex_ held.
+   */
+  void startRead(std::unique_ptr<Read> read);
+
+  /**
+   * Post the handler of a completed read, given the result of the read (the
+   * number of bytes read, or a negated errno value); once the handler has
+   * run, the read goes back to freeReads_.
+   */
+  void postHandler(std::unique_ptr<Read> read, const ssize_t result);
+
+  /**
+   * Wait for the eventfd to signal completions, unless we're waiting already.
+   *
+   * Must be called with mutex_ held.
+   */
+  void waitForCompletions();
+
+  /**
+   * Post the handlers of all completed reads in the io_uring's completion
+   * ring, then submit reads that didn't fit in the ring earlier.
+   */
+  void handleCompletions();
+
+  /**
+   * Body of each thread in the thread pool.
+   */
+  void runThread();
+
+  // io_service the handlers are posted to
+  boost::asio::io_service& ioService_;
+
+  // backend in use
+  Backend backend_;
+
+  // hold this mutex when accessing any of the members below
+  std::mutex mutex_;
+
+  // io_uring state (kIoUring only)
+  //
+  // the submission and completion rings are shared with the kernel: we
+  // advance the submission tail and completion head, and the kernel the
+  // submission head and completion tail
+  int ringFd_ = -1;
+  void* sqRing_ = nullptr;
+  std::size_t sqRingBytes_ = 0;
+  void* cqRing_ = nullptr;
+  std::size_t cqRingBytes_ = 0;
+  void* sqes_ = nullptr;
+  std::size_t sqesBytes_ = 0;
+  unsigned* sqTail_ = nullptr;
+  unsigned sqMask_ = 0;
+  unsigned* sqArray_ = nullptr;
+  unsigned* cqHead_ = nullptr;
+  unsigned* cqTail_ = nullptr;
+  unsigned cqMask_ = 0;
+  void* cqes_ = nullptr;
+
+  // number of reads the rings can hold at once
+  std::size_t maxReadsInFlight_ = 0;
+
+  // eventfd the kernel signals when reads complete, watched by the io_service
+  std::unique_ptr<boost::asio::posix::stream_descriptor> eventDescriptor_;
+  bool waitingForCompletions_ = false;
+
+  // reads submitted to the io_uring, by slot (the ID the kernel hands back
+  // with the read's completion), the slots that are free, and the number of
+  // slots taken
+  std::vector<std::unique_ptr<Read>> readsInFlight_;
+  std::vector<std::size_t> freeSlots_;
+  std::size_t numReadsInFlight_ = 0;
+
+  // reads waiting for room in the io_uring, or for a thread in the pool
+  std::deque<std::unique_ptr<Read>> pendingReads_;
+
+  // reads whose handlers have run, reused by the next reads
+  std::vector<std::unique_ptr<Read>> freeReads_;
+
+  // thread pool (kThreadPool only)
+  std::vector<std::thread> threads_;
+  std::condition_variable pendingReadsCondition_;
+  bool stopping_ = false;
+};
@@ -0,0 +1,456 @@
+#include "AsyncLog.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+DEFINE_int32(
+    log_client_sample_rate, 1,
+    "Log the messages about one in this many clients, picked by client ID "
+    "(1 = every client, 0 = none)");
+DEFINE_uint64(
+    log_rate_limit, 0,
+    "Maximum number of messages per second each thread handling clients may "
+    "log; the rest are dropped and counted (0 = unlimited)");
+
+namespace {
+
+// number of messages each thread's ring can hold (a power of two, so that
+// the ring's 64 bit positions never wrap around it unevenly)
+constexpr std::size_t kRingEntries = 4096;
+
+// how often the writer looks for messages; producers never wake it up, since
+// that would take a lock
+constexpr auto kDrainInterval = std::chrono::milliseconds(2);
+
+// how often, at most, the writer reports dropped messages
+constexpr auto kDropReportInterval = std::chrono::seconds(1);
+
+// how long a failing thread waits for the writer before aborting anyway
+constexpr auto kFailureDrainTimeout = std::chrono::seconds(1);
+
+/**
+ * A message waiting to be written.
+ */
+struct LogEntry {
+  const char* file = nullptr;
+  int line = 0;
+  google::LogSeverity severity = google::GLOG_INFO;
+  std::string text;
+};
+
+/**
+ * Single producer, single consumer ring of messages logged by one thread.
+ *
+ * Only the owning thread writes head (after filling the entry at head), and
+ * only the writer writes tail (after writing the entry at tail), so an entry
+ * is never accessed by both threads at once. Positions only ever increase;
+ * the ring is full when head - tail == kRingEntries.
+ */
+struct LogRing {
+  std::array<LogEntry, kRingEntries> entries;
+
+  // on cache lines of their own, so that the producer and the writer don't
+  // invalidate each other's line on every message
+  alignas(64) std::atomic<uint64_t> head{0};
+  alignas(64) std::atomic<uint64_t> tail{0};
+
+  // written by the producer only, read by the writer
+  alignas(64) std::atomic<uint64_t> droppedFull{0};
+  std::atomic<uint64_t> droppedRateLimited{0};
+
+  // the producer's --log_rate_limit window
+  std::chrono::steady_clock::time_point windowStart;
+  uint64_t windowMessages = 0;
+
+  // set by the producer as it exits, after its last message; the ring is
+  // then freed by the writer once it has written what's left in it
+  std::atomic<bool> exited{false};
+};
+
+/**
+ * Owner of a thread's ring, handing it over to the writer when the thread
+ * exits.
+ */
+struct ThreadRingOwner {
+  ~ThreadRingOwner();
+
+  LogRing* ring = nullptr;
+};
+
+/**
+ * Stream buffer appending to a string, so that a message can be handed to a
+ * ring entry by swapping strings instead of copying (and allocating) it.
+ */
+class StringStreamBuf : public std::streambuf {
+ public:
+  std::string text;
+
+ protected:
+  int_type overflow(const int_type c) override {
+    if (not traits_type::eq_int_type(c, traits_type::eof())) {
+      text.push_back(traits_type::to_char_type(c));
+    }
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(const char* s, const std::streamsize n) override {
+    text.append(s, n);
+    return n;
+  }
+};
+
+// whether messages are buffered (startAsyncLogging has been called)
+std::atomic<bool> asyncLogging(false);
+
+// hold this mutex when accessing rings
+std::mutex ringsMutex;
+std::vector<std::unique_ptr<LogRing>> rings;
+
+// held by whichever thread is consuming the rings (the writer, or a thread
+// that is about to abort); drainingRings, drainedText, the counts of the
+// messages dropped by freed rings and the reported counts are only accessed
+// while holding it
+std::timed_mutex drainMutex;
+std::vector<LogRing*> drainingRings;
+std::string drainedText;
+uint64_t freedDroppedFull = 0;
+uint64_t freedDroppedRateLimited = 0;
+uint64_t reportedDroppedFull = 0;
+uint64_t reportedDroppedRateLimited = 0;
+std::chrono::steady_clock::time_point lastDropReport;
+
+// set while the calling thread is in drainRings (and so holds drainMutex)
+thread_local bool drainingOnThisThread = false;
+
+// set once the calling thread has handed its ring over to the writer, as it
+// exits; messages logged after that (by other thread_local destructors) are
+// written synchronously
+thread_local bool threadRingReleased = false;
+
+// nesting depth of the messages the calling thread is formatting, see
+// AsyncLogMessage::getThreadStream
+thread_local std::size_t messageDepth = 0;
+
+// the background writer, woken up early by stopAsyncLogging
+std::thread writerThread;
+std::mutex writerMutex;
+std::condition_variable writerWakeup;
+bool stopWriter = false;
+
+ThreadRingOwner::~ThreadRingOwner() {
+  threadRingReleased = true;
+  if (ring) {
+    ring->exited.store(true, std::memory_order_release);
+  }
+}
+
+/**
+ * Return the calling thread's ring, creating it on first use, or nullptr if
+ * the thread is exiting and has already handed its ring over to the writer.
+ *
+ * A thread may exit with messages still waiting in its ring; the writer then
+ * frees the ring once they have been written (see drainRings).
+ */
+LogRing* getThreadRing() {
+  if (threadRingReleased) {
+    return nullptr;
+  }
+  thread_local ThreadRingOwner owner;
+  if (not owner.ring) {
+    std::lock_guard<std::mutex> guard(ringsMutex);
+    rings.emplace_back(new LogRing());
+    owner.ring = rings.back().get();
+  }
+  return owner.ring;
+}
+
+/**
+ * Write a message with glog.
+ */
+void writeMessage(
+    const char* file,
+    const int line,
+    const google::LogSeverity severity,
+    const std::string& text) {
+  google::LogMessage(file, line, severity).stream() << text;
+}
+
+/**
+ * Log a warning if messages were dropped since the last report.
+ *
+ * Must be called while holding drainMutex.
+ */
+void reportDroppedMessages() {
+  const auto now = std::chrono::steady_clock::now();
+  if (now - lastDropReport < kDropReportInterval) {
+    return;
+  }
+  uint64_t droppedFull = freedDroppedFull;
+  uint64_t droppedRateLimited = freedDroppedRateLimited;
+  for (const auto ring : drainingRings) {
+    droppedFull += ring->droppedFull.load(std::memory_order_relaxed);
+    droppedRateLimited +=
+        ring->droppedRateLimited.load(std::memory_order_relaxed);
+  }
+  if (droppedFull == reportedDroppedFull &&
+      droppedRateLimited == reportedDroppedRateLimited) {
+    return;
+  }
+  LOG(WARNING)
+      << "Dropped "
+      << droppedFull - reportedDroppedFull
+      << " log message(s) because the writer fell behind, and "
+      << droppedRateLimited - reportedDroppedRateLimited
+      << " over --log_rate_limit";
+  reportedDroppedFull = droppedFull;
+  reportedDroppedRateLimited = droppedRateLimited;
+  lastDropReport = now;
+}
+
+/**
+ * Write the messages waiting in all rings, and free the rings of threads
+ * that have exited once they are empty.
+ *
+ * Must be called while holding drainMutex.
+ */
+void drainRings() {
+  drainingOnThisThread = true;
+  {
+    std::lock_guard<std::mutex> guard(ringsMutex);
+    drainingRings.clear();
+    for (const auto& ring : rings) {
+      drainingRings.push_back(ring.get());
+    }
+  }
+
+  // rings are written one at a time, which keeps each thread's messages in
+  // order (but not messages across threads)
+  //
+  // each message is taken out of its entry (swapping strings, so that
+  // capacity keeps going around) before it's written, so that if writing it
+  // fails (a FATAL message), the drain in drainRingsAndAbort doesn't write
+  // it again
+  bool ringsExited = false;
+  for (const auto ring : drainingRings) {
+    ringsExited |= ring->exited.load(std::memory_order_relaxed);
+    const auto head = ring->head.load(std::memory_order_acquire);
+    for (auto tail = ring->tail.load(std::memory_order_relaxed);
+         tail != head;
+         tail++) {
+      auto& entry = ring->entries[tail % kRingEntries];
+      const auto file = entry.file;
+      const auto line = entry.line;
+      const auto severity = entry.severity;
+      drainedText.swap(entry.text);
+      ring->tail.store(tail + 1, std::memory_order_release);
+      writeMessage(file, line, severity, drainedText);
+    }
+  }
+  reportDroppedMessages();
+
+  // the producer sets exited after its last message, so once exited is set,
+  // an empty ring stays empty
+  if (ringsExited) {
+    std::lock_guard<std::mutex> guard(ringsMutex);
+    const auto end = std::remove_if(
+        rings.begin(), rings.end(), [](const std::unique_ptr<LogRing>& ring) {
+          if (not ring->exited.load(std::memory_order_acquire) ||
+              ring->head.load(std::memory_order_relaxed) !=
+                  ring->tail.load(std::memory_order_relaxed)) {
+            return false;
+          }
+          freedDroppedFull +=
+              ring->droppedFull.load(std::memory_order_relaxed);
+          freedDroppedRateLimited +=
+              ring->droppedRateLimited.load(std::memory_order_relaxed);
+          return true;
+        });
+    rings.erase(end, rings.end());
+    drainingRings.clear();
+  }
+  drainingOnThisThread = false;
+}
+
+/**
+ * Body of the background writer.
+ */
+void runWriter() {
+  std::unique_lock<std::mutex> lock(writerMutex);
+  while (not stopWriter) {
+    writerWakeup.wait_for(lock, kDrainInterval, []() { return stopWriter; });
+    lock.unlock();
+    {
+      std::lock_guard<std::timed_mutex> guard(drainMutex);
+      drainRings();
+    }
+    lock.lock();
+  }
+}
+
+/**
+ * Called by glog after writing a LOG(FATAL) message: write the messages that
+ * are still buffered, then abort.
+ */
+[[noreturn]] void drainRingsAndAbort() {
+  // a FATAL message written by the draining thread itself (the message was
+  // buffered with ASYNC_LOG(FATAL)): the thread already holds the mutex, so
+  // carry on draining without locking it again
+  if (drainingOnThisThread) {
+    drainRings();
+    std::abort();
+  }
+
+  // the writer holds the mutex while draining, which won't take long; don't
+  // wait forever though, in case it is stuck
+  if (asyncLogging.load(std::memory_order_acquire) &&
+      drainMutex.try_lock_for(kFailureDrainTimeout)) {
+    drainRings();
+    drainMutex.unlock();
+  }
+  std::abort();
+}
+
+} // namespace
+
+void startAsyncLogging() {
+  if (asyncLogging.exchange(true)) {
+    return;
+  }
+  google::InstallFailureFunction(&drainRingsAndAbort);
+  stopWriter = false;
+  writerThread = std::thread(runWriter);
+}
+
+void stopAsyncLogging() {
+  if (not asyncLogging.exchange(false)) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(writerMutex);
+    stopWriter = true;
+  }
+  writerWakeup.notify_one();
+  writerThread.join();
+
+  // the writer may have stopped after messages were added
+  std::lock_guard<std::timed_mutex> guard(drainMutex);
+  drainRings();
+}
+
+bool shouldAsyncLog(const google::LogSeverity severity) {
+  if (severity < FLAGS_minloglevel) {
+    return false;
+  }
+  if (FLAGS_log_rate_limit == 0) {
+    return true;
+  }
+
+  // a fixed one second window per thread, so no other thread is involved
+  const auto threadRing = getThreadRing();
+  if (not threadRing) {
+    return true;
+  }
+  auto& ring = *threadRing;
+  const auto now = std::chrono::steady_clock::now();
+  if (now - ring.windowStart >= std::chrono::seconds(1)) {
+    ring.windowStart = now;
+    ring.windowMessages = 0;
+  }
+  if (ring.windowMessages >= FLAGS_log_rate_limit) {
+    ring.droppedRateLimited.store(
+        ring.droppedRateLimited.load(std::memory_order_relaxed) + 1,
+        std::memory_order_relaxed);
+    return false;
+  }
+  ring.windowMessages++;
+  return true;
+}
+
+bool shouldLogClient(const int clientId) {
+  return FLAGS_log_client_sample_rate > 0 &&
+      clientId % FLAGS_log_client_sample_rate == 0;
+}
+
+struct AsyncLogMessage::ThreadStream {
+  ThreadStream()
+    : stream(&buffer),
+      defaultFlags(stream.flags()) {}
+
+  StringStreamBuf buffer;
+  std::ostream stream;
+  const std::ios_base::fmtflags defaultFlags;
+};
+
+AsyncLogMessage::ThreadStream& AsyncLogMessage::getThreadStream() {
+  // held by unique_ptr, so that streams in use stay put when a deeper one is
+  // added
+  thread_local std::vector<std::unique_ptr<ThreadStream>> threadStreams;
+  if (messageDepth == threadStreams.size()) {
+    threadStreams.emplace_back(new ThreadStream());
+  }
+  return *threadStreams[messageDepth++];
+}
+
+AsyncLogMessage::AsyncLogMessage(
+    const char* file,
+    const int line,
+    const google::LogSeverity severity)
+  : file_(file),
+    line_(line),
+    severity_(severity),
+    threadStream_(getThreadStream()) {
+  // the stream is reused, so undo whatever the previous message did to it
+  threadStream_.buffer.text.clear();
+  threadStream_.stream.clear();
+  threadStream_.stream.flags(threadStream_.defaultFlags);
+  threadStream_.stream.precision(6);
+  threadStream_.stream.fill(' ');
+}
+
+AsyncLogMessage::~AsyncLogMessage() {
+  // nothing below formats another message, so the level can be left already
+  messageDepth--;
+
+  auto& text = threadStream_.buffer.text;
+  const auto threadRing =
+      asyncLogging.load(std::memory_order_acquire) ? getThreadRing() : nullptr;
+  if (not threadRing) {
+    writeMessage(file_, line_, severity_, text);
+    return;
+  }
+
+  auto& ring = *threadRing;
+  const auto head = ring.head.load(std::memory_order_relaxed);
+  if (head - ring.tail.load(std::memory_order_acquire) == kRingEntries) {
+    ring.droppedFull.store(
+        ring.droppedFull.load(std::memory_order_relaxed) + 1,
+        std::memory_order_relaxed);
+    return;
+  }
+
+  // swapping hands the message to the entry, and the entry's old string (and
+  // its capacity) to the stream, so a busy thread stops allocating
+  auto& entry = ring.entries[head % kRingEntries];
+  entry.file = file_;
+  entry.line = line_;
+  entry.severity = severity_;
+  entry.text.swap(text);
+  ring.head.store(head + 1, std::memory_order_release);
+}
+
+std::ostream& AsyncLogMessage::stream() {
+  return threadStream_.stream;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <ostream>
+
+#include <glog/logging.h>
+
+/**
+ * Asynchronous logging for the server's hot paths.
+ *
+ * glog formats and writes every message while holding a process-wide lock,
+ * so at high connection rates the threads handling clients spend a good part
+ * of their time writing (or waiting to write) log lines to stderr. Messages
+ * logged with ASYNC_LOG are instead formatted by the calling thread into a
+ * ring buffer of its own, without taking a lock, and a background writer
+ * thread passes them on to glog. If a thread's ring is full (the writer can't
+ * keep up), its messages are dropped and counted rather than blocking it.
+ *
+ * Messages from a single thread are written in order, but they are only
+ * written (and timestamped by glog) once the writer gets to them, so they may
+ * appear a few milliseconds late, and after synchronous messages that were
+ * logged later. LOG(FATAL) is unaffected: it is written synchronously, and
+ * any messages still in the rings are written before the process aborts.
+ *
+ * Until startAsyncLogging is called (and once stopAsyncLogging has been),
+ * ASYNC_LOG writes its messages synchronously, like LOG.
+ */
+
+/**
+ * Start the background writer. Messages logged from now on are buffered.
+ */
+void startAsyncLogging();
+
+/**
+ * Write any buffered messages and stop the background writer.
+ *
+ * Messages logged concurrently with this call may be lost, so it should only
+ * be called once the threads logging with ASYNC_LOG have stopped.
+ */
+void stopAsyncLogging();
+
+/**
+ * Return whether a message of the given severity should be logged by the
+ * calling thread, i.e., whether it is at or above --minloglevel and the
+ * thread hasn't used up its --log_rate_limit for the current second.
+ */
+bool shouldAsyncLog(const google::LogSeverity severity);
+
+/**
+ * Return whether the messages about a client should be logged, according to
+ * --log_client_sample_rate.
+ *
+ * Clients are sampled by ID, so either all or none of a client's messages
+ * are logged.
+ */
+bool shouldLogClient(const int clientId);
+
+/**
+ * A message logged with ASYNC_LOG, passed on to the writer when destroyed.
+ */
+class AsyncLogMessage {
+ public:
+  AsyncLogMessage(
+      const char* file,
+      const int line,
+      const google::LogSeverity severity);
+  ~AsyncLogMessage();
+
+  AsyncLogMessage(const AsyncLogMessage&) = delete;
+  AsyncLogMessage& operator=(const AsyncLogMessage&) = delete;
+
+  std::ostream& stream();
+
+ private:
+  // a stream formatting into a string, reused by all messages of a thread
+  // logged at the same depth (a message may be logged while another one is
+  // being formatted, by a function called from its stream expression)
+  struct ThreadStream;
+
+  /**
+   * Return the calling thread's stream for a new message, one level deeper
+   * than the thread's messages being formatted (if any), creating it on first
+   * use. The destructor goes back up a level.
+   */
+  static ThreadStream& getThreadStream();
+
+  const char* file_;
+  const int line_;
+  const google::LogSeverity severity_;
+  ThreadStream& threadStream_;
+};
+
+/**
+ * Turns the stream expression in ASYNC_LOG_IF into a void expression, so that
+ * it can be used in the conditional operator (like glog's LogMessageVoidify).
+ */
+struct AsyncLogVoidify {
+  void operator&(std::ostream&) {}
+};
+
+/**
+ * Log a message asynchronously if condition is true, e.g.,
+ *
+ *   ASYNC_LOG_IF(INFO, verbose) << "Sent " << n << " bytes";
+ *
+ * Like with LOG_IF, the message is only formatted if it is logged.
+ */
+#define ASYNC_LOG_IF(severity, condition) \
+  not ((condition) && shouldAsyncLog(google::GLOG_##severity)) \
+      ? (void) 0 \
+      : AsyncLogVoidify() & \
+          AsyncLogMessage(__FILE__, __LINE__, google::GLOG_##severity).stream()
+
+/**
+ * Log a message asynchronously, e.g., ASYNC_LOG(INFO) << "Waiting".
+ */
+#define ASYNC_LOG(severity) ASYNC_LOG_IF(severity, true)
+
+/**
+ * Log a message about a client asynchronously, if the client is sampled
+ * (see shouldLogClient), e.g.,
+ *
+ *   CLIENT_LOG(INFO, clientId) << "Client closed connection";
+ */
+#define CLIENT_LOG(severity, clientId) \
+  ASYNC_LOG_IF(severity, shouldLogClient(clientId))
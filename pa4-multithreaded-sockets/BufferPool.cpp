@@ -0,0 +1,56 @@
+#include "BufferPool.h"
+
+#include <utility>
+
+BufferPool::BufferPool(
+    const std::size_t bufferBytes,
+    const std::size_t maxIdleBuffers)
+  : bufferBytes_(bufferBytes),
+    maxIdleBuffers_(maxIdleBuffers) {}
+
+void BufferPool::acquire(std::vector<char>& buffer) {
+  if (buffer.size() == bufferBytes_) {
+    return;
+  }
+  std::vector<char> idleBuffer;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (not idleBuffers_.empty()) {
+      idleBuffer.swap(idleBuffers_.back());
+      idleBuffers_.pop_back();
+      stats_.reused++;
+    } else {
+      stats_.allocated++;
+    }
+  }
+  if (idleBuffer.empty()) {
+    idleBuffer.resize(bufferBytes_);
+  }
+  buffer.swap(idleBuffer);
+}
+
+void BufferPool::release(std::vector<char>& buffer) {
+  if (buffer.empty()) {
+    return;
+  }
+  if (buffer.size() == bufferBytes_) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (idleBuffers_.size() < maxIdleBuffers_) {
+      idleBuffers_.push_back(std::move(buffer));
+      buffer.clear();
+      return;
+    }
+  }
+  std::vector<char>().swap(buffer);
+}
+
+std::size_t BufferPool::getBufferBytes() const {
+  return bufferBytes_;
+}
+
+PoolStats BufferPool::getStats() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto stats = stats_;
+  stats.idle = idleBuffers_.size();
+  return stats;
+}
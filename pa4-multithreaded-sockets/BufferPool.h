@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#include "ObjectPool.h"
+
+/**
+ * Freelist of fixed-size I/O buffers, shared by all connections.
+ *
+ * Connections that read files into memory (see ClientConnection's
+ * streamBuffer) take a buffer when they start doing so, and give it back
+ * when they close, so that a steady stream of new connections reuses the
+ * same few buffers instead of allocating (and zeroing) a new one each.
+ *
+ * All functions are thread safe.
+ */
+class BufferPool {
+ public:
+  BufferPool(const std::size_t bufferBytes, const std::size_t maxIdleBuffers);
+
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  /**
+   * Make buffer hold bufferBytes bytes, with an idle buffer if there is one.
+   *
+   * Does nothing if the buffer already has the right size, e.g., because it
+   * was acquired for a previous request on the same connection.
+   */
+  void acquire(std::vector<char>& buffer);
+
+  /**
+   * Take the buffer's storage back into the pool (or free it, if the pool is
+   * full), leaving the buffer empty. Does nothing if the buffer is empty.
+   */
+  void release(std::vector<char>& buffer);
+
+  /**
+   * Return the size of the buffers handed out.
+   */
+  std::size_t getBufferBytes() const;
+
+  /**
+   * Return the pool's counters.
+   */
+  PoolStats getStats();
+
+ private:
+  // size of every buffer, and the most buffers kept for reuse
+  const std::size_t bufferBytes_;
+  const std::size_t maxIdleBuffers_;
+
+  // hold this mutex when accessing the members below
+  std::mutex mutex_;
+  std::vector<std::vector<char>> idleBuffers_;
+  PoolStats stats_;
+};
@@ -0,0 +1,141 @@
+#include "Checksum.h"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+namespace {
+
+// CRC32C's polynomial, bit reversed (the CRC is computed least significant
+// bit first, like the CPU instructions do)
+constexpr uint32_t kCrc32cPolynomial = 0x82f63b78;
+
+/**
+ * Return the table for crc32cSoftware: the CRC of each possible byte.
+ */
+std::array<uint32_t, 256> makeCrc32cTable() {
+  std::array<uint32_t, 256> table;
+  for (uint32_t byte = 0; byte < 256; byte++) {
+    uint32_t crc = byte;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ ((crc & 1) ? kCrc32cPolynomial : 0);
+    }
+    table[byte] = crc;
+  }
+  return table;
+}
+
+/**
+ * Update a (pre-inverted) CRC one byte at a time, with a lookup table.
+ */
+uint32_t crc32cSoftware(
+    uint32_t crc,
+    const char* data,
+    const std::size_t numBytes) {
+  static const auto table = makeCrc32cTable();
+  for (std::size_t i = 0; i < numBytes; i++) {
+    crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+
+/**
+ * Update a (pre-inverted) CRC eight bytes at a time, with SSE 4.2's crc32.
+ *
+ * Compiled for SSE 4.2 regardless of the flags the rest of the program is
+ * built with; only called once the CPU is known to support it.
+ */
+__attribute__((target("sse4.2"))) uint32_t crc32cHardware(
+    uint32_t crc,
+    const char* data,
+    std::size_t numBytes) {
+  uint64_t crc64 = crc;
+  for (; numBytes >= sizeof(uint64_t); numBytes -= sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += sizeof(word);
+  }
+  crc = static_cast<uint32_t>(crc64);
+  for (; numBytes > 0; numBytes--) {
+    crc = _mm_crc32_u8(crc, static_cast<uint8_t>(*data++));
+  }
+  return crc;
+}
+
+bool hasHardwareCrc32c() {
+  return __builtin_cpu_supports("sse4.2");
+}
+
+#elif defined(__aarch64__)
+
+/**
+ * Update a (pre-inverted) CRC eight bytes at a time, with ARMv8's crc32cx.
+ *
+ * Compiled with the CRC extension regardless of the flags the rest of the
+ * program is built with; only called once the CPU is known to support it.
+ */
+__attribute__((target("+crc"))) uint32_t crc32cHardware(
+    uint32_t crc,
+    const char* data,
+    std::size_t numBytes) {
+  for (; numBytes >= sizeof(uint64_t); numBytes -= sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    crc = __crc32cd(crc, word);
+    data += sizeof(word);
+  }
+  for (; numBytes > 0; numBytes--) {
+    crc = __crc32cb(crc, static_cast<uint8_t>(*data++));
+  }
+  return crc;
+}
+
+bool hasHardwareCrc32c() {
+  return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+#else
+
+uint32_t crc32cHardware(
+    uint32_t crc,
+    const char* data,
+    const std::size_t numBytes) {
+  return crc32cSoftware(crc, data, numBytes);
+}
+
+bool hasHardwareCrc32c() {
+  return false;
+}
+
+#endif
+
+// picked once, so that checksumming a chunk doesn't check the CPU again
+const bool useHardwareCrc32c = hasHardwareCrc32c();
+
+} // namespace
+
+uint32_t crc32c(
+    const uint32_t crc,
+    const char* data,
+    const std::size_t numBytes) {
+  // the CRC is kept inverted while bytes are added, so that leading zero bytes
+  // still change it
+  const auto invertedCrc = useHardwareCrc32c
+      ? crc32cHardware(~crc, data, numBytes)
+      : crc32cSoftware(~crc, data, numBytes);
+  return ~invertedCrc;
+}
+
+bool isCrc32cHardwareAccelerated() {
+  return useHardwareCrc32c;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Extend a CRC32C (Castagnoli) checksum with numBytes bytes of data.
+ *
+ * Start with crc = 0, and pass each result back in along with the next bytes
+ * to checksum data that arrives in pieces; the result is the same as for a
+ * single call over all of them. crc32c(0, "123456789", 9) == 0xe3069283.
+ *
+ * Uses the CPU's CRC32 instructions (SSE 4.2 on x86-64, the CRC extension on
+ * ARMv8), which checksum several GB/s on a single core, when the CPU has
+ * them, and a (much slower) lookup table otherwise.
+ */
+uint32_t crc32c(
+    const uint32_t crc,
+    const char* data,
+    const std::size_t numBytes);
+
+/**
+ * Return whether crc32c uses the CPU's CRC32 instructions.
+ */
+bool isCrc32cHardwareAccelerated();
@@ -0,0 +1,111 @@
+#include "ClientRegistry.h"
+
+constexpr std::size_t ClientRegistry::kNumShards;
+constexpr std::size_t ClientRegistry::kMaxSpareNodes;
+
+static_assert(
+    (ClientRegistry::kNumShards & (ClientRegistry::kNumShards - 1)) == 0,
+    "kNumShards must be a power of two");
+
+ClientRegistry::ClientRegistry() : size_(0) {}
+
+void ClientRegistry::insert(
+    const int clientId, std::shared_ptr<ClientConnection> clientConn) {
+  auto& shard = getShard(clientId);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  const auto it = shard.clientConns.find(clientId);
+  if (it != shard.clientConns.end()) {
+    it->second = std::move(clientConn);
+    return;
+  }
+  if (shard.spareNodes.empty()) {
+    shard.clientConns.emplace(clientId, std::move(clientConn));
+  } else {
+    auto node = std::move(shard.spareNodes.back());
+    shard.spareNodes.pop_back();
+    node.key() = clientId;
+    node.mapped() = std::move(clientConn);
+    shard.clientConns.insert(std::move(node));
+  }
+  size_++;
+}
+
+bool ClientRegistry::erase(const int clientId) {
+  // release our reference to the connection after dropping the lock, so that
+  // a ClientConnection destructor never runs while the shard is locked
+  std::shared_ptr<ClientConnection> clientConn;
+  {
+    auto& shard = getShard(clientId);
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    auto node = shard.clientConns.extract(clientId);
+    if (node.empty()) {
+      return false;
+    }
+    clientConn = std::move(node.mapped());
+    if (shard.spareNodes.size() < kMaxSpareNodes) {
+      shard.spareNodes.push_back(std::move(node));
+    }
+    size_--;
+  }
+  return true;
+}
+
+std::shared_ptr<ClientConnection> ClientRegistry::find(const int clientId) {
+  auto& shard = getShard(clientId);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  const auto it = shard.clientConns.find(clientId);
+  if (it == shard.clientConns.end()) {
+    return nullptr;
+  }
+  return it->second;
+}
+
+std::vector<int> ClientRegistry::getClientIds() {
+  std::vector<int> clientIds;
+  clientIds.reserve(size());
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    for (const auto& kv : shard.clientConns) {
+      clientIds.push_back(kv.first);
+    }
+  }
+  return clientIds;
+}
+
+std::vector<std::shared_ptr<ClientConnection>> ClientRegistry::getAll() {
+  std::vector<std::shared_ptr<ClientConnection>> clientConns;
+  clientConns.reserve(size());
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    for (const auto& kv : shard.clientConns) {
+      clientConns.push_back(kv.second);
+    }
+  }
+  return clientConns;
+}
+
+void ClientRegistry::forEach(
+    const std::function<void(const std::shared_ptr<ClientConnection>&)>& fn) {
+  // copy one shard at a time, then call fn without holding the shard's lock
+  std::vector<std::shared_ptr<ClientConnection>> clientConns;
+  for (auto& shard : shards_) {
+    clientConns.clear();
+    {
+      std::lock_guard<std::mutex> guard(shard.mutex);
+      for (const auto& kv : shard.clientConns) {
+        clientConns.push_back(kv.second);
+      }
+    }
+    for (const auto& clientConn : clientConns) {
+      fn(clientConn);
+    }
+  }
+}
+
+std::size_t ClientRegistry::size() const {
+  return size_.load();
+}
+
+ClientRegistry::Shard& ClientRegistry::getShard(const int clientId) {
+  return shards_[static_cast<unsigned int>(clientId) & (kNumShards - 1)];
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+struct ClientConnection;
+
+/**
+ * Concurrent map of client ID -> ClientConnection.
+ *
+ * The map is split into kNumShards shards, each with its own mutex, so that
+ * connects and disconnects of different clients rarely contend on the same
+ * lock. Client IDs are handed out sequentially, so consecutive clients land in
+ * different shards.
+ *
+ * Iteration (forEach / getAll) locks one shard at a time and only while copying
+ * that shard's pointers, so it never blocks inserts and erases for long, and
+ * callbacks run without any lock held. The set of clients seen by an iteration
+ * is therefore not an atomic snapshot of the whole map: clients inserted or
+ * erased while iterating may or may not be included.
+ *
+ * The map nodes of erased clients are kept (up to kMaxSpareNodes per shard)
+ * and reused by the next inserts, so that clients coming and going don't
+ * allocate.
+ */
+class ClientRegistry {
+ public:
+  ClientRegistry();
+
+  /**
+   * Add a client connection. Replaces any existing connection with the ID.
+   */
+  void insert(const int clientId, std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Remove a client connection. Returns whether the ID was found.
+   */
+  bool erase(const int clientId);
+
+  /**
+   * Return the connection for a client ID, or nullptr if not found.
+   */
+  std::shared_ptr<ClientConnection> find(const int clientId);
+
+  /**
+   * Return the IDs of all clients.
+   */
+  std::vector<int> getClientIds();
+
+  /**
+   * Return all client connections.
+   */
+  std::vector<std::shared_ptr<ClientConnection>> getAll();
+
+  /**
+   * Call the function for each client connection, with no locks held.
+   */
+  void forEach(
+      const std::function<void(const std::shared_ptr<ClientConnection>&)>& fn);
+
+  /**
+   * Return the number of clients.
+   */
+  std::size_t size() const;
+
+  // number of shards, must be a power of two
+  static constexpr std::size_t kNumShards = 16;
+
+  // most map nodes kept for reuse by each shard
+  static constexpr std::size_t kMaxSpareNodes = 256;
+
+ private:
+  // a shard of the map, padded to its own cache line so that threads locking
+  // neighbouring shards don't invalidate each other's cache lines
+  struct alignas(64) Shard {
+    using Map = std::unordered_map<int, std::shared_ptr<ClientConnection>>;
+
+    std::mutex mutex;
+    Map clientConns;
+
+    // nodes extracted from clientConns by erase, see kMaxSpareNodes
+    std::vector<Map::node_type> spareNodes;
+  };
+
+  /**
+   * Return the shard holding the specified client ID.
+   */
+  Shard& getShard(const int clientId);
+
+  // all shards
+  std::array<Shard, kNumShards> shards_;
+
+  // total number of clients across all shards
+  std::atomic<std::size_t> size_;
+};
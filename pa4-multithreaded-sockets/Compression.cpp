@@ -0,0 +1,94 @@
+#include "Compression.h"
+
+#include <new>
+
+Compressor::Compressor(const int level)
+  : context_(ZSTD_createCCtx()) {
+  if (context_ == nullptr) {
+    throw std::bad_alloc();
+  }
+  ZSTD_CCtx_setParameter(context_, ZSTD_c_compressionLevel, level);
+}
+
+Compressor::~Compressor() {
+  ZSTD_freeCCtx(context_);
+}
+
+void Compressor::reset() {
+  // keeps the compression level
+  ZSTD_CCtx_reset(context_, ZSTD_reset_session_only);
+}
+
+bool Compressor::compress(
+    const char* data,
+    const std::size_t numBytes,
+    const bool last,
+    std::string& out) {
+  ZSTD_inBuffer input = {data, numBytes, 0};
+  const auto mode = last ? ZSTD_e_end : ZSTD_e_continue;
+
+  // grow out by the recommended output size until zstd is done with the
+  // input; each call either consumes input or fills the output it was given
+  const auto outputChunkBytes = ZSTD_CStreamOutSize();
+  for (;;) {
+    const auto outputStart = out.size();
+    out.resize(outputStart + outputChunkBytes);
+    ZSTD_outBuffer output = {&out[outputStart], outputChunkBytes, 0};
+    const auto remaining =
+        ZSTD_compressStream2(context_, &output, &input, mode);
+    out.resize(outputStart + output.pos);
+    if (ZSTD_isError(remaining)) {
+      return false;
+    }
+
+    // when ending the stream, zstd returns how many bytes it still has to
+    // flush; otherwise we're done once it has taken all of the input
+    if (last ? remaining == 0 : input.pos == input.size) {
+      return true;
+    }
+  }
+}
+
+Decompressor::Decompressor()
+  : context_(ZSTD_createDCtx()) {
+  if (context_ == nullptr) {
+    throw std::bad_alloc();
+  }
+}
+
+Decompressor::~Decompressor() {
+  ZSTD_freeDCtx(context_);
+}
+
+void Decompressor::reset() {
+  ZSTD_DCtx_reset(context_, ZSTD_reset_session_only);
+  lastResult_ = 1;
+}
+
+bool Decompressor::decompress(
+    const char* data,
+    const std::size_t numBytes,
+    std::vector<char>& out) {
+  ZSTD_inBuffer input = {data, numBytes, 0};
+  const auto outputChunkBytes = ZSTD_DStreamOutSize();
+  for (;;) {
+    const auto outputStart = out.size();
+    out.resize(outputStart + outputChunkBytes);
+    ZSTD_outBuffer output = {out.data() + outputStart, outputChunkBytes, 0};
+    lastResult_ = ZSTD_decompressStream(context_, &output, &input);
+    out.resize(outputStart + output.pos);
+    if (ZSTD_isError(lastResult_)) {
+      return false;
+    }
+
+    // if zstd filled all of the output it was given, it may have more to
+    // flush even though it has taken all of the input
+    if (input.pos == input.size && output.pos < output.size) {
+      return true;
+    }
+  }
+}
+
+bool Decompressor::isFrameComplete() const {
+  return lastResult_ == 0;
+}
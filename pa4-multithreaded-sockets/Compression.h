@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <zstd.h>
+
+/**
+ * Streaming zstd compressor.
+ *
+ * Input is fed in pieces of any size with compress(), which appends whatever
+ * compressed output is ready; the compressor may buffer input internally, so
+ * a piece does not always produce output. Passing last = true ends the zstd
+ * frame, flushing everything that is still buffered.
+ *
+ * The underlying context is reused across streams (see reset()), since it is
+ * expensive to create.
+ */
+class Compressor {
+ public:
+  /**
+   * Create a compressor using the given zstd compression level.
+   */
+  explicit Compressor(const int level);
+  ~Compressor();
+
+  Compressor(const Compressor&) = delete;
+  Compressor& operator=(const Compressor&) = delete;
+
+  /**
+   * Start a new stream, discarding any input buffered for the previous one.
+   */
+  void reset();
+
+  /**
+   * Compress numBytes bytes of data, appending the output that is ready to
+   * out. If last is set, the stream is finished.
+   *
+   * Returns false if compression failed.
+   */
+  bool compress(
+      const char* data,
+      const std::size_t numBytes,
+      const bool last,
+      std::string& out);
+
+ private:
+  // zstd compression context
+  ZSTD_CCtx* context_;
+};
+
+/**
+ * Streaming zstd decompressor for the output of Compressor.
+ */
+class Decompressor {
+ public:
+  Decompressor();
+  ~Decompressor();
+
+  Decompressor(const Decompressor&) = delete;
+  Decompressor& operator=(const Decompressor&) = delete;
+
+  /**
+   * Start a new stream.
+   */
+  void reset();
+
+  /**
+   * Decompress numBytes bytes of compressed data, appending the output to out.
+   *
+   * Returns false if the data is corrupt.
+   */
+  bool decompress(
+      const char* data,
+      const std::size_t numBytes,
+      std::vector<char>& out);
+
+  /**
+   * Return whether the stream decompressed so far ended with a complete zstd
+   * frame.
+   */
+  bool isFrameComplete() const;
+
+ private:
+  // zstd decompression context
+  ZSTD_DCtx* context_;
+
+  // result of the last call to ZSTD_decompressStream (0 once a frame has been
+  // completely decoded and flushed, non-zero before any data has been seen)
+  std::size_t lastResult_ = 1;
+};
@@ -0,0 +1,279 @@
+#include "EgressScheduler.h"
+
+#include <algorithm>
+#include <vector>
+
+bool parseEgressPolicy(const std::string& name, EgressPolicy& policy) {
+  if (name == "fifo") {
+    policy = EgressPolicy::kFirstCome;
+  } else if (name == "drr") {
+    policy = EgressPolicy::kDeficitRoundRobin;
+  } else if (name == "srpt") {
+    policy = EgressPolicy::kShortestRemainingFirst;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+std::string getEgressPolicyName(const EgressPolicy policy) {
+  switch (policy) {
+    case EgressPolicy::kFirstCome:
+      return "fifo";
+    case EgressPolicy::kDeficitRoundRobin:
+      return "drr";
+    case EgressPolicy::kShortestRemainingFirst:
+      return "srpt";
+  }
+  return "unknown";
+}
+
+EgressScheduler::EgressScheduler(
+    const std::vector<boost::asio::io_service*>& ioServices,
+    TokenBucket& tokenBucket,
+    const EgressPolicy policy,
+    const uint64_t quantumBytes)
+  : tokenBucket_(tokenBucket),
+    policy_(policy),
+    quantumBytes_(std::max<uint64_t>(quantumBytes, 1)),
+    numWaitingFlows_(0),
+    ioServices_(ioServices) {
+  timers_.reserve(ioServices_.size());
+  for (auto ioService : ioServices_) {
+    timers_.emplace_back(*ioService);
+  }
+}
+
+uint64_t EgressScheduler::take(Flow& flow, const uint64_t maxBytes) {
+  // a flow that isn't waiting is only touched by its own connection, so its
+  // grant can be read without the mutex (the grant was made before the flow
+  // was woken up)
+  if (flow.grantedBytes_ > 0) {
+    const auto bytes = std::min(flow.grantedBytes_, maxBytes);
+    flow.grantedBytes_ -= bytes;
+    return bytes;
+  }
+
+  if (policy_ == EgressPolicy::kFirstCome) {
+    return tokenBucket_.tryConsume(maxBytes);
+  }
+
+  // jumping ahead of the flows already waiting would defeat the policy; the
+  // count may be out of date by the time we take the tokens, but that only
+  // lets a flow slip in once, right as the queue forms or empties
+  if (numWaitingFlows_.load() > 0) {
+    return 0;
+  }
+
+  // the bucket refills continuously, so there are nearly always a few tokens
+  // in it; taking those would have every flow sending tiny chunks in whatever
+  // order they happen to ask, so a flow that can't have all it wants waits
+  // for its turn instead
+  const auto bytes = tokenBucket_.tryConsume(maxBytes);
+  if (bytes < maxBytes) {
+    tokenBucket_.refund(bytes);
+    return 0;
+  }
+  return bytes;
+}
+
+void EgressScheduler::wait(
+    Flow& flow,
+    const uint64_t maxBytes,
+    const uint64_t remainingBytes,
+    std::function<void()> wakeup) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (flow.waiting_) {
+    waitingFlows_.erase(flow.queueKey_);
+  }
+  flow.wantBytes_ = std::max<uint64_t>(maxBytes, 1);
+
+  // a flow coming back for its next turn keeps its round, unless the others
+  // have moved on without it; one that's new joins the current round
+  flow.round_ = std::max(flow.round_, round_);
+  flow.remainingBytes_ = std::max(remainingBytes, flow.wantBytes_);
+  flow.waiting_ = true;
+  flow.wakeup_ = std::move(wakeup);
+  enqueue(flow);
+  numWaitingFlows_.store(waitingFlows_.size());
+  stats_.waits++;
+  armTimer();
+}
+
+std::function<void()> EgressScheduler::cancel(Flow& flow) {
+  std::function<void()> wakeup;
+  uint64_t grantedBytes = 0;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (flow.waiting_) {
+      waitingFlows_.erase(flow.queueKey_);
+      numWaitingFlows_.store(waitingFlows_.size());
+      flow.waiting_ = false;
+      wakeup.swap(flow.wakeup_);
+    }
+    std::swap(grantedBytes, flow.grantedBytes_);
+
+    // the flow is no longer backlogged, so it doesn't keep its deficit
+    flow.deficitBytes_ = 0;
+    flow.turnBytes_ = 0;
+  }
+  if (grantedBytes > 0) {
+    tokenBucket_.refund(grantedBytes);
+  }
+  return wakeup;
+}
+
+void EgressScheduler::setWeight(Flow& flow, const uint64_t weight) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  flow.weight_ = std::max<uint64_t>(weight, 1);
+}
+
+void EgressScheduler::setIoService(
+    Flow& flow,
+    boost::asio::io_service& ioService) {
+  const auto it =
+      std::find(ioServices_.begin(), ioServices_.end(), &ioService);
+  std::lock_guard<std::mutex> guard(mutex_);
+  flow.timerIndex_ = it != ioServices_.end() ? it - ioServices_.begin() : 0;
+}
+
+EgressPolicy EgressScheduler::getPolicy() const {
+  return policy_;
+}
+
+EgressStats EgressScheduler::getStats() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto stats = stats_;
+  stats.waitingFlows = waitingFlows_.size();
+  return stats;
+}
+
+void EgressScheduler::dispatch() {
+  // the flows are woken up once the mutex has been released
+  std::vector<std::function<void()>> wakeups;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    timerArmed_ = false;
+    auto wokenRound = UINT64_MAX;
+    while (not waitingFlows_.empty()) {
+      // the first flow keeps its place (and the tokens granted so far) until
+      // it has been granted all of its turn
+      //
+      // a flow's turn only ever ends with a wakeup (or, for a flow whose
+      // deficit doesn't cover a chunk yet, with nothing), and the flow queues
+      // up at the back again for its next one, which is what makes this
+      // round-robin
+      //
+      // a flow woken up here is still backlogged, and queues up for its next
+      // round as soon as it has sent its chunks; moving on to a later round
+      // without it would hand its share to the others, so that's left to the
+      // timer, by which time it's back
+      const auto first = waitingFlows_.begin();
+      auto& flow = *first->second;
+      if (flow.round_ > wokenRound) {
+        break;
+      }
+      round_ = flow.round_;
+      const auto turnBytes = startTurn(flow);
+      if (turnBytes == 0) {
+        waitingFlows_.erase(first);
+        flow.round_++;
+        enqueue(flow);
+        continue;
+      }
+      flow.grantedBytes_ +=
+          tokenBucket_.tryConsume(turnBytes - flow.grantedBytes_);
+      if (flow.grantedBytes_ < turnBytes) {
+        break;
+      }
+
+      // what's left of the deficit is carried over to the flow's next turn,
+      // unless this turn finishes its response
+      if (policy_ == EgressPolicy::kDeficitRoundRobin) {
+        flow.deficitBytes_ -= turnBytes;
+        if (turnBytes >= flow.remainingBytes_) {
+          flow.deficitBytes_ = 0;
+        }
+        flow.round_++;
+        wokenRound = std::min(wokenRound, flow.round_);
+      }
+      flow.turnBytes_ = 0;
+      stats_.scheduledBytes += flow.grantedBytes_;
+      flow.waiting_ = false;
+      wakeups.emplace_back(std::move(flow.wakeup_));
+      flow.wakeup_ = nullptr;
+      waitingFlows_.erase(first);
+    }
+    numWaitingFlows_.store(waitingFlows_.size());
+    armTimer();
+  }
+  for (auto& wakeup : wakeups) {
+    wakeup();
+  }
+}
+
+void EgressScheduler::armTimer() {
+  if (timerArmed_ || waitingFlows_.empty()) {
+    return;
+  }
+
+  // the first flow's turn may not have started yet, in which case it wants
+  // at least one chunk
+  //
+  // the timer runs on the first flow's io_service, which is where it's woken
+  // up; the other flows woken up by the same dispatch are posted to theirs
+  const auto& flow = *waitingFlows_.begin()->second;
+  const auto turnBytes =
+      flow.turnBytes_ > 0 ? flow.turnBytes_ : flow.wantBytes_;
+  auto& timer = timers_[flow.timerIndex_];
+  timerArmed_ = true;
+  timer.expires_after(tokenBucket_.getRefillDelay(
+      turnBytes - std::min(turnBytes, flow.grantedBytes_)));
+  timer.async_wait([this](const boost::system::error_code& error) {
+    if (not error) {
+      dispatch();
+    }
+  });
+}
+
+uint64_t EgressScheduler::startTurn(Flow& flow) {
+  if (flow.turnBytes_ > 0) {
+    return flow.turnBytes_;
+  }
+  if (policy_ != EgressPolicy::kDeficitRoundRobin) {
+    flow.turnBytes_ = flow.wantBytes_;
+    return flow.turnBytes_;
+  }
+
+  // grant as many whole chunks as the deficit covers, or all that's left of
+  // the response if it covers that; a flow with a higher weight gets more
+  // chunks per turn, rather than bigger ones
+  flow.deficitBytes_ += flow.weight_ * quantumBytes_;
+  if (flow.deficitBytes_ >= flow.remainingBytes_) {
+    flow.turnBytes_ = flow.remainingBytes_;
+  } else {
+    flow.turnBytes_ =
+        flow.deficitBytes_ - flow.deficitBytes_ % flow.wantBytes_;
+  }
+  return flow.turnBytes_;
+}
+
+void EgressScheduler::enqueue(Flow& flow) {
+  // with kDeficitRoundRobin, a flow whose response ends with its next turn
+  // goes ahead of the round (as sparse flows do in fq_codel), so that a small
+  // response isn't held up by a turn of every large one
+  //
+  // the other flows are served round by round, and in the order they queued
+  // up within a round
+  uint64_t priority = flow.remainingBytes_;
+  uint64_t round = 0;
+  if (policy_ == EgressPolicy::kDeficitRoundRobin) {
+    priority = flow.remainingBytes_ <=
+                       flow.deficitBytes_ + flow.weight_ * quantumBytes_
+                   ? 0
+                   : 1;
+    round = flow.round_;
+  }
+  flow.queueKey_ = std::make_tuple(priority, round, nextArrival_++);
+  waitingFlows_.emplace(flow.queueKey_, &flow);
+}
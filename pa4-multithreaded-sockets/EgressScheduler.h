@@ -0,0 +1,252 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "TokenBucket.h"
+
+/**
+ * Order in which an EgressScheduler hands out the global token bucket's
+ * tokens to the connections waiting for them.
+ */
+enum class EgressPolicy {
+  // no queue: whichever connection asks first after the bucket has refilled
+  // gets the tokens, so connections sending big chunks crowd out the others
+  kFirstCome,
+
+  // deficit round-robin: each round, a waiting connection's deficit grows by
+  // its weight times the quantum, and it's granted as many whole chunks as
+  // its deficit covers, keeping the rest for its next turn, so bandwidth is
+  // split in proportion to the weights; a connection that can finish its
+  // response in a single turn is served ahead of the others
+  kDeficitRoundRobin,
+
+  // the connection with the fewest bytes left in its response goes first, so
+  // small responses finish quickly even behind large downloads (which may
+  // starve while small ones keep arriving)
+  kShortestRemainingFirst,
+};
+
+/**
+ * Return the policy with the given name (fifo, drr or srpt), or false if
+ * there is none.
+ */
+bool parseEgressPolicy(const std::string& name, EgressPolicy& policy);
+
+/**
+ * Return the name of a policy, as accepted by parseEgressPolicy.
+ */
+std::string getEgressPolicyName(const EgressPolicy policy);
+
+/**
+ * Counters describing an EgressScheduler, see getStats.
+ */
+struct EgressStats {
+  // connections currently waiting for their turn
+  uint64_t waitingFlows = 0;
+
+  // times a connection had to wait, and bytes handed out to connections once
+  // it was their turn, since the scheduler was created
+  uint64_t waits = 0;
+  uint64_t scheduledBytes = 0;
+};
+
+/**
+ * Splits the bandwidth of a (global) token bucket between the connections
+ * sending through it.
+ *
+ * While the bucket has tokens to spare, connections take them directly, as
+ * they would from the bucket itself. Once it runs low, connections that want
+ * more queue up with wait(), and as the bucket refills, the scheduler grants
+ * its tokens to them in the order set by its EgressPolicy, waking each one up
+ * once it has been granted its share. Connections only compete with each
+ * other in the queue: one that has been granted tokens never loses them to a
+ * connection that happened to ask at the right time.
+ *
+ * Each connection has a Flow, which it passes to every call. All functions
+ * are thread safe. The scheduler has a timer on each of the given
+ * io_services, and waits for the bucket to refill on the io_service of the
+ * flow that is next in line (see setIoService), so that the flows of one
+ * io_service aren't held up by how busy another one is.
+ */
+class EgressScheduler {
+ public:
+  /**
+   * A connection's state in the scheduler.
+   *
+   * Only accessed by the scheduler; a flow must not be destroyed while it is
+   * waiting (see cancel).
+   */
+  class Flow {
+   private:
+    friend class EgressScheduler;
+
+    // share of the bandwidth relative to other flows, see setWeight
+    uint64_t weight_ = 1;
+
+    // while waiting: the bytes wanted per chunk, the bytes left to send in
+    // all, and the tokens granted so far (kept across refills, until all of
+    // the flow's turn has been granted); once woken up: the tokens the next
+    // takes return without asking the bucket
+    uint64_t wantBytes_ = 0;
+    uint64_t remainingBytes_ = 0;
+    uint64_t grantedBytes_ = 0;
+
+    // for kDeficitRoundRobin: bytes the flow may still be granted, grown by
+    // weight_ quanta each time its turn comes up and carried from one turn to
+    // the next (reset once the flow has been granted all that's left of its
+    // response), and the bytes of the turn being granted (0 between turns)
+    uint64_t deficitBytes_ = 0;
+    uint64_t turnBytes_ = 0;
+
+    // for kDeficitRoundRobin: the round of the flow's next turn
+    uint64_t round_ = 0;
+
+    // the timer in timers_ used while the flow is first in line
+    std::size_t timerIndex_ = 0;
+
+    // position in waitingFlows_, and the function waking the connection up
+    bool waiting_ = false;
+    std::tuple<uint64_t, uint64_t, uint64_t> queueKey_;
+    std::function<void()> wakeup_;
+  };
+
+  /**
+   * Create a scheduler with a timer on each of ioServices (at least one).
+   */
+  EgressScheduler(
+      const std::vector<boost::asio::io_service*>& ioServices,
+      TokenBucket& tokenBucket,
+      const EgressPolicy policy,
+      const uint64_t quantumBytes);
+
+  EgressScheduler(const EgressScheduler&) = delete;
+  EgressScheduler& operator=(const EgressScheduler&) = delete;
+
+  /**
+   * Take up to maxBytes tokens for a flow that isn't waiting.
+   *
+   * Returns the tokens the flow was granted while it was waiting, if any, and
+   * otherwise takes them from the bucket, unless other flows are waiting for
+   * their turn or the bucket can't cover all of maxBytes (in which case the
+   * flow should wait too); with kFirstCome, takes whatever the bucket has.
+   * Returns the number of tokens taken, which may be zero.
+   */
+  uint64_t take(Flow& flow, const uint64_t maxBytes);
+
+  /**
+   * Queue a flow that wants maxBytes tokens (with remainingBytes left to send
+   * in all, which orders kShortestRemainingFirst), and call wakeup once it
+   * has been granted tokens; the flow then gets them from take.
+   *
+   * wakeup is called from one of the io_services' threads (or from cancel's
+   * caller), and must not call into the scheduler directly.
+   */
+  void wait(
+      Flow& flow,
+      const uint64_t maxBytes,
+      const uint64_t remainingBytes,
+      std::function<void()> wakeup);
+
+  /**
+   * Take a flow out of the queue, and return the tokens it was granted to the
+   * bucket.
+   *
+   * Returns the wakeup function the flow was waiting with, without calling it
+   * (an empty function if the flow wasn't waiting).
+   */
+  std::function<void()> cancel(Flow& flow);
+
+  /**
+   * Change the share of the bandwidth a flow gets with kDeficitRoundRobin (at
+   * least 1); a flow with weight 2 gets twice as much as one with weight 1.
+   */
+  void setWeight(Flow& flow, const uint64_t weight);
+
+  /**
+   * Have the timer granting a flow its tokens run on ioService, one of the
+   * io_services the scheduler was created with (the first one, if it isn't);
+   * this should be the io_service the flow's connection runs on.
+   */
+  void setIoService(Flow& flow, boost::asio::io_service& ioService);
+
+  /**
+   * Return the policy the scheduler was created with.
+   */
+  EgressPolicy getPolicy() const;
+
+  /**
+   * Return the scheduler's counters.
+   */
+  EgressStats getStats();
+
+ private:
+  /**
+   * Grant the bucket's tokens to the waiting flows, in order, and wake up
+   * each flow that has been granted its share.
+   */
+  void dispatch();
+
+  /**
+   * Set the timer to call dispatch once the bucket has refilled enough for
+   * the first waiting flow, unless it's already set.
+   *
+   * Must be called with mutex_ held.
+   */
+  void armTimer();
+
+  /**
+   * Start the turn of the first waiting flow if it hasn't started yet, and
+   * return the tokens it gets for it (0 if its deficit doesn't cover a single
+   * chunk yet, in which case its turn is over).
+   *
+   * Must be called with mutex_ held.
+   */
+  uint64_t startTurn(Flow& flow);
+
+  /**
+   * Queue a flow behind the waiting flows of the same priority and round.
+   *
+   * Must be called with mutex_ held.
+   */
+  void enqueue(Flow& flow);
+
+  TokenBucket& tokenBucket_;
+  const EgressPolicy policy_;
+  const uint64_t quantumBytes_;
+
+  // hold this mutex when accessing the members below, and the flows
+  std::mutex mutex_;
+
+  // waiting flows, by (priority, round, order of arrival), so that the first
+  // one is the next to be served; the priority is the bytes remaining for
+  // kShortestRemainingFirst, and whether the flow needs more than this turn
+  // for kDeficitRoundRobin (see enqueue), which is the only policy with
+  // rounds
+  std::map<std::tuple<uint64_t, uint64_t, uint64_t>, Flow*> waitingFlows_;
+  uint64_t nextArrival_ = 0;
+
+  // for kDeficitRoundRobin: the round of the last turn started
+  uint64_t round_ = 0;
+
+  // size of waitingFlows_, read by take without holding mutex_
+  std::atomic<uint64_t> numWaitingFlows_;
+
+  // one timer per io_service, the io_services they run on, and whether one
+  // of them is armed to call dispatch once the bucket has refilled
+  std::vector<boost::asio::steady_timer> timers_;
+  std::vector<boost::asio::io_service*> ioServices_;
+  bool timerArmed_ = false;
+
+  EgressStats stats_;
+};
@@ -0,0 +1,253 @@
+#include "FileCache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Checksum.h"
+#include "Compression.h"
+
+namespace {
+
+/**
+ * Return whether a CachedFile still matches the file described by fileStat.
+ */
+bool isCurrent(const CachedFile& file, const struct stat& fileStat) {
+  return file.inode == static_cast<uint64_t>(fileStat.st_ino) &&
+      file.size == static_cast<uint64_t>(fileStat.st_size) &&
+      file.mtime.tv_sec == fileStat.st_mtim.tv_sec &&
+      file.mtime.tv_nsec == fileStat.st_mtim.tv_nsec;
+}
+
+} // namespace
+
+FileCache::FileCache(const uint64_t capacityBytes, const uint64_t maxFileBytes)
+  : capacityBytes_(capacityBytes),
+    maxFileBytes_(maxFileBytes) {}
+
+std::shared_ptr<const CachedFile> FileCache::get(const std::string& filename) {
+  bool needsFill = false;
+  return lookUp(filename, true, needsFill);
+}
+
+std::shared_ptr<const CachedFile> FileCache::getCompressed(
+    const std::string& filename,
+    const std::shared_ptr<const CachedFile>& file,
+    const int level) {
+  bool needsFill = false;
+  return lookUpCompressed(filename, file, level, true, needsFill);
+}
+
+std::shared_ptr<const CachedFile> FileCache::find(
+    const std::string& filename,
+    bool& needsFill) {
+  needsFill = false;
+  return lookUp(filename, false, needsFill);
+}
+
+std::shared_ptr<const CachedFile> FileCache::findCompressed(
+    const std::string& filename,
+    const std::shared_ptr<const CachedFile>& file,
+    bool& needsFill) {
+  // the level only matters when compressing
+  needsFill = false;
+  return lookUpCompressed(filename, file, 0, false, needsFill);
+}
+
+std::shared_ptr<const CachedFile> FileCache::lookUp(
+    const std::string& filename,
+    const bool fill,
+    bool& needsFill) {
+  // check the file on disk first, without holding the lock
+  struct stat fileStat;
+  if (::stat(filename.c_str(), &fileStat) != 0 ||
+      not S_ISREG(fileStat.st_mode)) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stats_.bypasses++;
+    return nullptr;
+  }
+
+  // return the cached copy if it is still current
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    const uint64_t fileSize = fileStat.st_size;
+    if (fileSize > std::min(maxFileBytes_, capacityBytes_)) {
+      stats_.bypasses++;
+      return nullptr;
+    }
+
+    const auto it = entries_.find(filename);
+    if (it != entries_.end() && isCurrent(*it->second.file, fileStat)) {
+      // move the entry to the front of the LRU list
+      lruList_.splice(lruList_.begin(), lruList_, it->second.lruIt);
+      stats_.hits++;
+      return it->second.file;
+    }
+
+    // a request is counted by the lookup that settles it: a hit right away,
+    // a miss by the lookup that reads the file
+    if (not fill) {
+      needsFill = true;
+      return nullptr;
+    }
+    stats_.misses++;
+  }
+
+  // read the file without holding the lock so that other lookups are not
+  // stalled by disk I/O
+  //
+  // if several clients miss on the same file at once, each of them reads it;
+  // the last one to finish replaces the others' entries
+  const auto file = readFile(filename);
+  if (not file) {
+    return nullptr;
+  }
+
+  // insert (or replace) the entry, then make room for it
+  std::lock_guard<std::mutex> guard(mutex_);
+  const auto it = entries_.find(filename);
+  if (it != entries_.end()) {
+    erase(it);
+  }
+  lruList_.push_front(filename);
+  entries_[filename] = Entry{file, lruList_.begin(), nullptr};
+  bytes_ += file->data.size();
+  evict();
+  return file;
+}
+
+std::shared_ptr<const CachedFile> FileCache::lookUpCompressed(
+    const std::string& filename,
+    const std::shared_ptr<const CachedFile>& file,
+    const int level,
+    const bool fill,
+    bool& needsFill) {
+  // the compressed copy belongs to the entry holding the file's contents,
+  // which the caller has already looked up (and validated)
+  //
+  // like in lookUp, a miss is only counted by the lookup that compresses
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    const auto it = entries_.find(filename);
+    if (it != entries_.end() && it->second.file == file &&
+        it->second.compressedFile) {
+      stats_.compressedHits++;
+      return it->second.compressedFile;
+    }
+    if (not fill) {
+      needsFill = true;
+      return nullptr;
+    }
+    stats_.compressedMisses++;
+  }
+
+  // compress the file without holding the lock, like readFile
+  auto compressedFile = std::make_shared<CachedFile>();
+  compressedFile->compressed = true;
+  compressedFile->inode = file->inode;
+  compressedFile->size = file->size;
+  compressedFile->mtime = file->mtime;
+  compressedFile->checksum = file->checksum;
+  Compressor compressor(level);
+  if (not compressor.compress(
+          file->data.data(), file->data.size(), true,
+          compressedFile->data)) {
+    return nullptr;
+  }
+  compressedFile->data.shrink_to_fit();
+
+  // attach the copy to the entry, unless the entry was replaced or evicted in
+  // the meantime (the caller can still use the copy we made)
+  std::lock_guard<std::mutex> guard(mutex_);
+  const auto it = entries_.find(filename);
+  if (it == entries_.end() || it->second.file != file) {
+    return compressedFile;
+  }
+  if (it->second.compressedFile) {
+    return it->second.compressedFile;
+  }
+  it->second.compressedFile = compressedFile;
+  bytes_ += compressedFile->data.size();
+  compressedBytes_ += compressedFile->data.size();
+  compressedEntries_++;
+  evict();
+  return compressedFile;
+}
+
+void FileCache::setCapacity(const uint64_t capacityBytes) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  capacityBytes_ = capacityBytes;
+  evict();
+}
+
+FileCacheStats FileCache::getStats() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto stats = stats_;
+  stats.entries = entries_.size();
+  stats.bytes = bytes_;
+  stats.compressedEntries = compressedEntries_;
+  stats.compressedBytes = compressedBytes_;
+  stats.capacityBytes = capacityBytes_;
+  return stats;
+}
+
+std::shared_ptr<const CachedFile> FileCache::readFile(
+    const std::string& filename) {
+  const int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  // take the attributes from the descriptor we read from, so they match the
+  // contents even if the file is replaced in the meantime
+  auto file = std::make_shared<CachedFile>();
+  struct stat fileStat;
+  bool success = ::fstat(fd, &fileStat) == 0 && S_ISREG(fileStat.st_mode) &&
+      static_cast<uint64_t>(fileStat.st_size) <= maxFileBytes_;
+  if (success) {
+    file->inode = fileStat.st_ino;
+    file->size = fileStat.st_size;
+    file->mtime = fileStat.st_mtim;
+    file->data.resize(file->size);
+  }
+
+  // read until we have the whole file
+  std::size_t bytesRead = 0;
+  while (success && bytesRead < file->data.size()) {
+    const auto result = ::read(
+        fd, &file->data[bytesRead], file->data.size() - bytesRead);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    // stop on errors or if the file shrunk while we were reading it
+    success = result > 0;
+    bytesRead += std::max<ssize_t>(result, 0);
+  }
+  ::close(fd);
+
+  if (not success) {
+    return nullptr;
+  }
+  file->checksum = crc32c(0, file->data.data(), file->data.size());
+  return file;
+}
+
+void FileCache::erase(std::unordered_map<std::string, Entry>::iterator it) {
+  bytes_ -= it->second.file->data.size();
+  if (it->second.compressedFile) {
+    bytes_ -= it->second.compressedFile->data.size();
+    compressedBytes_ -= it->second.compressedFile->data.size();
+    compressedEntries_--;
+  }
+  lruList_.erase(it->second.lruIt);
+  entries_.erase(it);
+}
+
+void FileCache::evict() {
+  while (bytes_ > capacityBytes_ && not lruList_.empty()) {
+    erase(entries_.find(lruList_.back()));
+    stats_.evictions++;
+  }
+}
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/**
+ * Contents of a file held in the FileCache.
+ *
+ * Immutable once created, so it can be shared by any number of senders.
+ */
+struct CachedFile {
+  // file contents (zstd compressed, if compressed is set)
+  std::string data;
+
+  // whether data holds the file's contents compressed as a single zstd frame
+  // instead of the contents themselves; size is still the file's size
+  bool compressed = false;
+
+  // CRC32C of the file's contents (not of the compressed bytes), computed
+  // once when the file is read so that responses sending the whole file
+  // don't have to checksum it again
+  uint32_t checksum = 0;
+
+  // attributes of the file when it was read, used to detect changes
+  uint64_t inode = 0;
+  uint64_t size = 0;
+  struct timespec mtime = {0, 0};
+};
+
+/**
+ * Counters describing the behavior of a FileCache.
+ */
+struct FileCacheStats {
+  // lookups that were served from the cache
+  uint64_t hits = 0;
+
+  // lookups that had to read the file (including files that were stale)
+  uint64_t misses = 0;
+
+  // lookups for files that were too big to cache or could not be read
+  uint64_t bypasses = 0;
+
+  // entries removed to make room for others
+  uint64_t evictions = 0;
+
+  // lookups for compressed contents that found a compressed copy already in
+  // the cache, and lookups that had to compress the file first
+  uint64_t compressedHits = 0;
+  uint64_t compressedMisses = 0;
+
+  // number of entries and bytes currently in the cache
+  uint64_t entries = 0;
+  uint64_t bytes = 0;
+
+  // number of compressed copies, and the bytes they use (part of bytes)
+  uint64_t compressedEntries = 0;
+  uint64_t compressedBytes = 0;
+
+  // maximum number of bytes the cache may hold
+  uint64_t capacityBytes = 0;
+};
+
+/**
+ * Thread safe cache of file contents, shared by all client connections.
+ *
+ * Entries are keyed by filename and validated against the file's inode, size
+ * and modification time on every lookup, so a file that changes on disk is
+ * read again. Once the cache holds more than its capacity, the least recently
+ * used entries are evicted.
+ *
+ * Lookups return reference counted, immutable buffers. A sender can keep using
+ * a buffer after it has been evicted; the memory is released once the last
+ * sender drops its reference.
+ *
+ * An entry may also hold a compressed copy of the file, made the first time a
+ * client asks for the file compressed, so that the file isn't compressed
+ * again for every client. It counts against the capacity along with the
+ * file's contents, and is evicted with them.
+ */
+class FileCache {
+ public:
+  /**
+   * Create a cache holding at most capacityBytes bytes of file contents, and
+   * files no larger than maxFileBytes bytes.
+   */
+  FileCache(const uint64_t capacityBytes, const uint64_t maxFileBytes);
+
+  /**
+   * Return the contents of the specified file.
+   *
+   * Returns nullptr if the file does not exist, is not a regular file, could
+   * not be read, or is too big to cache; the caller should read the file
+   * directly in that case.
+   */
+  std::shared_ptr<const CachedFile> get(const std::string& filename);
+
+  /**
+   * Return the contents of the specified file compressed with zstd at the
+   * given level (see CachedFile::compressed).
+   *
+   * file is the file's contents, as returned by get() or find() for the same
+   * request; they were already validated and counted there, so this neither
+   * stats the file nor counts it again.
+   *
+   * Returns nullptr if compression failed.
+   */
+  std::shared_ptr<const CachedFile> getCompressed(
+      const std::string& filename,
+      const std::shared_ptr<const CachedFile>& file,
+      const int level);
+
+  /**
+   * Like get(), but never reads the file: if get() would have to (the file
+   * isn't cached, or has changed), returns nullptr and sets needsFill.
+   *
+   * Only stats the file, so that it can be called where blocking on a read
+   * is not an option; the caller can then call get() somewhere else.
+   */
+  std::shared_ptr<const CachedFile> find(
+      const std::string& filename,
+      bool& needsFill);
+
+  /**
+   * Like getCompressed(), but never reads nor compresses the file, setting
+   * needsFill instead if getCompressed() would have to (see find()).
+   */
+  std::shared_ptr<const CachedFile> findCompressed(
+      const std::string& filename,
+      const std::shared_ptr<const CachedFile>& file,
+      bool& needsFill);
+
+  /**
+   * Change the capacity of the cache, evicting entries if needed.
+   *
+   * A capacity of zero disables the cache.
+   */
+  void setCapacity(const uint64_t capacityBytes);
+
+  /**
+   * Return counters describing the cache's behavior.
+   */
+  FileCacheStats getStats();
+
+ private:
+  // an entry in the cache, along with its position in the LRU list
+  struct Entry {
+    std::shared_ptr<const CachedFile> file;
+    std::list<std::string>::iterator lruIt;
+
+    // compressed copy of the file (nullptr until first requested)
+    std::shared_ptr<const CachedFile> compressedFile;
+  };
+
+  /**
+   * Implementation of get() and find(): reads the file on a miss only if
+   * fill is set, and sets needsFill otherwise.
+   */
+  std::shared_ptr<const CachedFile> lookUp(
+      const std::string& filename,
+      const bool fill,
+      bool& needsFill);
+
+  /**
+   * Implementation of getCompressed() and findCompressed(), like lookUp().
+   */
+  std::shared_ptr<const CachedFile> lookUpCompressed(
+      const std::string& filename,
+      const std::shared_ptr<const CachedFile>& file,
+      const int level,
+      const bool fill,
+      bool& needsFill);
+
+  /**
+   * Read a file from disk.
+   *
+   * Returns nullptr if the file could not be read or is too big to cache.
+   */
+  std::shared_ptr<const CachedFile> readFile(const std::string& filename);
+
+  /**
+   * Remove an entry, updating the byte counts.
+   *
+   * Must be called with mutex_ held.
+   */
+  void erase(std::unordered_map<std::string, Entry>::iterator it);
+
+  /**
+   * Evict least recently used entries until the cache fits its capacity.
+   *
+   * Must be called with mutex_ held.
+   */
+  void evict();
+
+  // hold this mutex when accessing any of the members below
+  std::mutex mutex_;
+
+  // filename -> cache entry
+  std::unordered_map<std::string, Entry> entries_;
+
+  // filenames ordered from most to least recently used
+  std::list<std::string> lruList_;
+
+  // bytes of file contents currently held in the cache, and how many of them
+  // belong to compressed copies
+  uint64_t bytes_ = 0;
+  uint64_t compressedBytes_ = 0;
+  uint64_t compressedEntries_ = 0;
+
+  // maximum bytes the cache may hold, and maximum size of a single file
+  uint64_t capacityBytes_;
+  uint64_t maxFileBytes_;
+
+  // counters, see FileCacheStats
+  FileCacheStats stats_;
+};
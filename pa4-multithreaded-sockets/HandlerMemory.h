@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * Memory for the handler of one asynchronous operation at a time.
+ *
+ * boost::asio allocates an object for every operation it starts, big enough
+ * to hold the operation's state and its handler. It keeps a small cache of
+ * these per thread, but a connection with a read, a write and a timer in
+ * flight (or with handlers posted from another thread) misses that cache, and
+ * every operation costs a trip to the heap. Giving an operation that's started
+ * over and over (a connection's writes, say) its own HandlerMemory lets asio
+ * reuse the same bytes each time instead, see makeAllocHandler.
+ *
+ * Not thread safe, but it doesn't need to be: asio frees an operation's
+ * memory before calling its handler, so the next operation can only start
+ * once the last one's memory is free. Anything bigger than kSize bytes, or
+ * allocated while the memory is in use, comes from the heap as usual.
+ */
+class HandlerMemory {
+ public:
+  HandlerMemory() = default;
+  HandlerMemory(const HandlerMemory&) = delete;
+  HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+  void* allocate(const std::size_t size) {
+    if (not inUse_ && size <= sizeof(storage_)) {
+      inUse_ = true;
+      return &storage_;
+    }
+    return ::operator new(size);
+  }
+
+  void deallocate(void* pointer) {
+    if (pointer == &storage_) {
+      inUse_ = false;
+    } else {
+      ::operator delete(pointer);
+    }
+  }
+
+ private:
+  // enough for a write of a few buffers with a strand-bound handler holding a
+  // shared_ptr (the biggest of the operations that use it)
+  static constexpr std::size_t kSize = 512;
+
+  typename std::aligned_storage<kSize>::type storage_;
+  bool inUse_ = false;
+};
+
+/**
+ * Allocator handing out a HandlerMemory, as the associated allocator of a
+ * handler (see AllocHandler).
+ */
+template <typename T>
+class HandlerAllocator {
+ public:
+  using value_type = T;
+
+  explicit HandlerAllocator(HandlerMemory& memory) : memory_(&memory) {}
+
+  template <typename U>
+  HandlerAllocator(const HandlerAllocator<U>& other) noexcept
+    : memory_(other.memory_) {}
+
+  T* allocate(const std::size_t n) const {
+    return static_cast<T*>(memory_->allocate(sizeof(T) * n));
+  }
+
+  void deallocate(T* pointer, std::size_t) const {
+    memory_->deallocate(pointer);
+  }
+
+  bool operator==(const HandlerAllocator& other) const noexcept {
+    return memory_ == other.memory_;
+  }
+
+  bool operator!=(const HandlerAllocator& other) const noexcept {
+    return memory_ != other.memory_;
+  }
+
+ private:
+  template <typename> friend class HandlerAllocator;
+
+  HandlerMemory* memory_;
+};
+
+/**
+ * A handler whose operations are allocated from a HandlerMemory; otherwise it
+ * just calls the handler it wraps.
+ */
+template <typename Handler>
+class AllocHandler {
+ public:
+  using allocator_type = HandlerAllocator<Handler>;
+
+  AllocHandler(HandlerMemory& memory, Handler handler)
+    : memory_(memory), handler_(std::move(handler)) {}
+
+  allocator_type get_allocator() const noexcept {
+    return allocator_type(memory_);
+  }
+
+  template <typename... Args>
+  void operator()(Args&&... args) {
+    handler_(std::forward<Args>(args)...);
+  }
+
+ private:
+  HandlerMemory& memory_;
+  Handler handler_;
+};
+
+/**
+ * Wrap handler so that the operation it's passed to is allocated from memory,
+ * which must outlive the operation.
+ */
+template <typename Handler>
+AllocHandler<typename std::decay<Handler>::type> makeAllocHandler(
+    HandlerMemory& memory,
+    Handler&& handler) {
+  return AllocHandler<typename std::decay<Handler>::type>(
+      memory, std::forward<Handler>(handler));
+}
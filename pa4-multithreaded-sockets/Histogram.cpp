@@ -0,0 +1,122 @@
+#include "Histogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+void HistogramSnapshot::merge(const HistogramSnapshot& other) {
+  if (counts.size() < other.counts.size()) {
+    counts.resize(other.counts.size());
+  }
+  for (std::size_t i = 0; i < other.counts.size(); i++) {
+    counts[i] += other.counts[i];
+  }
+  count += other.count;
+  sum += other.sum;
+  max = std::max(max, other.max);
+}
+
+uint64_t HistogramSnapshot::getPercentile(const double p) const {
+  // the counts are read from several atomics without a lock, so they may not
+  // add up to count exactly; rank within what the buckets hold
+  uint64_t total = 0;
+  for (const auto bucketCount : counts) {
+    total += bucketCount;
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  // nearest rank: the smallest value with at least p of the values at or
+  // below it
+  const auto rank = std::max<uint64_t>(
+      static_cast<uint64_t>(std::ceil(p * total)), 1);
+  uint64_t seen = 0;
+  for (std::size_t i = 0; i < counts.size(); i++) {
+    seen += counts[i];
+    if (seen >= rank) {
+      return std::min(Histogram::getBucketUpperBound(i), max);
+    }
+  }
+  return max;
+}
+
+uint64_t HistogramSnapshot::getCountBelow(const uint64_t value) const {
+  const auto end = std::min(Histogram::getBucketIndex(value), counts.size());
+  uint64_t countBelow = 0;
+  for (std::size_t i = 0; i < end; i++) {
+    countBelow += counts[i];
+  }
+  return countBelow;
+}
+
+uint64_t HistogramSnapshot::getCountAtMost(const uint64_t value) const {
+  if (value == UINT64_MAX) {
+    uint64_t total = 0;
+    for (const auto bucketCount : counts) {
+      total += bucketCount;
+    }
+    return total;
+  }
+  return getCountBelow(value + 1);
+}
+
+Histogram::Histogram()
+  : count_(0),
+    sum_(0),
+    max_(0) {
+  for (auto& bucketCount : counts_) {
+    bucketCount.store(0, std::memory_order_relaxed);
+  }
+}
+
+void Histogram::record(const uint64_t value) {
+  // there is a single writer, so a load and a store are enough (and cheaper
+  // than an atomic read-modify-write); the atomics only keep concurrent
+  // snapshots well defined
+  auto& bucketCount = counts_[getBucketIndex(value)];
+  bucketCount.store(
+      bucketCount.load(std::memory_order_relaxed) + 1,
+      std::memory_order_relaxed);
+  count_.store(
+      count_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  sum_.store(
+      sum_.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+  if (value > max_.load(std::memory_order_relaxed)) {
+    max_.store(value, std::memory_order_relaxed);
+  }
+}
+
+HistogramSnapshot Histogram::getSnapshot() const {
+  HistogramSnapshot snapshot;
+  snapshot.count = count_.load(std::memory_order_relaxed);
+  snapshot.sum = sum_.load(std::memory_order_relaxed);
+  snapshot.max = max_.load(std::memory_order_relaxed);
+  snapshot.counts.resize(kNumBuckets);
+  for (std::size_t i = 0; i < kNumBuckets; i++) {
+    snapshot.counts[i] = counts_[i].load(std::memory_order_relaxed);
+  }
+  return snapshot;
+}
+
+std::size_t Histogram::getBucketIndex(const uint64_t value) {
+  if (value < kSubBuckets) {
+    return value;
+  }
+
+  // value is in [2^n, 2^(n+1)); its top kSubBucketBits + 1 bits pick the
+  // bucket within that range
+  const int n = 63 - __builtin_clzll(value);
+  const int shift = n - kSubBucketBits;
+  const auto subBucket = (value >> shift) - kSubBuckets;
+  return kSubBuckets + shift * kSubBuckets + subBucket;
+}
+
+uint64_t Histogram::getBucketUpperBound(const std::size_t index) {
+  if (index < kSubBuckets) {
+    return index;
+  }
+  const auto shift = (index - kSubBuckets) / kSubBuckets;
+  const auto subBucket = (index - kSubBuckets) % kSubBuckets;
+  const auto lowerBound = (kSubBuckets + subBucket) << shift;
+  return lowerBound + ((uint64_t(1) << shift) - 1);
+}
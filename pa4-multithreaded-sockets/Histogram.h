@@ -0,0 +1,111 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Copy of a Histogram's counts at some point in time.
+ *
+ * Snapshots of several histograms using the same buckets can be merged, e.g.
+ * to combine the histograms kept by each thread.
+ */
+struct HistogramSnapshot {
+  // number of values in each bucket, see Histogram
+  std::vector<uint64_t> counts;
+
+  // number of values, their sum, and the largest value
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t max = 0;
+
+  /**
+   * Add the counts of another snapshot to this one.
+   */
+  void merge(const HistogramSnapshot& other);
+
+  /**
+   * Return the p-th percentile (0 < p <= 1) of the values, or 0 if there are
+   * none.
+   *
+   * The result is the largest value that falls in the same bucket as the
+   * percentile (but no larger than max), so it overestimates the percentile
+   * by at most the bucket's width.
+   */
+  uint64_t getPercentile(const double p) const;
+
+  /**
+   * Return the number of values smaller than value.
+   *
+   * Exact when value is a bucket boundary (e.g., any power of two), otherwise
+   * values in value's bucket are not counted.
+   */
+  uint64_t getCountBelow(const uint64_t value) const;
+
+  /**
+   * Return the number of values no larger than value.
+   *
+   * Exact when value + 1 is a bucket boundary (e.g., one less than any power
+   * of two), see getCountBelow.
+   */
+  uint64_t getCountAtMost(const uint64_t value) const;
+};
+
+/**
+ * Histogram of unsigned 64-bit values with log-linear buckets, in the style
+ * of HdrHistogram.
+ *
+ * Each power of two range [2^n, 2^(n+1)) is split into kSubBuckets buckets of
+ * equal width, so a value's bucket tells us the value to within 1 /
+ * kSubBuckets (about 6%) regardless of its magnitude, and the whole range of
+ * uint64_t fits in kNumBuckets buckets. Values below kSubBuckets each get a
+ * bucket of their own.
+ *
+ * Recording is lock free and cheap (a handful of relaxed atomic stores), but
+ * only one thread may call record() on a histogram; give each thread its own
+ * histogram and merge snapshots of them when reading. Snapshots may be taken
+ * from any thread, while values are being recorded.
+ */
+class Histogram {
+ public:
+  // number of buckets each power of two range is split into (in bits)
+  static constexpr int kSubBucketBits = 4;
+  static constexpr uint64_t kSubBuckets = uint64_t(1) << kSubBucketBits;
+
+  // buckets for the values below kSubBuckets, then kSubBuckets buckets for
+  // each of the power of two ranges above
+  static constexpr std::size_t kNumBuckets =
+      kSubBuckets + (64 - kSubBucketBits) * kSubBuckets;
+
+  Histogram();
+
+  Histogram(const Histogram&) = delete;
+  Histogram& operator=(const Histogram&) = delete;
+
+  /**
+   * Record a value. Only one thread may record values at a time.
+   */
+  void record(const uint64_t value);
+
+  /**
+   * Return a copy of the histogram's counts.
+   */
+  HistogramSnapshot getSnapshot() const;
+
+  /**
+   * Return the index of the bucket holding value.
+   */
+  static std::size_t getBucketIndex(const uint64_t value);
+
+  /**
+   * Return the largest value held by the bucket with the specified index.
+   */
+  static uint64_t getBucketUpperBound(const std::size_t index);
+
+ private:
+  std::array<std::atomic<uint64_t>, kNumBuckets> counts_;
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+  std::atomic<uint64_t> max_;
+};
@@ -0,0 +1,75 @@
+#include "InputFile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+InputFile::~InputFile() {
+  close();
+}
+
+bool InputFile::open(const std::string& filename) {
+  close();
+
+  fd_ = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0) {
+    return false;
+  }
+
+  // only regular files can be sent -- reject directories, devices, etc.
+  struct stat fileStat;
+  if (::fstat(fd_, &fileStat) != 0 || not S_ISREG(fileStat.st_mode)) {
+    close();
+    return false;
+  }
+  size_ = fileStat.st_size;
+  return true;
+}
+
+void InputFile::close() {
+  if (mappedData_ != nullptr) {
+    ::munmap(mappedData_, size_);
+    mappedData_ = nullptr;
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+  size_ = 0;
+}
+
+bool InputFile::isOpen() const {
+  return fd_ >= 0;
+}
+
+int InputFile::getFd() const {
+  return fd_;
+}
+
+uint64_t InputFile::getSize() const {
+  return size_;
+}
+
+bool InputFile::map() {
+  if (mappedData_ != nullptr) {
+    return true;
+  }
+  if (not isOpen() || size_ == 0) {
+    return false;
+  }
+
+  void* mappedData = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+  if (mappedData == MAP_FAILED) {
+    return false;
+  }
+
+  // we read the file front to back, so let the kernel read ahead aggressively
+  ::madvise(mappedData, size_, MADV_SEQUENTIAL);
+  mappedData_ = mappedData;
+  return true;
+}
+
+const char* InputFile::getData() const {
+  return static_cast<const char*>(mappedData_);
+}
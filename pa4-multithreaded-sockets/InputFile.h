@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+/**
+ * Read-only handle to a regular file that is being sent to a client.
+ *
+ * The file descriptor can be handed to sendfile(2), or the file can be mapped
+ * into memory with map() when sendfile is not supported. The file is closed
+ * (and unmapped) when the object is destroyed.
+ */
+class InputFile {
+ public:
+  InputFile() = default;
+  ~InputFile();
+
+  InputFile(const InputFile&) = delete;
+  InputFile& operator=(const InputFile&) = delete;
+
+  /**
+   * Open the specified file, closing any file that is already open.
+   *
+   * Returns whether the file was opened. Fails if the file does not exist or
+   * is not a regular file (e.g., a directory).
+   */
+  bool open(const std::string& filename);
+
+  /**
+   * Close the file, if open.
+   */
+  void close();
+
+  /**
+   * Return whether a file is open.
+   */
+  bool isOpen() const;
+
+  /**
+   * Return the file descriptor (-1 if no file is open).
+   */
+  int getFd() const;
+
+  /**
+   * Return the size of the file in bytes, as of when it was opened.
+   */
+  uint64_t getSize() const;
+
+  /**
+   * Map the file into memory.
+   *
+   * Returns whether the file is mapped. Empty files are never mapped.
+   */
+  bool map();
+
+  /**
+   * Return a pointer to the mapped file contents (nullptr if not mapped).
+   */
+  const char* getData() const;
+
+ private:
+  // file descriptor for the open file
+  int fd_ = -1;
+
+  // size of the file when it was opened
+  uint64_t size_ = 0;
+
+  // address of the mapped file contents
+  void* mappedData_ = nullptr;
+};
@@ -0,0 +1,155 @@
+#include "MetricsServer.h"
+
+#include <istream>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <glog/logging.h>
+
+namespace {
+
+/**
+ * Return a complete HTTP response with the given status and body.
+ */
+std::string formatHttpResponse(
+    const std::string& status,
+    const std::string& contentType,
+    const std::string& body) {
+  return "HTTP/1.0 " + status + "\r\n" +
+      "Content-Type: " + contentType + "\r\n" +
+      "Content-Length: " + std::to_string(body.size()) + "\r\n" +
+      "Connection: close\r\n" +
+      "\r\n" + body;
+}
+
+} // namespace
+
+constexpr std::chrono::seconds MetricsServer::kConnectionTimeout;
+
+MetricsServer::MetricsServer(
+    boost::asio::io_service& ioService,
+    MetricsCallback metricsCallback)
+  : ioService_(ioService),
+    acceptor_(ioService),
+    strand_(ioService),
+    metricsCallback_(std::move(metricsCallback)) {}
+
+void MetricsServer::start(const boost::asio::ip::tcp::endpoint& endpoint) {
+  acceptor_.open(endpoint.protocol());
+  acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+  acceptor_.bind(endpoint);
+  acceptor_.listen();
+  LOG(INFO) << "Serving metrics on port " << endpoint.port();
+  strand_.dispatch([this]() { startAccept(); });
+}
+
+void MetricsServer::stop() {
+  strand_.post([this]() {
+    boost::system::error_code ignoredError;
+    acceptor_.close(ignoredError);
+
+    // closing a socket cancels its pending operations, whose handlers then
+    // close the connection (again) and drop it from connections_
+    for (const auto& connection : connections_) {
+      connection->socket.close(ignoredError);
+    }
+  });
+}
+
+void MetricsServer::startAccept() {
+  const auto connection = std::make_shared<Connection>(ioService_);
+  acceptor_.async_accept(
+      connection->socket,
+      strand_.wrap(
+          [this, connection](const boost::system::error_code& error) {
+            // the acceptor was closed by stop()
+            if (error == boost::asio::error::operation_aborted ||
+                not acceptor_.is_open()) {
+              return;
+            }
+            if (error) {
+              LOG(ERROR)
+                  << "Metrics accept error: "
+                  << boost::system::system_error(error).what();
+            } else {
+              connections_.insert(connection);
+              startDeadline(connection);
+              readRequest(connection);
+            }
+            startAccept();
+          }));
+}
+
+void MetricsServer::readRequest(std::shared_ptr<Connection> connection) {
+  // the request ends with an empty line; we ignore its headers
+  boost::asio::async_read_until(
+      connection->socket,
+      connection->request,
+      "\r\n\r\n",
+      strand_.wrap(
+          [this, connection](
+              const boost::system::error_code& error,
+              const std::size_t) {
+            if (error) {
+              closeConnection(connection);
+              return;
+            }
+            std::istream requestStream(&connection->request);
+            std::string requestLine;
+            std::getline(requestStream, requestLine);
+            connection->response = getResponse(requestLine);
+            boost::asio::async_write(
+                connection->socket,
+                boost::asio::buffer(connection->response),
+                strand_.wrap(
+                    [this, connection](
+                        const boost::system::error_code&,
+                        const std::size_t) {
+                      closeConnection(connection);
+                    }));
+          }));
+}
+
+void MetricsServer::startDeadline(std::shared_ptr<Connection> connection) {
+  connection->deadlineTimer.expires_after(kConnectionTimeout);
+  connection->deadlineTimer.async_wait(strand_.wrap(
+      [this, connection](const boost::system::error_code& error) {
+        // the timer is cancelled when the connection is closed
+        if (error == boost::asio::error::operation_aborted ||
+            not connection->socket.is_open()) {
+          return;
+        }
+        LOG(INFO) << "Closing metrics connection that timed out";
+
+        // like stop(), this cancels the connection's pending read or write,
+        // whose handler closes it
+        boost::system::error_code ignoredError;
+        connection->socket.close(ignoredError);
+      }));
+}
+
+std::string MetricsServer::getResponse(const std::string& requestLine) {
+  // "<method> <path> <version>", e.g. "GET /metrics HTTP/1.1"
+  std::vector<std::string> fields;
+  const auto trimmedLine = boost::trim_copy(requestLine);
+  boost::split(
+      fields, trimmedLine, boost::is_any_of(" "), boost::token_compress_on);
+  if (fields.size() != 3 || fields[0] != "GET") {
+    return formatHttpResponse(
+        "405 Method Not Allowed", "text/plain", "Only GET is supported\n");
+  }
+  if (fields[1] != "/metrics") {
+    return formatHttpResponse("404 Not Found", "text/plain", "Not found\n");
+  }
+  return formatHttpResponse(
+      "200 OK", "text/plain; version=0.0.4", metricsCallback_());
+}
+
+void MetricsServer::closeConnection(std::shared_ptr<Connection> connection) {
+  boost::system::error_code ignoredError;
+  connection->socket.shutdown(
+      boost::asio::ip::tcp::socket::shutdown_both, ignoredError);
+  connection->socket.close(ignoredError);
+  connection->deadlineTimer.cancel();
+  connections_.erase(connection);
+}
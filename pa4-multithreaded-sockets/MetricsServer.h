@@ -0,0 +1,118 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <set>
+#include <string>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+/**
+ * Minimal HTTP listener serving the server's metrics to Prometheus.
+ *
+ * Answers `GET /metrics` with the text returned by a callback, and anything
+ * else with a 404, one request per connection (HTTP/1.0 style). All of its
+ * handlers run on the io_service of the Server it belongs to, serialized by a
+ * strand of its own, so scrapes never hold up client connections for longer
+ * than it takes to format the metrics.
+ *
+ * A connection that hasn't sent its request and read the response within
+ * kConnectionTimeout is closed, so that idle or stalled scrapers can't pile
+ * up open sockets.
+ */
+class MetricsServer {
+ public:
+  /**
+   * Returns the metrics, in the Prometheus text exposition format.
+   */
+  using MetricsCallback = std::function<std::string()>;
+
+  MetricsServer(
+      boost::asio::io_service& ioService,
+      MetricsCallback metricsCallback);
+
+  MetricsServer(const MetricsServer&) = delete;
+  MetricsServer& operator=(const MetricsServer&) = delete;
+
+  /**
+   * Start listening on the given endpoint. Throws boost::system::system_error
+   * if the endpoint can't be bound.
+   */
+  void start(const boost::asio::ip::tcp::endpoint& endpoint);
+
+  /**
+   * Stop listening and close any open connections. Safe to call from any
+   * thread, and if the listener was never started.
+   */
+  void stop();
+
+ private:
+  // a connection from a scraper
+  struct Connection {
+    explicit Connection(boost::asio::io_service& ioService)
+        : socket(ioService),
+          request(kMaxRequestBytes),
+          deadlineTimer(ioService) {}
+
+    boost::asio::ip::tcp::socket socket;
+    boost::asio::streambuf request;
+    std::string response;
+
+    // closes the connection once kConnectionTimeout has passed
+    boost::asio::steady_timer deadlineTimer;
+  };
+
+  // requests longer than this are rejected, since we only ever need the
+  // request line
+  static constexpr std::size_t kMaxRequestBytes = 8 * 1024;
+
+  // time a connection has to send its request and read the response
+  static constexpr std::chrono::seconds kConnectionTimeout{10};
+
+  /**
+   * Register an async_accept operation for the next connection.
+   *
+   * Must be called from within strand_.
+   */
+  void startAccept();
+
+  /**
+   * Read the request on a new connection, then answer it.
+   *
+   * Must be called from within strand_.
+   */
+  void readRequest(std::shared_ptr<Connection> connection);
+
+  /**
+   * Close the connection once kConnectionTimeout has passed, unless it has
+   * been closed by then.
+   *
+   * Must be called from within strand_.
+   */
+  void startDeadline(std::shared_ptr<Connection> connection);
+
+  /**
+   * Return the response to a request, given its request line.
+   */
+  std::string getResponse(const std::string& requestLine);
+
+  /**
+   * Close a connection and forget about it.
+   *
+   * Must be called from within strand_.
+   */
+  void closeConnection(std::shared_ptr<Connection> connection);
+
+  boost::asio::io_service& ioService_;
+  boost::asio::ip::tcp::acceptor acceptor_;
+
+  // serializes all of the handlers below, and access to connections_
+  boost::asio::io_service::strand strand_;
+
+  MetricsCallback metricsCallback_;
+
+  // open connections, closed by stop()
+  std::set<std::shared_ptr<Connection>> connections_;
+};
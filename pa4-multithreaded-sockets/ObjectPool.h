@@ -0,0 +1,200 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * Counters describing the behavior of a pool, see ObjectPool and BufferPool.
+ */
+struct PoolStats {
+  // objects created because the pool had none to hand out, and objects
+  // handed out again after being returned to the pool
+  uint64_t allocated = 0;
+  uint64_t reused = 0;
+
+  // objects currently waiting in the pool to be handed out again
+  uint64_t idle = 0;
+};
+
+/**
+ * Freelist of objects that are expensive to create, handed out as shared_ptrs.
+ *
+ * When the last shared_ptr to an object goes away, the object isn't destroyed
+ * but returned to the pool (unless maxIdle objects are already waiting in
+ * it), and the next call to acquire reinitializes it instead of allocating a
+ * new one. Whatever the object has allocated along the way (string and buffer
+ * capacity, say) is reused along with it. The shared_ptrs' control blocks are
+ * recycled too, so that handing out an idle object doesn't touch the heap.
+ *
+ * All functions are thread safe, and objects may be returned from any thread.
+ * The pool must outlive the shared_ptrs it hands out; call close() before
+ * destroying anything the idle objects depend on.
+ */
+template <typename T>
+class ObjectPool {
+ public:
+  explicit ObjectPool(const std::size_t maxIdle) : maxIdle_(maxIdle) {}
+
+  ~ObjectPool() {
+    close();
+    for (const auto block : freeBlocks_) {
+      ::operator delete(block);
+    }
+  }
+
+  ObjectPool(const ObjectPool&) = delete;
+  ObjectPool& operator=(const ObjectPool&) = delete;
+
+  /**
+   * Return an idle object, after calling reuse(object) on it, or the new
+   * object returned by create() (a T*) if there is none.
+   */
+  template <typename Create, typename Reuse>
+  std::shared_ptr<T> acquire(Create create, Reuse reuse) {
+    std::unique_ptr<T> object;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (not idle_.empty()) {
+        object = std::move(idle_.back());
+        idle_.pop_back();
+        stats_.reused++;
+      } else {
+        stats_.allocated++;
+      }
+    }
+    if (object) {
+      reuse(*object);
+    } else {
+      object.reset(create());
+    }
+    return std::shared_ptr<T>(
+        object.release(), Recycler{this}, BlockAllocator<T>(this));
+  }
+
+  /**
+   * Destroy the idle objects, and destroy objects as they are returned from
+   * now on instead of keeping them.
+   */
+  void close() {
+    std::vector<std::unique_ptr<T>> idle;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      closed_ = true;
+      idle.swap(idle_);
+    }
+  }
+
+  /**
+   * Return the pool's counters.
+   */
+  PoolStats getStats() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto stats = stats_;
+    stats.idle = idle_.size();
+    return stats;
+  }
+
+ private:
+  // deleter of the shared_ptrs handed out, returning the object to the pool
+  struct Recycler {
+    ObjectPool* pool;
+
+    void operator()(T* object) const {
+      pool->release(object);
+    }
+  };
+
+  // allocator of the shared_ptrs' control blocks, see allocateBlock
+  template <typename U>
+  struct BlockAllocator {
+    using value_type = U;
+
+    explicit BlockAllocator(ObjectPool* pool) : pool(pool) {}
+
+    template <typename V>
+    BlockAllocator(const BlockAllocator<V>& other) : pool(other.pool) {}
+
+    U* allocate(const std::size_t n) {
+      return static_cast<U*>(pool->allocateBlock(n * sizeof(U)));
+    }
+
+    void deallocate(U* block, const std::size_t n) {
+      pool->freeBlock(block, n * sizeof(U));
+    }
+
+    template <typename V>
+    bool operator==(const BlockAllocator<V>& other) const {
+      return pool == other.pool;
+    }
+
+    template <typename V>
+    bool operator!=(const BlockAllocator<V>& other) const {
+      return pool != other.pool;
+    }
+
+    ObjectPool* pool;
+  };
+
+  /**
+   * Keep an object whose last shared_ptr went away, or destroy it if the pool
+   * is full or closed.
+   */
+  void release(T* object) {
+    // declared before the guard, so that an object that isn't kept is
+    // destroyed after the mutex has been released
+    std::unique_ptr<T> deadObject(object);
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (not closed_ && idle_.size() < maxIdle_) {
+      idle_.push_back(std::move(deadObject));
+    }
+  }
+
+  /**
+   * Return memory for a control block, taking a recycled one if possible.
+   *
+   * Every shared_ptr handed out has a control block of the same type, so the
+   * pool only needs to remember a single block size.
+   */
+  void* allocateBlock(const std::size_t bytes) {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (bytes == blockBytes_ && not freeBlocks_.empty()) {
+        const auto block = freeBlocks_.back();
+        freeBlocks_.pop_back();
+        return block;
+      }
+      blockBytes_ = bytes;
+    }
+    return ::operator new(bytes);
+  }
+
+  /**
+   * Keep the memory of a control block for the next allocateBlock.
+   */
+  void freeBlock(void* block, const std::size_t bytes) {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (bytes == blockBytes_ && freeBlocks_.size() < maxIdle_) {
+        freeBlocks_.push_back(block);
+        return;
+      }
+    }
+    ::operator delete(block);
+  }
+
+  // most objects (and control blocks) kept for reuse
+  const std::size_t maxIdle_;
+
+  // hold this mutex when accessing any of the members below
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<T>> idle_;
+  std::vector<void*> freeBlocks_;
+  std::size_t blockBytes_ = 0;
+  bool closed_ = false;
+  PoolStats stats_;
+};
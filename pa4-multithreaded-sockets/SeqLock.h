@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+/**
+ * Sequence lock protecting a small, trivially copyable value.
+ *
+ * A single writer publishes new values with store(); any number of readers
+ * take consistent snapshots with load(). Neither side ever blocks the other:
+ * the writer just bumps a sequence number around its update, and a reader that
+ * raced with an update (the sequence number changed while it was copying)
+ * simply retries.
+ *
+ * Only one thread may call store() at a time.
+ */
+template <typename T>
+class SeqLock {
+  static_assert(
+      std::is_trivially_copyable<T>::value,
+      "SeqLock can only hold trivially copyable types");
+
+ public:
+  SeqLock() : sequence_(0) {
+    store(T());
+  }
+
+  SeqLock(const SeqLock&) = delete;
+  SeqLock& operator=(const SeqLock&) = delete;
+
+  /**
+   * Publish a new value.
+   */
+  void store(const T& value) {
+    uint64_t words[kNumWords] = {};
+    std::memcpy(words, &value, sizeof(T));
+
+    // an odd sequence number tells readers that an update is in progress
+    const auto sequence = sequence_.load(std::memory_order_relaxed);
+    sequence_.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (std::size_t i = 0; i < kNumWords; i++) {
+      words_[i].store(words[i], std::memory_order_relaxed);
+    }
+    sequence_.store(sequence + 2, std::memory_order_release);
+  }
+
+  /**
+   * Return a consistent snapshot of the most recently published value.
+   */
+  T load() const {
+    uint64_t words[kNumWords];
+    uint64_t sequenceBefore = 0;
+    uint64_t sequenceAfter = 0;
+    do {
+      sequenceBefore = sequence_.load(std::memory_order_acquire);
+      for (std::size_t i = 0; i < kNumWords; i++) {
+        words[i] = words_[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      sequenceAfter = sequence_.load(std::memory_order_relaxed);
+    } while ((sequenceBefore & 1) != 0 || sequenceBefore != sequenceAfter);
+
+    T value;
+    std::memcpy(&value, words, sizeof(T));
+    return value;
+  }
+
+ private:
+  // the value is stored as relaxed atomic words so that a reader racing with
+  // the writer is not a data race (the sequence number catches torn reads)
+  static constexpr std::size_t kNumWords = (sizeof(T) + 7) / 8;
+
+  // incremented before and after each store (odd = store in progress)
+  std::atomic<uint64_t> sequence_;
+
+  // the value, split into words
+  std::atomic<uint64_t> words_[kNumWords];
+};
@@ -1,328 +1,2742 @@
 #include "Server.h"
 
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
-#include <fstream>
+#include <optional>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <boost/algorithm/string.hpp>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
-#include <boost/scope_exit.hpp>
 
+#include "AsyncLog.h"
+#include "Checksum.h"
 #include "SocketUtils.h"
 
-// The following flag allows us to artificially slow down the transfer
+// The following flags allow us to artificially slow down the transfer
+//
+// by default, each client is limited to 100 bytes per second
+DEFINE_uint64(
+    client_rate_limit, 100,
+    "Maximum bytes per second sent to each client (0 = unlimited)");
+DEFINE_uint64(
+    client_burst_bytes, 0,
+    "Token bucket size for each client in bytes (0 = one second's worth)");
+DEFINE_uint64(
+    global_rate_limit, 0,
+    "Maximum bytes per second sent across all clients (0 = unlimited)");
+DEFINE_uint64(
+    global_burst_bytes, 0,
+    "Token bucket size shared by all clients (0 = one second's worth)");
+DEFINE_uint64(
+    send_chunk_bytes, 64 * 1024,
+    "Maximum number of bytes passed to a single write on a client socket");
+DEFINE_string(
+    egress_policy, "drr",
+    "Order in which clients waiting on the global rate limit are served: drr "
+    "(deficit round-robin, splitting it by the clients' weights), srpt "
+    "(responses with the fewest bytes left first) or fifo (whichever client "
+    "asks first once tokens are available)");
+DEFINE_uint64(
+    egress_quantum_bytes, 16 * 1024,
+    "Bytes a client of weight 1 earns per round when clients take turns on "
+    "the global rate limit with --egress_policy=drr; a client sends whole "
+    "chunks (see --send_chunk_bytes) once it has earned them, keeping the "
+    "rest for its next turn");
+DEFINE_uint64(
+    client_weight, 1,
+    "Share of the global rate limit each client gets relative to the others "
+    "with --egress_policy=drr (the terminal's `weight` command changes it)");
+
+// Flags controlling connections
+DEFINE_bool(
+    keep_alive, true,
+    "Keep connections open after sending a file so that clients can send "
+    "more requests (which may be pipelined) on the same connection");
+DEFINE_uint64(
+    max_connections, 0,
+    "Maximum number of connections served at once; connections accepted "
+    "beyond that wait in a queue until one of them closes (0 = unlimited)");
+DEFINE_uint64(
+    connection_queue_length, 64,
+    "Maximum number of connections waiting to be served; connections "
+    "accepted beyond that are turned away with a busy response");
+DEFINE_uint64(
+    busy_retry_after_ms, 1000,
+    "Milliseconds after which clients turned away are told to try again");
+DEFINE_uint64(
+    connection_pool_size, 1024,
+    "Maximum number of closed connections each acceptor keeps for reuse by "
+    "new connections, instead of freeing and allocating them again");
 DEFINE_int32(
-    send_delay_ms, 10,
-    "Number of milliseconds to wait between sending each byte of the file");
+    listen_backlog, 0,
+    "Number of connections the kernel completes before they are accepted "
+    "(0 = the system's maximum, SOMAXCONN)");
+DEFINE_uint64(
+    request_timeout_ms, 60000,
+    "Milliseconds a client has to send a complete request, counted from when "
+    "it started being served or its previous response was sent, so this is "
+    "also how long an idle connection is kept open (0 = no limit)");
+DEFINE_uint64(
+    write_timeout_ms, 60000,
+    "Milliseconds a client has to accept each chunk of a response written to "
+    "its socket (0 = no limit)");
+DEFINE_uint64(
+    transfer_timeout_ms, 0,
+    "Milliseconds a response may take to send in full, including time spent "
+    "waiting on rate limits (0 = no limit)");
+DEFINE_bool(
+    tcp_nodelay, true,
+    "Set TCP_NODELAY on client sockets, so that the last segment of a "
+    "response isn't held back by Nagle's algorithm");
+DEFINE_bool(
+    tcp_cork, false,
+    "Set TCP_CORK on client sockets while a response is being sent, so that "
+    "only full segments go out until the response is complete");
 
-Server::Server()
-  : nextClientID_(1),
-    acceptor_(ioService_) {}
-
-void Server::run(const boost::asio::ip::tcp::endpoint& endpoint) {
-  // open the acceptor and bind it to our endpoint (All V4 addresses on system)
-  acceptor_.open(endpoint.protocol());
-  acceptor_.bind(endpoint);
-  acceptor_.listen();
-
-  // keep processing connections until the acceptor is shutdown
-  LOG(INFO) << "Entering connection acceptance loop";
-  while (acceptor_.is_open()) {
-    // Setup a socket and wait on a client connection
-    //
-    // We'll use `acceptor_.async_accept()` to setup a lambda function that will
-    // be called when a new connection is ready to be accepted, or when the
-    // acceptor has been closed. This lambda function is called our "handler"
-    // function (since it is called to handle new client connections). Normally
-    // we would put more of the logic below into the handler function, but we
-    // don't do that here primarily for readability and to avoid changing this
-    // code too much from previous examples.
-    //
-    // When we call `ioService_.run()`, the ``io_service` object processes
-    // serviceable event handlers, returning once there are no more handlers
-    // waiting. This ensures that `run()` will not return until all registered
-    // handlers (such as the function we registered for async_accept) have been
-    // called.
-    //
-    // We call `reset` on the `io_service` object because we need to reset its
-    // state to be able to call `run()` on it multiple times.
-    //
-    // Note that the approach shown here is much different than what you would
-    // find in Boost::Asio documentation. We choose this method to avoid use of
-    // the more sophisticated ASIO functionality and instead have things handled
-    // directly by threads.
-    boost::asio::ip::tcp::socket socket(ioService_);
-    boost::system::error_code acceptorError;
-    acceptor_.async_accept(
-        socket, [&acceptorError](const boost::system::error_code& error) {
-          acceptorError = error;
-        }
-    );
-    LOG(INFO) << "Waiting for client to connect";
-    ioService_.reset();
-    ioService_.run();
-
-    // our handler function for async_accept must have been called, but it's
-    // possible that it was called because the acceptor was closed by
-    // Server::stop() or due to some other error
-    //
-    // check if the async_accept was cancelled or if the acceptor is closed
-    if (acceptorError == boost::asio::error::operation_aborted or
-        not acceptor_.is_open()) {
-      // looks like we need to shutdown -- break out of the loop
-      LOG(INFO) << "cancel() called or acceptor closed, breaking out of loop";
-      break;
-    }
-
-    // otherwise, if there's some other error, print it and also shutdown
-    if (acceptorError) {
-      LOG(ERROR)
-          << "Accept error: "
-          << boost::system::system_error(acceptorError).what()
-          << ", breaking out of loop";
-      break;
-    }
-
-    // a client has connected
-    // determine the client's ID and create a ClientConnection object
-    //
-    // we use a shared_ptr so that both the client's thread and the main server
-    // thread can have access to the ClientConnection object and its socket
-    const auto clientId = getNextClientID();
-    const auto clientConn =
-        std::make_shared<ClientConnection>(clientId, std::move(socket));
-    LOG(INFO) << "Processing new client connection, client ID = " << clientId;
-
-    // add it to our map of clientId -> ClientConnection object
-    {
-      std::lock_guard<std::mutex> guard(clientConnectionsMutex_);
-      clientConnections_.emplace(clientId, clientConn);
+// Flags controlling how file contents are sent
+DEFINE_bool(
+    zero_copy, true,
+    "Send files with sendfile() instead of reading them into memory first");
+DEFINE_uint64(
+    stream_chunk_bytes, 64 * 1024,
+    "Size of the per-client buffer used to read files when zero_copy is off, "
+    "and of the windows of a file compressed at a time");
+DEFINE_uint64(
+    stream_buffer_pool_bytes, 16 * 1024 * 1024,
+    "Maximum bytes of per-client stream buffers kept for reuse once their "
+    "connection has closed");
+DEFINE_uint64(
+    file_cache_bytes, 64 * 1024 * 1024,
+    "Maximum bytes of file contents cached in memory (0 = no cache)");
+DEFINE_uint64(
+    file_cache_max_file_bytes, 1024 * 1024,
+    "Files larger than this are never cached");
+DEFINE_int32(
+    cache_fill_threads, 2,
+    "Number of threads reading files into the file cache, and compressing "
+    "cached files, so that worker threads never block on either");
+DEFINE_bool(
+    compression, true,
+    "Compress responses with zstd for clients that ask for it (compressed "
+    "responses are never sent with sendfile())");
+DEFINE_bool(
+    checksums, true,
+    "Follow responses with a CRC32C checksum of the file's bytes for clients "
+    "that ask for it (the bytes of files that aren't cached are then read into "
+    "memory instead of being sent with sendfile())");
+DEFINE_int32(
+    compression_level, 3,
+    "zstd compression level used for responses (1 = fastest, 19 = smallest)");
+DEFINE_string(
+    async_file_io, "io_uring",
+    "How files are read when they aren't sent with sendfile() or from memory: "
+    "io_uring (falling back to threads if unsupported) or threads");
+DEFINE_int32(
+    file_io_threads, 4,
+    "Number of threads reading files for each acceptor (see --acceptors), if "
+    "async_file_io is threads (or io_uring is unsupported)");
+DEFINE_int32(
+    metrics_port, 0,
+    "Port serving the server's metrics in the Prometheus text format at "
+    "/metrics (0 = disabled)");
+DEFINE_int32(
+    worker_threads, 0,
+    "Number of worker threads handling client connections "
+    "(0 = one per hardware thread)");
+DEFINE_int32(
+    acceptors, 1,
+    "Number of acceptors listening on the server's port with SO_REUSEPORT, "
+    "each with an io_service and worker threads of its own, so that the "
+    "kernel spreads new connections across them");
+DEFINE_bool(
+    pin_worker_threads, false,
+    "Pin each worker thread to a CPU of its own (round-robin, if there are "
+    "more worker threads than CPUs)");
+
+namespace {
+
+// how long a connection being turned away is kept open for its client to
+// read the busy response and close it
+const auto kRejectLingerTime = std::chrono::seconds(1);
+
+// how long to wait before accepting again after an accept error, e.g. once
+// we've run out of file descriptors, for some connections to close
+const auto kAcceptRetryDelay = std::chrono::milliseconds(100);
+
+// flags that Server::reloadConfig may change
+const std::vector<std::string> kReloadableFlags = {
+  "client_rate_limit",
+  "client_burst_bytes",
+  "global_rate_limit",
+  "global_burst_bytes",
+  "file_cache_bytes",
+  "request_timeout_ms",
+  "write_timeout_ms",
+  "transfer_timeout_ms",
+};
+
+/**
+ * Build a RateLimit from a pair of (rate, burst) flag values.
+ */
+RateLimit makeRateLimit(const uint64_t bytesPerSecond, const uint64_t burst) {
+  RateLimit rateLimit;
+  rateLimit.bytesPerSecond = bytesPerSecond;
+  rateLimit.burstBytes = burst;
+  return rateLimit;
+}
+
+/**
+ * Set the flags in a configuration file, see Server::reloadConfig.
+ *
+ * Returns whether all of them were set; if not, an error is logged, and the
+ * flags that were set are set back to their previous values.
+ */
+bool setFlagsFromFile(const std::string& configFile) {
+  std::ifstream file(configFile);
+  if (not file) {
+    LOG(ERROR) << "Unable to open configuration file " << configFile;
+    return false;
+  }
+
+  // the previous values of the flags set so far, in case we need to undo
+  std::vector<std::pair<std::string, std::string>> previousValues;
+  const auto fail = [&configFile, &previousValues](
+      const int lineNumber, const std::string& reason) {
+    LOG(ERROR)
+        << configFile << ":" << lineNumber << ": " << reason
+        << ", configuration not applied";
+    for (auto it = previousValues.rbegin(); it != previousValues.rend(); it++) {
+      gflags::SetCommandLineOption(it->first.c_str(), it->second.c_str());
+    }
+    return false;
+  };
+
+  std::string line;
+  for (int lineNumber = 1; std::getline(file, line); lineNumber++) {
+    boost::trim(line);
+    if (line.empty() || line.front() == '#') {
+      continue;
+    }
+
+    // "--name=value" (or "-name=value")
+    const auto nameStart = line.find_first_not_of('-');
+    const auto equals = line.find('=');
+    if (nameStart == 0 || nameStart > 2 || equals == std::string::npos) {
+      return fail(lineNumber, "expected --<flag>=<value>");
+    }
+    const auto name = line.substr(nameStart, equals - nameStart);
+    const auto value = line.substr(equals + 1);
+    if (std::find(kReloadableFlags.begin(), kReloadableFlags.end(), name) ==
+        kReloadableFlags.end()) {
+      return fail(
+          lineNumber, "--" + name + " can't be changed without a restart");
     }
 
-    // create a std::thread object that executes Server::handleClient
-    // we pass in `this` because we need to pass in the instance of the Server
-    // class to call a class function, and the ClientConnection structure
-    //
-    // TODO: Periodic cleanup of thread objects in clientThreads_...
-    clientThreads_.emplace_back(
-        std::thread(&Server::handleClient, this, clientConn));
+    // SetCommandLineOption checks the value, and returns an empty string if
+    // it isn't valid for the flag's type
+    std::string previousValue;
+    gflags::GetCommandLineOption(name.c_str(), &previousValue);
+    if (gflags::SetCommandLineOption(name.c_str(), value.c_str()).empty()) {
+      return fail(lineNumber, "invalid value for --" + name);
+    }
+    previousValues.emplace_back(name, previousValue);
   }
-  LOG(INFO) << "Exited connection acceptance loop";
+  return true;
+}
 
-  // disconnect remaining client connections
-  //
-  // we know that we're not going to accept any more clients, so just call
-  // getConnectedClients() to get all clientIds and then call disconnectClient()
-  // for each client ID
-  LOG(INFO) << "Cleaning up client connections";
-  const auto connectedClientIds = getConnectedClients();
-  for (const auto& clientId : connectedClientIds) {
-    // call disconnect
-    LOG(INFO) << "Disconnecting client " << clientId;
-    disconnectClient(clientId);
+/**
+ * Pin a thread to a CPU, logging (but otherwise ignoring) any failure.
+ */
+void pinThreadToCpu(std::thread& thread, const unsigned int cpu) {
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  CPU_SET(cpu, &cpuSet);
+  const int result =
+      pthread_setaffinity_np(thread.native_handle(), sizeof(cpuSet), &cpuSet);
+  if (result != 0) {
+    LOG(ERROR)
+        << "Unable to pin worker thread to CPU " << cpu << ": "
+        << boost::system::system_error(
+            result, boost::system::system_category()).what();
   }
+}
 
-  // wait for all client threads to cleanup by calling join() on each
-  LOG(INFO) << "Waiting for client threads to exit";
-  for (auto& clientThread : clientThreads_) {
-    clientThread.join();
+/**
+ * Return the AsyncFileReader backend named by FLAGS_async_file_io.
+ */
+AsyncFileReader::Backend getFileReaderBackend() {
+  if (FLAGS_async_file_io == "io_uring") {
+    return AsyncFileReader::Backend::kIoUring;
   }
+  if (FLAGS_async_file_io != "threads") {
+    LOG(FATAL) << "Unknown --async_file_io value: " << FLAGS_async_file_io;
+  }
+  return AsyncFileReader::Backend::kThreadPool;
+}
 
-  // we're done -- all client connections were closed and threads joined
-  LOG(INFO) << "Finished shutting down server";
+/**
+ * Return the EgressPolicy named by FLAGS_egress_policy.
+ */
+EgressPolicy getEgressPolicyFlag() {
+  EgressPolicy policy;
+  if (not parseEgressPolicy(FLAGS_egress_policy, policy)) {
+    LOG(FATAL) << "Unknown --egress_policy value: " << FLAGS_egress_policy;
+  }
+  return policy;
 }
 
-void Server::stop() {
-  // close the acceptor, which will cancel async_accept calls waiting on it
-  LOG(INFO) << "Closing acceptor, canceling all pending accept operations";
-  acceptor_.close();
-  LOG(INFO) << "Acceptor closed";
+// most bytes the header of a chunk of a compressed response takes: a frame
+// header, or up to 20 digits and the delimiter
+const std::size_t kMaxChunkHeaderBytes = 24;
+
+/**
+ * Encode the header announcing a chunk of numBytes bytes of a compressed
+ * response (see FileRequest) into data, returning its length.
+ */
+std::size_t encodeChunkHeader(
+    const bool binaryFraming,
+    const uint32_t requestId,
+    const uint64_t numBytes,
+    std::array<char, kMaxChunkHeaderBytes>& data) {
+  if (not binaryFraming) {
+    const auto end =
+        std::to_chars(data.data(), data.data() + data.size(), numBytes).ptr;
+    const auto length = end - data.data();
+    return kDelimiter.copy(end, data.size() - length) + length;
+  }
+  FrameHeader header;
+  header.type = FrameType::kChunk;
+  header.requestId = requestId;
+  header.length = numBytes;
+  EncodedFrameHeader headerData;
+  encodeFrameHeader(header, headerData);
+  std::copy(headerData.begin(), headerData.end(), data.begin());
+  return headerData.size();
 }
 
-std::vector<int> Server::getConnectedClients() {
-  std::vector<int> clientIds;
-  {
-    std::lock_guard<std::mutex> guard(clientConnectionsMutex_);
-    for (const auto& kv : clientConnections_) {
-      const auto& clientId = kv.first;
-      clientIds.push_back(clientId);
-    }
+/**
+ * Append the checksum following a response (see FileRequest) to str.
+ */
+void appendChecksumTrailer(
+    std::string& str,
+    const bool binaryFraming,
+    const uint32_t requestId,
+    const uint32_t checksum) {
+  if (not binaryFraming) {
+    str += formatChecksum(checksum);
+    str += kDelimiter;
+    return;
   }
-  return clientIds;
+  FrameHeader header;
+  header.type = FrameType::kChecksum;
+  header.requestId = requestId;
+  header.length = sizeof(uint32_t);
+  appendFrameHeader(str, header);
+  appendUint32(str, checksum);
 }
 
-std::map<int, ClientRequestInfo> Server::getConnectedClientsWithInfo() {
-  std::map<int, ClientRequestInfo> clientIdToRequestInfo;
+/**
+ * Return whether the response to a request for a cached file of fileSize
+ * bytes is sent from the cache's compressed copy of the file: it's to be
+ * compressed, and sends all of the file.
+ */
+bool sendsCompressedCopy(const FileRequest& request, const uint64_t fileSize) {
+  return FLAGS_compression && request.compress && fileSize > 0 &&
+      request.offset == 0 && request.length >= fileSize;
+}
+
+} // namespace
+
+void ClientConnection::reset(
+    const int newClientId,
+    boost::asio::ip::tcp::socket clientSocket,
+    const RateLimit& rateLimit,
+    const std::chrono::steady_clock::time_point newAcceptTime) {
+  clientId = newClientId;
+  clientRequestInfo.filename.clear();
+  clientRequestInfo.offset = 0;
+  clientRequestInfo.bytesTransferred = 0;
+  clientRequestInfo.bytesToTransfer = 0;
+  clientRequestInfo.compressed = false;
+  clientRequestInfo.compressedBytesSent = 0;
   {
-    std::lock_guard<std::mutex> guard(clientConnectionsMutex_);
-    for (const auto& kv : clientConnections_) {
-      const auto& clientId = kv.first;
-      const auto& clientConn = kv.second;
+    std::lock_guard<std::mutex> guard(publishedFilenameMutex);
+    publishedFilename.clear();
+  }
+  publishedProgress.store(ClientRequestProgress());
+  socket = std::move(clientSocket);
+  rcvBuffer.consume(rcvBuffer.size());
+  binaryFraming = false;
+  requestId = 0;
+  requestInProgress = false;
+  responseHeader.clear();
+  responseHeaderBytesSent = 0;
+  cachedFile.reset();
+  inputFile.close();
+  streamFile = false;
+  compressResponse = false;
+  compressor.reset();
+  compressedChunk.clear();
+  compressedChunkBytesSent = 0;
+  compressedChunkPayloadStart = 0;
+  bytesCompressed = 0;
+  compressedDataOffset = 0;
+  compressionFinished = false;
+  sendChecksum = false;
+  checksum = 0;
+  checksumFromCache = false;
+  responseTrailer.clear();
+  responseTrailerBytesSent = 0;
+  streamBufferOffset = 0;
+  streamBufferBytes = 0;
+  fileReadPending = false;
+  requestDeadline = kNoDeadline;
+  writeDeadline = kNoDeadline;
+  transferDeadline = kNoDeadline;
+  deadlineTimerExpiry = kNoDeadline;
+  tokenBucket.reset(rateLimit);
+  egressWantBytes = 0;
+  acceptTime = newAcceptTime;
+  firstByteSent = false;
+  responseStartTime = std::chrono::steady_clock::time_point();
+  fileReadStartTime = std::chrono::steady_clock::time_point();
+  fileBytesSent = 0;
+}
 
-      // lock and copy the ClientRequestInfo structure
-      {
-        std::lock_guard<std::mutex> guard(clientConn->clientRequestInfoMutex);
-        clientIdToRequestInfo[clientId] = clientConn->clientRequestInfo;
+struct Server::RejectedConnection {
+  RejectedConnection(
+      boost::asio::io_service& ioService,
+      boost::asio::ip::tcp::socket clientSocket)
+      : socket(std::move(clientSocket)),
+        lingerTimer(ioService) {}
+
+  boost::asio::ip::tcp::socket socket;
+  boost::asio::steady_timer lingerTimer;
+  std::string response;
+
+  // bytes read from the client, which are thrown away
+  std::array<char, 4096> discardBuffer;
+};
+
+Server::Server()
+  : nextClientID_(1),
+    listeners_(createListeners()),
+    defaultClientRateLimit_(
+        makeRateLimit(FLAGS_client_rate_limit, FLAGS_client_burst_bytes)),
+    defaultClientWeight_(std::max<uint64_t>(FLAGS_client_weight, 1)),
+    requestTimeoutMs_(FLAGS_request_timeout_ms),
+    writeTimeoutMs_(FLAGS_write_timeout_ms),
+    transferTimeoutMs_(FLAGS_transfer_timeout_ms),
+    draining_(false),
+    drainFinished_(false),
+    drainTimer_(listeners_.front()->ioService),
+    globalTokenBucket_(
+        makeRateLimit(FLAGS_global_rate_limit, FLAGS_global_burst_bytes)),
+    egressScheduler_(
+        getIoServices(listeners_),
+        globalTokenBucket_,
+        getEgressPolicyFlag(),
+        FLAGS_egress_quantum_bytes),
+    fileCache_(FLAGS_file_cache_bytes, FLAGS_file_cache_max_file_bytes),
+    cacheFillPool_(std::max(FLAGS_cache_fill_threads, 1)),
+    streamBufferPool_(
+        std::max<uint64_t>(FLAGS_stream_chunk_bytes, 1),
+        FLAGS_stream_buffer_pool_bytes /
+            std::max<uint64_t>(FLAGS_stream_chunk_bytes, 1)),
+    metricsServer_(
+        listeners_.front()->ioService,
+        [this]() { return getPrometheusMetrics(); }) {}
+
+std::vector<std::unique_ptr<Server::Listener>> Server::createListeners() {
+  std::vector<std::unique_ptr<Listener>> listeners;
+  for (int i = 0; i < std::max(FLAGS_acceptors, 1); i++) {
+    listeners.emplace_back(new Listener(
+        FLAGS_connection_pool_size, getFileReaderBackend(),
+        std::max(FLAGS_file_io_threads, 1)));
+  }
+  return listeners;
+}
+
+std::vector<boost::asio::io_service*> Server::getIoServices(
+    const std::vector<std::unique_ptr<Listener>>& listeners) {
+  std::vector<boost::asio::io_service*> ioServices;
+  for (const auto& listener : listeners) {
+    ioServices.push_back(&listener->ioService);
+  }
+  return ioServices;
+}
+
+void Server::openAcceptors(
+    Listener& listener,
+    const std::vector<boost::asio::ip::tcp::endpoint>& endpoints) {
+  listener.acceptors.reserve(endpoints.size());
+  for (const auto& endpoint : endpoints) {
+    listener.acceptors.emplace_back(listener.ioService);
+    auto& acceptor = listener.acceptors.back();
+    acceptor.open(endpoint.protocol());
+    if (endpoint.address().is_v6()) {
+      acceptor.set_option(
+          boost::asio::ip::v6_only(not isDualStack(endpoints, endpoint)));
+    }
+
+    // the acceptors can only share the port if every one of them (including
+    // the first) sets SO_REUSEPORT before binding
+    if (listeners_.size() > 1) {
+      boost::system::error_code error;
+      setReusePort(acceptor, true, error);
+      if (error) {
+        LOG(FATAL)
+            << "Unable to set SO_REUSEPORT: "
+            << boost::system::system_error(error).what();
       }
     }
+    acceptor.bind(endpoint);
+    acceptor.listen(
+        FLAGS_listen_backlog > 0
+            ? FLAGS_listen_backlog
+            : boost::asio::socket_base::max_listen_connections);
   }
-  return clientIdToRequestInfo;
 }
 
-bool Server::disconnectClient(const int clientId) {
-  // try to find a ClientConnection for the given clientId
-  std::shared_ptr<ClientConnection> clientConn = nullptr;
-  {
-    std::lock_guard<std::mutex> guard(clientConnectionsMutex_);
-    const auto& kv = clientConnections_.find(clientId);
-    if (kv != clientConnections_.end()) {
-      clientConn = kv->second;
+void Server::run(
+    const std::vector<boost::asio::ip::tcp::endpoint>& endpoints) {
+  // open the acceptors and bind them to our endpoints
+  //
+  // if an endpoint's port is 0, the first listener's acceptor is given a free
+  // port, and the other listeners' acceptors are bound to that same port
+  auto listenEndpoints = endpoints;
+  for (auto& listener : listeners_) {
+    openAcceptors(*listener, listenEndpoints);
+    for (std::size_t i = 0; i < listenEndpoints.size(); i++) {
+      listenEndpoints[i].port(
+          listener->acceptors[i].local_endpoint().port());
     }
   }
+  for (const auto& endpoint : listenEndpoints) {
+    LOG(INFO) << "Listening on " << endpoint;
+  }
 
-  // we cannot find a ClientConnection for the given clientId
-  if (not clientConn) {
-      return false;
+  // serve metrics on the first endpoint's address, on a port of their own
+  if (FLAGS_metrics_port != 0) {
+    metricsServer_.start(
+        boost::asio::ip::tcp::endpoint(
+            endpoints.front().address(), FLAGS_metrics_port));
   }
 
-  // found a ClientConnection, call shutdown
-  {
-    std::lock_guard<std::mutex> guard(clientConn->socketStateMutex);
-    // it's possible the socket has already been closed, so check first
-    if (clientConn->socket.is_open()) {
-      clientConn->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both);
+  // register the first async_accept
+  //
+  // Unlike the previous version of this server, we don't create a thread for
+  // each client. Instead, everything (accepting, reading requests, sending
+  // files) is done by "handler" functions that are registered with the
+  // io_service and called once the operation they are waiting on completes.
+  //
+  // A fixed pool of worker threads calls `ioService.run()`, and each thread
+  // picks up whichever handler is ready next. This means a few threads can
+  // serve thousands of clients: a client that is waiting on the network does
+  // not occupy a thread (or its stack) at all.
+  //
+  // With several listeners, each has its own io_service (and its own share
+  // of the worker threads), so that threads handling one listener's
+  // connections never contend with the others' for the io_service's queue.
+  //
+  // `run()` returns once there is no more work registered with the io_service.
+  // Since the accept handler always registers the next async_accept, this only
+  // happens after stop() closes the acceptor and all clients have gone away.
+  for (auto& listener : listeners_) {
+    Listener& listenerRef = *listener;
+    listenerRef.acceptorStrand.dispatch([this, &listenerRef]() {
+      for (auto& acceptor : listenerRef.acceptors) {
+        startAccept(listenerRef, acceptor);
+      }
+    });
+  }
+
+  // determine the number of worker threads
+  unsigned int numWorkerThreads = FLAGS_worker_threads;
+  if (numWorkerThreads == 0) {
+    numWorkerThreads = std::thread::hardware_concurrency();
+  }
+  if (numWorkerThreads == 0) {
+    // hardware_concurrency() may return 0 if it cannot determine the value
+    numWorkerThreads = 1;
+  }
+
+  // every listener needs at least one worker thread
+  numWorkerThreads = std::max<unsigned int>(
+      numWorkerThreads, listeners_.size());
+
+  // start the worker threads, spread round-robin across the listeners
+  LOG(INFO)
+      << "Starting " << numWorkerThreads << " worker thread(s) for "
+      << listeners_.size() << " acceptor(s) per endpoint";
+  LOG(INFO)
+      << "Reading files with "
+      << AsyncFileReader::getBackendName(
+             listeners_.front()->fileReader.getBackend());
+  const unsigned int numCpus =
+      std::max(std::thread::hardware_concurrency(), 1u);
+  for (unsigned int i = 0; i < numWorkerThreads; i++) {
+    auto& ioService = listeners_[i % listeners_.size()]->ioService;
+    workerThreads_.emplace_back([&ioService]() { ioService.run(); });
+    if (FLAGS_pin_worker_threads) {
+      pinThreadToCpu(workerThreads_.back(), i % numCpus);
     }
   }
 
-  return true;
+  // wait for all worker threads to exit by calling join() on each
+  //
+  // the worker threads exit once the acceptor is closed and every client
+  // connection has been cleaned up (no more handlers are waiting)
+  for (auto& workerThread : workerThreads_) {
+    workerThread.join();
+  }
+  workerThreads_.clear();
+
+  // we're done -- all client connections were closed and threads joined
+  LOG(INFO) << "Finished shutting down server";
 }
 
-void Server::handleClient(std::shared_ptr<ClientConnection> clientConn) {
-  // capture the client ID and create a string for logging
-  const auto& clientId = clientConn->clientId;
-  std::string clientIdStr = "CID=" + std::to_string(clientId) + "|";
+void Server::stop() {
+  // close the acceptors, which will cancel async_accept calls waiting on them
+  //
+  // an acceptor is not thread safe, so we post the close to its listener's
+  // strand instead of calling close() directly from the caller's thread
+  //
+  // clients are only disconnected once every acceptor has been closed, by
+  // whichever listener closes its acceptor last; otherwise, a client accepted
+  // by another listener in the meantime would never be disconnected
+  metricsServer_.stop();
+  listeners_.front()->acceptorStrand.post([this]() { drainTimer_.cancel(); });
+  const auto listenersOpen =
+      std::make_shared<std::atomic<std::size_t>>(listeners_.size());
+  for (auto& listener : listeners_) {
+    Listener& listenerRef = *listener;
+    listenerRef.acceptorStrand.post([this, &listenerRef, listenersOpen]() {
+      LOG(INFO)
+          << "Closing acceptors, canceling all pending accept operations";
+      boost::system::error_code ignoredError;
+      for (auto& acceptor : listenerRef.acceptors) {
+        acceptor.close(ignoredError);
+      }
+      LOG(INFO) << "Acceptors closed";
+      if (listenersOpen->fetch_sub(1) != 1) {
+        return;
+      }
+
+      // connections waiting for a slot are closed without being served, and
+      // the slots of the clients disconnected below aren't handed out again
+      {
+        std::lock_guard<std::mutex> guard(admissionMutex_);
+        admissionClosed_ = true;
+        connectionQueue_.clear();
+      }
 
-  // we want to make sure we clean up the connection, no matter where we return
-  // in this function (from an error, or at the end after sending the file)
+      // disconnect remaining client connections
+      //
+      // we know that we're not going to accept any more clients, so just call
+      // getConnectedClients() to get all clientIds and then call
+      // disconnectClient() for each client ID
+      LOG(INFO) << "Cleaning up client connections";
+      const auto connectedClientIds = getConnectedClients();
+      for (const auto& clientId : connectedClientIds) {
+        // call disconnect
+        CLIENT_LOG(INFO, clientId) << "Disconnecting client " << clientId;
+        disconnectClient(clientId);
+      }
+    });
+  }
+}
+
+void Server::drain(const std::chrono::milliseconds timeout) {
+  if (draining_.exchange(true)) {
+    return;
+  }
+  LOG(INFO)
+      << "Draining: no longer accepting connections, waiting up to "
+      << timeout.count() << " ms for " << clientConnections_.size()
+      << " client(s) to finish";
+
+  // disconnect whoever is left once the deadline passes
   //
-  // to accomplish this, we use BOOST_SCOPE_EXIT
-  // the logic in the SCOPE exit function will be executed when this function
-  // returns, ensuring that we cleanup
-  BOOST_SCOPE_EXIT(&clientConn, &clientIdStr, &clientId, this_) {
-    // start to disconnect the client
-    LOG(INFO) << clientIdStr << "Cleaning up for client ID " << clientId;
+  // the timer is set before any connection is closed, so that the stop()
+  // cancelling it (once the last connection is gone) is always posted after
+  auto& drainStrand = listeners_.front()->acceptorStrand;
+  drainStrand.post([this, timeout, &drainStrand]() {
+    drainTimer_.expires_after(timeout);
+    drainTimer_.async_wait(
+        drainStrand.wrap([this](const boost::system::error_code& error) {
+          if (error) {
+            return;
+          }
+          LOG(INFO)
+              << "Drain deadline passed, disconnecting "
+              << clientConnections_.size() << " remaining client(s)";
+          stop();
+        }));
+  });
 
-    // close the socket
-    // scope for lock on mutex for socket state
-    {
-      std::lock_guard<std::mutex> guard(clientConn->socketStateMutex);
-      clientConn->socket.close();
-    }
+  // stop accepting connections, and give up on the queued ones; their
+  // clients are told to retry, and will find another server (or this one,
+  // restarted)
+  std::deque<QueuedConnection> queuedConnections;
+  {
+    std::lock_guard<std::mutex> guard(admissionMutex_);
+    queuedConnections.swap(connectionQueue_);
+    connectionsRejected_ += queuedConnections.size();
+  }
+  for (auto& listener : listeners_) {
+    Listener& listenerRef = *listener;
+    listenerRef.acceptorStrand.post([&listenerRef]() {
+      boost::system::error_code ignoredError;
+      for (auto& acceptor : listenerRef.acceptors) {
+        acceptor.close(ignoredError);
+      }
+    });
+  }
+  for (auto& queuedConn : queuedConnections) {
+    Listener& listener = *queuedConn.listener;
+    const auto socket = std::make_shared<boost::asio::ip::tcp::socket>(
+        std::move(queuedConn.socket));
+    listener.acceptorStrand.post([this, &listener, socket]() {
+      ASYNC_LOG(INFO) << "Draining, turning queued connection away";
+      rejectConnection(listener, std::move(*socket));
+    });
+  }
 
-    // remove ourselves from the list of connections
-    // add it to our map of clientId -> ClientConnection object
-    {
-      std::lock_guard<std::mutex> guard(this_->clientConnectionsMutex_);
-      this_->clientConnections_.erase(clientId);
-    }
+  // close the connections that are between requests; the others are closed
+  // by finishRequest once their response has been sent
+  //
+  // a request is in progress from when processRequest accepts it until
+  // finishRequest, even while its file is being read into the cache
+  clientConnections_.forEach(
+      [this](const std::shared_ptr<ClientConnection>& clientConn) {
+        clientConn->strand.post([this, clientConn]() {
+          if (clientConn->socket.is_open() &&
+              not clientConn->requestInProgress) {
+            closeClient(clientConn);
+          }
+        });
+      });
 
-    // we're done
-    LOG(INFO) << clientIdStr << "Exiting handler for client ID " << clientId;
-  } BOOST_SCOPE_EXIT_END
+  // there may be no clients at all
+  if (clientConnections_.size() == 0) {
+    finishDrain();
+  }
+}
 
-  // log the address of the remote client
-  const auto remoteEndpoint = clientConn->socket.remote_endpoint();
-  LOG(INFO)
-      << clientIdStr
-      << "Connected to client ID "
-      << clientId
-      << " ("
-      << remoteEndpoint.address() << ":" << remoteEndpoint.port() << ")";
+bool Server::isDraining() {
+  return draining_.load();
+}
 
-  // we'll reuse the same error_code object and keep checking for errors
-  boost::system::error_code error;
+bool Server::reloadConfig(const std::string& configFile) {
+  // a SIGHUP may arrive while the terminal's `reload` is being applied; the
+  // second reload then starts from the flags the first one left
+  std::lock_guard<std::mutex> guard(reloadMutex_);
+  if (not setFlagsFromFile(configFile)) {
+    return false;
+  }
+  applyReloadableFlags();
+  LOG(INFO) << "Applied configuration from " << configFile;
+  return true;
+}
 
-  // wait for a message from the client
-  LOG(INFO) << clientIdStr << "Waiting for message from client";
-  boost::asio::streambuf rcvBuffer;
-  const auto filename =
-      readUntilDelimiter(clientConn->socket, rcvBuffer, kDelimiter, error);
-  if (error) {
-    LOG(ERROR)
-        << clientIdStr
-        << "Read error: "
-        << boost::system::system_error(error).what();
+void Server::applyReloadableFlags() {
+  // only touch the rate limits that changed, so that a reload doesn't undo
+  // the limits set for individual clients from the terminal
+  const auto defaultClientRateLimit =
+      makeRateLimit(FLAGS_client_rate_limit, FLAGS_client_burst_bytes);
+  const auto currentDefault = getDefaultClientRateLimit();
+  if (defaultClientRateLimit.bytesPerSecond != currentDefault.bytesPerSecond ||
+      defaultClientRateLimit.burstBytes != currentDefault.burstBytes) {
+    setDefaultClientRateLimit(defaultClientRateLimit);
+  }
+  const auto globalRateLimit =
+      makeRateLimit(FLAGS_global_rate_limit, FLAGS_global_burst_bytes);
+  const auto currentGlobal = getGlobalRateLimit();
+  if (globalRateLimit.bytesPerSecond != currentGlobal.bytesPerSecond ||
+      globalRateLimit.burstBytes != currentGlobal.burstBytes) {
+    setGlobalRateLimit(globalRateLimit);
+  }
+
+  fileCache_.setCapacity(FLAGS_file_cache_bytes);
+
+  // deadlines already set keep their time; the new timeouts apply from the
+  // next phase of each connection on
+  requestTimeoutMs_.store(FLAGS_request_timeout_ms);
+  writeTimeoutMs_.store(FLAGS_write_timeout_ms);
+  transferTimeoutMs_.store(FLAGS_transfer_timeout_ms);
+}
+
+void Server::finishDrain() {
+  // drain() and the last connection's closeClient may both find that no
+  // connections are left
+  if (drainFinished_.exchange(true)) {
     return;
   }
-  LOG(INFO)
-      << clientIdStr
-      << "Message received from client (should be a filename) = "
-      << filename.empty() ? ("(empty)") : filename;
+  LOG(INFO) << "All connections drained";
+  stop();
+}
 
-  // the message should be a filename for us to read from
-  std::string inputFileBuf;
-  std::ifstream inputFile(filename, std::ios::in | std::ios::binary);
-  if (inputFile.is_open()) {
-    LOG(INFO) << clientIdStr << "Opened file \"" << filename << "\"";
-    inputFileBuf = std::string(
-        std::istreambuf_iterator<char>(inputFile),
-        std::istreambuf_iterator<char>());
-  } else {
-    LOG(INFO) << clientIdStr << "Unable to open file \"" << filename << "\"";
+void Server::startAccept(
+    Listener& listener,
+    boost::asio::ip::tcp::acceptor& acceptor) {
+  // wait on a client connection
+  //
+  // the handler receives the newly connected socket; it is called from one of
+  // the listener's worker threads, wrapped in its acceptorStrand so that it
+  // never races with the close() in Server::stop()
+  ASYNC_LOG(INFO) << "Waiting for client to connect";
+  acceptor.async_accept(
+      boost::asio::bind_executor(
+          listener.acceptorStrand,
+          [this, &listener, &acceptor](
+              const boost::system::error_code& error,
+              boost::asio::ip::tcp::socket socket) {
+            handleAccept(listener, acceptor, error, std::move(socket));
+          }));
+}
+
+void Server::handleAccept(
+    Listener& listener,
+    boost::asio::ip::tcp::acceptor& acceptor,
+    const boost::system::error_code& error,
+    boost::asio::ip::tcp::socket socket) {
+  // our handler function for async_accept can be called because the acceptor
+  // was closed by Server::stop() or due to some other error
+  //
+  // check if the async_accept was cancelled or if the acceptor is closed
+  if (error == boost::asio::error::operation_aborted or
+      not acceptor.is_open()) {
+    // looks like we need to shutdown -- don't register another async_accept
+    LOG(INFO) << "cancel() called or acceptor closed, exiting accept loop";
+    return;
   }
-  inputFile.close();
 
-  // update the ClientRequestInfo structure
-  {
-    std::lock_guard<std::mutex> guard(clientConn->clientRequestInfoMutex);
-    clientConn->clientRequestInfo.filename = filename;
-    clientConn->clientRequestInfo.bytesToTransfer = inputFileBuf.size();
+  // a client that gave up before we got to accept it doesn't affect the
+  // others, so just wait for the next one
+  if (error == boost::asio::error::connection_aborted) {
+    ASYNC_LOG(INFO) << "Client disconnected before it was accepted";
+    startAccept(listener, acceptor);
+    return;
   }
 
-  // first send a message with the number of bytes in the file and a delimiter
-  sendBytes(
-      clientConn->socket,
-      std::to_string(inputFileBuf.size()) + kDelimiter, error);
+  // other errors are transient too, e.g. we ran out of file descriptors
+  // (EMFILE, ENFILE) or socket buffers (ENOBUFS); accepting again right away
+  // would most likely fail the same way, so give other connections a chance
+  // to close first, as pa2-filetransfer does
+  //
+  // the timer only keeps a reference to itself; if the acceptor is closed in
+  // the meantime, the retry finds it closed and the accept loop ends
   if (error) {
     LOG(ERROR)
-        << clientIdStr
-        << "Write error: "
-        << boost::system::system_error(error).what();
+        << "Accept error: "
+        << boost::system::system_error(error).what()
+        << ", accepting again in " << kAcceptRetryDelay.count() << " ms";
+    const auto retryTimer = std::make_shared<boost::asio::steady_timer>(
+        listener.ioService, kAcceptRetryDelay);
+    retryTimer->async_wait(boost::asio::bind_executor(
+        listener.acceptorStrand,
+        [this, &listener, &acceptor, retryTimer](
+            const boost::system::error_code&) {
+          if (not acceptor.is_open()) {
+            LOG(INFO) << "Acceptor closed, exiting accept loop";
+            return;
+          }
+          startAccept(listener, acceptor);
+        }));
     return;
   }
 
-  // then send the actual bytes in the file (no delimiter)
-  // if we weren't able to read the file, inputFileBuf will be empty
+  // a client has connected
   //
-  // we send one byte at a time to slow down the send rate...
+  // serve it if there's a free connection slot, or let it wait for one in
+  // the queue; if the queue is full too, we're overloaded, and turning the
+  // client away right now (so that it can retry later) is better than
+  // slowing down every client we're already serving
   //
-  // TODO(PA4): Add logic to rate limit based on token bucket
-  for (unsigned int i = 0; i < inputFileBuf.size(); i++) {
-    // send a single byte
-    sendBytes(clientConn->socket, inputFileBuf.substr(i, 1), error);
+  // a client accepted while the server is draining (before drain() has
+  // closed this acceptor) is turned away too, so that it retries elsewhere;
+  // draining_ is set before drain() empties the queue under admissionMutex_,
+  // so a connection can't slip into the queue after that
+  const auto acceptTime = std::chrono::steady_clock::now();
+  metrics_.increment(CounterMetric::kConnectionsAccepted);
+  bool admitted = false;
+  bool queued = false;
+  const bool draining = draining_.load();
+  {
+    std::lock_guard<std::mutex> guard(admissionMutex_);
+    if (draining) {
+      connectionsRejected_++;
+    } else if (FLAGS_max_connections == 0 ||
+               activeConnections_ < FLAGS_max_connections) {
+      activeConnections_++;
+      admitted = true;
+    } else if (connectionQueue_.size() < FLAGS_connection_queue_length) {
+      connectionQueue_.push_back({&listener, std::move(socket), acceptTime});
+      connectionsQueued_++;
+      queued = true;
+    } else {
+      connectionsRejected_++;
+    }
+  }
+  if (admitted) {
+    startConnection(listener, std::move(socket), acceptTime);
+  } else if (queued) {
+    ASYNC_LOG(INFO) << "All connection slots taken, queued new connection";
+  } else if (draining) {
+    ASYNC_LOG(INFO) << "Draining, turning new connection away";
+    rejectConnection(listener, std::move(socket));
+  } else {
+    ASYNC_LOG(INFO) << "Connection queue is full, turning new connection away";
+    rejectConnection(listener, std::move(socket));
+  }
 
-    // check for errors -- socket might have been closed while we were writing
-    if (error) {
-      LOG(ERROR)
-          << clientIdStr
-          << "Write error: "
-          << boost::system::system_error(error).what();
-      return;
+  // wait for the next client, unless drain() is about to close the acceptor
+  if (not draining) {
+    startAccept(listener, acceptor);
+  }
+}
+
+void Server::startConnection(
+    Listener& listener,
+    boost::asio::ip::tcp::socket socket,
+    const std::chrono::steady_clock::time_point acceptTime) {
+  // determine the client's ID and get a ClientConnection object
+  //
+  // we use a shared_ptr so that the connection's handlers and the server can
+  // all have access to the ClientConnection object and its socket; each
+  // pending handler holds a reference, so the object goes back to the
+  // listener's pool as soon as the last handler for the connection finishes,
+  // and is reused from there for a later connection
+  const auto clientId = getNextClientID();
+  const auto rateLimit = getDefaultClientRateLimit();
+  const auto clientConn = listener.connectionPool.acquire(
+      [&]() {
+        return new ClientConnection(
+            clientId, listener.ioService, listener.fileReader,
+            std::move(socket), rateLimit, acceptTime);
+      },
+      [&](ClientConnection& pooledConn) {
+        pooledConn.reset(clientId, std::move(socket), rateLimit, acceptTime);
+      });
+  egressScheduler_.setWeight(
+      clientConn->egressFlow, defaultClientWeight_.load());
+  egressScheduler_.setIoService(clientConn->egressFlow, listener.ioService);
+  CLIENT_LOG(INFO, clientId)
+      << "Processing new client connection, client ID = " << clientId;
+
+  // add it to our map of clientId -> ClientConnection object
+  clientConnections_.insert(clientId, clientConn);
+
+  // start handling the client on its strand
+  clientConn->strand.dispatch([this, clientConn]() {
+    handleClient(clientConn);
+  });
+}
+
+void Server::releaseConnectionSlot() {
+  // hand the slot straight to the connection that has waited the longest,
+  // unless the server is shutting down or draining (drain() turns the queued
+  // connections away itself)
+  //
+  // the connection is still handled by the listener that accepted it, whose
+  // io_service its socket belongs to
+  std::optional<QueuedConnection> nextConn;
+  {
+    std::lock_guard<std::mutex> guard(admissionMutex_);
+    if (not admissionClosed_ && not draining_.load() &&
+        not connectionQueue_.empty()) {
+      nextConn.emplace(std::move(connectionQueue_.front()));
+      connectionQueue_.pop_front();
+    } else {
+      activeConnections_--;
     }
+  }
+  if (nextConn) {
+    startConnection(
+        *nextConn->listener, std::move(nextConn->socket),
+        nextConn->acceptTime);
+  }
+}
+
+void Server::rejectConnection(
+    Listener& listener,
+    boost::asio::ip::tcp::socket socket) {
+  const auto rejectedConn = std::make_shared<RejectedConnection>(
+      listener.ioService, std::move(socket));
+  rejectedConn->response =
+      formatBusyResponse(FLAGS_busy_retry_after_ms) + kDelimiter;
+
+  // the handlers below run on the listener's acceptorStrand, since they're
+  // short and a strand of their own would only add to what every rejection
+  // costs
+  boost::asio::async_write(
+      rejectedConn->socket,
+      boost::asio::buffer(rejectedConn->response),
+      listener.acceptorStrand.wrap(
+          [this, &listener, rejectedConn](
+              const boost::system::error_code& error, const std::size_t) {
+            boost::system::error_code ignoredError;
+            if (error) {
+              rejectedConn->socket.close(ignoredError);
+              return;
+            }
+
+            // tell the client we're done, then give it a moment to close
+            // the connection on its side
+            rejectedConn->socket.shutdown(
+                boost::asio::ip::tcp::socket::shutdown_send, ignoredError);
+            rejectedConn->lingerTimer.expires_after(kRejectLingerTime);
+            rejectedConn->lingerTimer.async_wait(
+                listener.acceptorStrand.wrap(
+                    [rejectedConn](const boost::system::error_code&) {
+                      boost::system::error_code ignoredError;
+                      rejectedConn->socket.close(ignoredError);
+                    }));
+            discardUntilClosed(listener, rejectedConn);
+          }));
+}
+
+void Server::discardUntilClosed(
+    Listener& listener,
+    std::shared_ptr<RejectedConnection> rejectedConn) {
+  rejectedConn->socket.async_read_some(
+      boost::asio::buffer(rejectedConn->discardBuffer),
+      listener.acceptorStrand.wrap(
+          [this, &listener, rejectedConn](
+              const boost::system::error_code& error, const std::size_t) {
+            // end of file once the client closes the connection, or an
+            // error once the linger timer closed it
+            if (error) {
+              boost::system::error_code ignoredError;
+              rejectedConn->socket.close(ignoredError);
+              rejectedConn->lingerTimer.cancel();
+              return;
+            }
+            discardUntilClosed(listener, rejectedConn);
+          }));
+}
+
+std::vector<int> Server::getConnectedClients() {
+  return clientConnections_.getClientIds();
+}
 
-    // update the ClientRequestInfo structure
+std::map<int, ClientRequestInfo> Server::getConnectedClientsWithInfo() {
+  // snapshot each client's published request information
+  //
+  // the registry only locks one shard at a time while copying pointers, so
+  // this doesn't block clients from connecting or disconnecting; the progress
+  // counters are read through a SeqLock, which never blocks the client's
+  // handlers, and the filename mutex is only taken when a request arrives
+  std::map<int, ClientRequestInfo> clientIdToRequestInfo;
+  for (const auto& clientConn : clientConnections_.getAll()) {
+    auto& requestInfo = clientIdToRequestInfo[clientConn->clientId];
     {
-      std::lock_guard<std::mutex> guard(clientConn->clientRequestInfoMutex);
-      clientConn->clientRequestInfo.bytesTransferred++;
+      std::lock_guard<std::mutex> guard(clientConn->publishedFilenameMutex);
+      requestInfo.filename = clientConn->publishedFilename;
     }
+    const auto progress = clientConn->publishedProgress.load();
+    requestInfo.offset = progress.offset;
+    requestInfo.bytesTransferred = progress.bytesTransferred;
+    requestInfo.bytesToTransfer = progress.bytesToTransfer;
+    requestInfo.compressed = progress.compressed;
+    requestInfo.compressedBytesSent = progress.compressedBytesSent;
+  }
+  return clientIdToRequestInfo;
+}
+
+bool Server::disconnectClient(const int clientId) {
+  // try to find a ClientConnection for the given clientId
+  const auto clientConn = clientConnections_.find(clientId);
 
-    // wait before sending the next byte
-    std::this_thread::sleep_for(std::chrono::milliseconds(FLAGS_send_delay_ms));
+  // we cannot find a ClientConnection for the given clientId
+  if (not clientConn) {
+      return false;
   }
-  LOG(INFO)
-      << clientIdStr
-      << "Sent header + " << inputFileBuf.size()
-      << " bytes of data to client";
 
-  // our BOOST_SCOPE_EXIT will clean up
+  // found a ClientConnection, call shutdown
+  //
+  // the socket and timer are only touched from within the connection's strand,
+  // so post the shutdown there; any pending operation then completes with an
+  // error and the connection's handlers clean up
+  clientConn->strand.post([this, clientConn]() {
+    // it's possible the socket has already been closed, so check first
+    if (clientConn->socket.is_open()) {
+      boost::system::error_code ignoredError;
+      clientConn->socket.shutdown(
+          boost::asio::ip::tcp::socket::shutdown_both, ignoredError);
+    }
+    clientConn->sendTimer.cancel();
+
+    // a client waiting for its turn with the egress scheduler is woken up
+    // right away too
+    const auto wakeup = egressScheduler_.cancel(clientConn->egressFlow);
+    if (wakeup) {
+      wakeup();
+    }
+  });
+
+  return true;
+}
+
+RateLimit Server::getDefaultClientRateLimit() {
+  std::lock_guard<std::mutex> guard(defaultClientRateLimitMutex_);
+  return defaultClientRateLimit_;
+}
+
+void Server::setDefaultClientRateLimit(const RateLimit& rateLimit) {
+  {
+    std::lock_guard<std::mutex> guard(defaultClientRateLimitMutex_);
+    defaultClientRateLimit_ = rateLimit;
+  }
+
+  // apply the new limit to clients that are already connected
+  clientConnections_.forEach(
+      [&rateLimit](const std::shared_ptr<ClientConnection>& clientConn) {
+        clientConn->tokenBucket.setRateLimit(rateLimit);
+      });
+}
+
+bool Server::setClientRateLimit(
+    const int clientId, const RateLimit& rateLimit) {
+  // try to find a ClientConnection for the given clientId
+  const auto clientConn = clientConnections_.find(clientId);
+  if (not clientConn) {
+    return false;
+  }
+
+  // the token bucket is thread safe; a client that is currently waiting for
+  // tokens picks up the new rate the next time its timer fires
+  clientConn->tokenBucket.setRateLimit(rateLimit);
+  return true;
+}
+
+uint64_t Server::getDefaultClientWeight() {
+  return defaultClientWeight_.load();
+}
+
+void Server::setDefaultClientWeight(const uint64_t weight) {
+  defaultClientWeight_.store(std::max<uint64_t>(weight, 1));
+
+  // apply the new weight to clients that are already connected
+  clientConnections_.forEach(
+      [this, weight](const std::shared_ptr<ClientConnection>& clientConn) {
+        egressScheduler_.setWeight(clientConn->egressFlow, weight);
+      });
+}
+
+bool Server::setClientWeight(const int clientId, const uint64_t weight) {
+  // try to find a ClientConnection for the given clientId
+  const auto clientConn = clientConnections_.find(clientId);
+  if (not clientConn) {
+    return false;
+  }
+
+  // a client that is currently waiting for its turn gets the new share from
+  // its next turn on
+  egressScheduler_.setWeight(clientConn->egressFlow, weight);
+  return true;
+}
+
+EgressPolicy Server::getEgressPolicy() {
+  return egressScheduler_.getPolicy();
+}
+
+EgressStats Server::getEgressStats() {
+  return egressScheduler_.getStats();
+}
+
+RateLimit Server::getGlobalRateLimit() {
+  return globalTokenBucket_.getRateLimit();
+}
+
+void Server::setGlobalRateLimit(const RateLimit& rateLimit) {
+  globalTokenBucket_.setRateLimit(rateLimit);
+}
+
+AdmissionStats Server::getAdmissionStats() {
+  AdmissionStats stats;
+  stats.maxConnections = FLAGS_max_connections;
+  stats.maxQueuedConnections = FLAGS_connection_queue_length;
+  std::lock_guard<std::mutex> guard(admissionMutex_);
+  stats.activeConnections = activeConnections_;
+  stats.queuedConnections = connectionQueue_.size();
+  stats.connectionsQueued = connectionsQueued_;
+  stats.connectionsRejected = connectionsRejected_;
+  return stats;
+}
+
+PoolStats Server::getConnectionPoolStats() {
+  PoolStats stats;
+  for (const auto& listener : listeners_) {
+    const auto listenerStats = listener->connectionPool.getStats();
+    stats.allocated += listenerStats.allocated;
+    stats.reused += listenerStats.reused;
+    stats.idle += listenerStats.idle;
+  }
+  return stats;
+}
+
+PoolStats Server::getStreamBufferPoolStats() {
+  return streamBufferPool_.getStats();
+}
+
+FileCacheStats Server::getFileCacheStats() {
+  return fileCache_.getStats();
+}
+
+void Server::handleClient(std::shared_ptr<ClientConnection> clientConn) {
+  // capture the client ID and create a string for logging
+  const auto& clientId = clientConn->clientId;
+  const std::string clientIdStr = "CID=" + std::to_string(clientId) + "|";
+
+  // log the address of the remote client
+  boost::system::error_code error;
+  const auto remoteEndpoint = clientConn->socket.remote_endpoint(error);
+  if (error) {
+    CLIENT_LOG(ERROR, clientConn->clientId)
+        << clientIdStr
+        << "Unable to get remote endpoint: "
+        << boost::system::system_error(error).what();
+    closeClient(clientConn);
+    return;
+  }
+  CLIENT_LOG(INFO, clientId)
+      << clientIdStr
+      << "Connected to client ID "
+      << clientId
+      << " ("
+      << remoteEndpoint.address() << ":" << remoteEndpoint.port() << ")";
+
+  // header and body are coalesced into as few writes as possible, so Nagle's
+  // algorithm would only ever delay the tail of a response
+  if (FLAGS_tcp_nodelay) {
+    clientConn->socket.set_option(
+        boost::asio::ip::tcp::no_delay(true), error);
+    if (error) {
+      CLIENT_LOG(ERROR, clientConn->clientId)
+          << clientIdStr
+          << "Unable to set TCP_NODELAY: "
+          << boost::system::system_error(error).what();
+    }
+  }
+
+  // the client has request_timeout_ms to send its first request, however it
+  // trickles in
+  setDeadline(
+      clientConn, clientConn->requestDeadline,
+      std::chrono::milliseconds(requestTimeoutMs_.load()));
+  detectFraming(clientConn);
+}
+
+void Server::detectFraming(std::shared_ptr<ClientConnection> clientConn) {
+  // a client asking for binary framing sends a kHello frame as its very first
+  // bytes, so wait for the first byte to arrive and check it, see SocketUtils.h
+  //
+  // the bytes read stay in rcvBuffer for the first request
+  boost::asio::async_read(
+      clientConn->socket, clientConn->rcvBuffer,
+      boost::asio::transfer_at_least(1),
+      clientConn->strand.wrap(
+          [this, clientConn](
+              const boost::system::error_code& error, const std::size_t) {
+            if (error) {
+              handleReadError(clientConn, error);
+              return;
+            }
+            clientConn->binaryFraming =
+                static_cast<uint8_t>(peekBytes(clientConn->rcvBuffer, 1)[0]) ==
+                static_cast<uint8_t>(FrameType::kHello);
+            if (clientConn->binaryFraming) {
+              CLIENT_LOG(INFO, clientConn->clientId)
+                  << "CID=" << clientConn->clientId << "|"
+                  << "Client is using binary framing";
+            }
+            readRequest(clientConn);
+          }));
+}
+
+void Server::readRequest(std::shared_ptr<ClientConnection> clientConn) {
+  // a draining server still answers the requests it has received (pipelined
+  // behind the one just answered), but doesn't wait for more
+  if (draining_.load() && not hasBufferedRequest(clientConn)) {
+    closeClient(clientConn);
+    return;
+  }
+
+  // the deadline for the request is only set once, so bytes trickling in
+  // don't extend it
+  if (clientConn->requestDeadline == kNoDeadline) {
+    setDeadline(
+        clientConn, clientConn->requestDeadline,
+        std::chrono::milliseconds(requestTimeoutMs_.load()));
+  }
+  if (clientConn->binaryFraming) {
+    readFrame(clientConn);
+    return;
+  }
+
+  // wait for a message from the client
+  //
+  // the handler is wrapped in the connection's strand and holds a reference to
+  // the ClientConnection, keeping it alive until the read completes
+  //
+  // if the client pipelined several requests, the next one may already be in
+  // rcvBuffer (read past the previous delimiter); async_read_until checks the
+  // buffer before reading from the socket, so it completes right away
+  //
+  // rcvBuffer is bounded, so a client that keeps sending without a delimiter
+  // fills it and the read fails with not_found, see handleRequest
+  CLIENT_LOG(INFO, clientConn->clientId)
+      << "CID=" << clientConn->clientId << "|"
+      << "Waiting for message from client";
+  boost::asio::async_read_until(
+      clientConn->socket, clientConn->rcvBuffer, kDelimiter,
+      clientConn->strand.wrap(
+          [this, clientConn](
+              const boost::system::error_code& error,
+              const std::size_t bytesTransferred) {
+            handleRequest(clientConn, error, bytesTransferred);
+          }));
+}
+
+bool Server::hasBufferedRequest(
+    std::shared_ptr<ClientConnection> clientConn) {
+  const auto& rcvBuffer = clientConn->rcvBuffer;
+  if (not clientConn->binaryFraming) {
+    return peekBytes(rcvBuffer, rcvBuffer.size()).find(kDelimiter) !=
+        std::string_view::npos;
+  }
+  FrameHeader header;
+  return rcvBuffer.size() >= kFrameHeaderBytes &&
+      decodeFrameHeader(peekBytes(rcvBuffer, kFrameHeaderBytes), header) &&
+      rcvBuffer.size() >= kFrameHeaderBytes + header.length;
+}
+
+void Server::handleRequest(
+    std::shared_ptr<ClientConnection> clientConn,
+    const boost::system::error_code& error,
+    const std::size_t bytesTransferred) {
+  if (error == boost::asio::error::not_found) {
+    CLIENT_LOG(ERROR, clientConn->clientId)
+        << "CID=" << clientConn->clientId << "|"
+        << "Request too large (no delimiter in "
+        << clientConn->rcvBuffer.size() << " bytes)";
+    closeClient(clientConn);
+    return;
+  }
+  if (error) {
+    handleReadError(clientConn, error);
+    return;
+  }
+
+  // extract the request from the buffer, see peekUntilDelimiter
+  auto& rcvBuffer = clientConn->rcvBuffer;
+  const auto messageView =
+      peekBytes(rcvBuffer, bytesTransferred - kDelimiter.length());
+  clientConn->requestMessage.assign(messageView.data(), messageView.size());
+  rcvBuffer.consume(bytesTransferred);
+  processRequest(clientConn, clientConn->requestMessage);
+}
+
+void Server::readFrame(std::shared_ptr<ClientConnection> clientConn) {
+  const std::string clientIdStr =
+      "CID=" + std::to_string(clientConn->clientId) + "|";
+
+  // wait until rcvBuffer holds the next frame's header, and then its payload
+  //
+  // the header has a fixed size and says how long the payload is, so we know
+  // exactly how many bytes to wait for; if the client pipelined its requests,
+  // the whole frame may already be in the buffer
+  auto& rcvBuffer = clientConn->rcvBuffer;
+  FrameHeader header;
+  std::size_t frameBytes = kFrameHeaderBytes;
+  if (rcvBuffer.size() >= kFrameHeaderBytes) {
+    if (not decodeFrameHeader(
+            peekBytes(rcvBuffer, kFrameHeaderBytes), header)) {
+      CLIENT_LOG(ERROR, clientConn->clientId)
+          << clientIdStr << "Invalid frame header";
+      closeClient(clientConn);
+      return;
+    }
+    if (header.length > kMaxRequestFrameBytes) {
+      CLIENT_LOG(ERROR, clientConn->clientId)
+          << clientIdStr
+          << "Frame payload too large (" << header.length << " bytes)";
+      closeClient(clientConn);
+      return;
+    }
+    frameBytes += header.length;
+  }
+  if (rcvBuffer.size() < frameBytes) {
+    if (rcvBuffer.size() == 0) {
+      CLIENT_LOG(INFO, clientConn->clientId)
+          << clientIdStr << "Waiting for message from client";
+    }
+    boost::asio::async_read(
+        clientConn->socket, rcvBuffer,
+        boost::asio::transfer_at_least(frameBytes - rcvBuffer.size()),
+        clientConn->strand.wrap(
+            [this, clientConn](
+                const boost::system::error_code& error, const std::size_t) {
+              if (error) {
+                handleReadError(clientConn, error);
+                return;
+              }
+              readFrame(clientConn);
+            }));
+    return;
+  }
+
+  // we have the whole frame, take it out of the buffer
+  rcvBuffer.consume(kFrameHeaderBytes);
+  const auto payloadView = peekBytes(rcvBuffer, header.length);
+  clientConn->requestMessage.assign(payloadView.data(), payloadView.size());
+  rcvBuffer.consume(header.length);
+
+  switch (header.type) {
+    case FrameType::kHello: {
+      // acknowledge the client's request for binary framing
+      //
+      // the frame is a shared_ptr so that it stays alive until the write
+      // finishes
+      FrameHeader helloHeader;
+      helloHeader.type = FrameType::kHello;
+      const auto hello = std::make_shared<EncodedFrameHeader>();
+      encodeFrameHeader(helloHeader, *hello);
+      setDeadline(
+          clientConn, clientConn->writeDeadline,
+          std::chrono::milliseconds(writeTimeoutMs_.load()));
+      boost::asio::async_write(
+          clientConn->socket, boost::asio::buffer(*hello),
+          clientConn->strand.wrap(
+              [this, clientConn, clientIdStr, hello](
+                  const boost::system::error_code& error, const std::size_t) {
+                if (error) {
+                  CLIENT_LOG(ERROR, clientConn->clientId)
+                      << clientIdStr
+                      << "Write error: "
+                      << boost::system::system_error(error).what();
+                  closeClient(clientConn);
+                  return;
+                }
+                clientConn->writeDeadline = kNoDeadline;
+                readFrame(clientConn);
+              }));
+      return;
+    }
+    case FrameType::kRequest:
+      clientConn->requestId = header.requestId;
+      processRequest(clientConn, clientConn->requestMessage);
+      return;
+    default:
+      CLIENT_LOG(ERROR, clientConn->clientId)
+          << clientIdStr
+          << "Unexpected frame type "
+          << static_cast<int>(static_cast<uint8_t>(header.type));
+      closeClient(clientConn);
+      return;
+  }
+}
+
+void Server::setDeadline(
+    std::shared_ptr<ClientConnection> clientConn,
+    std::chrono::steady_clock::time_point& deadline,
+    const std::chrono::milliseconds timeout) {
+  if (timeout.count() == 0) {
+    deadline = kNoDeadline;
+    return;
+  }
+  deadline = std::chrono::steady_clock::now() + timeout;
+  armDeadlineTimer(clientConn);
+}
+
+void Server::armDeadlineTimer(std::shared_ptr<ClientConnection> clientConn) {
+  const auto deadline = std::min(
+      {clientConn->requestDeadline,
+       clientConn->writeDeadline,
+       clientConn->transferDeadline});
+  if (deadline >= clientConn->deadlineTimerExpiry) {
+    return;
+  }
+
+  // setting the expiry cancels the wait that's pending, if any, whose
+  // handler then sees operation_aborted
+  clientConn->deadlineTimerExpiry = deadline;
+  clientConn->deadlineTimer.expires_at(deadline);
+  clientConn->deadlineTimer.async_wait(
+      clientConn->strand.wrap(
+          [this, clientConn](const boost::system::error_code& error) {
+            if (error == boost::asio::error::operation_aborted) {
+              return;
+            }
+            checkDeadlines(clientConn);
+          }));
+}
+
+void Server::checkDeadlines(std::shared_ptr<ClientConnection> clientConn) {
+  if (not clientConn->socket.is_open()) {
+    return;
+  }
+  clientConn->deadlineTimerExpiry = kNoDeadline;
+
+  // the timer expires at the earliest deadline there was when it was set, so
+  // the deadlines may have moved back (or been cleared) since
+  const auto now = std::chrono::steady_clock::now();
+  const char* waitingFor = nullptr;
+  auto metric = CounterMetric::kRequestTimeouts;
+  if (clientConn->requestDeadline <= now) {
+    waitingFor = "a request";
+  } else if (clientConn->writeDeadline <= now) {
+    waitingFor = "the client to accept a chunk of the response";
+    metric = CounterMetric::kWriteTimeouts;
+  } else if (clientConn->transferDeadline <= now) {
+    waitingFor = "the response to be sent";
+    metric = CounterMetric::kTransferTimeouts;
+  }
+  if (not waitingFor) {
+    armDeadlineTimer(clientConn);
+    return;
+  }
+
+  metrics_.increment(metric);
+  CLIENT_LOG(WARNING, clientConn->clientId)
+      << "CID=" << clientConn->clientId << "|"
+      << "Timed out waiting for " << waitingFor << ", closing connection";
+  closeClient(clientConn);
+}
+
+void Server::handleReadError(
+    std::shared_ptr<ClientConnection> clientConn,
+    const boost::system::error_code& error) {
+  const std::string clientIdStr =
+      "CID=" + std::to_string(clientConn->clientId) + "|";
+  if (error == boost::asio::error::eof && clientConn->rcvBuffer.size() == 0) {
+    // the client closed the connection between requests, which is how a
+    // client using a persistent connection tells us that it is done
+    CLIENT_LOG(INFO, clientConn->clientId)
+        << clientIdStr << "Client closed connection";
+  } else if (error == boost::asio::error::operation_aborted) {
+    // closeClient closed the socket while the read was pending (say, because
+    // the client missed its deadline), and has already said why
+  } else {
+    CLIENT_LOG(ERROR, clientConn->clientId)
+        << clientIdStr
+        << "Read error: "
+        << boost::system::system_error(error).what();
+  }
+  closeClient(clientConn);
+}
+
+void Server::processRequest(
+    std::shared_ptr<ClientConnection> clientConn,
+    const std::string& message) {
+  const std::string clientIdStr =
+      "CID=" + std::to_string(clientConn->clientId) + "|";
+  CLIENT_LOG(INFO, clientConn->clientId)
+      << clientIdStr
+      << "Message received from client (should be a filename) = "
+      << (message.empty() ? "(empty)" : message);
+
+  // the request is in; from now on, the response has to get through
+  clientConn->requestInProgress = true;
+  clientConn->requestDeadline = kNoDeadline;
+  setDeadline(
+      clientConn, clientConn->transferDeadline,
+      std::chrono::milliseconds(transferTimeoutMs_.load()));
+
+  // the message may carry a byte range after the filename, see FileRequest
+  //
+  // a malformed range is answered like a file that doesn't exist
+  FileRequest request;
+  const bool validRequest = parseFileRequest(message, request);
+  if (not validRequest) {
+    CLIENT_LOG(INFO, clientConn->clientId)
+        << clientIdStr << "Invalid byte range in request";
+  }
+  const auto& filename = request.filename;
+
+  // the message should be a filename for us to read from
+  //
+  // we never read the whole file into memory; in zero copy mode the kernel
+  // copies the file's bytes directly from the page cache to the socket as we
+  // send them, otherwise we read the file one window at a time into a buffer
+  // that is reused for the whole transfer
+  //
+  // either way, memory used per client stays constant no matter how big the
+  // requested file is
+  //
+  // small files are served from the server's file cache instead, so clients
+  // requesting the same hot file share a single copy in memory
+  //
+  // a file that has to be read into the cache first (or compressed for it)
+  // is handed to cacheFillPool_, since either could keep this thread from
+  // serving its other clients for a while; the response is started once
+  // that's done, within the connection's strand
+  const auto openStartTime = std::chrono::steady_clock::now();
+  std::shared_ptr<const CachedFile> file;
+  bool needsFill = false;
+  if (validRequest) {
+    clientConn->cachedFile =
+        lookUpCachedFile(request, file, false, needsFill);
+  }
+  if (needsFill) {
+    CLIENT_LOG(INFO, clientConn->clientId)
+        << clientIdStr << "Reading file \"" << filename << "\" into cache";
+    boost::asio::post(
+        cacheFillPool_,
+        [this, clientConn, request, openStartTime,
+         file = std::move(file)]() mutable {
+          bool needsFill = false;
+          auto cachedFile = lookUpCachedFile(request, file, true, needsFill);
+          clientConn->strand.post(
+              [this, clientConn, request, openStartTime,
+               cachedFile = std::move(cachedFile)]() mutable {
+                // the connection may have been closed in the meantime
+                if (not clientConn->socket.is_open()) {
+                  return;
+                }
+                clientConn->cachedFile = std::move(cachedFile);
+                startResponse(clientConn, request, true, openStartTime);
+              });
+        });
+    return;
+  }
+  startResponse(clientConn, request, validRequest, openStartTime);
+}
+
+std::shared_ptr<const CachedFile> Server::lookUpCachedFile(
+    const FileRequest& request,
+    std::shared_ptr<const CachedFile>& file,
+    const bool fill,
+    bool& needsFill) {
+  // only look the file's contents up if an earlier call didn't find them;
+  // looking them up again would count the request twice
+  needsFill = false;
+  if (not file) {
+    file = fill ? fileCache_.get(request.filename)
+                : fileCache_.find(request.filename, needsFill);
+  }
+  if (file && sendsCompressedCopy(request, file->size)) {
+    auto compressedFile = fill
+        ? fileCache_.getCompressed(
+              request.filename, file, FLAGS_compression_level)
+        : fileCache_.findCompressed(request.filename, file, needsFill);
+    if (compressedFile) {
+      return compressedFile;
+    }
+  }
+  return needsFill ? nullptr : file;
+}
+
+void Server::startResponse(
+    std::shared_ptr<ClientConnection> clientConn,
+    const FileRequest& request,
+    const bool validRequest,
+    const std::chrono::steady_clock::time_point openStartTime) {
+  const std::string clientIdStr =
+      "CID=" + std::to_string(clientConn->clientId) + "|";
+  const auto& filename = request.filename;
+  uint64_t fileSize = 0;
+  if (clientConn->cachedFile) {
+    CLIENT_LOG(INFO, clientConn->clientId)
+        << clientIdStr << "Found file \"" << filename << "\" in cache";
+    fileSize = clientConn->cachedFile->size;
+  } else if (validRequest && clientConn->inputFile.open(filename)) {
+    CLIENT_LOG(INFO, clientConn->clientId)
+        << clientIdStr << "Opened file \"" << filename << "\"";
+    fileSize = clientConn->inputFile.getSize();
+  } else {
+    CLIENT_LOG(INFO, clientConn->clientId)
+        << clientIdStr << "Unable to open file \"" << filename << "\"";
+  }
+  clientConn->responseStartTime = std::chrono::steady_clock::now();
+  metrics_.recordDuration(
+      HistogramMetric::kFileOpen,
+      clientConn->responseStartTime - openStartTime);
+
+  // clamp the requested range to the file; a range starting past the end of
+  // the file is answered with zero bytes
+  const auto offset = std::min(request.offset, fileSize);
+  const auto rangeBytes = std::min(request.length, fileSize - offset);
+  if (request.hasRange) {
+    CLIENT_LOG(INFO, clientConn->clientId)
+        << clientIdStr
+        << "Sending " << rangeBytes << " bytes starting at offset " << offset;
+  }
+
+  // compress the response if the client asked for it (and there's anything
+  // to compress)
+  //
+  // if the whole file is in the cache, the cache's compressed copy of it was
+  // looked up along with it (see lookUpCachedFile), so that it is only
+  // compressed once no matter how many clients ask for it; otherwise,
+  // compress the range as we send it
+  clientConn->compressResponse =
+      FLAGS_compression && request.compress && rangeBytes > 0;
+  if (clientConn->compressResponse) {
+    if (not clientConn->cachedFile || not clientConn->cachedFile->compressed) {
+      if (not clientConn->compressor) {
+        clientConn->compressor.reset(
+            new Compressor(FLAGS_compression_level));
+      }
+      clientConn->compressor->reset();
+    }
+    clientConn->compressedChunk.clear();
+    clientConn->compressedChunkBytesSent = 0;
+    clientConn->bytesCompressed = 0;
+    clientConn->compressedDataOffset = 0;
+    clientConn->compressionFinished = false;
+    CLIENT_LOG(INFO, clientConn->clientId)
+        << clientIdStr << "Compressing response"
+        << (clientConn->cachedFile && clientConn->cachedFile->compressed
+                ? " (from cache)" : "");
+  }
+
+  // follow the response with a checksum if the client asked for it
+  //
+  // the checksum of a whole cached file was computed when it was cached;
+  // otherwise the bytes are checksummed as they are sent, which means they
+  // have to pass through memory, so a file that isn't cached is streamed
+  // instead of being sent with sendfile
+  clientConn->sendChecksum =
+      FLAGS_checksums && request.checksum &&
+      (clientConn->cachedFile || clientConn->inputFile.isOpen());
+  clientConn->checksumFromCache =
+      clientConn->sendChecksum && clientConn->cachedFile &&
+      rangeBytes == fileSize;
+  clientConn->checksum =
+      clientConn->checksumFromCache ? clientConn->cachedFile->checksum : 0;
+  clientConn->responseTrailer.clear();
+  clientConn->responseTrailerBytesSent = 0;
+
+  clientConn->streamFile =
+      (not FLAGS_zero_copy || clientConn->sendChecksum) &&
+      not clientConn->cachedFile;
+  if (clientConn->streamFile ||
+      (clientConn->compressResponse && not clientConn->cachedFile)) {
+    streamBufferPool_.acquire(clientConn->streamBuffer);
+    clientConn->streamBufferOffset = 0;
+    clientConn->streamBufferBytes = 0;
+  }
+
+  // update the ClientRequestInfo structure
+  clientConn->clientRequestInfo.filename = filename;
+  clientConn->clientRequestInfo.offset = offset;
+  clientConn->clientRequestInfo.bytesTransferred = 0;
+  clientConn->clientRequestInfo.bytesToTransfer = rangeBytes;
+  clientConn->clientRequestInfo.compressed = clientConn->compressResponse;
+  clientConn->clientRequestInfo.compressedBytesSent = 0;
+  {
+    std::lock_guard<std::mutex> guard(clientConn->publishedFilenameMutex);
+    clientConn->publishedFilename = filename;
+  }
+  publishRequestProgress(clientConn);
+
+  // the response starts with a header with the number of bytes we're sending
+  // and a delimiter; for byte range requests, the size of the whole file
+  // follows
+  //
+  // with binary framing, the header is a kResponse frame header instead (or a
+  // kError frame if we couldn't open the file), and for byte range requests
+  // the payload starts with the size of the whole file
+  //
+  // compressed responses are marked in the header, and the file's bytes
+  // follow it in chunks instead (see FileRequest and SocketUtils.h)
+  //
+  // sendFileBytes sends it along with the first bytes of the file
+  if (clientConn->binaryFraming) {
+    const bool foundFile =
+        clientConn->cachedFile || clientConn->inputFile.isOpen();
+    FrameHeader header;
+    header.type = foundFile ? FrameType::kResponse : FrameType::kError;
+    header.requestId = clientConn->requestId;
+    if (foundFile && request.hasRange) {
+      header.flags = kFrameFlagFileSize;
+      header.length = sizeof(uint64_t);
+    }
+    if (clientConn->compressResponse) {
+      header.flags |= kFrameFlagCompressed;
+      header.length += sizeof(uint64_t);
+    } else {
+      header.length += rangeBytes;
+    }
+    if (clientConn->sendChecksum) {
+      header.flags |= kFrameFlagChecksum;
+    }
+    clientConn->responseHeader.clear();
+    appendFrameHeader(clientConn->responseHeader, header);
+    if (header.flags & kFrameFlagFileSize) {
+      appendUint64(clientConn->responseHeader, fileSize);
+    }
+    if (header.flags & kFrameFlagCompressed) {
+      appendUint64(clientConn->responseHeader, rangeBytes);
+    }
+  } else {
+    clientConn->responseHeader.clear();
+    clientConn->responseHeader += std::to_string(rangeBytes);
+    if (request.hasRange) {
+      clientConn->responseHeader += "/" + std::to_string(fileSize);
+    }
+    if (clientConn->compressResponse) {
+      clientConn->responseHeader += ";zstd";
+    }
+    if (clientConn->sendChecksum) {
+      clientConn->responseHeader += ";crc32c";
+    }
+    clientConn->responseHeader += kDelimiter;
+  }
+  clientConn->responseHeaderBytesSent = 0;
+
+  // while corked, partial segments are held back until the response is done
+  if (FLAGS_tcp_cork) {
+    boost::system::error_code error;
+    setTcpCork(clientConn->socket, true, error);
+    if (error) {
+      CLIENT_LOG(ERROR, clientConn->clientId)
+          << clientIdStr
+          << "Unable to set TCP_CORK: "
+          << boost::system::system_error(error).what();
+    }
+  }
+  sendFileBytes(clientConn);
+}
+
+void Server::sendFileBytes(std::shared_ptr<ClientConnection> clientConn) {
+  const std::string clientIdStr =
+      "CID=" + std::to_string(clientConn->clientId) + "|";
+
+  // compressed responses have their own framing, see sendCompressedBytes
+  if (clientConn->compressResponse) {
+    sendCompressedBytes(clientConn);
+    return;
+  }
+
+  // then send the actual bytes in the file (no delimiter)
+  // if we weren't able to open the file, bytesToTransfer will be zero
+  //
+  // only handlers for this connection access clientRequestInfo, and they are
+  // serialized by the strand, so we can read it without holding a lock
+  const auto bytesTransferred =
+      clientConn->clientRequestInfo.bytesTransferred;
+  const auto bytesToTransfer =
+      clientConn->clientRequestInfo.bytesToTransfer;
+  const auto filePosition =
+      clientConn->clientRequestInfo.offset + bytesTransferred;
+  const bool headerPending =
+      clientConn->responseHeaderBytesSent <
+      clientConn->responseHeader.size();
+  if (not headerPending && bytesTransferred >= bytesToTransfer) {
+    // the checksum usually went out with the last of the file's bytes, but
+    // not if there weren't any
+    if (clientConn->sendChecksum && clientConn->responseTrailer.empty()) {
+      finishChecksum(clientConn);
+    }
+    if (clientConn->responseTrailerBytesSent <
+        clientConn->responseTrailer.size()) {
+      sendResponseTrailer(clientConn);
+      return;
+    }
+    CLIENT_LOG(INFO, clientConn->clientId)
+        << clientIdStr
+        << "Sent header + " << bytesToTransfer
+        << " bytes of data to client";
+    finishRequest(clientConn);
+    return;
+  }
+
+  // the header can only share a write with the file's bytes if we're sending
+  // them from memory; otherwise (or if there are no bytes to send), send it by
+  // itself
+  const bool sendFromMemory =
+      clientConn->cachedFile || clientConn->streamFile ||
+      clientConn->inputFile.getData() != nullptr;
+  if (headerPending &&
+      (bytesTransferred >= bytesToTransfer || not sendFromMemory)) {
+    sendResponseHeader(clientConn);
+    return;
+  }
+
+  // figure out how many bytes we're allowed to send right now
+  const auto maxChunkBytes = std::min<uint64_t>(
+      bytesToTransfer - bytesTransferred,
+      std::max<uint64_t>(FLAGS_send_chunk_bytes, 1));
+  const auto chunkBytes = takeSendTokens(clientConn, maxChunkBytes);
+
+  // if we don't have any tokens, wait until one of the buckets has refilled
+  //
+  // the header isn't rate limited, so if it hasn't been sent yet, send it by
+  // itself first
+  if (chunkBytes == 0 && headerPending) {
+    sendResponseHeader(clientConn);
+    return;
+  }
+  if (chunkBytes == 0) {
+    waitForSendTokens(clientConn, maxChunkBytes);
+    return;
+  }
+
+  // if the file is cached, send as many bytes as we have tokens for from the
+  // cached copy
+  if (clientConn->cachedFile) {
+    writeFileBytes(
+        clientConn,
+        clientConn->cachedFile->data.data() + filePosition,
+        chunkBytes);
+    return;
+  }
+
+  // if we're streaming the file, send from the stream buffer
+  const auto& inputFile = clientConn->inputFile;
+  if (clientConn->streamFile) {
+    sendFileBytesStreamed(clientConn, chunkBytes);
+    return;
+  }
+
+  // if the file is not mapped into memory, send it with sendfile
+  if (inputFile.getData() == nullptr) {
+    sendFileBytesZeroCopy(clientConn, chunkBytes);
+    return;
+  }
+
+  // otherwise, send as many bytes as we have tokens for from the mapping
+  writeFileBytes(clientConn, inputFile.getData() + filePosition, chunkBytes);
+}
+
+uint64_t Server::takeSendTokens(
+    std::shared_ptr<ClientConnection> clientConn,
+    const uint64_t maxBytes) {
+  // we first take tokens from the client's bucket, then try to take the same
+  // number from the global bucket, which the egress scheduler hands out;
+  // whatever the global bucket couldn't cover is handed back to the client's
+  // bucket
+  const auto clientBytes = clientConn->tokenBucket.tryConsume(maxBytes);
+  clientConn->egressWantBytes = 0;
+  if (clientBytes == 0) {
+    return 0;
+  }
+  const auto globalBytes =
+      egressScheduler_.take(clientConn->egressFlow, clientBytes);
+  clientConn->tokenBucket.refund(clientBytes - globalBytes);
+  if (globalBytes == 0) {
+    clientConn->egressWantBytes = clientBytes;
+  }
+  return globalBytes;
+}
+
+void Server::waitForSendTokens(
+    std::shared_ptr<ClientConnection> clientConn,
+    const uint64_t maxBytes) {
+  // waiting on our own rate limits doesn't count against the client
+  clientConn->writeDeadline = kNoDeadline;
+
+  // if the client's own bucket had the tokens, it's the global bucket we're
+  // waiting for, along with the other clients; the egress scheduler wakes us
+  // up once it's our turn, with the tokens for it
+  //
+  // we only ask for as many bytes as the client's bucket had, so that we're
+  // not granted tokens we can't use yet
+  if (clientConn->egressWantBytes > 0 &&
+      egressScheduler_.getPolicy() != EgressPolicy::kFirstCome) {
+    // the wakeup holds the connection through egressWaitRef, see
+    // ClientConnection
+    const auto& requestInfo = clientConn->clientRequestInfo;
+    const auto conn = clientConn.get();
+    clientConn->egressWaitRef = clientConn;
+    egressScheduler_.wait(
+        clientConn->egressFlow, clientConn->egressWantBytes,
+        requestInfo.bytesToTransfer - requestInfo.bytesTransferred,
+        [this, conn]() {
+          conn->strand.post([this, conn]() {
+            sendFileBytes(std::move(conn->egressWaitRef));
+          });
+        });
+    return;
+  }
+
+  // otherwise, we use a timer instead of sleeping so that the worker thread
+  // can service other clients in the meantime
+  const auto delay = std::max(
+      {clientConn->tokenBucket.getRefillDelay(maxBytes),
+       globalTokenBucket_.getRefillDelay(maxBytes),
+       std::chrono::nanoseconds(std::chrono::milliseconds(1))});
+  clientConn->sendTimer.expires_after(delay);
+  clientConn->sendTimer.async_wait(
+      clientConn->strand.wrap(
+          [this, clientConn](const boost::system::error_code&) {
+            // if the timer was cancelled by disconnectClient, the socket has
+            // been shut down and the next write will fail
+            sendFileBytes(clientConn);
+          }));
+}
+
+void Server::sendCompressedBytes(
+    std::shared_ptr<ClientConnection> clientConn) {
+  const std::string clientIdStr =
+      "CID=" + std::to_string(clientConn->clientId) + "|";
+  auto& requestInfo = clientConn->clientRequestInfo;
+
+  // once all of a chunk has been sent, the file's bytes in it count as
+  // transferred; then move on to the next chunk, unless that was the chunk
+  // ending the response
+  if (clientConn->compressedChunkBytesSent >=
+      clientConn->compressedChunk.size()) {
+    requestInfo.bytesTransferred = clientConn->bytesCompressed;
+    publishRequestProgress(clientConn);
+    if (clientConn->compressionFinished) {
+      CLIENT_LOG(INFO, clientConn->clientId)
+          << clientIdStr
+          << "Sent header + " << requestInfo.bytesToTransfer
+          << " bytes of data to client, compressed to "
+          << requestInfo.compressedBytesSent << " bytes";
+      finishRequest(clientConn);
+      return;
+    }
+    fillCompressedChunk(clientConn);
+    return;
+  }
+
+  // the rate limits apply to the compressed bytes, since that's what goes
+  // over the network
+  const auto& chunk = clientConn->compressedChunk;
+  const auto maxChunkBytes = std::min<uint64_t>(
+      chunk.size() - clientConn->compressedChunkBytesSent,
+      std::max<uint64_t>(FLAGS_send_chunk_bytes, 1));
+  const auto chunkBytes = takeSendTokens(clientConn, maxChunkBytes);
+  if (chunkBytes == 0) {
+    waitForSendTokens(clientConn, maxChunkBytes);
+    return;
+  }
+  setDeadline(
+      clientConn, clientConn->writeDeadline,
+      std::chrono::milliseconds(writeTimeoutMs_.load()));
+  boost::asio::async_write(
+      clientConn->socket,
+      boost::asio::buffer(
+          chunk.data() + clientConn->compressedChunkBytesSent, chunkBytes),
+      clientConn->strand.wrap(
+          [this, clientConn, clientIdStr](
+              const boost::system::error_code& error,
+              const std::size_t bytesWritten) {
+            if (error) {
+              CLIENT_LOG(ERROR, clientConn->clientId)
+                  << clientIdStr
+                  << "Write error: "
+                  << boost::system::system_error(error).what();
+              closeClient(clientConn);
+              return;
+            }
+            recordBytesWritten(clientConn);
+            clientConn->compressedChunkBytesSent += bytesWritten;
+            clientConn->clientRequestInfo.compressedBytesSent += bytesWritten;
+            publishRequestProgress(clientConn);
+            sendCompressedBytes(clientConn);
+          }));
+}
+
+void Server::fillCompressedChunk(
+    std::shared_ptr<ClientConnection> clientConn) {
+  const auto& requestInfo = clientConn->clientRequestInfo;
+  auto& chunk = clientConn->compressedChunk;
+  chunk.clear();
+  clientConn->compressedChunkBytesSent = 0;
+
+  // the compressed bytes are appended to the chunk first, and the chunk's
+  // header is written in front of them once we know how many there are, see
+  // finishCompressedChunk
+  //
+  // room is left for the longest chunk header, and the response header that
+  // goes out in front of the first chunk
+  const auto& header = clientConn->responseHeader;
+  chunk.resize(
+      kMaxChunkHeaderBytes + header.size() -
+      clientConn->responseHeaderBytesSent);
+  clientConn->compressedChunkPayloadStart = chunk.size();
+  const auto& cachedFile = clientConn->cachedFile;
+  if (not cachedFile || not cachedFile->compressed) {
+    compressFileWindows(clientConn);
+    return;
+  }
+
+  // the cache's compressed copy can be sent as it is, one window at a time
+  //
+  // the copy doesn't tell us which of the file's bytes are in which window,
+  // so count them as transferred in proportion to the compressed bytes
+  const auto& data = cachedFile->data;
+  const auto bytesToCopy = std::min<uint64_t>(
+      std::max<uint64_t>(FLAGS_stream_chunk_bytes, 1),
+      data.size() - clientConn->compressedDataOffset);
+  chunk.append(data, clientConn->compressedDataOffset, bytesToCopy);
+  clientConn->compressedDataOffset += bytesToCopy;
+  clientConn->bytesCompressed =
+      requestInfo.bytesToTransfer * clientConn->compressedDataOffset /
+      data.size();
+  clientConn->compressionFinished =
+      clientConn->compressedDataOffset == data.size();
+  finishCompressedChunk(clientConn);
+}
+
+void Server::compressFileWindows(
+    std::shared_ptr<ClientConnection> clientConn) {
+  const std::string clientIdStr =
+      "CID=" + std::to_string(clientConn->clientId) + "|";
+  const auto& requestInfo = clientConn->clientRequestInfo;
+  const auto& cachedFile = clientConn->cachedFile;
+  const auto& inputFile = clientConn->inputFile;
+  auto& chunk = clientConn->compressedChunk;
+  const auto windowBytes = std::max<uint64_t>(FLAGS_stream_chunk_bytes, 1);
+
+  // feed the compressor one window of the file at a time, until it has some
+  // output for us (it buffers its input internally) or the whole range has
+  // been compressed
+  while (chunk.size() == clientConn->compressedChunkPayloadStart &&
+         not clientConn->compressionFinished) {
+    const auto filePosition =
+        requestInfo.offset + clientConn->bytesCompressed;
+    const auto bytesLeft =
+        requestInfo.bytesToTransfer - clientConn->bytesCompressed;
+    auto bytesToCompress = std::min<uint64_t>(windowBytes, bytesLeft);
+    const char* window = nullptr;
+    if (cachedFile) {
+      window = cachedFile->data.data() + filePosition;
+    } else if (inputFile.getData() != nullptr) {
+      window = inputFile.getData() + filePosition;
+    } else {
+      // read the next window into the stream buffer, and pick up from here
+      // once the read completes
+      const auto windowEnd =
+          clientConn->streamBufferOffset + clientConn->streamBufferBytes;
+      if (filePosition < clientConn->streamBufferOffset ||
+          filePosition >= windowEnd) {
+        readFileWindow(
+            clientConn, filePosition, bytesToCompress,
+            FileReadContinuation::kCompress, 0);
+        return;
+      }
+      const auto windowOffset = filePosition - clientConn->streamBufferOffset;
+      bytesToCompress = std::min<uint64_t>(
+          bytesToCompress, clientConn->streamBufferBytes - windowOffset);
+      window = clientConn->streamBuffer.data() + windowOffset;
+    }
+
+    const bool last = bytesToCompress == bytesLeft;
+    if (not clientConn->compressor->compress(
+            window, bytesToCompress, last, chunk)) {
+      CLIENT_LOG(ERROR, clientConn->clientId)
+          << clientIdStr << "Unable to compress file";
+      closeClient(clientConn);
+      return;
+    }
+    if (clientConn->sendChecksum && not clientConn->checksumFromCache) {
+      clientConn->checksum =
+          crc32c(clientConn->checksum, window, bytesToCompress);
+    }
+    clientConn->bytesCompressed += bytesToCompress;
+    clientConn->compressionFinished = last;
+  }
+  finishCompressedChunk(clientConn);
+}
+
+void Server::finishCompressedChunk(
+    std::shared_ptr<ClientConnection> clientConn) {
+  // write the chunk's header into the room left in front of the compressed
+  // bytes, preceded by what's left of the response header; the chunk is sent
+  // from there, skipping whatever room is left unused
+  auto& chunk = clientConn->compressedChunk;
+  const auto payloadStart = clientConn->compressedChunkPayloadStart;
+  const auto payloadBytes = chunk.size() - payloadStart;
+  std::array<char, kMaxChunkHeaderBytes> chunkHeader;
+  std::size_t chunkHeaderBytes = 0;
+  if (payloadBytes > 0) {
+    chunkHeaderBytes = encodeChunkHeader(
+        clientConn->binaryFraming, clientConn->requestId, payloadBytes,
+        chunkHeader);
+  }
+  auto chunkStart = payloadStart - chunkHeaderBytes;
+  std::copy_n(chunkHeader.data(), chunkHeaderBytes, &chunk[chunkStart]);
+  const auto& header = clientConn->responseHeader;
+  const auto headerBytes = header.size() - clientConn->responseHeaderBytesSent;
+  chunkStart -= headerBytes;
+  header.copy(
+      &chunk[chunkStart], headerBytes, clientConn->responseHeaderBytesSent);
+  clientConn->responseHeaderBytesSent = header.size();
+  clientConn->compressedChunkBytesSent = chunkStart;
+
+  // end the response with an empty chunk
+  if (clientConn->compressionFinished) {
+    chunkHeaderBytes = encodeChunkHeader(
+        clientConn->binaryFraming, clientConn->requestId, 0, chunkHeader);
+    chunk.append(chunkHeader.data(), chunkHeaderBytes);
+    if (clientConn->sendChecksum) {
+      finishChecksum(clientConn);
+      chunk += clientConn->responseTrailer;
+    }
+  }
+  sendCompressedBytes(clientConn);
+}
+
+void Server::sendResponseHeader(std::shared_ptr<ClientConnection> clientConn) {
+  const std::string clientIdStr =
+      "CID=" + std::to_string(clientConn->clientId) + "|";
+
+  // if the file's bytes follow, tell the kernel to hold the header until it
+  // can send it in the same segment as them (we're about to send them with
+  // sendfile, or once tokens are available)
+  const auto& requestInfo = clientConn->clientRequestInfo;
+  const bool moreToFollow =
+      requestInfo.bytesTransferred < requestInfo.bytesToTransfer;
+  const auto& header = clientConn->responseHeader;
+  setDeadline(
+      clientConn, clientConn->writeDeadline,
+      std::chrono::milliseconds(writeTimeoutMs_.load()));
+  clientConn->socket.async_send(
+      boost::asio::buffer(header) + clientConn->responseHeaderBytesSent,
+      moreToFollow ? MSG_MORE : 0,
+      clientConn->strand.wrap(
+          [this, clientConn, clientIdStr](
+              const boost::system::error_code& error,
+              const std::size_t bytesWritten) {
+            if (error) {
+              CLIENT_LOG(ERROR, clientConn->clientId)
+                  << clientIdStr
+                  << "Write error: "
+                  << boost::system::system_error(error).what();
+              closeClient(clientConn);
+              return;
+            }
+
+            // async_send may send only part of the header; sendFileBytes
+            // sends the rest
+            recordBytesWritten(clientConn);
+            clientConn->responseHeaderBytesSent += bytesWritten;
+            sendFileBytes(clientConn);
+          }));
+}
+
+void Server::finishChecksum(std::shared_ptr<ClientConnection> clientConn) {
+  clientConn->responseTrailer.clear();
+  appendChecksumTrailer(
+      clientConn->responseTrailer, clientConn->binaryFraming,
+      clientConn->requestId, clientConn->checksum);
+  clientConn->responseTrailerBytesSent = 0;
+}
+
+void Server::sendResponseTrailer(
+    std::shared_ptr<ClientConnection> clientConn) {
+  const std::string clientIdStr =
+      "CID=" + std::to_string(clientConn->clientId) + "|";
+  setDeadline(
+      clientConn, clientConn->writeDeadline,
+      std::chrono::milliseconds(writeTimeoutMs_.load()));
+  boost::asio::async_write(
+      clientConn->socket,
+      boost::asio::buffer(clientConn->responseTrailer) +
+          clientConn->responseTrailerBytesSent,
+      clientConn->strand.wrap(
+          [this, clientConn, clientIdStr](
+              const boost::system::error_code& error,
+              const std::size_t bytesWritten) {
+            if (error) {
+              CLIENT_LOG(ERROR, clientConn->clientId)
+                  << clientIdStr
+                  << "Write error: "
+                  << boost::system::system_error(error).what();
+              closeClient(clientConn);
+              return;
+            }
+            recordBytesWritten(clientConn);
+            clientConn->responseTrailerBytesSent += bytesWritten;
+            sendFileBytes(clientConn);
+          }));
+}
+
+void Server::writeFileBytes(
+    std::shared_ptr<ClientConnection> clientConn,
+    const char* data,
+    const std::size_t numBytes) {
+  // async_write sends all of the bytes unless the connection fails, so they
+  // can be checksummed before they are sent
+  const auto& requestInfo = clientConn->clientRequestInfo;
+  if (clientConn->sendChecksum) {
+    if (not clientConn->checksumFromCache) {
+      clientConn->checksum = crc32c(clientConn->checksum, data, numBytes);
+    }
+    if (requestInfo.bytesTransferred + numBytes ==
+        requestInfo.bytesToTransfer) {
+      finishChecksum(clientConn);
+    }
+  }
+
+  // the header is empty here once it has been sent, so after the first chunk
+  // this is a plain write of the file's bytes (and the trailer is empty until
+  // the last chunk)
+  const std::array<boost::asio::const_buffer, 3> buffers = {{
+      boost::asio::buffer(clientConn->responseHeader) +
+          clientConn->responseHeaderBytesSent,
+      boost::asio::buffer(data, numBytes),
+      boost::asio::buffer(clientConn->responseTrailer) +
+          clientConn->responseTrailerBytesSent}};
+  setDeadline(
+      clientConn, clientConn->writeDeadline,
+      std::chrono::milliseconds(writeTimeoutMs_.load()));
+
+  // bind_executor (unlike strand.wrap) lets asio see the handler's allocator
+  auto& handlerMemory = clientConn->writeHandlerMemory;
+  boost::asio::async_write(
+      clientConn->socket,
+      buffers,
+      boost::asio::bind_executor(
+          clientConn->strand,
+          makeAllocHandler(
+              handlerMemory,
+              [this, clientConn](
+                  const boost::system::error_code& error,
+                  const std::size_t bytesWritten) {
+                handleFileBytesSent(clientConn, error, bytesWritten);
+              })));
+}
+
+void Server::sendFileBytesZeroCopy(
+    std::shared_ptr<ClientConnection> clientConn,
+    const uint64_t chunkBytes) {
+  const std::string clientIdStr =
+      "CID=" + std::to_string(clientConn->clientId) + "|";
+
+  // sendfile must not block the worker thread, so put the socket's file
+  // descriptor in non-blocking mode (asio still emulates blocking behavior for
+  // any synchronous calls made on the socket)
+  boost::system::error_code error;
+  clientConn->socket.native_non_blocking(true, error);
+  std::size_t bytesSent = 0;
+  if (not error) {
+    bytesSent = sendFile(
+        clientConn->socket,
+        clientConn->inputFile.getFd(),
+        clientConn->clientRequestInfo.offset +
+            clientConn->clientRequestInfo.bytesTransferred,
+        chunkBytes,
+        error);
+  }
+  refundSendTokens(clientConn, chunkBytes - bytesSent);
+
+  // the socket's send buffer is full -- wait for it to drain, then try again
+  if (error == boost::asio::error::would_block) {
+    setDeadline(
+        clientConn, clientConn->writeDeadline,
+        std::chrono::milliseconds(writeTimeoutMs_.load()));
+    clientConn->socket.async_wait(
+        boost::asio::ip::tcp::socket::wait_write,
+        clientConn->strand.wrap(
+            [this, clientConn, clientIdStr](
+                const boost::system::error_code& error) {
+              if (error) {
+                CLIENT_LOG(ERROR, clientConn->clientId)
+                    << clientIdStr
+                    << "Write error: "
+                    << boost::system::system_error(error).what();
+                closeClient(clientConn);
+                return;
+              }
+              sendFileBytes(clientConn);
+            }));
+    return;
+  }
+
+  // sendfile isn't supported for this file -- fall back to mapping the file
+  // into memory and sending from the mapping
+  if (error == boost::system::errc::invalid_argument ||
+      error == boost::system::errc::function_not_supported) {
+    CLIENT_LOG(INFO, clientConn->clientId)
+        << clientIdStr
+        << "sendfile() not supported for file, falling back to mmap()";
+    if (not clientConn->inputFile.map()) {
+      CLIENT_LOG(ERROR, clientConn->clientId)
+          << clientIdStr << "Unable to map file into memory";
+      closeClient(clientConn);
+      return;
+    }
+    sendFileBytes(clientConn);
+    return;
+  }
+
+  // the file was truncated while it was being sent; the unsent chunk's tokens
+  // were refunded above
+  if (not error && bytesSent == 0) {
+    CLIENT_LOG(ERROR, clientConn->clientId)
+        << clientIdStr << "Read error: unexpected end of file";
+    closeClient(clientConn);
+    return;
+  }
+
+  // we post the completion instead of calling it directly; sendfile usually
+  // completes right away, and this lets other clients' handlers run between
+  // chunks instead of recursing until the whole file has been sent
+  clientConn->strand.post([this, clientConn, error, bytesSent]() {
+    handleFileBytesSent(clientConn, error, bytesSent);
+  });
+}
+
+void Server::sendFileBytesStreamed(
+    std::shared_ptr<ClientConnection> clientConn,
+    const uint64_t chunkBytes) {
+  const auto bytesTransferred =
+      clientConn->clientRequestInfo.bytesTransferred;
+  const auto bytesToTransfer =
+      clientConn->clientRequestInfo.bytesToTransfer;
+  const auto filePosition =
+      clientConn->clientRequestInfo.offset + bytesTransferred;
+
+  // refill the buffer once all of the bytes in it have been sent, then send
+  // the chunk (the tokens for it have been taken already) once the read has
+  // completed
+  //
+  // the window always starts at the next byte to send, so bytesTransferred
+  // remains the single source of truth for how far along the transfer is
+  const auto windowEnd =
+      clientConn->streamBufferOffset + clientConn->streamBufferBytes;
+  if (filePosition < clientConn->streamBufferOffset ||
+      filePosition >= windowEnd) {
+    readFileWindow(
+        clientConn, filePosition, bytesToTransfer - bytesTransferred,
+        FileReadContinuation::kSendChunk, chunkBytes);
+    return;
+  }
+
+  // send as many bytes as we have tokens for, up to the end of the window
+  //
+  // tokens for bytes past the end of the window go back to the buckets
+  const auto windowOffset = filePosition - clientConn->streamBufferOffset;
+  const auto bytesToSend = std::min<uint64_t>(
+      chunkBytes, clientConn->streamBufferBytes - windowOffset);
+  refundSendTokens(clientConn, chunkBytes - bytesToSend);
+  writeFileBytes(
+      clientConn, clientConn->streamBuffer.data() + windowOffset, bytesToSend);
+}
+
+void Server::readFileWindow(
+    std::shared_ptr<ClientConnection> clientConn,
+    const uint64_t filePosition,
+    const uint64_t maxBytes,
+    const FileReadContinuation continuation,
+    const uint64_t chunkBytes) {
+  auto& streamBuffer = clientConn->streamBuffer;
+  clientConn->writeDeadline = kNoDeadline;
+  clientConn->fileReadPending = true;
+  clientConn->fileReadStartTime = std::chrono::steady_clock::now();
+  clientConn->fileReadContinuation = continuation;
+  clientConn->fileReadChunkBytes = chunkBytes;
+  clientConn->streamBufferOffset = filePosition;
+  clientConn->streamBufferBytes = 0;
+
+  // the handler holds the connection through fileReadRef, see
+  // ClientConnection
+  const auto conn = clientConn.get();
+  clientConn->fileReadRef = clientConn;
+  clientConn->fileReader.read(
+      clientConn->inputFile.getFd(),
+      streamBuffer.data(),
+      std::min<uint64_t>(maxBytes, streamBuffer.size()),
+      filePosition,
+      [this, conn](
+          const boost::system::error_code& error,
+          const std::size_t bytesRead) {
+        conn->strand.dispatch(makeAllocHandler(
+            conn->fileReadHandlerMemory, [this, conn, error, bytesRead]() {
+              handleFileWindowRead(
+                  std::move(conn->fileReadRef), error, bytesRead);
+            }));
+      });
+}
+
+void Server::handleFileWindowRead(
+    std::shared_ptr<ClientConnection> clientConn,
+    const boost::system::error_code& error,
+    const std::size_t bytesRead) {
+  clientConn->fileReadPending = false;
+  metrics_.recordDuration(
+      HistogramMetric::kFileRead,
+      std::chrono::steady_clock::now() - clientConn->fileReadStartTime);
+
+  // if the connection was closed while the read was in flight, release what
+  // closeClient had to leave behind
+  if (not clientConn->socket.is_open()) {
+    clientConn->inputFile.close();
+    streamBufferPool_.release(clientConn->streamBuffer);
+    return;
+  }
+
+  // the file was truncated (bytesRead == 0) or could not be read
+  if (error || bytesRead == 0) {
+    CLIENT_LOG(ERROR, clientConn->clientId)
+        << "CID=" << clientConn->clientId << "|"
+        << "Read error: "
+        << (error ? boost::system::system_error(error).what()
+                  : "unexpected end of file");
+    closeClient(clientConn);
+    return;
+  }
+  clientConn->streamBufferBytes = bytesRead;
+  switch (clientConn->fileReadContinuation) {
+    case FileReadContinuation::kSendChunk:
+      sendFileBytesStreamed(clientConn, clientConn->fileReadChunkBytes);
+      return;
+    case FileReadContinuation::kCompress:
+      compressFileWindows(clientConn);
+      return;
+  }
+}
+
+void Server::handleFileBytesSent(
+    std::shared_ptr<ClientConnection> clientConn,
+    const boost::system::error_code& error,
+    const std::size_t bytesWritten) {
+  // check for errors -- socket might have been closed while we were writing
+  if (error) {
+    CLIENT_LOG(ERROR, clientConn->clientId)
+        << "CID=" << clientConn->clientId << "|"
+        << "Write error: "
+        << boost::system::system_error(error).what();
+    closeClient(clientConn);
+    return;
+  }
+
+  // record the time to the first byte once anything has been written
+  if (bytesWritten > 0) {
+    recordBytesWritten(clientConn);
+  }
+
+  // the first bytes written may belong to the response header, see
+  // writeFileBytes
+  //
+  // the last bytes written may belong to the checksum that follows the
+  // file's bytes
+  auto& requestInfo = clientConn->clientRequestInfo;
+  const auto headerBytes = std::min(
+      bytesWritten,
+      clientConn->responseHeader.size() - clientConn->responseHeaderBytesSent);
+  clientConn->responseHeaderBytesSent += headerBytes;
+  const auto fileBytes = std::min(
+      bytesWritten - headerBytes,
+      requestInfo.bytesToTransfer - requestInfo.bytesTransferred);
+  clientConn->responseTrailerBytesSent +=
+      bytesWritten - headerBytes - fileBytes;
+
+  // update the ClientRequestInfo structure and publish the new progress
+  //
+  // this happens once per chunk and takes no locks
+  requestInfo.bytesTransferred += fileBytes;
+  publishRequestProgress(clientConn);
+
+  // send the next chunk
+  sendFileBytes(clientConn);
+}
+
+void Server::recordBytesWritten(
+    std::shared_ptr<ClientConnection> clientConn) {
+  if (clientConn->firstByteSent) {
+    return;
+  }
+  clientConn->firstByteSent = true;
+  metrics_.recordDuration(
+      HistogramMetric::kAcceptToFirstByte,
+      std::chrono::steady_clock::now() - clientConn->acceptTime);
+}
+
+void Server::publishRequestProgress(
+    std::shared_ptr<ClientConnection> clientConn) {
+  ClientRequestProgress progress;
+  progress.offset = clientConn->clientRequestInfo.offset;
+  progress.bytesTransferred = clientConn->clientRequestInfo.bytesTransferred;
+  progress.bytesToTransfer = clientConn->clientRequestInfo.bytesToTransfer;
+  progress.compressed = clientConn->clientRequestInfo.compressed;
+  progress.compressedBytesSent =
+      clientConn->clientRequestInfo.compressedBytesSent;
+  clientConn->publishedProgress.store(progress);
+}
+
+void Server::refundSendTokens(
+    std::shared_ptr<ClientConnection> clientConn,
+    const uint64_t tokens) {
+  if (tokens == 0) {
+    return;
+  }
+  clientConn->tokenBucket.refund(tokens);
+  globalTokenBucket_.refund(tokens);
+}
+
+void Server::finishRequest(std::shared_ptr<ClientConnection> clientConn) {
+  // uncork the socket, sending the tail of the response right away
+  if (FLAGS_tcp_cork) {
+    boost::system::error_code ignoredError;
+    setTcpCork(clientConn->socket, false, ignoredError);
+  }
+
+  // record how long the response took
+  const auto& requestInfo = clientConn->clientRequestInfo;
+  metrics_.recordDuration(
+      HistogramMetric::kResponseSend,
+      std::chrono::steady_clock::now() - clientConn->responseStartTime);
+  metrics_.increment(CounterMetric::kResponses);
+  metrics_.increment(
+      CounterMetric::kFileBytesSent, requestInfo.bytesTransferred);
+  clientConn->fileBytesSent += requestInfo.bytesTransferred;
+  clientConn->writeDeadline = kNoDeadline;
+  clientConn->transferDeadline = kNoDeadline;
+
+  // release the file as soon as the response has been sent
+  clientConn->requestInProgress = false;
+  clientConn->responseHeader.clear();
+  clientConn->responseHeaderBytesSent = 0;
+  clientConn->cachedFile.reset();
+  clientConn->inputFile.close();
+  clientConn->streamBufferOffset = 0;
+  clientConn->streamBufferBytes = 0;
+  clientConn->compressResponse = false;
+  clientConn->compressedChunk.clear();
+  clientConn->sendChecksum = false;
+  clientConn->responseTrailer.clear();
+  clientConn->responseTrailerBytesSent = 0;
+
+  // keep the connection open and wait for the client's next request
+  if (FLAGS_keep_alive) {
+    readRequest(clientConn);
+    return;
+  }
+  closeClient(clientConn);
+}
+
+void Server::closeClient(std::shared_ptr<ClientConnection> clientConn) {
+  // start to disconnect the client
+  const auto& clientId = clientConn->clientId;
+  const std::string clientIdStr = "CID=" + std::to_string(clientId) + "|";
+  CLIENT_LOG(INFO, clientId)
+      << clientIdStr << "Cleaning up for client ID " << clientId;
+
+  // record the connection's throughput (once, even if several handlers fail),
+  // counting the part of the current response that has been sent, if any
+  const bool socketWasOpen = clientConn->socket.is_open();
+  if (socketWasOpen) {
+    auto fileBytesSent = clientConn->fileBytesSent;
+    if (not clientConn->responseHeader.empty()) {
+      fileBytesSent += clientConn->clientRequestInfo.bytesTransferred;
+    }
+    const std::chrono::duration<double> connectionTime =
+        std::chrono::steady_clock::now() - clientConn->acceptTime;
+    metrics_.record(
+        HistogramMetric::kConnectionThroughput,
+        static_cast<uint64_t>(
+            fileBytesSent / std::max(connectionTime.count(), 1e-6)));
+  }
+
+  // close the socket and cancel any pending timer
+  boost::system::error_code ignoredError;
+  clientConn->socket.close(ignoredError);
+  clientConn->sendTimer.cancel();
+  clientConn->deadlineTimer.cancel();
+
+  // give up our place with the egress scheduler (and any tokens it granted
+  // us); the handler it would have woken up is dropped, along with the
+  // reference it would have taken over (if the wakeup has already been
+  // posted, its handler takes the reference instead)
+  if (egressScheduler_.cancel(clientConn->egressFlow)) {
+    clientConn->egressWaitRef.reset();
+  }
+
+  // release the file now instead of when the last handler returns
+  //
+  // if a read is in flight, the file and stream buffer are released once it
+  // completes instead, see readFileWindow
+  clientConn->cachedFile.reset();
+  if (not clientConn->fileReadPending) {
+    clientConn->inputFile.close();
+    streamBufferPool_.release(clientConn->streamBuffer);
+  }
+  std::string().swap(clientConn->compressedChunk);
+  clientConn->compressor.reset();
+
+  // remove ourselves from the map of clientId -> ClientConnection object,
+  // and let the next queued connection (if any) take our slot
+  clientConnections_.erase(clientId);
+  if (socketWasOpen) {
+    releaseConnectionSlot();
+  }
+
+  // if the server is draining and this was the last connection, we're done
+  //
+  // only the close that took the connection down counts; a handler closing
+  // it again later mustn't stop the server a second time
+  if (socketWasOpen && draining_.load() && clientConnections_.size() == 0) {
+    finishDrain();
+  }
+
+  // we're done
+  CLIENT_LOG(INFO, clientId)
+      << clientIdStr << "Exiting handler for client ID " << clientId;
+}
+
+ServerMetricsSnapshot Server::getMetrics() {
+  return metrics_.getSnapshot();
+}
+
+std::string Server::getPrometheusMetrics() {
+  const auto cacheStats = getFileCacheStats();
+  const auto admissionStats = getAdmissionStats();
+  const auto connectionPoolStats = getConnectionPoolStats();
+  const auto streamBufferPoolStats = getStreamBufferPoolStats();
+  const auto egressStats = getEgressStats();
+  return formatPrometheusMetrics(
+      getMetrics(),
+      {{"connected_clients", "gauge", "Clients currently connected",
+        clientConnections_.size()},
+       {"connections_active", "gauge",
+        "Connections holding one of the max_connections slots",
+        admissionStats.activeConnections},
+       {"connections_waiting", "gauge",
+        "Connections waiting in the queue for a connection slot",
+        admissionStats.queuedConnections},
+       {"connections_queued_total", "counter",
+        "Connections that had to wait for a connection slot",
+        admissionStats.connectionsQueued},
+       {"connections_rejected_total", "counter",
+        "Connections turned away with a busy response",
+        admissionStats.connectionsRejected},
+       {"connection_pool_allocated_total", "counter",
+        "Connection objects allocated because none were pooled",
+        connectionPoolStats.allocated},
+       {"connection_pool_reused_total", "counter",
+        "Connection objects reused from the pool",
+        connectionPoolStats.reused},
+       {"stream_buffer_pool_allocated_total", "counter",
+        "Stream buffers allocated because none were pooled",
+        streamBufferPoolStats.allocated},
+       {"stream_buffer_pool_reused_total", "counter",
+        "Stream buffers reused from the pool",
+        streamBufferPoolStats.reused},
+       {"egress_waiting_clients", "gauge",
+        "Clients waiting for their turn on the global rate limit",
+        egressStats.waitingFlows},
+       {"egress_waits_total", "counter",
+        "Times a client had to wait for its turn on the global rate limit",
+        egressStats.waits},
+       {"egress_scheduled_bytes_total", "counter",
+        "Bytes sent by clients in their turn on the global rate limit",
+        egressStats.scheduledBytes},
+       {"file_cache_hits_total", "counter", "File cache hits",
+        cacheStats.hits},
+       {"file_cache_misses_total", "counter", "File cache misses",
+        cacheStats.misses},
+       {"file_cache_evictions_total", "counter", "File cache evictions",
+        cacheStats.evictions},
+       {"file_cache_bytes", "gauge", "Bytes held by the file cache",
+        cacheStats.bytes}});
 }
 
 int Server::getNextClientID() {
@@ -1,11 +1,32 @@
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
-#include <unordered_map>
 #include <vector>
 
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "AsyncFileReader.h"
+#include "BufferPool.h"
+#include "ClientRegistry.h"
+#include "Compression.h"
+#include "EgressScheduler.h"
+#include "FileCache.h"
+#include "FileRequest.h"
+#include "HandlerMemory.h"
+#include "InputFile.h"
+#include "MetricsServer.h"
+#include "ObjectPool.h"
+#include "SeqLock.h"
+#include "ServerMetrics.h"
+#include "SocketUtils.h"
+#include "TokenBucket.h"
 
 // value used as delimiter / for marking the end of a message
 const std::string kDelimiter = "#";
@@ -17,36 +38,323 @@ struct ClientRequestInfo {
   // filename requested
   std::string filename;
 
+  // offset in the file of the first byte sent (non-zero for byte ranges)
+  uint64_t offset = 0;
+
+  // bytes transferred
+  uint64_t bytesTransferred = 0;
+
+  // total bytes to send
+  uint64_t bytesToTransfer = 0;
+
+  // whether the response is compressed, and if so, the number of bytes sent
+  // so far, counting compressed data and headers (bytesTransferred counts the
+  // file's bytes that they hold)
+  bool compressed = false;
+  uint64_t compressedBytesSent = 0;
+};
+
+/**
+ * Progress counters of a client's request, published through a SeqLock.
+ */
+struct ClientRequestProgress {
+  // offset in the file of the first byte sent
+  uint64_t offset = 0;
+
   // bytes transferred
   uint64_t bytesTransferred = 0;
 
   // total bytes to send
   uint64_t bytesToTransfer = 0;
+
+  // whether the response is compressed, and if so, the number of bytes sent
+  // so far, counting compressed data and headers (bytesTransferred counts the
+  // file's bytes that they hold)
+  bool compressed = false;
+  uint64_t compressedBytesSent = 0;
+};
+
+// deadline of a phase a connection isn't in, see ClientConnection
+constexpr auto kNoDeadline = std::chrono::steady_clock::time_point::max();
+
+// largest request payload accepted with binary framing (a filename and range)
+constexpr uint64_t kMaxRequestFrameBytes = 64 * 1024;
+
+// most bytes a connection buffers while waiting for a request, whichever
+// framing it uses; a client sending more than this without completing a
+// request is cut off instead of growing the buffer until its deadline
+constexpr std::size_t kMaxRequestBufferBytes =
+    kFrameHeaderBytes + kMaxRequestFrameBytes;
+
+/**
+ * What a connection goes on to do once a read into its stream buffer has
+ * completed, see Server::readFileWindow.
+ */
+enum class FileReadContinuation {
+  // send the chunk the connection has taken tokens for
+  // (Server::sendFileBytesStreamed)
+  kSendChunk,
+
+  // compress the window that was read (Server::compressFileWindows)
+  kCompress,
 };
 
 /**
  * Struct used to track each client's connection.
+ *
+ * Connections are pooled (see Server::Listener), so once a connection has
+ * closed the object is reused for a later one, with reset() putting it back
+ * into the state the constructor leaves it in.
  */
 struct ClientConnection {
   ClientConnection(
-      const int clientId, boost::asio::ip::tcp::socket clientSocket)
+      const int clientId,
+      boost::asio::io_service& ioService,
+      AsyncFileReader& fileReader,
+      boost::asio::ip::tcp::socket clientSocket,
+      const RateLimit& rateLimit,
+      const std::chrono::steady_clock::time_point acceptTime)
       : clientId(clientId),
-        socket(std::move(clientSocket)) {}
+        socket(std::move(clientSocket)),
+        strand(ioService),
+        rcvBuffer(kMaxRequestBufferBytes),
+        fileReader(fileReader),
+        sendTimer(ioService),
+        deadlineTimer(ioService),
+        tokenBucket(rateLimit),
+        acceptTime(acceptTime) {}
+
+  /**
+   * Prepare a closed connection for reuse by a new client, on the same
+   * io_service.
+   *
+   * Buffers are emptied but keep their capacity, so a reused connection
+   * doesn't allocate again for its requests until they outgrow it.
+   */
+  void reset(
+      const int newClientId,
+      boost::asio::ip::tcp::socket clientSocket,
+      const RateLimit& rateLimit,
+      const std::chrono::steady_clock::time_point newAcceptTime);
 
   // client ID
-  const int clientId;
+  int clientId;
 
   // client request information
+  //
+  // only accessed by the connection's handlers (from within its strand), so no
+  // lock is needed; other threads read the published copies below instead
   ClientRequestInfo clientRequestInfo;
 
-  // hold this mutex when accessing clientRequestInfo
-  std::mutex clientRequestInfoMutex;
+  // filename of the current request, published when the request arrives
+  //
+  // hold this mutex when accessing publishedFilename; it is never taken on the
+  // send path, so readers cannot stall a transfer
+  std::string publishedFilename;
+  std::mutex publishedFilenameMutex;
+
+  // progress of the current request, published once per chunk sent
+  SeqLock<ClientRequestProgress> publishedProgress;
 
   // client socket
   boost::asio::ip::tcp::socket socket;
 
-  // hold this mutex when calling shutdown or close on a socket
-  std::mutex socketStateMutex;
+  // all handlers for this connection (and any shutdown / close of the socket)
+  // are dispatched through this strand, so they never run concurrently even
+  // though several worker threads are running the connection's io_service
+  boost::asio::io_service::strand strand;
+
+  // buffer for bytes read from the socket (may hold bytes past a delimiter),
+  // holding at most kMaxRequestBufferBytes
+  boost::asio::streambuf rcvBuffer;
+
+  // the current request's message (a filename, and its options), copied out
+  // of rcvBuffer into a string whose capacity is reused by the next request
+  std::string requestMessage;
+
+  // whether the client asked for binary framing (see SocketUtils.h) instead
+  // of the '#' delimited protocol
+  bool binaryFraming = false;
+
+  // request ID of the current request, when using binary framing
+  uint32_t requestId = 0;
+
+  // whether a request has been accepted and its response not yet finished,
+  // including while the file is read into the cache (see
+  // Server::processRequest); a draining server leaves these connections open
+  bool requestInProgress = false;
+
+  // header of the response currently being sent, and how many of its bytes
+  // have been sent so far
+  //
+  // the header goes out in the same (gathering) write as the first bytes of
+  // the file whenever the file is sent from memory
+  std::string responseHeader;
+  std::size_t responseHeaderBytesSent = 0;
+
+  // contents of the file currently being sent to the client, if the file was
+  // found in (or added to) the server's file cache
+  std::shared_ptr<const CachedFile> cachedFile;
+
+  // file currently being sent to the client, if not cached
+  InputFile inputFile;
+
+  // whether the file is read into streamBuffer before being sent, instead of
+  // being sent with sendfile (or from a mapping)
+  bool streamFile = false;
+
+  // whether the current response is compressed, see FileRequest
+  //
+  // the file's bytes are compressed as they are sent, one window at a time,
+  // unless cachedFile holds a compressed copy of the whole file
+  bool compressResponse = false;
+
+  // compressor for this connection's responses, created for the first
+  // compressed response and reused from then on
+  std::unique_ptr<Compressor> compressor;
+
+  // the next bytes of a compressed response (chunk headers and compressed
+  // data, and the response header in front of the first chunk), and the
+  // offset of the next of them to send
+  //
+  // the chunk doesn't start at the beginning of compressedChunk, see
+  // Server::finishCompressedChunk
+  std::string compressedChunk;
+  std::size_t compressedChunkBytesSent = 0;
+
+  // where the compressed bytes start in compressedChunk, while the chunk is
+  // being filled (room is left in front of them for its header, which is
+  // written there once it's complete)
+  std::size_t compressedChunkPayloadStart = 0;
+
+  // bytes of the file that have been compressed into chunks so far, and bytes
+  // of cachedFile's compressed copy that have been put into chunks
+  uint64_t bytesCompressed = 0;
+  uint64_t compressedDataOffset = 0;
+
+  // whether the chunk ending the response has been added to compressedChunk
+  bool compressionFinished = false;
+
+  // whether the current response ends with a checksum of the file's bytes
+  // (see FileRequest), their CRC32C so far, and whether it was taken from
+  // cachedFile instead (when sending all of a cached file), in which case the
+  // bytes aren't checksummed as they are sent
+  bool sendChecksum = false;
+  uint32_t checksum = 0;
+  bool checksumFromCache = false;
+
+  // the checksum following the file's bytes, once all of them have been
+  // checksummed, and how many of its bytes have been sent so far
+  //
+  // it goes out in the same write as the last of the file's bytes, or at the
+  // end of the last chunk of a compressed response
+  std::string responseTrailer;
+  std::size_t responseTrailerBytesSent = 0;
+
+  // reusable buffer holding a window of the file, when streaming the file
+  //
+  // taken from the server's stream buffer pool (see BufferPool) for the
+  // first request that needs it, and given back when the connection closes;
+  // the window starts at file offset streamBufferOffset and contains
+  // streamBufferBytes valid bytes; it is refilled once all of them are sent
+  std::vector<char> streamBuffer;
+  uint64_t streamBufferOffset = 0;
+  std::size_t streamBufferBytes = 0;
+
+  // reads the file into streamBuffer; the reader of the listener that
+  // accepted the connection, whose completions are handled on the same
+  // io_service as the rest of the connection
+  AsyncFileReader& fileReader;
+
+  // whether a read into streamBuffer is in flight, see Server::readFileWindow
+  //
+  // while it is, the kernel (or a file I/O thread) may still write into
+  // streamBuffer and the file may not be closed, since its descriptor could
+  // otherwise be reused for another file before the read completes
+  bool fileReadPending = false;
+
+  // what to do once the read completes, and the tokens taken for the chunk
+  // to send then (for kSendChunk)
+  FileReadContinuation fileReadContinuation = FileReadContinuation::kSendChunk;
+  uint64_t fileReadChunkBytes = 0;
+
+  // references keeping the connection alive while a read into streamBuffer
+  // is in flight, and while it's waiting for (or has just been granted) its
+  // turn with the egress scheduler
+  //
+  // the handlers of both only hold a plain pointer to the connection, so
+  // that they fit in a std::function without a heap allocation; each
+  // reference is moved out by the handler it's for
+  std::shared_ptr<ClientConnection> fileReadRef;
+  std::shared_ptr<ClientConnection> egressWaitRef;
+
+  // memory for the operations started for every chunk of a file sent, so
+  // that they don't allocate (see HandlerMemory): the writes of writeFileBytes
+  // and the handoff of a completed file read to the strand
+  HandlerMemory writeHandlerMemory;
+  HandlerMemory fileReadHandlerMemory;
+
+  // timer used to wait for tokens without blocking a worker thread
+  boost::asio::steady_timer sendTimer;
+
+  // deadlines of the phases the connection is currently in, see
+  // Server::checkDeadlines (kNoDeadline when not in the phase): receiving the
+  // next request, getting the pending write on the socket accepted by the
+  // client, and sending the current response
+  std::chrono::steady_clock::time_point requestDeadline = kNoDeadline;
+  std::chrono::steady_clock::time_point writeDeadline = kNoDeadline;
+  std::chrono::steady_clock::time_point transferDeadline = kNoDeadline;
+
+  // timer enforcing the deadlines above, and when it's set to expire
+  // (kNoDeadline if it isn't waiting)
+  //
+  // moving a deadline back doesn't touch the timer; when it expires, it is
+  // set to the earliest deadline again, so only phases starting (or a
+  // deadline moving forward) need to reset it
+  boost::asio::steady_timer deadlineTimer;
+  std::chrono::steady_clock::time_point deadlineTimerExpiry = kNoDeadline;
+
+  // limits the rate at which bytes are sent to this client
+  TokenBucket tokenBucket;
+
+  // the connection's place in the server's egress scheduler, and the bytes
+  // the client's token bucket had tokens for the last time the scheduler
+  // didn't (0 if the client's own bucket ran dry), see
+  // Server::waitForSendTokens
+  EgressScheduler::Flow egressFlow;
+  uint64_t egressWantBytes = 0;
+
+  // instrumentation, see ServerMetrics
+  //
+  // when the connection was accepted (before it waited for a connection
+  // slot, if it had to, see Server::handleAccept), whether any bytes of a
+  // response have been written to it since, when the current response (and
+  // the current read into streamBuffer) started, and the bytes of files sent
+  // over the connection by the responses that have been completed
+  std::chrono::steady_clock::time_point acceptTime;
+  bool firstByteSent = false;
+  std::chrono::steady_clock::time_point responseStartTime;
+  std::chrono::steady_clock::time_point fileReadStartTime;
+  uint64_t fileBytesSent = 0;
+};
+
+/**
+ * State of the server's admission control, see Server::getAdmissionStats.
+ */
+struct AdmissionStats {
+  // connections being served, and the most that may be (0 = unlimited)
+  uint64_t activeConnections = 0;
+  uint64_t maxConnections = 0;
+
+  // accepted connections waiting for one of the active connections to close,
+  // and the most that may wait
+  uint64_t queuedConnections = 0;
+  uint64_t maxQueuedConnections = 0;
+
+  // connections that had to wait in the queue, and connections turned away
+  // with a busy response because the queue was full, since the server started
+  uint64_t connectionsQueued = 0;
+  uint64_t connectionsRejected = 0;
 };
 
 /**
@@ -57,20 +365,58 @@ class Server {
   Server();
 
   /**
-   * Starts a server process listening on the given endpoint.
+   * Starts a server process listening on the given endpoints.
+   *
+   * All endpoints are listened on at once, for instance an IPv4 and an IPv6
+   * address (see parseEndpoints in SocketUtils.h), and clients are served the
+   * same way whichever endpoint they connected to.
    *
-   * This is a blocking call.
+   * Client connections are handled asynchronously by a fixed pool of worker
+   * threads, each running the io_service of one of the server's listeners
+   * (see Listener). This is a blocking call, returning once the server has
+   * been stopped and all worker threads have exited.
    */
-  void run(const boost::asio::ip::tcp::endpoint& endpoint);
+  void run(const std::vector<boost::asio::ip::tcp::endpoint>& endpoints);
   // void run(const int32_t port);
 
   /**
    * Stops the server server process.
    *
-   * Closes the acceptor and all outstanding threads.
+   * Closes the acceptors and disconnects all clients. Safe to call from any
+   * thread; run() returns once all outstanding handlers have completed.
    */
   void stop();
 
+  /**
+   * Stops the server once the responses in progress have been sent.
+   *
+   * Closes the acceptors and turns queued connections away with a busy
+   * response, so that their clients retry elsewhere. Connections waiting for
+   * a request are closed right away, and every other connection once its
+   * current response has been sent; after timeout, the clients that are
+   * left are disconnected with stop(). Safe to call from any thread; run()
+   * returns once the last client is gone.
+   */
+  void drain(const std::chrono::milliseconds timeout);
+
+  /**
+   * Return whether drain() has been called.
+   */
+  bool isDraining();
+
+  /**
+   * Apply the settings in a configuration file to the running server.
+   *
+   * The file holds flags, one per line, as in a gflags --flagfile (e.g.,
+   * "--global_rate_limit=1000000"), with '#' starting a comment line. Only
+   * settings that can change while clients are connected are accepted: the
+   * rate limits, the file cache's capacity and the connection timeouts.
+   *
+   * Returns whether the file was applied; if it can't be read, or holds an
+   * invalid line, an error is logged and nothing is changed.
+   */
+  bool reloadConfig(const std::string& configFile);
+
   /**
    * Return client IDs for all connected clients.
    */
@@ -94,16 +440,555 @@ class Server {
    */
   bool disconnectClient(const int clientId);
 
+  /**
+   * Return the rate limit applied to each newly connected client.
+   */
+  RateLimit getDefaultClientRateLimit();
+
+  /**
+   * Set the rate limit for all clients, including those already connected.
+   */
+  void setDefaultClientRateLimit(const RateLimit& rateLimit);
+
+  /**
+   * Set the rate limit for the client with the specified ID.
+   *
+   * Returns whether the limit was changed (fails if no client exists for the
+   * client ID).
+   */
+  bool setClientRateLimit(const int clientId, const RateLimit& rateLimit);
+
+  /**
+   * Return the share of the global rate limit given to each newly connected
+   * client, see EgressScheduler::setWeight.
+   */
+  uint64_t getDefaultClientWeight();
+
+  /**
+   * Set the share of the global rate limit for all clients, including those
+   * already connected.
+   */
+  void setDefaultClientWeight(const uint64_t weight);
+
+  /**
+   * Set the share of the global rate limit for the client with the specified
+   * ID.
+   *
+   * Returns whether the weight was changed (fails if no client exists for the
+   * client ID).
+   */
+  bool setClientWeight(const int clientId, const uint64_t weight);
+
+  /**
+   * Return the order in which clients waiting on the global rate limit are
+   * served, and the egress scheduler's counters.
+   */
+  EgressPolicy getEgressPolicy();
+  EgressStats getEgressStats();
+
+  /**
+   * Return the rate limit shared by all clients.
+   */
+  RateLimit getGlobalRateLimit();
+
+  /**
+   * Set the rate limit shared by all clients.
+   */
+  void setGlobalRateLimit(const RateLimit& rateLimit);
+
+  /**
+   * Return counters describing the behavior of the file cache.
+   */
+  FileCacheStats getFileCacheStats();
+
+  /**
+   * Return the number of connections being served and waiting to be, and
+   * how many were queued or turned away so far.
+   */
+  AdmissionStats getAdmissionStats();
+
+  /**
+   * Return the counters of the pools of ClientConnection objects (summed
+   * across listeners), and of the stream buffer pool.
+   */
+  PoolStats getConnectionPoolStats();
+  PoolStats getStreamBufferPoolStats();
+
+  /**
+   * Return the server's metrics, merged across worker threads.
+   */
+  ServerMetricsSnapshot getMetrics();
+
+  /**
+   * Return the server's metrics (and the file cache's counters) in the
+   * Prometheus text exposition format, as served on FLAGS_metrics_port.
+   */
+  std::string getPrometheusMetrics();
+
  private:
+  /**
+   * Acceptors for each of the server's endpoints, with the io_service their
+   * connections are handled on.
+   *
+   * With FLAGS_acceptors > 1, the listeners' acceptors for an endpoint all
+   * listen on it with SO_REUSEPORT, and the kernel spreads new connections
+   * across them. Each listener has worker threads of its own, so a single
+   * accept loop never limits the rate at which connections are accepted, and
+   * a connection is handled on the threads that accepted it.
+   */
+  struct Listener {
+    Listener(
+        const std::size_t connectionPoolSize,
+        const AsyncFileReader::Backend fileReaderBackend,
+        const unsigned int numFileReaderThreads)
+      : connectionPool(connectionPoolSize),
+        fileReader(ioService, fileReaderBackend, numFileReaderThreads),
+        acceptorStrand(ioService) {}
+
+    // the pooled connections' sockets and timers belong to ioService, so
+    // they must be gone before it is; connections whose last handler is
+    // destroyed along with ioService are then freed instead of pooled
+    ~Listener() {
+      connectionPool.close();
+    }
+
+    // closed connections, reused by the connections accepted next (see
+    // ClientConnection::reset)
+    //
+    // declared before ioService, since handlers destroyed with it return
+    // their connections to the pool
+    ObjectPool<ClientConnection> connectionPool;
+
+    boost::asio::io_service ioService;
+
+    // reads files for the stream buffers of the listener's connections
+    // without blocking its worker threads
+    AsyncFileReader fileReader;
+
+    // one acceptor per endpoint, in the order they were passed to run()
+    //
+    // only resized by run(), before any async_accept is registered
+    std::vector<boost::asio::ip::tcp::acceptor> acceptors;
+
+    // serializes async_accept and close() calls on the acceptors (and the
+    // handlers of connections they turned away)
+    boost::asio::io_service::strand acceptorStrand;
+  };
+
+  /**
+   * Return FLAGS_acceptors (at least one) new listeners.
+   */
+  static std::vector<std::unique_ptr<Listener>> createListeners();
+
+  /**
+   * Return the io_services of the listeners, in order.
+   */
+  static std::vector<boost::asio::io_service*> getIoServices(
+      const std::vector<std::unique_ptr<Listener>>& listeners);
+
+  /**
+   * Open an acceptor of a listener for each endpoint, bind it and start
+   * listening.
+   *
+   * IPv6 acceptors are dual-stack or IPv6 only according to isDualStack
+   * (see SocketUtils.h).
+   */
+  void openAcceptors(
+      Listener& listener,
+      const std::vector<boost::asio::ip::tcp::endpoint>& endpoints);
+
+  /**
+   * Register an async_accept operation for the next client connection on one
+   * of a listener's acceptors.
+   *
+   * Must be called from within the listener's acceptorStrand.
+   */
+  void startAccept(
+      Listener& listener,
+      boost::asio::ip::tcp::acceptor& acceptor);
+
+  /**
+   * Handle completion of an async_accept operation.
+   *
+   * Serves the new connection if fewer than FLAGS_max_connections are being
+   * served, queues it until one of them closes otherwise, and turns it away
+   * with a busy response (see FileRequest.h) if the queue is full too.
+   *
+   * Accept errors are taken to be transient (e.g., running out of file
+   * descriptors), and accepting is tried again a little later; the accept
+   * loop only ends once the acceptor has been closed.
+   */
+  void handleAccept(
+      Listener& listener,
+      boost::asio::ip::tcp::acceptor& acceptor,
+      const boost::system::error_code& error,
+      boost::asio::ip::tcp::socket socket);
+
+  /**
+   * Create a ClientConnection for a connection that was given a connection
+   * slot, and start handling it on its strand (on the io_service of the
+   * listener that accepted it).
+   */
+  void startConnection(
+      Listener& listener,
+      boost::asio::ip::tcp::socket socket,
+      const std::chrono::steady_clock::time_point acceptTime);
+
+  /**
+   * Give the connection slot of a connection that was closed to the first
+   * queued connection, if any.
+   */
+  void releaseConnectionSlot();
+
+  // a connection being turned away, see rejectConnection
+  struct RejectedConnection;
+
+  /**
+   * Send a busy response on a connection, then close it once the client has
+   * (or after kRejectLingerTime at most).
+   *
+   * The request the client may already have sent is read and discarded
+   * first; closing a socket with unread bytes would reset the connection, and
+   * the client might never see the busy response.
+   */
+  void rejectConnection(
+      Listener& listener,
+      boost::asio::ip::tcp::socket socket);
+
+  /**
+   * Discard bytes from a connection being turned away until the client closes
+   * it, then close it too.
+   *
+   * Must be called from within the listener's acceptorStrand.
+   */
+  void discardUntilClosed(
+      Listener& listener,
+      std::shared_ptr<RejectedConnection> rejectedConn);
+
   /**
    * Handle a client connection.
    *
-   * This function will block until the client disconnects. It should be called
-   * from within its own thread if multiple clients need to be handled in
-   * parallel.
+   * Registers an async read for the client's first request and returns
+   * immediately; the rest of the exchange is driven by handlers on the
+   * connection's strand. Clients may send several requests on the same
+   * connection, which are answered in order.
    */
   void handleClient(std::shared_ptr<ClientConnection> clientConn);
 
+  /**
+   * Wait for the client's first bytes and check whether it asked for binary
+   * framing, then read its first request.
+   */
+  void detectFraming(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Register an async read for the client's next request.
+   *
+   * While the server is draining, only requests the client has already sent
+   * in full are served; the connection is closed once none are left.
+   */
+  void readRequest(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Return whether the connection's rcvBuffer holds a complete request (or
+   * frame, with binary framing).
+   */
+  bool hasBufferedRequest(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Handle the read of a '#' delimited request.
+   */
+  void handleRequest(
+      std::shared_ptr<ClientConnection> clientConn,
+      const boost::system::error_code& error,
+      const std::size_t bytesTransferred);
+
+  /**
+   * Read the client's next binary frame, and handle it once it has been read.
+   */
+  void readFrame(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Set one of the connection's deadlines to timeout from now (or clear it, if
+   * timeout is zero), and make sure the deadline timer expires by then.
+   *
+   * Must be called from within the connection's strand.
+   */
+  void setDeadline(
+      std::shared_ptr<ClientConnection> clientConn,
+      std::chrono::steady_clock::time_point& deadline,
+      const std::chrono::milliseconds timeout);
+
+  /**
+   * Set the connection's deadline timer to expire at its earliest deadline,
+   * unless it's already set to expire by then.
+   *
+   * Must be called from within the connection's strand.
+   */
+  void armDeadlineTimer(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Handle expiry of the connection's deadline timer: close the connection if
+   * one of its deadlines has passed, and wait for the earliest one otherwise.
+   *
+   * This is what keeps clients that never send a request, send it a byte at a
+   * time, or stop reading the response from holding on to a connection (and
+   * its connection slot) forever.
+   */
+  void checkDeadlines(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Handle a failed read of the client's next request, closing the connection.
+   */
+  void handleReadError(
+      std::shared_ptr<ClientConnection> clientConn,
+      const boost::system::error_code& error);
+
+  /**
+   * Handle the client's request (a filename and optional byte range) once it
+   * has been read, and start sending the response.
+   */
+  void processRequest(
+      std::shared_ptr<ClientConnection> clientConn,
+      const std::string& message);
+
+  /**
+   * Look the requested file up in the file cache, along with its compressed
+   * copy if the response is sent from that (see sendsCompressedCopy).
+   *
+   * With fill, reads the file into the cache and compresses it as needed,
+   * which may block for a while. Otherwise never blocks, and returns nullptr
+   * and sets needsFill if either would be needed.
+   *
+   * file is set to the file's contents once they have been found; a lookup
+   * that set needsFill is finished by calling again with fill and the same
+   * file, so that the cache counts each request once.
+   */
+  std::shared_ptr<const CachedFile> lookUpCachedFile(
+      const FileRequest& request,
+      std::shared_ptr<const CachedFile>& file,
+      const bool fill,
+      bool& needsFill);
+
+  /**
+   * Start the response to a request once the file cache has been consulted
+   * (setting the connection's cachedFile), opening the file if it isn't
+   * cached.
+   *
+   * openStartTime is when processRequest started looking for the file.
+   */
+  void startResponse(
+      std::shared_ptr<ClientConnection> clientConn,
+      const FileRequest& request,
+      const bool validRequest,
+      const std::chrono::steady_clock::time_point openStartTime);
+
+  /**
+   * Send the next chunk of the file to the client.
+   *
+   * The chunk is sized to the tokens available in both the client's and the
+   * global token bucket. If there are none, waits on the connection's timer
+   * until enough tokens have accumulated.
+   */
+  void sendFileBytes(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Take tokens for sending up to maxBytes bytes to the client from both the
+   * client's and the global token bucket (through the egress scheduler).
+   *
+   * Returns the number of bytes that may be sent (possibly zero).
+   */
+  uint64_t takeSendTokens(
+      std::shared_ptr<ClientConnection> clientConn,
+      const uint64_t maxBytes);
+
+  /**
+   * Wait until both token buckets have refilled enough to send maxBytes
+   * bytes, then call sendFileBytes.
+   *
+   * Waits on the connection's timer for the client's own bucket; if it's the
+   * global bucket the client is waiting for, the egress scheduler wakes the
+   * client up once it's the client's turn instead (see EgressPolicy).
+   */
+  void waitForSendTokens(
+      std::shared_ptr<ClientConnection> clientConn,
+      const uint64_t maxBytes);
+
+  /**
+   * Send the next part of a compressed response, as part of sendFileBytes.
+   *
+   * Sends the bytes in the connection's compressedChunk, as far as the token
+   * buckets allow, and refills it with the next chunk once all of it has been
+   * sent.
+   */
+  void sendCompressedBytes(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Fill the connection's compressedChunk with the next chunk of a compressed
+   * response, then continue with sendCompressedBytes. Adds the chunk ending
+   * the response once the whole range has been compressed.
+   *
+   * Closes the connection if the file could not be read or compressed.
+   */
+  void fillCompressedChunk(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Compress windows of the file into the connection's compressedChunk until
+   * the compressor has some output, as part of fillCompressedChunk.
+   *
+   * Windows of a file that isn't in memory are read asynchronously into the
+   * stream buffer, and compression picks up again once each read completes.
+   */
+  void compressFileWindows(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Put the header in front of the compressed bytes in the connection's
+   * compressedChunk (and the empty chunk ending the response after them, if
+   * the whole range has been compressed), then call sendCompressedBytes.
+   */
+  void finishCompressedChunk(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Send the response header on its own, as part of sendFileBytes.
+   *
+   * Used when the header can't be combined with the file's bytes in a single
+   * write. If file bytes follow, the header is sent with MSG_MORE so that the
+   * kernel holds it until it can share a segment with them.
+   */
+  void sendResponseHeader(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Set the connection's responseTrailer to the checksum of the file's bytes,
+   * once all of them have been checksummed.
+   */
+  void finishChecksum(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Send the rest of the response's checksum on its own, as part of
+   * sendFileBytes.
+   *
+   * Only needed when it couldn't go out with the last of the file's bytes,
+   * e.g., because there weren't any.
+   */
+  void sendResponseTrailer(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Write bytes of the file held in memory to the client, as part of
+   * sendFileBytes.
+   *
+   * Any part of the response header that hasn't been sent yet is placed in
+   * front of the bytes, and both go out in a single gathering write. If the
+   * response has a checksum, the bytes are added to it, and the checksum
+   * follows the last of them in the same write.
+   */
+  void writeFileBytes(
+      std::shared_ptr<ClientConnection> clientConn,
+      const char* data,
+      const std::size_t numBytes);
+
+  /**
+   * Send a chunk of the file with sendfile(2), as part of sendFileBytes.
+   *
+   * If the socket's send buffer is full, waits until the socket is writable
+   * before trying again. If the file does not support sendfile, maps the file
+   * into memory so that later chunks are sent from the mapping.
+   */
+  void sendFileBytesZeroCopy(
+      std::shared_ptr<ClientConnection> clientConn,
+      const uint64_t chunkBytes);
+
+  /**
+   * Send a chunk of the file from the connection's stream buffer, as part of
+   * sendFileBytes.
+   *
+   * Refills the buffer from the file (asynchronously, see readFileWindow)
+   * once all bytes in it have been sent.
+   */
+  void sendFileBytesStreamed(
+      std::shared_ptr<ClientConnection> clientConn,
+      const uint64_t chunkBytes);
+
+  /**
+   * Start reading up to maxBytes bytes of the file at filePosition into the
+   * connection's stream buffer, without blocking the worker thread.
+   *
+   * Once the read completes, sets the stream buffer's window and carries on
+   * with continuation within the connection's strand (sending a chunk of
+   * chunkBytes, for kSendChunk). Closes the connection instead if the file
+   * could not be read, or ended early.
+   */
+  void readFileWindow(
+      std::shared_ptr<ClientConnection> clientConn,
+      const uint64_t filePosition,
+      const uint64_t maxBytes,
+      const FileReadContinuation continuation,
+      const uint64_t chunkBytes);
+
+  /**
+   * Handle the completion of a read started by readFileWindow, within the
+   * connection's strand.
+   */
+  void handleFileWindowRead(
+      std::shared_ptr<ClientConnection> clientConn,
+      const boost::system::error_code& error,
+      const std::size_t bytesRead);
+
+  /**
+   * Note that bytes of a response have been written to the client, recording
+   * the time from accept to the first byte if these are the first.
+   */
+  void recordBytesWritten(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Handle completion of a write of file bytes to the client.
+   */
+  void handleFileBytesSent(
+      std::shared_ptr<ClientConnection> clientConn,
+      const boost::system::error_code& error,
+      const std::size_t bytesWritten);
+
+  /**
+   * Publish the connection's request progress for getConnectedClientsWithInfo.
+   *
+   * Must be called from within the connection's strand.
+   */
+  void publishRequestProgress(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Return tokens that were taken for a chunk but not sent to both the
+   * client's and the global token bucket.
+   */
+  void refundSendTokens(
+      std::shared_ptr<ClientConnection> clientConn,
+      const uint64_t tokens);
+
+  /**
+   * Clean up after a response has been sent.
+   *
+   * Waits for the client's next request if FLAGS_keep_alive is set, otherwise
+   * closes the connection (see readRequest for what happens while draining).
+   */
+  void finishRequest(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Close the client's socket and remove it from the connections map.
+   *
+   * Must be called from within the connection's strand. Once the last handler
+   * referencing the connection returns, the ClientConnection is destroyed.
+   */
+  void closeClient(std::shared_ptr<ClientConnection> clientConn);
+
+  /**
+   * Apply the reloadable flags (see reloadConfig), after they have changed.
+   */
+  void applyReloadableFlags();
+
+  /**
+   * Stop the server once drain() has found that no connections are left,
+   * unless it has already been stopped for that.
+   */
+  void finishDrain();
+
   /**
    * Return the next client ID, incrementing the client ID in parallel.
    */
@@ -112,17 +997,94 @@ class Server {
   // atomic integer holding next client ID
   std::atomic<int> nextClientID_;
 
-  // all client threads
-  std::vector<std::thread> clientThreads_;
+  // worker threads, each running one listener's io_service
+  std::vector<std::thread> workerThreads_;
 
   // all client connections
-  std::unordered_map<int, std::shared_ptr<ClientConnection>> clientConnections_;
+  ClientRegistry clientConnections_;
+
+  // listeners, see Listener
+  //
+  // the first listener's io_service also runs the metrics listener's
+  // handlers and the drain deadline, neither of which is on the path of a
+  // transfer
+  std::vector<std::unique_ptr<Listener>> listeners_;
+
+  // an accepted connection waiting for a connection slot
+  struct QueuedConnection {
+    Listener* listener;
+    boost::asio::ip::tcp::socket socket;
+    std::chrono::steady_clock::time_point acceptTime;
+  };
+
+  // admission control, see handleAccept
+  //
+  // hold this mutex when accessing the members below; activeConnections_
+  // counts the connections holding a slot (including those being started),
+  // and once admissionClosed_ is set by stop() no queued connection is served
+  std::mutex admissionMutex_;
+  uint64_t activeConnections_ = 0;
+  std::deque<QueuedConnection> connectionQueue_;
+  bool admissionClosed_ = false;
+  uint64_t connectionsQueued_ = 0;
+  uint64_t connectionsRejected_ = 0;
+
+  // rate limit for newly connected clients
+  RateLimit defaultClientRateLimit_;
+
+  // mutex used to protect defaultClientRateLimit_
+  std::mutex defaultClientRateLimitMutex_;
+
+  // egress scheduler weight for newly connected clients
+  std::atomic<uint64_t> defaultClientWeight_;
+
+  // connection timeouts in milliseconds (0 = no limit), taken from their
+  // flags when the server is created and by reloadConfig; ClientConnection's
+  // deadlines are set from these, since flags can't be read while another
+  // thread may be changing them
+  std::atomic<uint64_t> requestTimeoutMs_;
+  std::atomic<uint64_t> writeTimeoutMs_;
+  std::atomic<uint64_t> transferTimeoutMs_;
+
+  // serializes reloadConfig, which may be called from the SIGHUP thread and
+  // the terminal at once
+  std::mutex reloadMutex_;
+
+  // set by drain(); from then on finishRequest closes connections instead of
+  // waiting for another request, and closeClient calls stop() once the last
+  // connection is gone
+  std::atomic<bool> draining_;
+
+  // set by finishDrain(), so that the drained server is only stopped once
+  std::atomic<bool> drainFinished_;
+
+  // calls stop() when the drain deadline passes
+  //
+  // only accessed from within the first listener's acceptorStrand
+  boost::asio::steady_timer drainTimer_;
+
+  // limits the rate at which bytes are sent across all clients
+  TokenBucket globalTokenBucket_;
+
+  // splits the global rate limit between the clients waiting on it
+  EgressScheduler egressScheduler_;
+
+  // contents of recently requested files, shared by all clients
+  FileCache fileCache_;
+
+  // threads reading files into fileCache_ and compressing them for it, see
+  // processRequest
+  //
+  // declared after fileCache_, so that its threads are joined before the
+  // cache is destroyed
+  boost::asio::thread_pool cacheFillPool_;
+
+  // buffers for ClientConnection::streamBuffer, shared by all clients
+  BufferPool streamBufferPool_;
 
-  // mutex used to protect client connections map
-  std::mutex clientConnectionsMutex_;
+  // latency histograms and counters, kept per worker thread
+  ServerMetrics metrics_;
 
-  // io_service and acceptor objects
-  // we store the acceptor at the class level so we can call close
-  boost::asio::io_service ioService_;
-  boost::asio::ip::tcp::acceptor acceptor_;
+  // serves metrics_ to Prometheus, if FLAGS_metrics_port is set
+  MetricsServer metricsServer_;
 };
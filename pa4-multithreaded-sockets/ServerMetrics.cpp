@@ -0,0 +1,245 @@
+#include "ServerMetrics.h"
+
+#include <iomanip>
+#include <sstream>
+
+namespace {
+
+// prefix of the names of all exported metrics
+const std::string kPrometheusPrefix = "pa4_";
+
+/**
+ * How a histogram is described and exported.
+ */
+struct HistogramInfo {
+  // name when exported to Prometheus, and in the server's terminal
+  const char* prometheusName;
+  const char* summaryName;
+  const char* help;
+
+  // whether the histogram holds durations in microseconds (exported in
+  // seconds); otherwise values are exported as they were recorded
+  bool isDuration;
+
+  // the exported buckets hold the values below 2^n for n in [minExponent,
+  // maxExponent] (so their le bounds are 2^n - 1, see formatPrometheusMetrics)
+  int minExponent;
+  int maxExponent;
+};
+
+// indexed by HistogramMetric
+const HistogramInfo kHistogramInfo[kNumHistogramMetrics] = {
+  {"accept_to_first_byte_seconds", "accept to first byte",
+   "Time from accepting a connection until the first byte of its first "
+   "response was written",
+   true, 4, 25},
+  {"file_open_seconds", "file open",
+   "Time to look up a requested file in the cache and open it",
+   true, 0, 22},
+  {"file_read_seconds", "file read",
+   "Time to read a window of a file into a stream buffer",
+   true, 0, 22},
+  {"response_send_seconds", "response send",
+   "Time from starting to send a response until it was sent",
+   true, 4, 30},
+  {"connection_throughput_bytes_per_second", "connection throughput",
+   "File bytes sent over a connection divided by how long it was open",
+   false, 10, 34},
+};
+
+// indexed by CounterMetric
+const ExtraMetric kCounterInfo[kNumCounterMetrics] = {
+  {"connections_accepted_total", "counter", "Connections accepted", 0},
+  {"responses_total", "counter",
+   "Responses sent, including for files that weren't found", 0},
+  {"file_bytes_sent_total", "counter", "Bytes of files sent", 0},
+  {"request_timeouts_total", "counter",
+   "Connections closed because the client took longer than "
+   "--request_timeout_ms to send a request", 0},
+  {"write_timeouts_total", "counter",
+   "Connections closed because a chunk of a response wasn't accepted by the "
+   "client within --write_timeout_ms", 0},
+  {"transfer_timeouts_total", "counter",
+   "Connections closed because a response took longer than "
+   "--transfer_timeout_ms to send", 0},
+};
+
+// hands out ServerMetrics IDs
+std::atomic<uint64_t> nextServerMetricsId(1);
+
+/**
+ * Append the HELP and TYPE lines of a metric.
+ */
+void appendMetricHeader(
+    std::ostringstream& out,
+    const std::string& name,
+    const std::string& type,
+    const std::string& help) {
+  out
+      << "# HELP " << kPrometheusPrefix << name << " " << help << "\n"
+      << "# TYPE " << kPrometheusPrefix << name << " " << type << "\n";
+}
+
+/**
+ * Format a value recorded in a histogram in the unit Prometheus expects:
+ * durations, recorded in microseconds, in seconds, and anything else as is.
+ *
+ * Durations are formatted with integer arithmetic, so that they are exact
+ * however big they are (a double only has 15 to 17 significant digits).
+ */
+std::string formatHistogramValue(const uint64_t value, const bool isDuration) {
+  if (not isDuration) {
+    return std::to_string(value);
+  }
+  std::ostringstream out;
+  out << value / 1000000 << "." << std::setw(6) << std::setfill('0')
+      << value % 1000000;
+  return out.str();
+}
+
+} // namespace
+
+const HistogramSnapshot& ServerMetricsSnapshot::get(
+    const HistogramMetric metric) const {
+  return histograms[static_cast<std::size_t>(metric)];
+}
+
+uint64_t ServerMetricsSnapshot::get(const CounterMetric metric) const {
+  return counters[static_cast<std::size_t>(metric)];
+}
+
+ServerMetrics::ServerMetrics()
+  : id_(nextServerMetricsId.fetch_add(1)) {}
+
+void ServerMetrics::record(const HistogramMetric metric, const uint64_t value) {
+  getThreadMetrics().histograms[static_cast<std::size_t>(metric)].record(
+      value);
+}
+
+void ServerMetrics::recordDuration(
+    const HistogramMetric metric,
+    const std::chrono::steady_clock::duration duration) {
+  const auto micros =
+      std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+  record(metric, micros > 0 ? micros : 0);
+}
+
+void ServerMetrics::increment(const CounterMetric metric, const uint64_t n) {
+  // only this thread writes its counters, see Histogram::record
+  auto& counter =
+      getThreadMetrics().counters[static_cast<std::size_t>(metric)];
+  counter.store(
+      counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+ServerMetricsSnapshot ServerMetrics::getSnapshot() {
+  ServerMetricsSnapshot snapshot;
+  std::lock_guard<std::mutex> guard(mutex_);
+  for (const auto& kv : threadMetrics_) {
+    const auto& threadMetrics = *kv.second;
+    for (std::size_t i = 0; i < kNumHistogramMetrics; i++) {
+      snapshot.histograms[i].merge(threadMetrics.histograms[i].getSnapshot());
+    }
+    for (std::size_t i = 0; i < kNumCounterMetrics; i++) {
+      snapshot.counters[i] +=
+          threadMetrics.counters[i].load(std::memory_order_relaxed);
+    }
+  }
+  return snapshot;
+}
+
+ServerMetrics::ThreadMetrics& ServerMetrics::getThreadMetrics() {
+  // each thread remembers the metrics it used last, so that the map (and the
+  // mutex) are only needed the first time a thread records something
+  thread_local uint64_t cachedId = 0;
+  thread_local ThreadMetrics* cachedThreadMetrics = nullptr;
+  if (cachedId == id_) {
+    return *cachedThreadMetrics;
+  }
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto& threadMetrics = threadMetrics_[std::this_thread::get_id()];
+  if (not threadMetrics) {
+    threadMetrics.reset(new ThreadMetrics());
+  }
+  cachedId = id_;
+  cachedThreadMetrics = threadMetrics.get();
+  return *cachedThreadMetrics;
+}
+
+std::string formatPrometheusMetrics(
+    const ServerMetricsSnapshot& snapshot,
+    const std::vector<ExtraMetric>& extraMetrics) {
+  std::ostringstream out;
+
+  for (std::size_t i = 0; i < kNumCounterMetrics; i++) {
+    const auto& info = kCounterInfo[i];
+    appendMetricHeader(out, info.name, info.type, info.help);
+    out
+        << kPrometheusPrefix << info.name << " " << snapshot.counters[i]
+        << "\n";
+  }
+  for (const auto& metric : extraMetrics) {
+    appendMetricHeader(out, metric.name, metric.type, metric.help);
+    out << kPrometheusPrefix << metric.name << " " << metric.value << "\n";
+  }
+
+  // histogram buckets are cumulative, and end with a +Inf bucket holding
+  // every value
+  //
+  // a bucket counts the values less than or equal to its le bound; the
+  // values are whole microseconds (or bytes per second), so a bucket bounded
+  // by 2^n - 1 exactly holds those below 2^n, one of our bucket boundaries
+  for (std::size_t i = 0; i < kNumHistogramMetrics; i++) {
+    const auto& info = kHistogramInfo[i];
+    const auto& histogram = snapshot.histograms[i];
+    const std::string name = kPrometheusPrefix + info.prometheusName;
+    appendMetricHeader(out, info.prometheusName, "histogram", info.help);
+    for (int n = info.minExponent; n <= info.maxExponent; n++) {
+      const auto bound = (uint64_t(1) << n) - 1;
+      out
+          << name << "_bucket{le=\""
+          << formatHistogramValue(bound, info.isDuration) << "\"} "
+          << histogram.getCountAtMost(bound) << "\n";
+    }
+
+    // the buckets are read without a lock, so use their total for the count
+    // to keep the exported histogram consistent
+    uint64_t count = 0;
+    for (const auto bucketCount : histogram.counts) {
+      count += bucketCount;
+    }
+    out
+        << name << "_bucket{le=\"+Inf\"} " << count << "\n"
+        << name << "_sum "
+        << formatHistogramValue(histogram.sum, info.isDuration) << "\n"
+        << name << "_count " << count << "\n";
+  }
+  return out.str();
+}
+
+std::string formatMetricsSummary(const ServerMetricsSnapshot& snapshot) {
+  std::ostringstream out;
+  out
+      << "Connections accepted = "
+      << snapshot.get(CounterMetric::kConnectionsAccepted) << "\n"
+      << "Responses sent = " << snapshot.get(CounterMetric::kResponses)
+      << " (" << snapshot.get(CounterMetric::kFileBytesSent)
+      << " bytes of files)\n"
+      << "Timeouts = "
+      << snapshot.get(CounterMetric::kRequestTimeouts) << " request, "
+      << snapshot.get(CounterMetric::kWriteTimeouts) << " write, "
+      << snapshot.get(CounterMetric::kTransferTimeouts) << " transfer\n";
+  for (std::size_t i = 0; i < kNumHistogramMetrics; i++) {
+    const auto& info = kHistogramInfo[i];
+    const auto& histogram = snapshot.histograms[i];
+    const char* unit = info.isDuration ? " us" : " B/s";
+    out
+        << " - " << info.summaryName << ": count = " << histogram.count
+        << ", p50 = " << histogram.getPercentile(0.5) << unit
+        << ", p99 = " << histogram.getPercentile(0.99) << unit
+        << ", p999 = " << histogram.getPercentile(0.999) << unit
+        << ", max = " << histogram.max << unit << "\n";
+  }
+  return out.str();
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Histogram.h"
+
+/**
+ * Distributions measured by the server, each kept in a Histogram.
+ */
+enum class HistogramMetric {
+  // from accepting a connection until the first byte of the first response
+  // has been written to it (microseconds)
+  kAcceptToFirstByte,
+
+  // looking the requested file up in the cache and opening it (microseconds)
+  kFileOpen,
+
+  // each read of a window of a file into a stream buffer (microseconds)
+  kFileRead,
+
+  // from starting to send a response until it has been sent (microseconds)
+  kResponseSend,
+
+  // file bytes sent over a connection divided by how long it was open, once
+  // it's closed (bytes per second)
+  kConnectionThroughput,
+
+  kNumMetrics
+};
+
+/**
+ * Events counted by the server.
+ */
+enum class CounterMetric {
+  // connections accepted
+  kConnectionsAccepted,
+
+  // responses sent (including for files that weren't found)
+  kResponses,
+
+  // bytes of files sent
+  kFileBytesSent,
+
+  // connections closed because a deadline passed, see Server::checkDeadlines:
+  // the client took too long to send a request, to accept a chunk of a
+  // response, or to receive a whole response
+  kRequestTimeouts,
+  kWriteTimeouts,
+  kTransferTimeouts,
+
+  kNumMetrics
+};
+
+constexpr std::size_t kNumHistogramMetrics =
+    static_cast<std::size_t>(HistogramMetric::kNumMetrics);
+constexpr std::size_t kNumCounterMetrics =
+    static_cast<std::size_t>(CounterMetric::kNumMetrics);
+
+/**
+ * All metrics of a ServerMetrics, merged across threads.
+ */
+struct ServerMetricsSnapshot {
+  std::array<HistogramSnapshot, kNumHistogramMetrics> histograms;
+  std::array<uint64_t, kNumCounterMetrics> counters = {};
+
+  const HistogramSnapshot& get(const HistogramMetric metric) const;
+  uint64_t get(const CounterMetric metric) const;
+};
+
+/**
+ * A value to export besides those in a ServerMetricsSnapshot (e.g., the
+ * number of connected clients), see formatPrometheusMetrics.
+ */
+struct ExtraMetric {
+  // name, without the common prefix
+  std::string name;
+
+  // "counter" or "gauge"
+  std::string type;
+
+  std::string help;
+  uint64_t value = 0;
+};
+
+/**
+ * Low overhead instrumentation for the server's hot paths.
+ *
+ * Every thread that records a metric gets its own set of histograms and
+ * counters, so recording never takes a lock or contends with other threads
+ * on a cache line; a thread only takes the mutex the first time it records
+ * something. Reading the metrics (getSnapshot) merges the threads' values.
+ */
+class ServerMetrics {
+ public:
+  ServerMetrics();
+
+  ServerMetrics(const ServerMetrics&) = delete;
+  ServerMetrics& operator=(const ServerMetrics&) = delete;
+
+  /**
+   * Record a value in one of the histograms.
+   */
+  void record(const HistogramMetric metric, const uint64_t value);
+
+  /**
+   * Record a duration, in microseconds, in one of the histograms.
+   */
+  void recordDuration(
+      const HistogramMetric metric,
+      const std::chrono::steady_clock::duration duration);
+
+  /**
+   * Add n to one of the counters.
+   */
+  void increment(const CounterMetric metric, const uint64_t n = 1);
+
+  /**
+   * Return the metrics recorded so far by all threads.
+   */
+  ServerMetricsSnapshot getSnapshot();
+
+ private:
+  // metrics recorded by a single thread, on cache lines of their own
+  struct alignas(64) ThreadMetrics {
+    std::array<Histogram, kNumHistogramMetrics> histograms;
+    std::array<std::atomic<uint64_t>, kNumCounterMetrics> counters = {};
+  };
+
+  /**
+   * Return the calling thread's metrics, creating them on first use.
+   */
+  ThreadMetrics& getThreadMetrics();
+
+  // distinguishes this object from other ServerMetrics objects (including
+  // destroyed ones at the same address) in each thread's cached lookup
+  const uint64_t id_;
+
+  // hold this mutex when accessing threadMetrics_
+  std::mutex mutex_;
+  std::unordered_map<std::thread::id, std::unique_ptr<ThreadMetrics>>
+      threadMetrics_;
+};
+
+/**
+ * Return the metrics in a snapshot (and the extra metrics) in the
+ * Prometheus text exposition format, with names starting with "pa4_".
+ *
+ * Durations are exported in seconds, as is conventional for Prometheus.
+ * Values are recorded as whole microseconds (or bytes per second), and the
+ * le bound of each histogram bucket is one less than a power of two of the
+ * recorded unit; each bucket counts the values up to and including its
+ * bound, as Prometheus expects. Bounds and sums are printed exactly.
+ */
+std::string formatPrometheusMetrics(
+    const ServerMetricsSnapshot& snapshot,
+    const std::vector<ExtraMetric>& extraMetrics);
+
+/**
+ * Return a short, human readable summary of a snapshot (one line per
+ * metric), for the server's terminal.
+ */
+std::string formatMetricsSummary(const ServerMetricsSnapshot& snapshot);
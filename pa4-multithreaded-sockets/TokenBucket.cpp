@@ -0,0 +1,93 @@
+#include "TokenBucket.h"
+
+#include <algorithm>
+
+constexpr uint64_t TokenBucket::kRefillsPerSecond;
+
+TokenBucket::TokenBucket(const RateLimit& rateLimit)
+  : rateLimit_(rateLimit),
+    tokens_(0),
+    lastRefill_(std::chrono::steady_clock::now()) {
+  // start with a full bucket so the first burst can go out immediately
+  tokens_ = getBurstBytes();
+}
+
+void TokenBucket::setRateLimit(const RateLimit& rateLimit) {
+  std::lock_guard<std::mutex> guard(mutex_);
+
+  // credit tokens earned under the old rate before switching
+  refill();
+  rateLimit_ = rateLimit;
+  tokens_ = std::min(tokens_, getBurstBytes());
+}
+
+void TokenBucket::reset(const RateLimit& rateLimit) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  rateLimit_ = rateLimit;
+  tokens_ = getBurstBytes();
+  lastRefill_ = std::chrono::steady_clock::now();
+}
+
+RateLimit TokenBucket::getRateLimit() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return rateLimit_;
+}
+
+uint64_t TokenBucket::tryConsume(const uint64_t maxTokens) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (rateLimit_.bytesPerSecond == 0) {
+    return maxTokens;
+  }
+
+  // only whole tokens can be taken; fractions stay in the bucket
+  refill();
+  const auto tokensTaken =
+      std::min(maxTokens, static_cast<uint64_t>(tokens_));
+  tokens_ -= tokensTaken;
+  return tokensTaken;
+}
+
+void TokenBucket::refund(const uint64_t tokens) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (rateLimit_.bytesPerSecond == 0) {
+    return;
+  }
+  tokens_ = std::min(tokens_ + tokens, getBurstBytes());
+}
+
+std::chrono::nanoseconds TokenBucket::getRefillDelay(const uint64_t maxTokens) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  const auto rate = rateLimit_.bytesPerSecond;
+  if (rate == 0) {
+    return std::chrono::nanoseconds(0);
+  }
+
+  // wait for enough tokens to make the wakeup worthwhile, but never for more
+  // than the sender wants or the bucket can hold
+  refill();
+  const double wantedTokens = std::min(
+      {static_cast<double>(maxTokens),
+       std::max(1.0, static_cast<double>(rate) / kRefillsPerSecond),
+       getBurstBytes()});
+  const double missingTokens = wantedTokens - tokens_;
+  if (missingTokens <= 0) {
+    return std::chrono::nanoseconds(0);
+  }
+  return std::chrono::nanoseconds(
+      static_cast<int64_t>(missingTokens * 1e9 / rate) + 1);
+}
+
+void TokenBucket::refill() {
+  const auto now = std::chrono::steady_clock::now();
+  const std::chrono::duration<double> elapsed = now - lastRefill_;
+  lastRefill_ = now;
+  tokens_ = std::min(
+      tokens_ + elapsed.count() * rateLimit_.bytesPerSecond, getBurstBytes());
+}
+
+double TokenBucket::getBurstBytes() const {
+  if (rateLimit_.burstBytes != 0) {
+    return rateLimit_.burstBytes;
+  }
+  return std::max<uint64_t>(rateLimit_.bytesPerSecond, 1);
+}
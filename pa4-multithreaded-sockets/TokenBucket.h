@@ -0,0 +1,102 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * Rate and burst size for a TokenBucket.
+ */
+struct RateLimit {
+  // bytes added to the bucket per second (0 = unlimited)
+  uint64_t bytesPerSecond = 0;
+
+  // maximum number of bytes the bucket can hold (0 = one second's worth)
+  uint64_t burstBytes = 0;
+};
+
+/**
+ * Token bucket used to rate limit the number of bytes sent.
+ *
+ * Tokens (bytes) are added to the bucket at a fixed rate, up to the burst size.
+ * Senders take tokens from the bucket before sending, and may only send as many
+ * bytes as they were able to take.
+ *
+ * All functions are thread safe, so a single bucket can be shared between
+ * multiple client connections (for example, to enforce a global limit).
+ */
+class TokenBucket {
+ public:
+  explicit TokenBucket(const RateLimit& rateLimit);
+
+  /**
+   * Change the rate and burst size.
+   *
+   * Tokens currently in the bucket are kept, up to the new burst size.
+   */
+  void setRateLimit(const RateLimit& rateLimit);
+
+  /**
+   * Change the rate and burst size, and fill the bucket, as if it had just
+   * been created with the given rate limit.
+   */
+  void reset(const RateLimit& rateLimit);
+
+  /**
+   * Return the current rate and burst size.
+   */
+  RateLimit getRateLimit();
+
+  /**
+   * Take up to maxTokens tokens from the bucket.
+   *
+   * Returns the number of tokens taken, which may be zero. If the bucket is
+   * unlimited, maxTokens is always returned.
+   */
+  uint64_t tryConsume(const uint64_t maxTokens);
+
+  /**
+   * Return tokens previously taken with tryConsume that were not used.
+   */
+  void refund(const uint64_t tokens);
+
+  /**
+   * Return how long a sender that wants maxTokens tokens should wait before
+   * calling tryConsume again.
+   *
+   * To bound the number of timer wakeups, the delay is long enough to gather
+   * at least 1 / kRefillsPerSecond of a second's worth of tokens (or maxTokens,
+   * whichever is smaller). Returns zero if tokens are available now.
+   */
+  std::chrono::nanoseconds getRefillDelay(const uint64_t maxTokens);
+
+  // upper bound on how often a waiting sender is woken up
+  static constexpr uint64_t kRefillsPerSecond = 100;
+
+ private:
+  /**
+   * Add the tokens accumulated since the last refill.
+   *
+   * Must be called with mutex_ held.
+   */
+  void refill();
+
+  /**
+   * Return the burst size, substituting the default if unset.
+   *
+   * Must be called with mutex_ held.
+   */
+  double getBurstBytes() const;
+
+  // hold this mutex when accessing any of the members below
+  std::mutex mutex_;
+
+  // current rate and burst size
+  RateLimit rateLimit_;
+
+  // number of tokens currently in the bucket
+  double tokens_;
+
+  // last time tokens were added to the bucket
+  std::chrono::steady_clock::time_point lastRefill_;
+};
@@ -0,0 +1,570 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/algorithm/string.hpp>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "FileRequest.h"
+#include "Server.h"
+#include "SocketUtils.h"
+
+// Load generator for the pa4 server
+//
+// Starts a Server in this process, then M client threads that each send a
+// series of requests over a keep-alive connection (or a new connection per
+// request), timing every response. Prints a JSON summary so that results can
+// be compared across commits, e.g.:
+//
+//   make pa4-bench && ./pa4-bench --bench_clients=32 > results.json
+//
+// (`make bench` builds the benchmark and runs it with its default settings)
+//
+// All of the server's flags (--zero_copy, --file_cache_bytes, ...) apply.
+//
+// The benchmark replaces operator new to count the server's heap allocations
+// while the clients run (the clients' own allocations are left out), so that
+// the allocations per request can be compared across commits too.
+
+DEFINE_int32(
+    bench_clients, 8,
+    "Number of concurrent clients");
+DEFINE_int32(
+    bench_requests, 100,
+    "Number of requests sent by each client");
+DEFINE_string(
+    bench_file_sizes, "4096,65536,1048576",
+    "Comma separated list of file sizes in bytes; a file of each size is "
+    "created for the run, and each client requests them in turn");
+DEFINE_bool(
+    bench_text_files, false,
+    "Fill the files with lines of text instead of random bytes, so that they "
+    "compress well");
+DEFINE_bool(
+    bench_compress, false,
+    "Ask the server to compress the responses with zstd");
+DEFINE_bool(
+    bench_new_connections, false,
+    "Open a new connection for each request instead of keeping one open");
+DEFINE_int32(
+    bench_port, 0,
+    "Port the server listens on (0 = pick a free port)");
+DEFINE_string(
+    bench_output, "",
+    "File to write the JSON results to (default = stdout)");
+
+// the server's rate limit, which the benchmark turns off by default
+DECLARE_uint64(client_rate_limit);
+
+/**
+ * Timings of a single request, in microseconds since it was sent.
+ */
+struct RequestTiming {
+  // until the first byte of the response arrived
+  double timeToFirstByteUs = 0;
+
+  // until the last byte of the response arrived
+  double completionUs = 0;
+};
+
+/**
+ * Everything measured by one client thread.
+ */
+struct ClientResult {
+  std::vector<RequestTiming> timings;
+
+  // bytes of the files received, and bytes actually read from the socket
+  // (headers and, for compressed responses, chunk headers and compressed data)
+  uint64_t fileBytes = 0;
+  uint64_t wireBytes = 0;
+
+  // requests that failed (the client stops at the first one)
+  uint64_t errors = 0;
+};
+
+// heap allocations made by threads other than the benchmark's own while
+// countingAllocations is set, see operator new
+std::atomic<bool> countingAllocations(false);
+std::atomic<uint64_t> numAllocations(0);
+thread_local bool isBenchThread = false;
+
+std::vector<uint64_t> parseFileSizes(const std::string& fileSizes);
+std::string getBenchFilename(const uint64_t fileSize);
+void createBenchFile(const std::string& filename, const uint64_t fileSize);
+int pickFreePort();
+void waitForServer(const int port);
+void runBenchClient(
+    const int port,
+    const int clientIndex,
+    const std::vector<uint64_t>& fileSizes,
+    ClientResult& result);
+bool connectSocket(
+    boost::asio::ip::tcp::socket& socket,
+    const int port,
+    boost::system::error_code& error);
+bool receiveResponse(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    std::vector<char>& discardBuffer,
+    const std::chrono::steady_clock::time_point startTime,
+    RequestTiming& timing,
+    ClientResult& result,
+    boost::system::error_code& error);
+void discardBytes(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    std::vector<char>& discardBuffer,
+    uint64_t numBytes,
+    boost::system::error_code& error);
+double getPercentile(const std::vector<double>& sortedValues, const double p);
+std::string formatList(const std::vector<uint64_t>& values);
+std::string formatLatencies(std::vector<double> values);
+
+void* operator new(std::size_t size) {
+  if (countingAllocations.load(std::memory_order_relaxed) &&
+      not isBenchThread) {
+    numAllocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  // malloc(0) may return nullptr, which new must not
+  if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+
+int main(int argc, char *argv[]) {
+  isBenchThread = true;
+
+  // a client that disconnects while the server (or another client) is
+  // sending would otherwise kill the benchmark with SIGPIPE, instead of
+  // failing the send
+  std::signal(SIGPIPE, SIG_IGN);
+
+  // the server logs several lines per request, which would dominate the
+  // measurement, and its default rate limit would make it meaningless; both
+  // can still be overridden by flags
+  FLAGS_logtostderr = true;
+  FLAGS_minloglevel = google::WARNING;
+  FLAGS_client_rate_limit = 0;
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_bench_clients <= 0 || FLAGS_bench_requests <= 0) {
+    LOG(FATAL) << "--bench_clients and --bench_requests must be positive";
+  }
+  const auto fileSizes = parseFileSizes(FLAGS_bench_file_sizes);
+
+  // create the files, in the directory the server serves files from
+  for (const auto fileSize : fileSizes) {
+    createBenchFile(getBenchFilename(fileSize), fileSize);
+  }
+
+  // start the server
+  const int port = FLAGS_bench_port != 0 ? FLAGS_bench_port : pickFreePort();
+  Server server;
+  std::thread serverThread([&server, port]() {
+    const boost::asio::ip::tcp::endpoint endpoint(
+        boost::asio::ip::address_v4::loopback(), port);
+    server.run({endpoint});
+  });
+  waitForServer(port);
+
+  // run the clients, all at once
+  std::vector<ClientResult> results(FLAGS_bench_clients);
+  std::vector<std::thread> clientThreads;
+  const auto startTime = std::chrono::steady_clock::now();
+  countingAllocations = true;
+  for (int i = 0; i < FLAGS_bench_clients; i++) {
+    clientThreads.emplace_back(
+        runBenchClient, port, i, std::cref(fileSizes), std::ref(results[i]));
+  }
+  for (auto& clientThread : clientThreads) {
+    clientThread.join();
+  }
+  countingAllocations = false;
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - startTime;
+
+  server.stop();
+  serverThread.join();
+  for (const auto fileSize : fileSizes) {
+    std::remove(getBenchFilename(fileSize).c_str());
+  }
+
+  // combine the results of all clients
+  ClientResult total;
+  std::vector<double> timesToFirstByte;
+  std::vector<double> completionTimes;
+  for (const auto& result : results) {
+    for (const auto& timing : result.timings) {
+      timesToFirstByte.push_back(timing.timeToFirstByteUs);
+      completionTimes.push_back(timing.completionUs);
+    }
+    total.fileBytes += result.fileBytes;
+    total.wireBytes += result.wireBytes;
+    total.errors += result.errors;
+  }
+  const auto numRequests = completionTimes.size();
+  const auto seconds = std::max(elapsed.count(), 1e-9);
+
+  // write the results as JSON; latencies are in microseconds
+  std::ostringstream json;
+  json << std::fixed << std::setprecision(3);
+  json
+      << "{\n"
+      << "  \"clients\": " << FLAGS_bench_clients << ",\n"
+      << "  \"file_sizes\": [" << formatList(fileSizes) << "],\n"
+      << "  \"compress\": " << (FLAGS_bench_compress ? "true" : "false")
+      << ",\n"
+      << "  \"new_connections\": "
+      << (FLAGS_bench_new_connections ? "true" : "false") << ",\n"
+      << "  \"requests\": " << numRequests << ",\n"
+      << "  \"errors\": " << total.errors << ",\n"
+      << "  \"seconds\": " << seconds << ",\n"
+      << "  \"file_bytes\": " << total.fileBytes << ",\n"
+      << "  \"wire_bytes\": " << total.wireBytes << ",\n"
+      << "  \"requests_per_second\": " << numRequests / seconds << ",\n"
+      << "  \"megabytes_per_second\": "
+      << total.fileBytes / seconds / (1024 * 1024) << ",\n"
+      << "  \"server_allocations\": " << numAllocations.load() << ",\n"
+      << "  \"server_allocations_per_request\": "
+      << static_cast<double>(numAllocations.load()) /
+             std::max<std::size_t>(numRequests, 1)
+      << ",\n"
+      << "  \"time_to_first_byte_us\": "
+      << formatLatencies(std::move(timesToFirstByte)) << ",\n"
+      << "  \"completion_us\": "
+      << formatLatencies(std::move(completionTimes)) << "\n"
+      << "}\n";
+  if (FLAGS_bench_output.empty()) {
+    std::cout << json.str();
+  } else {
+    std::ofstream output(FLAGS_bench_output);
+    output << json.str();
+    if (not output) {
+      LOG(FATAL) << "Unable to write to file \"" << FLAGS_bench_output << "\"";
+    }
+  }
+  return total.errors == 0 ? 0 : 1;
+}
+
+/**
+ * Parse the comma separated list of file sizes passed to --bench_file_sizes.
+ */
+std::vector<uint64_t> parseFileSizes(const std::string& fileSizes) {
+  std::vector<std::string> fields;
+  boost::split(fields, fileSizes, boost::is_any_of(","));
+  std::vector<uint64_t> sizes;
+  for (const auto& field : fields) {
+    try {
+      std::size_t pos = 0;
+      const auto size = std::stoull(field, &pos);
+      if (pos != field.size() || size == 0) {
+        throw std::invalid_argument(field);
+      }
+      sizes.push_back(size);
+    } catch (const std::exception&) {
+      LOG(FATAL) << "Invalid file size \"" << field << "\"";
+    }
+  }
+  return sizes;
+}
+
+/**
+ * Return the name of the file created for a file size.
+ */
+std::string getBenchFilename(const uint64_t fileSize) {
+  return "bench-" + std::to_string(fileSize) + ".dat";
+}
+
+/**
+ * Create a file of fileSize bytes, filled with random bytes or (with
+ * --bench_text_files) lines of text.
+ */
+void createBenchFile(const std::string& filename, const uint64_t fileSize) {
+  std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+  std::mt19937_64 generator(fileSize);
+  std::string block;
+  for (uint64_t written = 0; written < fileSize; written += block.size()) {
+    block.clear();
+    if (FLAGS_bench_text_files) {
+      block = "line " + std::to_string(generator() % 100000) +
+          " of a file that compresses well\n";
+    } else {
+      for (int i = 0; i < 512; i++) {
+        const auto value = generator();
+        block.append(reinterpret_cast<const char*>(&value), sizeof(value));
+      }
+    }
+    if (block.size() > fileSize - written) {
+      block.resize(fileSize - written);
+    }
+    file.write(block.data(), block.size());
+  }
+  if (not file) {
+    LOG(FATAL) << "Unable to create file \"" << filename << "\"";
+  }
+}
+
+/**
+ * Return a port that nothing is listening on right now, by letting the
+ * kernel pick one.
+ */
+int pickFreePort() {
+  boost::asio::io_service ioService;
+  boost::asio::ip::tcp::acceptor acceptor(
+      ioService,
+      boost::asio::ip::tcp::endpoint(
+          boost::asio::ip::address_v4::loopback(), 0));
+  return acceptor.local_endpoint().port();
+}
+
+/**
+ * Wait until the server accepts connections, since Server::run doesn't tell
+ * us when it is listening.
+ */
+void waitForServer(const int port) {
+  boost::asio::io_service ioService;
+  boost::system::error_code error;
+  for (int attempt = 0; attempt < 500; attempt++) {
+    boost::asio::ip::tcp::socket socket(ioService);
+    if (connectSocket(socket, port, error)) {
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  LOG(FATAL)
+      << "Server is not accepting connections: "
+      << boost::system::system_error(error).what();
+}
+
+/**
+ * Body of each client thread: send --bench_requests requests, cycling through
+ * the files (starting with a different one for each client), and time each
+ * response.
+ */
+void runBenchClient(
+    const int port,
+    const int clientIndex,
+    const std::vector<uint64_t>& fileSizes,
+    ClientResult& result) {
+  isBenchThread = true;
+  boost::asio::io_service ioService;
+  boost::asio::ip::tcp::socket socket(ioService);
+  boost::asio::streambuf rcvBuffer;
+  std::vector<char> discardBuffer(64 * 1024);
+  boost::system::error_code error;
+  result.timings.reserve(FLAGS_bench_requests);
+
+  for (int i = 0; i < FLAGS_bench_requests; i++) {
+    if (not socket.is_open() && not connectSocket(socket, port, error)) {
+      break;
+    }
+
+    FileRequest request;
+    request.filename =
+        getBenchFilename(fileSizes[(clientIndex + i) % fileSizes.size()]);
+    request.compress = FLAGS_bench_compress;
+    const auto message = formatFileRequest(request) + kDelimiter;
+    const auto startTime = std::chrono::steady_clock::now();
+    sendBytes(socket, message, error);
+    RequestTiming timing;
+    if (error ||
+        not receiveResponse(
+            socket, rcvBuffer, discardBuffer, startTime, timing, result,
+            error)) {
+      break;
+    }
+    result.timings.push_back(timing);
+
+    if (FLAGS_bench_new_connections) {
+      socket.close();
+      rcvBuffer.consume(rcvBuffer.size());
+    }
+  }
+
+  if (result.timings.size() < static_cast<std::size_t>(FLAGS_bench_requests)) {
+    LOG(ERROR)
+        << "Client " << clientIndex << " stopped after "
+        << result.timings.size() << " requests: "
+        << (error ? boost::system::system_error(error).what()
+                  : "file not found");
+    result.errors++;
+  }
+}
+
+/**
+ * Connect the socket to the server on the loopback interface.
+ */
+bool connectSocket(
+    boost::asio::ip::tcp::socket& socket,
+    const int port,
+    boost::system::error_code& error) {
+  socket.connect(
+      boost::asio::ip::tcp::endpoint(
+          boost::asio::ip::address_v4::loopback(), port),
+      error);
+  if (error) {
+    socket.close();
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Receive the response to a request sent at startTime, setting its timings.
+ *
+ * The file's bytes are read and thrown away. Compressed responses are not
+ * decompressed either, since we're measuring the server and not the client.
+ * Returns false if the request failed.
+ */
+bool receiveResponse(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    std::vector<char>& discardBuffer,
+    const std::chrono::steady_clock::time_point startTime,
+    RequestTiming& timing,
+    ClientResult& result,
+    boost::system::error_code& error) {
+  // wait for the first byte of the response (with new connections, there
+  // can't be any left over from the previous response)
+  if (rcvBuffer.size() == 0) {
+    boost::asio::read(
+        socket, rcvBuffer, boost::asio::transfer_at_least(1), error);
+    if (error) {
+      return false;
+    }
+  }
+  const auto firstByteTime = std::chrono::steady_clock::now();
+
+  // the header holds the number of bytes that follow, see FileRequest
+  auto header = readUntilDelimiter(socket, rcvBuffer, kDelimiter, error);
+  if (error) {
+    return false;
+  }
+  result.wireBytes += header.size() + kDelimiter.size();
+  const bool compressed = boost::ends_with(header, ";zstd");
+  const auto numBytes = std::strtoull(header.c_str(), nullptr, 10);
+  if (numBytes == 0) {
+    // the file wasn't found
+    return false;
+  }
+
+  if (not compressed) {
+    discardBytes(socket, rcvBuffer, discardBuffer, numBytes, error);
+    if (error) {
+      return false;
+    }
+    result.wireBytes += numBytes;
+  } else {
+    // chunks of compressed bytes follow, up to an empty one
+    for (;;) {
+      const auto chunkHeader =
+          readUntilDelimiter(socket, rcvBuffer, kDelimiter, error);
+      if (error) {
+        return false;
+      }
+      const auto chunkBytes = std::strtoull(chunkHeader.c_str(), nullptr, 10);
+      result.wireBytes += chunkHeader.size() + kDelimiter.size() + chunkBytes;
+      if (chunkBytes == 0) {
+        break;
+      }
+      discardBytes(socket, rcvBuffer, discardBuffer, chunkBytes, error);
+      if (error) {
+        return false;
+      }
+    }
+  }
+  result.fileBytes += numBytes;
+
+  const auto endTime = std::chrono::steady_clock::now();
+  timing.timeToFirstByteUs =
+      std::chrono::duration<double, std::micro>(firstByteTime - startTime)
+          .count();
+  timing.completionUs =
+      std::chrono::duration<double, std::micro>(endTime - startTime).count();
+  return true;
+}
+
+/**
+ * Read numBytes bytes from the socket (or rcvBuffer) and throw them away.
+ */
+void discardBytes(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    std::vector<char>& discardBuffer,
+    uint64_t numBytes,
+    boost::system::error_code& error) {
+  while (numBytes > 0) {
+    const auto bytesToRead =
+        std::min<uint64_t>(numBytes, discardBuffer.size());
+    readBytes(
+        socket, rcvBuffer,
+        boost::asio::buffer(discardBuffer.data(), bytesToRead), error);
+    if (error) {
+      return;
+    }
+    numBytes -= bytesToRead;
+  }
+}
+
+/**
+ * Return the p-th percentile (0 < p <= 1) of a sorted list of values, using
+ * the nearest rank method.
+ */
+double getPercentile(const std::vector<double>& sortedValues, const double p) {
+  if (sortedValues.empty()) {
+    return 0;
+  }
+  const auto rank = static_cast<std::size_t>(
+      std::ceil(p * sortedValues.size()));
+  return sortedValues[std::max<std::size_t>(rank, 1) - 1];
+}
+
+/**
+ * Format a list of values as the elements of a JSON array.
+ */
+std::string formatList(const std::vector<uint64_t>& values) {
+  std::string list;
+  for (const auto value : values) {
+    list += (list.empty() ? "" : ", ") + std::to_string(value);
+  }
+  return list;
+}
+
+/**
+ * Format the distribution of a list of latencies as a JSON object.
+ */
+std::string formatLatencies(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  std::ostringstream json;
+  json << std::fixed << std::setprecision(1)
+       << "{\"p50\": " << getPercentile(values, 0.5)
+       << ", \"p99\": " << getPercentile(values, 0.99)
+       << ", \"p999\": " << getPercentile(values, 0.999)
+       << ", \"max\": " << (values.empty() ? 0 : values.back())
+       << "}";
+  return json.str();
+}
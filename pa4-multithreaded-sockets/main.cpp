@@ -1,17 +1,28 @@
 #include <algorithm>
+#include <cerrno>
 #include <chrono>
-#include <fstream>
+#include <csignal>
+#include <cstring>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <mutex>
 #include <thread>
 #include <unordered_map>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <boost/asio.hpp>
 #include <boost/algorithm/string.hpp>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include "AsyncLog.h"
+#include "Checksum.h"
+#include "Compression.h"
+#include "FileWriter.h"
+#include "ProgressMeter.h"
 #include "Server.h"
 #include "SocketUtils.h"
 
@@ -23,17 +34,140 @@ DEFINE_bool(
     server, false,
     "Whether to operate in server or client mode (true = server)");
 
+// Flags only used for server
+DEFINE_string(
+    listen, "0.0.0.0",
+    "Comma separated list of addresses to listen on, each optionally with a "
+    "port (default = --port), e.g. 0.0.0.0,[::1]:9000; the IPv6 wildcard "
+    "address [::] also accepts IPv4 connections, unless an IPv4 address is "
+    "listed with the same port");
+DEFINE_string(
+    config_file, "",
+    "File of flags applied at startup, and again on SIGHUP or the `reload` "
+    "command, e.g. --global_rate_limit=1000000 on a line; only the rate "
+    "limits, file_cache_bytes and the connection timeouts may be set");
+DEFINE_uint64(
+    drain_timeout_ms, 30000,
+    "Milliseconds the `drain` command waits for responses in progress to be "
+    "sent before disconnecting their clients, unless it's given a timeout");
+DEFINE_bool(
+    async_logging, true,
+    "Write the server's per-connection log messages from a background thread "
+    "instead of the threads handling clients (see AsyncLog.h)");
+
 // Flags only used for client
 DEFINE_string(
     ip_address, "127.0.0.1",
     "IP address for server / where server is running");
 DEFINE_string(
     filename, "",
-    "Filename to capture from remote server");
+    "Filename to capture from remote server (a comma separated list requests "
+    "several files over one connection)");
+DEFINE_uint64(
+    offset, 0,
+    "Offset of the first byte of the file(s) to request");
+DEFINE_int64(
+    length, -1,
+    "Number of bytes of the file(s) to request (-1 = to the end of the file)");
+DEFINE_string(
+    output_file, "",
+    "File to save a single requested file to; byte ranges are written at "
+    "their offset without truncating the file, so a partial download can be "
+    "resumed (default = <filename>.<timestamp>)");
+DEFINE_bool(
+    binary_framing, false,
+    "Talk to the server with binary, length prefixed frames instead of '#' "
+    "delimited messages");
+DEFINE_bool(
+    compress, false,
+    "Ask the server to compress the file(s) with zstd while sending them");
+DEFINE_bool(
+    checksum, false,
+    "Ask the server for a CRC32C checksum of each response, and check the "
+    "bytes received against it as they arrive");
+DEFINE_int32(
+    connections, 1,
+    "Number of connections used to download a single file in parallel, each "
+    "fetching one byte range of the file");
+DEFINE_int32(
+    busy_retries, 3,
+    "Number of times to connect again, after the delay the server asks for, "
+    "if the server is too busy to serve a connection");
+DEFINE_uint64(
+    receive_chunk_bytes, 1024 * 1024,
+    "Bytes read from the socket and written to the output file at a time, so "
+    "that a download never has to fit in memory");
+DEFINE_bool(
+    preallocate, false,
+    "Reserve the disk space for a download before receiving it, with "
+    "fallocate(), so that the output file isn't fragmented");
+DEFINE_bool(
+    direct_io, false,
+    "Write downloads with O_DIRECT, bypassing the page cache, so that a large "
+    "download doesn't evict everything else from memory (falls back to "
+    "buffered writes where unsupported)");
+DEFINE_bool(
+    progress, false,
+    "Show the progress and throughput of each download on stderr");
 
 void runServer();
+void reloadOnHangup(boost::asio::signal_set& hangupSignal, Server& server);
 void runServerTerminal(Server& server);
+bool parseRateLimit(
+    const std::vector<std::string>& commandFields,
+    const size_t firstField,
+    RateLimit& rateLimit);
+std::string rateLimitToString(const RateLimit& rateLimit);
 void runClient();
+void connectToServer(boost::asio::ip::tcp::socket& socket);
+void sendRequests(
+    boost::asio::ip::tcp::socket& socket,
+    const std::vector<FileRequest>& requests);
+void connectAndSendRequests(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const std::vector<FileRequest>& requests);
+bool readBusyResponse(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    uint64_t& retryAfterMs);
+bool readResponseHeader(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const uint32_t requestId,
+    uint64_t& numBytes,
+    uint64_t& fileSize,
+    bool& compressed,
+    bool& checksummed);
+void receiveCompressedBytes(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const uint32_t requestId,
+    const uint64_t numBytes,
+    std::vector<char>& outputFileBuf,
+    const std::function<void(const char*, std::size_t)>& onBytes);
+bool verifyChecksum(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const uint32_t requestId,
+    const std::string& filename,
+    const uint32_t checksum);
+void receiveFile(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const FileRequest& request,
+    const uint32_t requestId,
+    std::vector<char>& outputFileBuf);
+void runParallelClient(
+    boost::asio::ip::tcp::socket& socket,
+    const std::string& filename);
+void receiveRange(
+    const std::string& filename,
+    const std::string& localFilename,
+    const uint64_t offset,
+    const uint64_t length,
+    ProgressMeter& progress);
+FileWriterOptions getFileWriterOptions();
 
 int main(int argc, char *argv[]) {
   // setup Google logging and flags
@@ -63,15 +197,42 @@ int main(int argc, char *argv[]) {
 }
 
 void runServer() {
-  // create a server object
+  // from here on, messages logged with ASYNC_LOG are buffered
+  if (FLAGS_async_logging) {
+    startAsyncLogging();
+  }
+
+  // determine the endpoints to listen on (without any DNS lookups, which
+  // could hold up startup for as long as the resolver takes to time out)
+  const auto endpoints = parseEndpoints(FLAGS_listen, FLAGS_port);
+
+  // a client that goes away in the middle of a sendfile() would otherwise
+  // kill the whole server with SIGPIPE, instead of failing the send
+  std::signal(SIGPIPE, SIG_IGN);
+
+  // create a server object, and apply the configuration file on top of the
+  // flags given on the command line
   Server server;
+  if (not FLAGS_config_file.empty() &&
+      not server.reloadConfig(FLAGS_config_file)) {
+    LOG(FATAL) << "Invalid configuration file " << FLAGS_config_file;
+  }
+
+  // reload the configuration file on SIGHUP
+  //
+  // the signal is handled by an io_service (and thread) of its own, so that
+  // a reload never runs on, or waits for, one of the server's threads
+  boost::asio::io_service signalService;
+  boost::asio::signal_set hangupSignal(signalService);
+  if (not FLAGS_config_file.empty()) {
+    hangupSignal.add(SIGHUP);
+    reloadOnHangup(hangupSignal, server);
+  }
+  std::thread signalThread([&signalService]() { signalService.run(); });
 
   // create a thread that calls Server::run
-  std::thread serverThread([&server](){
-    // create endpoint to listen on
-    const boost::asio::ip::tcp::endpoint endpoint(
-        boost::asio::ip::tcp::v4(), FLAGS_port);
-    server.run(endpoint);
+  std::thread serverThread([&server, &endpoints](){
+    server.run(endpoints);
   });
 
   // create a thread with simple logic that operates on the server
@@ -91,12 +252,31 @@ void runServer() {
   // wait on the server thread to exit
   LOG(INFO) << "Waiting on server thread(s) to shutdown";
   serverThread.join();
+  signalService.stop();
+  signalThread.join();
+  stopAsyncLogging();
 
   // done
   LOG(INFO) << "Exiting";
   std::cout << "Exiting" << std::endl;
 }
 
+/**
+ * Wait for SIGHUP, then reload FLAGS_config_file and wait again.
+ */
+void reloadOnHangup(boost::asio::signal_set& hangupSignal, Server& server) {
+  hangupSignal.async_wait(
+      [&hangupSignal, &server](
+          const boost::system::error_code& error, const int) {
+        if (error) {
+          return;
+        }
+        LOG(INFO) << "Received SIGHUP, reloading " << FLAGS_config_file;
+        server.reloadConfig(FLAGS_config_file);
+        reloadOnHangup(hangupSignal, server);
+      });
+}
+
 void runServerTerminal(Server& server) {
   std::cout << "Starting server terminal..." << std::endl;
   // loop until "shutdown" is called
@@ -122,7 +302,21 @@ void runServerTerminal(Server& server) {
       //
       // Connected clients:
       //  - Client ID <#> | filename = <filename> | transferred X out of Y bytes
+      //
+      // with " (from offset Z)" appended for byte range requests, and
+      // " | compressed to C bytes" for compressed responses (X and Y count
+      // the file's bytes, C the bytes actually sent)
       //  ...
+      //
+      // followed by the state of admission control:
+      //
+      // Connections: A active (max M), Q queued (max L), R turned away
+      //
+      // and by the number of connections closed because they timed out:
+      //
+      // Timeouts: X waiting for a request, Y writing, Z for a whole response
+      const auto admissionStats = server.getAdmissionStats();
+      const auto metrics = server.getMetrics();
       if (clientIdToRequestInfo.empty()) {
         std::cout << "No clients currently connected" << std::endl;
       } else {
@@ -140,11 +334,87 @@ void runServerTerminal(Server& server) {
               << " | filename = " << filename
               << " | transferred " << bytesTransferred
               << " out of " << bytesToTransfer
-              << " bytes"
-              << std::endl;
+              << " bytes";
+          if (requestInfo.offset > 0) {
+            std::cout << " (from offset " << requestInfo.offset << ")";
+          }
+          if (requestInfo.compressed) {
+            std::cout
+                << " | compressed to " << requestInfo.compressedBytesSent
+                << " bytes";
+          }
+          std::cout << std::endl;
         }
         std::cout << "-------------------------------------------" << std::endl;
       }
+      std::cout
+          << "Connections: " << admissionStats.activeConnections
+          << " active (max "
+          << (admissionStats.maxConnections == 0
+                  ? "unlimited"
+                  : std::to_string(admissionStats.maxConnections))
+          << "), " << admissionStats.queuedConnections << " queued (max "
+          << admissionStats.maxQueuedConnections << "), "
+          << admissionStats.connectionsRejected << " turned away"
+          << std::endl;
+      std::cout
+          << "Timeouts: " << metrics.get(CounterMetric::kRequestTimeouts)
+          << " waiting for a request, "
+          << metrics.get(CounterMetric::kWriteTimeouts) << " writing, "
+          << metrics.get(CounterMetric::kTransferTimeouts)
+          << " for a whole response" << std::endl;
+      continue;
+    }
+
+    // handle "stats" command
+    if (commandFields[0] == "stats") {
+      const auto cacheStats = server.getFileCacheStats();
+      std::cout << "-------------------------------------------" << std::endl;
+      std::cout
+          << "File cache: "
+          << cacheStats.entries << " files, "
+          << cacheStats.bytes << " out of " << cacheStats.capacityBytes
+          << " bytes" << std::endl
+          << " - hits = " << cacheStats.hits << std::endl
+          << " - misses = " << cacheStats.misses << std::endl
+          << " - bypasses = " << cacheStats.bypasses << std::endl
+          << " - evictions = " << cacheStats.evictions << std::endl
+          << " - compressed copies = " << cacheStats.compressedEntries
+          << " (" << cacheStats.compressedBytes << " bytes)" << std::endl
+          << " - compressed hits = " << cacheStats.compressedHits << std::endl
+          << " - compressed misses = " << cacheStats.compressedMisses
+          << std::endl;
+
+      // allocated counts the objects the pools had to allocate; once the
+      // pools have warmed up, new connections should only add to reused
+      const auto connectionPoolStats = server.getConnectionPoolStats();
+      const auto bufferPoolStats = server.getStreamBufferPoolStats();
+      std::cout << "-------------------------------------------" << std::endl;
+      std::cout
+          << "Connection pool: " << connectionPoolStats.idle << " idle"
+          << std::endl
+          << " - allocated = " << connectionPoolStats.allocated << std::endl
+          << " - reused = " << connectionPoolStats.reused << std::endl
+          << "Stream buffer pool: " << bufferPoolStats.idle << " idle"
+          << std::endl
+          << " - allocated = " << bufferPoolStats.allocated << std::endl
+          << " - reused = " << bufferPoolStats.reused << std::endl;
+
+      // waits only happen while the global rate limit is the bottleneck
+      const auto egressStats = server.getEgressStats();
+      std::cout << "-------------------------------------------" << std::endl;
+      std::cout
+          << "Egress scheduler ("
+          << getEgressPolicyName(server.getEgressPolicy()) << "): "
+          << egressStats.waitingFlows << " waiting" << std::endl
+          << " - waits = " << egressStats.waits << std::endl
+          << " - scheduled bytes = " << egressStats.scheduledBytes
+          << std::endl;
+
+      // latencies are in microseconds, see ServerMetrics
+      std::cout << "-------------------------------------------" << std::endl;
+      std::cout << formatMetricsSummary(server.getMetrics());
+      std::cout << "-------------------------------------------" << std::endl;
       continue;
     }
 
@@ -177,6 +447,175 @@ void runServerTerminal(Server& server) {
       continue;
     }
 
+    // handle "ratelimit" command
+    //
+    //   ratelimit                              show current limits
+    //   ratelimit global <bytes/s> [burst]     limit shared by all clients
+    //   ratelimit default <bytes/s> [burst]    limit for every client
+    //   ratelimit client <id> <bytes/s> [burst]
+    //
+    // a rate of 0 removes the limit
+    if (commandFields[0] == "ratelimit") {
+      if (commandFields.size() == 1) {
+        std::cout
+            << "Global rate limit: "
+            << rateLimitToString(server.getGlobalRateLimit()) << std::endl
+            << "Default client rate limit: "
+            << rateLimitToString(server.getDefaultClientRateLimit())
+            << std::endl;
+        continue;
+      }
+
+      RateLimit rateLimit;
+      if (commandFields[1] == "global" &&
+          parseRateLimit(commandFields, 2, rateLimit)) {
+        server.setGlobalRateLimit(rateLimit);
+        std::cout
+            << "Global rate limit set to "
+            << rateLimitToString(rateLimit) << std::endl;
+        continue;
+      }
+      if (commandFields[1] == "default" &&
+          parseRateLimit(commandFields, 2, rateLimit)) {
+        server.setDefaultClientRateLimit(rateLimit);
+        std::cout
+            << "Default client rate limit set to "
+            << rateLimitToString(rateLimit) << std::endl;
+        continue;
+      }
+      if (commandFields[1] == "client" && commandFields.size() >= 3 &&
+          parseRateLimit(commandFields, 3, rateLimit)) {
+        int clientId = 0;
+        try {
+          clientId = std::stoi(commandFields[2]);
+        } catch (const std::logic_error& e) {
+          std::cout << "Invalid arguments for `ratelimit` command" << std::endl;
+          continue;
+        }
+        if (server.setClientRateLimit(clientId, rateLimit)) {
+          std::cout
+              << "Rate limit for client ID " << clientId << " set to "
+              << rateLimitToString(rateLimit) << std::endl;
+        } else {
+          std::cout
+              << "Unable to set rate limit for client ID " << clientId
+              << std::endl;
+        }
+        continue;
+      }
+
+      std::cout << "Invalid arguments for `ratelimit` command" << std::endl;
+      continue;
+    }
+
+    // handle "weight" command
+    //
+    //   weight                         show the egress policy and weight
+    //   weight default <weight>        weight of every client
+    //   weight client <id> <weight>
+    //
+    // with --egress_policy=drr, clients waiting on the global rate limit get
+    // a share of it in proportion to their weights
+    if (commandFields[0] == "weight") {
+      if (commandFields.size() == 1) {
+        std::cout
+            << "Egress policy: "
+            << getEgressPolicyName(server.getEgressPolicy()) << std::endl
+            << "Default client weight: " << server.getDefaultClientWeight()
+            << std::endl;
+        continue;
+      }
+
+      uint64_t weight = 0;
+      int clientId = 0;
+      try {
+        if (commandFields[1] == "default" && commandFields.size() == 3) {
+          weight = std::stoull(commandFields[2]);
+        } else if (commandFields[1] == "client" && commandFields.size() == 4) {
+          clientId = std::stoi(commandFields[2]);
+          weight = std::stoull(commandFields[3]);
+        }
+      } catch (const std::logic_error& e) {
+        weight = 0;
+      }
+      if (weight == 0) {
+        std::cout << "Invalid arguments for `weight` command" << std::endl;
+        continue;
+      }
+
+      if (commandFields[1] == "default") {
+        server.setDefaultClientWeight(weight);
+        std::cout << "Default client weight set to " << weight << std::endl;
+      } else if (server.setClientWeight(clientId, weight)) {
+        std::cout
+            << "Weight for client ID " << clientId << " set to " << weight
+            << std::endl;
+      } else {
+        std::cout
+            << "Unable to set weight for client ID " << clientId << std::endl;
+      }
+      continue;
+    }
+
+    // handle "reload" command, applying FLAGS_config_file again
+    if (commandFields[0] == "reload") {
+      if (FLAGS_config_file.empty()) {
+        std::cout << "No configuration file to reload (see --config_file)"
+                  << std::endl;
+      } else if (server.reloadConfig(FLAGS_config_file)) {
+        std::cout << "Reloaded " << FLAGS_config_file << std::endl;
+      } else {
+        std::cout
+            << "Unable to reload " << FLAGS_config_file
+            << ", see the log for why" << std::endl;
+      }
+      continue;
+    }
+
+    // handle "drain" command
+    //
+    //   drain [seconds]
+    //
+    // stops accepting connections and shuts the server down once the
+    // responses in progress have been sent, or the timeout (by default
+    // FLAGS_drain_timeout_ms) has passed
+    if (commandFields[0] == "drain") {
+      auto timeout = std::chrono::milliseconds(FLAGS_drain_timeout_ms);
+      if (commandFields.size() == 2) {
+        try {
+          timeout = std::chrono::seconds(std::stoull(commandFields[1]));
+        } catch (const std::logic_error& e) {
+          std::cout << "Invalid arguments for `drain` command" << std::endl;
+          continue;
+        }
+      } else if (commandFields.size() > 2) {
+        std::cout << "Invalid arguments for `drain` command" << std::endl;
+        continue;
+      }
+      server.drain(timeout);
+
+      // report progress once a second, until the last client is gone
+      while (true) {
+        const auto clientIdToRequestInfo =
+            server.getConnectedClientsWithInfo();
+        if (clientIdToRequestInfo.empty()) {
+          break;
+        }
+        uint64_t bytesLeft = 0;
+        for (const auto& kv : clientIdToRequestInfo) {
+          bytesLeft +=
+              kv.second.bytesToTransfer - kv.second.bytesTransferred;
+        }
+        std::cout
+            << "Draining: " << clientIdToRequestInfo.size()
+            << " client(s) left, " << bytesLeft << " bytes still to send"
+            << std::endl;
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+      }
+      std::cout << "All clients drained, exiting server terminal" << std::endl;
+      break;
+    }
+
     // handle "shutdown" command
     if (commandFields[0] == "shutdown") {
       std::cout << "Exiting server terminal" << std::endl;
@@ -188,14 +627,144 @@ void runServerTerminal(Server& server) {
   }
 }
 
-void runClient() {
-  const auto remoteIp = FLAGS_ip_address;
-  const auto remotePort = FLAGS_port;
+/**
+ * Parse "<bytes/s> [burst]" starting at commandFields[firstField].
+ *
+ * Returns whether the fields were valid.
+ */
+bool parseRateLimit(
+    const std::vector<std::string>& commandFields,
+    const size_t firstField,
+    RateLimit& rateLimit) {
+  const auto numFields = commandFields.size();
+  if (numFields != firstField + 1 && numFields != firstField + 2) {
+    return false;
+  }
+
+  // std::stoull throws invalid_argument or out_of_range (both logic_errors)
+  try {
+    rateLimit.bytesPerSecond = std::stoull(commandFields[firstField]);
+    rateLimit.burstBytes = 0;
+    if (numFields == firstField + 2) {
+      rateLimit.burstBytes = std::stoull(commandFields[firstField + 1]);
+    }
+  } catch (const std::logic_error& e) {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Return a human readable description of a RateLimit.
+ */
+std::string rateLimitToString(const RateLimit& rateLimit) {
+  if (rateLimit.bytesPerSecond == 0) {
+    return "unlimited";
+  }
+  std::string description =
+      std::to_string(rateLimit.bytesPerSecond) + " bytes/s";
+  if (rateLimit.burstBytes != 0) {
+    description += ", burst " + std::to_string(rateLimit.burstBytes) + " bytes";
+  }
+  return description;
+}
 
-  // create an ASIO instance and a socket
+void runClient() {
+  // create an ASIO instance and a socket; we connect to the server once we
+  // know what to ask it for
   boost::asio::io_service ioService;
   boost::asio::ip::tcp::socket socket(ioService);
 
+  // let the user specity what file(s) they want, unless set by flag
+  //
+  // several files can be requested at once by separating them with commas;
+  // they're all fetched over the same connection
+  std::string filenames = FLAGS_filename;
+  if (filenames.empty()) {
+    std::cout
+        << "Enter filename(s) to retrieve (separated by commas): "
+        << std::flush;
+    std::getline(std::cin, filenames);
+  }
+  std::vector<std::string> filenameList;
+  boost::split(filenameList, filenames, boost::is_any_of(","));
+  filenameList.erase(
+      std::remove(filenameList.begin(), filenameList.end(), ""),
+      filenameList.end());
+  if (filenameList.empty()) {
+    LOG(FATAL) << "No filename to retrieve";
+  }
+  if (not FLAGS_output_file.empty() && filenameList.size() > 1) {
+    LOG(FATAL) << "An output file can only be set when requesting one file";
+  }
+
+  // a single file may be split across several connections instead
+  if (FLAGS_connections > 1) {
+    if (filenameList.size() > 1) {
+      LOG(FATAL) << "Only one file can be downloaded over several connections";
+    }
+    if (FLAGS_offset > 0 || FLAGS_length >= 0) {
+      LOG(FATAL) << "A byte range cannot be combined with several connections";
+    }
+    if (FLAGS_compress) {
+      LOG(FATAL) << "Compression cannot be combined with several connections";
+    }
+    runParallelClient(socket, filenameList.front());
+    LOG(INFO) << "Client exiting";
+    return;
+  }
+
+  // build a request for each file, restricting it to a byte range if one was
+  // set by flag
+  std::vector<FileRequest> requestList;
+  for (const auto& filename : filenameList) {
+    FileRequest request;
+    request.filename = filename;
+    request.compress = FLAGS_compress;
+    request.checksum = FLAGS_checksum;
+    if (FLAGS_offset > 0 || FLAGS_length >= 0) {
+      request.hasRange = true;
+      request.offset = FLAGS_offset;
+      if (FLAGS_length >= 0) {
+        request.length = FLAGS_length;
+      }
+    }
+    requestList.push_back(request);
+  }
+
+  // send all of the requests back to back, without waiting for replies
+  //
+  // the server answers them in order on the same connection, so we only pay
+  // for one connection setup (and one round trip) for the whole batch
+  boost::asio::streambuf rcvBuffer;
+  connectAndSendRequests(socket, rcvBuffer, requestList);
+
+  // receive the responses in the order we sent the requests
+  //
+  // the same rcvBuffer is used for all of them, since reading one response's
+  // header may pull in bytes that belong to the next response
+  //
+  // each file is received a chunk at a time through the same outputFileBuf,
+  // so a batch of pipelined requests only allocates one chunk
+  std::vector<char> outputFileBuf;
+
+  // with binary framing, request IDs are the requests' positions in the list,
+  // starting at one (see sendRequests)
+  for (std::size_t i = 0; i < requestList.size(); i++) {
+    receiveFile(socket, rcvBuffer, requestList[i], i + 1, outputFileBuf);
+  }
+
+  // done
+  LOG(INFO) << "Client exiting";
+}
+
+/**
+ * Connect the socket to the server given by flags.
+ */
+void connectToServer(boost::asio::ip::tcp::socket& socket) {
+  const auto remoteIp = FLAGS_ip_address;
+  const auto remotePort = FLAGS_port;
+
   // connect the socket to the remote system
   LOG(INFO) << "Connecting to " << remoteIp << ":" << remotePort;
   boost::asio::ip::tcp::endpoint endpoint(
@@ -208,56 +777,658 @@ void runClient() {
         << boost::system::system_error(error).what();
   }
   LOG(INFO) << "Connected to remote endpoint";
+}
+
+/**
+ * Send requests to the server, all in a single write.
+ *
+ * With binary framing, the requests are preceded by a kHello frame, and each
+ * request's ID is its position in the list, starting at one.
+ */
+void sendRequests(
+    boost::asio::ip::tcp::socket& socket,
+    const std::vector<FileRequest>& requests) {
+  std::string requestBytes;
+  if (FLAGS_binary_framing) {
+    FrameHeader helloHeader;
+    helloHeader.type = FrameType::kHello;
+    appendFrameHeader(requestBytes, helloHeader);
+  }
+  for (std::size_t i = 0; i < requests.size(); i++) {
+    const auto message = formatFileRequest(requests[i]);
+    LOG(INFO) << "Requesting file " << message;
+    if (FLAGS_binary_framing) {
+      FrameHeader header;
+      header.type = FrameType::kRequest;
+      header.requestId = i + 1;
+      header.length = message.size();
+      appendFrameHeader(requestBytes, header);
+      requestBytes += message;
+    } else {
+      requestBytes += message + kDelimiter;
+    }
+  }
+  sendBytes(socket, requestBytes);
+}
+
+/**
+ * Connect to the server given by flags and send requests to it (see
+ * sendRequests).
+ *
+ * If the server is too busy to serve the connection, waits for as long as it
+ * asks for and tries again, up to FLAGS_busy_retries times.
+ */
+void connectAndSendRequests(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const std::vector<FileRequest>& requests) {
+  for (int attempt = 0;; attempt++) {
+    connectToServer(socket);
+    sendRequests(socket, requests);
+    uint64_t retryAfterMs = 0;
+    if (not readBusyResponse(socket, rcvBuffer, retryAfterMs)) {
+      return;
+    }
+    if (attempt >= FLAGS_busy_retries) {
+      LOG(FATAL)
+          << "Server is busy, giving up after " << attempt + 1
+          << " attempt(s)";
+    }
+    LOG(INFO) << "Server is busy, trying again in " << retryAfterMs << " ms";
+    boost::system::error_code ignoredError;
+    socket.close(ignoredError);
+    rcvBuffer.consume(rcvBuffer.size());
+    std::this_thread::sleep_for(std::chrono::milliseconds(retryAfterMs));
+  }
+}
+
+/**
+ * Wait for the server's first bytes on a connection, and check whether they
+ * are a busy response (see FileRequest.h).
+ *
+ * If so, consumes the response, sets retryAfterMs to the delay the server
+ * asks for, and returns true. Otherwise the bytes stay in rcvBuffer.
+ */
+bool readBusyResponse(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    uint64_t& retryAfterMs) {
+  if (rcvBuffer.size() == 0) {
+    boost::system::error_code error;
+    boost::asio::read(
+        socket, rcvBuffer, boost::asio::transfer_at_least(1), error);
+    if (error) {
+      LOG(FATAL)
+          << "Read error: " << boost::system::system_error(error).what();
+    }
+  }
+
+  // neither a header nor a frame can start with the busy response's first
+  // byte
+  if (peekBytes(rcvBuffer, 1)[0] != kBusyResponsePrefix[0]) {
+    return false;
+  }
+  const auto response = readUntilDelimiter(socket, rcvBuffer, kDelimiter);
+  if (not parseBusyResponse(response, retryAfterMs)) {
+    LOG(FATAL) << "Invalid response (" << response << ")";
+  }
+  return true;
+}
+
+/**
+ * Read the header of the server's response to the request with requestId.
+ *
+ * Sets numBytes to the number of the file's bytes that follow, and fileSize
+ * to the size of the whole file (only known for byte range requests; for
+ * other requests it's equal to numBytes). Sets compressed if the file's bytes
+ * follow in compressed chunks instead (see receiveCompressedBytes), and
+ * checksummed if a checksum follows them (see verifyChecksum). Returns false
+ * if the server could not serve the request.
+ */
+bool readResponseHeader(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const uint32_t requestId,
+    uint64_t& numBytes,
+    uint64_t& fileSize,
+    bool& compressed,
+    bool& checksummed) {
+  compressed = false;
+  checksummed = false;
+  if (not FLAGS_binary_framing) {
+    // the header holds the # of bytes the server is sending; for byte range
+    // requests, it also holds the size of the whole file
+    // ("<bytes>/<file size>"), and it ends with ";zstd" if the server is
+    // compressing the file and ";crc32c" if a checksum follows the file
+    auto header = readUntilDelimiter(socket, rcvBuffer, kDelimiter);
+    const auto optionStart = header.find(';');
+    if (optionStart != std::string::npos) {
+      std::vector<std::string> options;
+      boost::split(
+          options, header.substr(optionStart + 1), boost::is_any_of(";"));
+      for (const auto& option : options) {
+        if (option == "zstd") {
+          compressed = true;
+        } else if (option == "crc32c") {
+          checksummed = true;
+        } else {
+          LOG(FATAL) << "Invalid header (" << header << "), unknown option";
+        }
+      }
+      header.resize(optionStart);
+    }
+    std::size_t headerPos = 0;
+    try {
+      numBytes = std::stoull(header, &headerPos);
+      fileSize = numBytes;
+      if (headerPos < header.length() && header[headerPos] == '/') {
+        fileSize = std::stoull(header.substr(headerPos + 1));
+      }
+    } catch (const std::exception& e) {
+      LOG(FATAL)
+          << "Invalid header (" << header << "), cannot convert to numBytes";
+    }
+
+    // a file that couldn't be found looks like an empty file
+    return fileSize > 0;
+  }
+
+  // the server acknowledges binary framing before its first response
+  auto header = readFrameHeader(socket, rcvBuffer);
+  if (header.type == FrameType::kHello) {
+    header = readFrameHeader(socket, rcvBuffer);
+  }
+  if (header.requestId != requestId) {
+    LOG(FATAL)
+        << "Response for request ID " << header.requestId
+        << ", expected " << requestId;
+  }
+  if (header.type == FrameType::kError) {
+    numBytes = 0;
+    fileSize = 0;
+    return false;
+  }
+  if (header.type != FrameType::kResponse) {
+    LOG(FATAL)
+        << "Unexpected frame type "
+        << static_cast<int>(static_cast<uint8_t>(header.type));
+  }
+
+  // for byte range requests, the payload starts with the size of the file
+  //
+  // for compressed responses, the number of bytes follows; the bytes
+  // themselves arrive in kChunk frames
+  numBytes = header.length;
+  fileSize = numBytes;
+  if (header.flags & kFrameFlagFileSize) {
+    char fileSizeData[sizeof(uint64_t)];
+    readBytes(socket, rcvBuffer, boost::asio::buffer(fileSizeData));
+    fileSize = decodeUint64(fileSizeData);
+    numBytes -= sizeof(fileSizeData);
+  }
+  if (header.flags & kFrameFlagCompressed) {
+    char numBytesData[sizeof(uint64_t)];
+    readBytes(socket, rcvBuffer, boost::asio::buffer(numBytesData));
+    numBytes = decodeUint64(numBytesData);
+    if (not (header.flags & kFrameFlagFileSize)) {
+      fileSize = numBytes;
+    }
+    compressed = true;
+  }
+  checksummed = header.flags & kFrameFlagChecksum;
+  return true;
+}
 
-  // let the user specity what file they want
-  std::string filename;
-  std::cout << "Enter filename to retrieve: " << std::flush;
-  std::getline(std::cin, filename);
+/**
+ * Receive the chunks of a compressed response, decompressing each one into
+ * outputFileBuf and passing the decompressed bytes to onBytes.
+ *
+ * Each chunk is preceded by its size and a delimiter ("<chunk bytes>#"), or
+ * sent as a kChunk frame with binary framing; an empty chunk ends the
+ * response. Together, the chunks hold a single zstd frame that decompresses
+ * to the numBytes bytes announced in the response's header.
+ */
+void receiveCompressedBytes(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const uint32_t requestId,
+    const uint64_t numBytes,
+    std::vector<char>& outputFileBuf,
+    const std::function<void(const char*, std::size_t)>& onBytes) {
+  Decompressor decompressor;
+  std::vector<char> chunk;
+  uint64_t compressedBytes = 0;
+  uint64_t decompressedBytes = 0;
+  for (;;) {
+    uint64_t chunkBytes = 0;
+    if (FLAGS_binary_framing) {
+      const auto header = readFrameHeader(socket, rcvBuffer);
+      if (header.type != FrameType::kChunk || header.requestId != requestId) {
+        LOG(FATAL)
+            << "Unexpected frame (type "
+            << static_cast<int>(static_cast<uint8_t>(header.type))
+            << ", request ID " << header.requestId
+            << ") in compressed response";
+      }
+      chunkBytes = header.length;
+    } else {
+      const auto header = readUntilDelimiter(socket, rcvBuffer, kDelimiter);
+      try {
+        chunkBytes = std::stoull(header);
+      } catch (const std::exception& e) {
+        LOG(FATAL) << "Invalid chunk header (" << header << ")";
+      }
+    }
+    if (chunkBytes == 0) {
+      break;
+    }
 
-  // send the filename that we want to receive
-  LOG(INFO) << "Requesting file " << filename;
-  sendBytes(socket, filename + "#");
+    // the chunk boundaries don't mean anything to zstd, so each chunk can be
+    // decompressed as soon as it arrives
+    chunk.resize(chunkBytes);
+    readBytes(socket, rcvBuffer, boost::asio::buffer(chunk.data(), chunkBytes));
+    compressedBytes += chunkBytes;
+
+    // the decompressed bytes are handed on right away too, while they're
+    // still in the CPU's cache, so that only one chunk's worth is ever held
+    outputFileBuf.clear();
+    if (not decompressor.decompress(chunk.data(), chunkBytes, outputFileBuf) ||
+        decompressedBytes + outputFileBuf.size() > numBytes) {
+      LOG(FATAL) << "Received corrupt compressed data";
+    }
+    decompressedBytes += outputFileBuf.size();
+    onBytes(outputFileBuf.data(), outputFileBuf.size());
+  }
+  if (not decompressor.isFrameComplete() || decompressedBytes != numBytes) {
+    LOG(FATAL)
+        << "Compressed response ended after " << decompressedBytes
+        << " out of " << numBytes << " bytes";
+  }
+  LOG(INFO)
+      << "Received " << compressedBytes << " compressed bytes for "
+      << numBytes << " bytes";
+}
+
+/**
+ * Receive the checksum that follows a response's bytes, and compare it with
+ * the checksum of the bytes received (see crc32c).
+ *
+ * The checksum is sent as 8 hex digits and a delimiter ("<crc32c>#"), or as a
+ * kChecksum frame with binary framing. Returns false (after logging the
+ * mismatch) if they differ; the caller decides what to do with the bytes it
+ * has already written.
+ */
+bool verifyChecksum(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const uint32_t requestId,
+    const std::string& filename,
+    const uint32_t checksum) {
+  uint32_t expectedChecksum = 0;
+  if (FLAGS_binary_framing) {
+    const auto header = readFrameHeader(socket, rcvBuffer);
+    if (header.type != FrameType::kChecksum ||
+        header.requestId != requestId || header.length != sizeof(uint32_t)) {
+      LOG(FATAL)
+          << "Unexpected frame (type "
+          << static_cast<int>(static_cast<uint8_t>(header.type))
+          << ", request ID " << header.requestId
+          << ") instead of checksum";
+    }
+    char checksumData[sizeof(uint32_t)];
+    readBytes(socket, rcvBuffer, boost::asio::buffer(checksumData));
+    expectedChecksum = decodeUint32(checksumData);
+  } else {
+    const auto trailer = readUntilDelimiter(socket, rcvBuffer, kDelimiter);
+    if (not parseChecksum(trailer, expectedChecksum)) {
+      LOG(FATAL) << "Invalid checksum (" << trailer << ")";
+    }
+  }
+  if (checksum != expectedChecksum) {
+    LOG(ERROR)
+        << "Checksum mismatch for \"" << filename << "\": received bytes have "
+        << formatChecksum(checksum) << ", server sent "
+        << formatChecksum(expectedChecksum);
+    return false;
+  }
+  LOG(INFO)
+      << "Verified checksum " << formatChecksum(checksum) << " of \""
+      << filename << "\"";
+  return true;
+}
+
+void receiveFile(
+    boost::asio::ip::tcp::socket& socket,
+    boost::asio::streambuf& rcvBuffer,
+    const FileRequest& request,
+    const uint32_t requestId,
+    std::vector<char>& outputFileBuf) {
+  const auto& filename = request.filename;
 
   // listen for a message containing the # of bytes the server is sending
-  boost::asio::streambuf rcvBuffer;
-  const auto header = readUntilDelimiter(socket, rcvBuffer, kDelimiter);
-  int numBytes = 0;
-  try {
-    numBytes = std::stoi(header);
-  } catch (const std::invalid_argument& ia) {
-     LOG(FATAL)
-        << "Invalid header (" << header << "), cannot convert to numBytes";
+  uint64_t numBytes = 0;
+  uint64_t fileSize = 0;
+  bool compressed = false;
+  bool checksummed = false;
+  const bool found = readResponseHeader(
+      socket, rcvBuffer, requestId, numBytes, fileSize, compressed,
+      checksummed);
+  if (request.hasRange) {
+    LOG(INFO) << "Whole file is " << fileSize << " bytes";
   }
-  if (numBytes < 0) {
-    LOG(FATAL) << "Invalid header, numBytes = " << numBytes;
+  if (request.checksum && not checksummed && found) {
+    LOG(WARNING) << "Server sent no checksum for \"" << filename << "\"";
   }
-  if (numBytes == 0) {
-    LOG(FATAL) << "Server is returning 0 bytes (maybe could not find file)";
+  if (not found || numBytes == 0) {
+    // the checksum of an empty file still follows, if there is one
+    if (checksummed &&
+        not verifyChecksum(socket, rcvBuffer, requestId, filename, 0)) {
+      LOG(FATAL) << "Server sent a corrupt response";
+    }
+
+    // keep going, other requested files may still be available
+    LOG(ERROR)
+        << "Server is returning 0 bytes for \"" << filename
+        << "\" (maybe could not find file)";
+    return;
   }
   LOG(INFO) << "Server is responding with " << numBytes << " bytes";
 
-  // receive the specified # of bytes
-  const auto outputFileBuf = readBytes(socket, rcvBuffer, numBytes);
-
-  // write the bytes to a file, appended with current timestamp
-  const auto now = std::chrono::system_clock::now();
-  const auto timeSinceEpoch =
-      std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch());
-  const std::string localFilename =
-      filename + "." + std::to_string(timeSinceEpoch.count());
-  std::ofstream outputFile(
-      localFilename, std::ios::out | std::ios::binary | std::ios::trunc);
-  if (outputFile.is_open()) {
+  // write the bytes to the output file if one was set, otherwise to a file
+  // named after the requested file, appended with current timestamp
+  //
+  // a byte range is written at its offset in the output file, keeping the
+  // bytes already in it, so that a partial download can be resumed
+  std::string localFilename = FLAGS_output_file;
+  if (localFilename.empty()) {
+    const auto now = std::chrono::system_clock::now();
+    const auto timeSinceEpoch =
+        std::chrono::duration_cast<std::chrono::seconds>(
+            now.time_since_epoch());
+    localFilename = filename + "." + std::to_string(timeSinceEpoch.count());
+  }
+  const bool resume = request.hasRange && not FLAGS_output_file.empty();
+  FileWriter outputFile;
+  boost::system::error_code error;
+  outputFile.open(
+      localFilename, not resume, resume ? request.offset : 0, numBytes,
+      getFileWriterOptions(), error);
+  if (error) {
+    // the bytes still have to be received, so that the responses after this
+    // one can be parsed
+    LOG(ERROR)
+        << "Unable to save to file \"" << localFilename << "\": "
+        << error.message();
+  } else {
     LOG(INFO) << "Saving to file \"" << localFilename << "\"";
-    outputFile << outputFileBuf;
-    outputFile.close();
-    LOG(INFO)
-        << "Wrote " << outputFileBuf.size()
-        << " bytes to file \"" << localFilename << "\"";
+  }
+  const bool saving = not error;
+
+  // receive the specified # of bytes, writing them to the file a chunk at a
+  // time as they arrive, so that the file never has to fit in memory
+  //
+  // each chunk is checksummed on its way to the file too, rather than in a
+  // pass of their own once the whole file is in
+  uint32_t checksum = 0;
+  ProgressMeter progress(filename, numBytes, FLAGS_progress);
+  const auto saveBytes = [&](const char* data, const std::size_t bytes) {
+    if (checksummed) {
+      checksum = crc32c(checksum, data, bytes);
+    }
+    if (saving) {
+      outputFile.write(data, bytes, error);
+      if (error) {
+        LOG(FATAL)
+            << "Unable to write to file \"" << localFilename << "\": "
+            << error.message();
+      }
+    }
+    progress.add(bytes);
+  };
+  if (compressed) {
+    receiveCompressedBytes(
+        socket, rcvBuffer, requestId, numBytes, outputFileBuf, saveBytes);
   } else {
-    LOG(INFO) << "Unable to save to file \"" << filename << "\"";
+    outputFileBuf.resize(std::max<uint64_t>(
+        std::min<uint64_t>(FLAGS_receive_chunk_bytes, numBytes), 1));
+    for (uint64_t chunkStart = 0; chunkStart < numBytes;
+         chunkStart += outputFileBuf.size()) {
+      const auto chunkBytes =
+          std::min<uint64_t>(outputFileBuf.size(), numBytes - chunkStart);
+      readBytes(
+          socket, rcvBuffer,
+          boost::asio::buffer(outputFileBuf.data(), chunkBytes));
+      saveBytes(outputFileBuf.data(), chunkBytes);
+    }
+  }
+  progress.finish();
+  if (saving) {
+    outputFile.close(error);
+    if (error) {
+      LOG(FATAL)
+          << "Unable to write to file \"" << localFilename << "\": "
+          << error.message();
+    }
   }
 
-  // done
-  LOG(INFO) << "Client exiting";
+  // the bytes are already in the file by the time the checksum arrives, so a
+  // corrupted file is removed (or, when resuming, reported) instead of kept
+  if (checksummed &&
+      not verifyChecksum(socket, rcvBuffer, requestId, filename, checksum)) {
+    if (saving && not resume) {
+      unlink(localFilename.c_str());
+      LOG(FATAL) << "Removed corrupt file \"" << localFilename << "\"";
+    }
+    LOG(FATAL)
+        << "Bytes " << request.offset << " to "
+        << request.offset + numBytes << " of file \"" << localFilename
+        << "\" are corrupt";
+  }
+  if (saving) {
+    LOG(INFO)
+        << "Wrote " << outputFile.getBytesWritten() << " bytes to file \""
+        << localFilename << "\" in " << std::fixed << std::setprecision(3)
+        << progress.getElapsedSeconds() << " s (" << std::setprecision(2)
+        << progress.getMibPerSecond() << " MiB/s)";
+  }
+}
+
+/**
+ * Download a single file over FLAGS_connections parallel connections.
+ *
+ * First asks for an empty byte range over the given socket to learn the size
+ * of the file, then splits the file into one range per connection. Each range
+ * is fetched by its own thread and written straight to its offset in the
+ * output file, so the file never has to fit in memory.
+ */
+void runParallelClient(
+    boost::asio::ip::tcp::socket& socket,
+    const std::string& filename) {
+  // the header of a byte range response holds the size of the whole file
+  FileRequest probe;
+  probe.filename = filename;
+  probe.hasRange = true;
+  probe.length = 0;
+  LOG(INFO) << "Requesting size of file " << filename;
+  boost::asio::streambuf rcvBuffer;
+  connectAndSendRequests(socket, rcvBuffer, {probe});
+  uint64_t numBytes = 0;
+  uint64_t fileSize = 0;
+  bool compressed = false;
+  bool checksummed = false;
+  const bool found = readResponseHeader(
+      socket, rcvBuffer, 1, numBytes, fileSize, compressed, checksummed);
+  if (not found || fileSize == 0) {
+    LOG(FATAL)
+        << "Server is returning 0 bytes for \"" << filename
+        << "\" (maybe could not find file)";
+  }
+  LOG(INFO) << "Whole file is " << fileSize << " bytes";
+
+  // the ranges are fetched over connections of their own, so don't hold on
+  // to one of the server's connection slots (see --max_connections)
+  boost::system::error_code ignoredError;
+  socket.close(ignoredError);
+
+  // create the output file at its final size, so that each thread can write
+  // its range (through a descriptor of its own) without coordinating with the
+  // others
+  std::string localFilename = FLAGS_output_file;
+  if (localFilename.empty()) {
+    const auto now = std::chrono::system_clock::now();
+    const auto timeSinceEpoch =
+        std::chrono::duration_cast<std::chrono::seconds>(
+            now.time_since_epoch());
+    localFilename = filename + "." + std::to_string(timeSinceEpoch.count());
+  }
+  const int outputFd = open(
+      localFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (outputFd < 0) {
+    LOG(FATAL)
+        << "Unable to open file \"" << localFilename << "\": "
+        << strerror(errno);
+  }
+  if (ftruncate(outputFd, fileSize) != 0) {
+    LOG(FATAL)
+        << "Unable to resize file \"" << localFilename << "\": "
+        << strerror(errno);
+  }
+  close(outputFd);
+
+  // split the file into (nearly) equal ranges, one per connection; there's no
+  // point in having more connections than bytes
+  //
+  // with O_DIRECT, the ranges start on block boundaries, so that all of them
+  // (not just the first) can bypass the page cache
+  const auto numConnections = std::min<uint64_t>(FLAGS_connections, fileSize);
+  auto rangeBytes = fileSize / numConnections;
+  if (FLAGS_direct_io && rangeBytes >= FileWriter::kDirectIoAlignment) {
+    rangeBytes -= rangeBytes % FileWriter::kDirectIoAlignment;
+  }
+  LOG(INFO)
+      << "Saving to file \"" << localFilename << "\" over "
+      << numConnections << " connections";
+  ProgressMeter progress(filename, fileSize, FLAGS_progress);
+  std::vector<std::thread> rangeThreads;
+  for (uint64_t i = 0; i < numConnections; i++) {
+    // the last range picks up the remainder
+    const auto offset = i * rangeBytes;
+    const auto length =
+        (i + 1 == numConnections) ? fileSize - offset : rangeBytes;
+    rangeThreads.emplace_back(
+        receiveRange, filename, localFilename, offset, length,
+        std::ref(progress));
+  }
+  for (auto& rangeThread : rangeThreads) {
+    rangeThread.join();
+  }
+  progress.finish();
+
+  // report how fast the whole file arrived, across all connections
+  LOG(INFO)
+      << "Wrote " << fileSize << " bytes to file \"" << localFilename << "\"";
+  std::cout
+      << "Received " << fileSize << " bytes over " << numConnections
+      << " connections in " << std::fixed << std::setprecision(3)
+      << progress.getElapsedSeconds() << " s (" << std::setprecision(2)
+      << progress.getMibPerSecond() << " MiB/s)" << std::endl;
+}
+
+/**
+ * Fetch one byte range of a file over a new connection, writing it to the
+ * same offset in the output file, and counting its bytes in progress.
+ */
+void receiveRange(
+    const std::string& filename,
+    const std::string& localFilename,
+    const uint64_t offset,
+    const uint64_t length,
+    ProgressMeter& progress) {
+  boost::asio::io_service ioService;
+  boost::asio::ip::tcp::socket socket(ioService);
+
+  // ask for the range
+  FileRequest request;
+  request.filename = filename;
+  request.hasRange = true;
+  request.offset = offset;
+  request.length = length;
+  request.checksum = FLAGS_checksum;
+  boost::asio::streambuf rcvBuffer;
+  connectAndSendRequests(socket, rcvBuffer, {request});
+
+  // the server should send exactly the range we asked for
+  uint64_t numBytes = 0;
+  uint64_t fileSize = 0;
+  bool compressed = false;
+  bool checksummed = false;
+  readResponseHeader(
+      socket, rcvBuffer, 1, numBytes, fileSize, compressed, checksummed);
+  if (numBytes != length) {
+    LOG(FATAL)
+        << "Server is returning " << numBytes << " bytes for range at offset "
+        << offset << ", expected " << length;
+  }
+
+  // the other threads are writing the rest of the file, so it must not be
+  // truncated
+  FileWriter outputFile;
+  boost::system::error_code error;
+  outputFile.open(
+      localFilename, false, offset, length, getFileWriterOptions(), error);
+  if (error) {
+    LOG(FATAL)
+        << "Unable to open file \"" << localFilename << "\": "
+        << error.message();
+  }
+
+  // receive the range one buffer at a time, writing each buffer at its
+  // offset in the file
+  //
+  // readBytes hands us any bytes read past the header's delimiter (still in
+  // rcvBuffer) first, then reads the rest straight into our buffer
+  std::vector<char> buffer(std::max<uint64_t>(
+      std::min<uint64_t>(FLAGS_receive_chunk_bytes, length), 1));
+  uint64_t bytesReceived = 0;
+  uint32_t checksum = 0;
+  while (bytesReceived < length) {
+    const auto bytesRead = readBytes(
+        socket, rcvBuffer,
+        boost::asio::buffer(
+            buffer.data(),
+            std::min<uint64_t>(buffer.size(), length - bytesReceived)));
+    if (checksummed) {
+      checksum = crc32c(checksum, buffer.data(), bytesRead);
+    }
+    outputFile.write(buffer.data(), bytesRead, error);
+    if (error) {
+      LOG(FATAL) << "Write error: " << error.message();
+    }
+    bytesReceived += bytesRead;
+    progress.add(bytesRead);
+  }
+  outputFile.close(error);
+  if (error) {
+    LOG(FATAL) << "Write error: " << error.message();
+  }
+  if (checksummed &&
+      not verifyChecksum(socket, rcvBuffer, 1, filename, checksum)) {
+    LOG(FATAL)
+        << "Bytes " << offset << " to " << offset + length << " of file \""
+        << localFilename << "\" are corrupt";
+  } else if (not checksummed && FLAGS_checksum) {
+    LOG(WARNING) << "Server sent no checksum for \"" << filename << "\"";
+  }
+  LOG(INFO)
+      << "Received " << length << " bytes starting at offset " << offset;
+}
+
+/**
+ * Return how downloads are written to their output files, as set by flags.
+ */
+FileWriterOptions getFileWriterOptions() {
+  FileWriterOptions options;
+  options.preallocate = FLAGS_preallocate;
+  options.directIo = FLAGS_direct_io;
+  return options;
 }
@@ -0,0 +1,531 @@
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "Checksum.h"
+#include "Compression.h"
+#include "EgressScheduler.h"
+#include "FileRequest.h"
+#include "ServerMetrics.h"
+#include "SocketUtils.h"
+#include "TokenBucket.h"
+
+// Tests for the parts of the server that can be checked without a network
+//
+//   make test
+//
+// builds the tests and runs them; each test prints a line, and the program
+// exits with a non-zero status if any of them failed.
+
+/**
+ * A connection sending through an EgressScheduler, as the server's connections
+ * do, except that it only ever sends in its turns: it waits for a turn, takes
+ * all of the bytes granted for it, and queues up for the next one, until it
+ * has been granted all it has to send.
+ */
+struct TestFlow {
+  EgressScheduler::Flow flow;
+  uint64_t bytesToSend = 0;
+  uint64_t bytesSent = 0;
+
+  // the scheduler's scheduledBytes once the flow had been granted all of its
+  // bytes
+  uint64_t scheduledBytesWhenDone = 0;
+};
+
+bool testDeficitRoundRobinShares(
+    const std::vector<uint64_t>& weights,
+    const uint64_t chunkBytes,
+    const uint64_t quantumBytes);
+void waitForTurn(
+    EgressScheduler& scheduler,
+    TestFlow& testFlow,
+    const uint64_t chunkBytes);
+bool testCrc32cKnownAnswer();
+bool testCrc32cInPieces();
+bool testFileRequestRoundTrip();
+bool testFileRequestRejectsMalformed();
+bool testFrameHeaderRoundTrip();
+bool testFrameHeaderRejectsMalformed();
+bool testCompressionRoundTrip();
+bool testPrometheusHistogramBuckets();
+std::string makeTestBytes(const std::size_t numBytes);
+bool expect(const bool condition, const std::string& description);
+bool expectLine(const std::string& text, const std::string& line);
+
+int main(int argc, char *argv[]) {
+  FLAGS_logtostderr = true;
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  // with chunks bigger than the quantum, a flow of weight 1 has to save up
+  // its deficit over several rounds before it can send a chunk; with smaller
+  // ones, every flow sends several chunks per turn
+  bool passed = true;
+  passed &= testDeficitRoundRobinShares({1, 1}, 64 * 1024, 16 * 1024);
+  passed &= testDeficitRoundRobinShares({1, 8}, 64 * 1024, 64 * 1024);
+  passed &= testDeficitRoundRobinShares({1, 8}, 4 * 1024, 16 * 1024);
+  passed &= testDeficitRoundRobinShares({1, 2, 4}, 64 * 1024, 64 * 1024);
+  passed &= testCrc32cKnownAnswer();
+  passed &= testCrc32cInPieces();
+  passed &= testFileRequestRoundTrip();
+  passed &= testFileRequestRejectsMalformed();
+  passed &= testFrameHeaderRoundTrip();
+  passed &= testFrameHeaderRejectsMalformed();
+  passed &= testCompressionRoundTrip();
+  passed &= testPrometheusHistogramBuckets();
+  return passed ? 0 : 1;
+}
+
+/**
+ * Have one flow per weight send chunkBytes chunks through an EgressScheduler
+ * with kDeficitRoundRobin, and check that every round grants each flow exactly
+ * its weight's worth of quanta.
+ *
+ * The token bucket is unlimited, so each dispatch serves a whole round, and
+ * nothing depends on how fast the test runs: each flow is given its weight's
+ * share of the bytes to send, and all of them should be granted their last
+ * bytes in the same dispatch.
+ */
+bool testDeficitRoundRobinShares(
+    const std::vector<uint64_t>& weights,
+    const uint64_t chunkBytes,
+    const uint64_t quantumBytes) {
+  // a whole number of chunks and of quanta, so that no flow is part way
+  // through saving up for its next chunk when it's done
+  const uint64_t kBytesPerWeight = 16 * std::max(chunkBytes, quantumBytes);
+  TokenBucket tokenBucket(RateLimit{});
+  boost::asio::io_service ioService;
+  EgressScheduler scheduler(
+      {&ioService}, tokenBucket, EgressPolicy::kDeficitRoundRobin,
+      quantumBytes);
+
+  std::vector<std::unique_ptr<TestFlow>> testFlows;
+  uint64_t totalBytes = 0;
+  for (const auto weight : weights) {
+    testFlows.emplace_back(new TestFlow());
+    scheduler.setWeight(testFlows.back()->flow, weight);
+    testFlows.back()->bytesToSend = weight * kBytesPerWeight;
+    totalBytes += testFlows.back()->bytesToSend;
+  }
+
+  // all of the flows queue up before the first dispatch, so they start in
+  // the same round; the test ends once none of them is waiting any more
+  for (auto& testFlow : testFlows) {
+    waitForTurn(scheduler, *testFlow, chunkBytes);
+  }
+  ioService.run();
+
+  // a dispatch adds up everything it grants before it wakes any of the flows
+  // up, so each flow should see all of the flows' bytes scheduled by the time
+  // it's done; one that finished a round early (or late) sees fewer (or more)
+  bool passed = true;
+  std::string sent;
+  for (const auto& testFlow : testFlows) {
+    if (testFlow->bytesSent != testFlow->bytesToSend ||
+        testFlow->scheduledBytesWhenDone != totalBytes) {
+      passed = false;
+    }
+    char sentStr[128];
+    std::snprintf(
+        sentStr, sizeof(sentStr), "%s%llu of %llu bytes by %llu",
+        sent.empty() ? "" : ", ",
+        static_cast<unsigned long long>(testFlow->bytesSent),
+        static_cast<unsigned long long>(testFlow->bytesToSend),
+        static_cast<unsigned long long>(testFlow->scheduledBytesWhenDone));
+    sent += sentStr;
+  }
+
+  std::string weightsStr;
+  for (const auto weight : weights) {
+    weightsStr += (weightsStr.empty() ? "" : ":") + std::to_string(weight);
+  }
+  std::printf(
+      "%s: deficit round-robin shares at weights %s with %llu byte chunks and "
+      "a %llu byte quantum: %s (of %llu)\n",
+      passed ? "ok" : "FAILED", weightsStr.c_str(),
+      static_cast<unsigned long long>(chunkBytes),
+      static_cast<unsigned long long>(quantumBytes), sent.c_str(),
+      static_cast<unsigned long long>(totalBytes));
+  return passed;
+}
+
+/**
+ * Wait for the flow's next turn, and take the bytes granted for it once it's
+ * woken up.
+ *
+ * The flow queues up for its next turn straight from the wakeup, rather than
+ * from a handler posted to the io_service as the server does, so that it's
+ * back in the queue before the scheduler's timer can fire again.
+ */
+void waitForTurn(
+    EgressScheduler& scheduler,
+    TestFlow& testFlow,
+    const uint64_t chunkBytes) {
+  // the flows never run out of bytes to send as far as the scheduler knows,
+  // so none of them is moved ahead of the round to finish its response
+  scheduler.wait(
+      testFlow.flow, chunkBytes, UINT64_MAX,
+      [&scheduler, &testFlow, chunkBytes]() {
+        testFlow.bytesSent += scheduler.take(testFlow.flow, UINT64_MAX);
+        if (testFlow.bytesSent >= testFlow.bytesToSend) {
+          testFlow.scheduledBytesWhenDone =
+              scheduler.getStats().scheduledBytes;
+          return;
+        }
+        waitForTurn(scheduler, testFlow, chunkBytes);
+      });
+}
+
+/**
+ * Check crc32c against the standard check value for CRC32C, and that an empty
+ * buffer leaves the checksum unchanged.
+ */
+bool testCrc32cKnownAnswer() {
+  bool passed = true;
+  passed &= expect(
+      crc32c(0, "123456789", 9) == 0xe3069283,
+      "crc32c of \"123456789\" is 0xe3069283");
+  passed &= expect(crc32c(0, "", 0) == 0, "crc32c of no bytes is 0");
+  passed &= expect(
+      crc32c(0xe3069283, "", 0) == 0xe3069283,
+      "no bytes leave the crc unchanged");
+  std::printf(
+      "%s: crc32c matches the check value (%s)\n", passed ? "ok" : "FAILED",
+      isCrc32cHardwareAccelerated() ? "hardware" : "software");
+  return passed;
+}
+
+/**
+ * Check that checksumming a buffer in pieces gives the same result as
+ * checksumming it in one call, for pieces that start and end on and off word
+ * boundaries.
+ */
+bool testCrc32cInPieces() {
+  // one byte more than a whole number of words, starting off a word boundary
+  const auto bytes = makeTestBytes(64 * 1024 + 2);
+  const char* data = bytes.data() + 1;
+  const std::size_t numBytes = bytes.size() - 1;
+  const auto expected = crc32c(0, data, numBytes);
+
+  bool passed = true;
+  for (const std::size_t pieceBytes : {1, 3, 7, 8, 13, 4096, 65536}) {
+    uint32_t crc = 0;
+    for (std::size_t offset = 0; offset < numBytes; offset += pieceBytes) {
+      crc = crc32c(
+          crc, data + offset, std::min(pieceBytes, numBytes - offset));
+    }
+    passed &= expect(
+        crc == expected,
+        "crc32c in " + std::to_string(pieceBytes) + " byte pieces");
+  }
+  std::printf(
+      "%s: crc32c in pieces matches crc32c in one call\n",
+      passed ? "ok" : "FAILED");
+  return passed;
+}
+
+/**
+ * Check that requests are parsed into the fields they set, and formatted back
+ * into the same message.
+ */
+bool testFileRequestRoundTrip() {
+  bool passed = true;
+  FileRequest request;
+  passed &= expect(
+      parseFileRequest("linux.jpg", request) &&
+          request.filename == "linux.jpg" && not request.hasRange &&
+          request.offset == 0 &&
+          request.length == FileRequest::kToEndOfFile &&
+          not request.compress && not request.checksum,
+      "plain request");
+  passed &= expect(
+      formatFileRequest(request) == "linux.jpg", "plain request formatted");
+
+  const std::string message =
+      "linux.jpg?offset=1024&length=4096&compress=zstd&checksum=crc32c";
+  passed &= expect(
+      parseFileRequest(message, request) && request.filename == "linux.jpg" &&
+          request.hasRange && request.offset == 1024 &&
+          request.length == 4096 && request.compress && request.checksum,
+      "request with every option");
+  passed &= expect(
+      formatFileRequest(request) == message,
+      "request with every option formatted");
+
+  // a range without a length runs to the end of the file
+  passed &= expect(
+      parseFileRequest("log.txt?offset=18446744073709551615", request) &&
+          request.hasRange && request.offset == UINT64_MAX &&
+          request.length == FileRequest::kToEndOfFile,
+      "range without a length");
+  passed &= expect(
+      formatFileRequest(request) == "log.txt?offset=18446744073709551615",
+      "range without a length formatted");
+
+  // the options may come in any order, and the filename may be empty
+  passed &= expect(
+      parseFileRequest("?checksum=crc32c&length=5", request) &&
+          request.filename.empty() && request.hasRange &&
+          request.offset == 0 && request.length == 5 && request.checksum,
+      "options out of order");
+  passed &= expect(
+      formatFileRequest(request) == "?offset=0&length=5&checksum=crc32c",
+      "options out of order formatted");
+  std::printf(
+      "%s: file requests are parsed and formatted\n",
+      passed ? "ok" : "FAILED");
+  return passed;
+}
+
+/**
+ * Check that requests with malformed or unknown options are rejected.
+ */
+bool testFileRequestRejectsMalformed() {
+  bool passed = true;
+  for (const auto& message : {
+           "a?",
+           "a?offset",
+           "a?offset=",
+           "a?offset=-1",
+           "a?offset=+1",
+           "a?offset=0x10",
+           "a?length=1 ",
+           "a?length=18446744073709551616",
+           "a?offset=1&",
+           "a?compress=gzip",
+           "a?checksum=md5",
+           "a?range=0-1",
+       }) {
+    FileRequest request;
+    passed &= expect(
+        not parseFileRequest(message, request),
+        std::string("rejects ") + message);
+  }
+  std::printf(
+      "%s: malformed file requests are rejected\n",
+      passed ? "ok" : "FAILED");
+  return passed;
+}
+
+/**
+ * Check that a frame header is encoded in the documented layout, the same way
+ * by encodeFrameHeader and appendFrameHeader, and decoded back.
+ */
+bool testFrameHeaderRoundTrip() {
+  FrameHeader header;
+  header.type = FrameType::kResponse;
+  header.flags = kFrameFlagFileSize | kFrameFlagChecksum;
+  header.requestId = 0x01020304;
+  header.length = 0x05060708090a0b0c;
+  EncodedFrameHeader data;
+  encodeFrameHeader(header, data);
+
+  // type, flags, two reserved bytes, then the request ID and the length,
+  // little endian
+  const std::string expected(
+      "\x02\x05\x00\x00\x04\x03\x02\x01"
+      "\x0c\x0b\x0a\x09\x08\x07\x06\x05",
+      kFrameHeaderBytes);
+  bool passed = true;
+  passed &= expect(
+      std::string(data.data(), data.size()) == expected,
+      "encoded layout");
+  std::string str = "x";
+  appendFrameHeader(str, header);
+  passed &= expect(str == "x" + expected, "appended layout");
+
+  FrameHeader decoded;
+  passed &= expect(
+      decodeFrameHeader(std::string_view(data.data(), data.size()), decoded) &&
+          decoded.type == header.type && decoded.flags == header.flags &&
+          decoded.requestId == header.requestId &&
+          decoded.length == header.length,
+      "decoded header");
+
+  // the payload following the header is ignored
+  passed &= expect(
+      decodeFrameHeader(expected + "payload", decoded) &&
+          decoded.length == header.length,
+      "decoded header followed by a payload");
+  std::printf(
+      "%s: frame headers are encoded and decoded\n",
+      passed ? "ok" : "FAILED");
+  return passed;
+}
+
+/**
+ * Check that truncated headers, unknown frame types, and headers using the
+ * reserved bytes are rejected.
+ */
+bool testFrameHeaderRejectsMalformed() {
+  FrameHeader header;
+  header.type = FrameType::kRequest;
+  header.length = 5;
+  std::string valid;
+  appendFrameHeader(valid, header);
+
+  FrameHeader decoded;
+  bool passed = true;
+  passed &= expect(decodeFrameHeader(valid, decoded), "valid header");
+  passed &= expect(
+      not decodeFrameHeader(valid.substr(0, kFrameHeaderBytes - 1), decoded),
+      "rejects a truncated header");
+  for (const auto type : {0x00, 0x07, 0xb0, 0xff}) {
+    auto data = valid;
+    data[0] = static_cast<char>(type);
+    passed &= expect(
+        not decodeFrameHeader(data, decoded),
+        "rejects frame type " + std::to_string(type));
+  }
+  for (const std::size_t reserved : {2, 3}) {
+    auto data = valid;
+    data[reserved] = 1;
+    passed &= expect(
+        not decodeFrameHeader(data, decoded),
+        "rejects reserved byte " + std::to_string(reserved));
+  }
+  std::printf(
+      "%s: malformed frame headers are rejected\n",
+      passed ? "ok" : "FAILED");
+  return passed;
+}
+
+/**
+ * Check that data compressed in pieces decompresses, in other pieces, back to
+ * the same bytes, with a compressor reused across streams as the server does,
+ * and that corrupt data is rejected.
+ */
+bool testCompressionRoundTrip() {
+  // repetitive enough to compress, with some bytes that don't
+  auto input = makeTestBytes(4096);
+  std::string text;
+  while (text.size() < 256 * 1024) {
+    text += "GET /linux.jpg?offset=" + std::to_string(text.size()) + "\n";
+  }
+  input += text;
+
+  Compressor compressor(3);
+  Decompressor decompressor;
+  bool passed = true;
+  for (int stream = 0; stream < 2; stream++) {
+    compressor.reset();
+    std::string compressed;
+    const std::size_t kInputPieceBytes = 10000;
+    for (std::size_t offset = 0; offset < input.size();
+         offset += kInputPieceBytes) {
+      const auto pieceBytes =
+          std::min(kInputPieceBytes, input.size() - offset);
+      passed &= expect(
+          compressor.compress(
+              input.data() + offset, pieceBytes,
+              offset + pieceBytes == input.size(), compressed),
+          "compress");
+    }
+    passed &= expect(compressed.size() < input.size(), "output is smaller");
+
+    decompressor.reset();
+    std::vector<char> output;
+    const std::size_t kCompressedPieceBytes = 1000;
+    for (std::size_t offset = 0; offset < compressed.size();
+         offset += kCompressedPieceBytes) {
+      passed &= expect(
+          not decompressor.isFrameComplete(), "frame incomplete until the end");
+      passed &= expect(
+          decompressor.decompress(
+              compressed.data() + offset,
+              std::min(kCompressedPieceBytes, compressed.size() - offset),
+              output),
+          "decompress");
+    }
+    passed &= expect(decompressor.isFrameComplete(), "frame complete");
+    passed &= expect(
+        std::string(output.begin(), output.end()) == input,
+        "round trip " + std::to_string(stream + 1));
+  }
+
+  decompressor.reset();
+  std::vector<char> output;
+  const std::string corrupt = "not a zstd frame";
+  passed &= expect(
+      not decompressor.decompress(corrupt.data(), corrupt.size(), output),
+      "rejects data that isn't zstd");
+  std::printf(
+      "%s: compressed data decompresses to the same bytes\n",
+      passed ? "ok" : "FAILED");
+  return passed;
+}
+
+/**
+ * Check that the exported histogram buckets count the values up to and
+ * including their le bound, and that bounds and sums are printed exactly.
+ */
+bool testPrometheusHistogramBuckets() {
+  // 1023 us is the largest value in the bucket bounded by 0.001023 seconds,
+  // and 1024 us the smallest in the next one
+  Histogram histogram;
+  histogram.record(1023);
+  histogram.record(1024);
+  ServerMetricsSnapshot snapshot;
+  snapshot.histograms[static_cast<std::size_t>(HistogramMetric::kFileOpen)] =
+      histogram.getSnapshot();
+  const auto text = formatPrometheusMetrics(snapshot, {});
+
+  bool passed = true;
+  passed &= expectLine(
+      text, "pa4_file_open_seconds_bucket{le=\"0.000511\"} 0");
+  passed &= expectLine(
+      text, "pa4_file_open_seconds_bucket{le=\"0.001023\"} 1");
+  passed &= expectLine(
+      text, "pa4_file_open_seconds_bucket{le=\"0.002047\"} 2");
+  passed &= expectLine(
+      text, "pa4_file_open_seconds_bucket{le=\"4.194303\"} 2");
+  passed &= expectLine(text, "pa4_file_open_seconds_sum 0.002047");
+  passed &= expectLine(text, "pa4_file_open_seconds_count 2");
+  std::printf(
+      "%s: Prometheus histogram buckets are inclusive and exact\n",
+      passed ? "ok" : "FAILED");
+  return passed;
+}
+
+/**
+ * Return numBytes bytes that vary from byte to byte (the same bytes every
+ * time).
+ */
+std::string makeTestBytes(const std::size_t numBytes) {
+  std::string bytes(numBytes, '\0');
+  uint32_t state = 1;
+  for (auto& byte : bytes) {
+    state = state * 1103515245 + 12345;
+    byte = static_cast<char>(state >> 24);
+  }
+  return bytes;
+}
+
+/**
+ * Return condition, printing description if it's false.
+ */
+bool expect(const bool condition, const std::string& description) {
+  if (not condition) {
+    std::printf("failed: %s\n", description.c_str());
+  }
+  return condition;
+}
+
+/**
+ * Return whether text holds line as one of its lines, printing the line if it
+ * doesn't.
+ */
+bool expectLine(const std::string& text, const std::string& line) {
+  if (("\n" + text).find("\n" + line + "\n") != std::string::npos) {
+    return true;
+  }
+  std::printf("missing line: %s\n", line.c_str());
+  return false;
+}
@@ -0,0 +1,457 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "SeqLock.h"
+
+// Contention microbenchmarks for the synchronization patterns of main.cpp
+//
+// main.cpp shares an std::atomic<int> counter and a mutex-guarded string
+// between threads, as the pa4 server does with nextClientID_ and each
+// client's request info. This measures how those patterns, and the
+// alternatives the server uses in its hot paths, hold up as threads are
+// added:
+//
+//   mutex             all threads increment one counter under an std::mutex
+//   spinlock          ... under a test-and-test-and-set spinlock
+//   atomic            ... with an atomic fetch_add
+//   sharded_packed    each thread increments a counter of its own (as
+//                     ServerMetrics does), with the counters packed next to
+//                     each other, so that they share cache lines (false
+//                     sharing)
+//   sharded_padded    ... with each counter on a cache line of its own
+//   snapshot_mutex    one thread publishes a struct of progress counters
+//                     while the others read consistent snapshots of it, all
+//                     under an std::mutex
+//   snapshot_seqlock  ... through the server's SeqLock
+//
+// Each pattern is run with each number of threads, and checked: a counter
+// must end up with every increment, and a snapshot must never be torn.
+// Prints a JSON summary so that results can be compared across commits, e.g.:
+//
+//   make pa4-threads-bench && ./pa4-threads-bench --bench_threads=1,4,16
+//
+// (`make bench` builds the benchmark and runs it with its default settings)
+//
+// Spinlocks and seqlock readers burn CPU while they wait, so their numbers are
+// only meaningful with no more threads than the machine has cores.
+
+DEFINE_string(
+    bench_patterns,
+    "mutex,spinlock,atomic,sharded_packed,sharded_padded,snapshot_mutex,"
+    "snapshot_seqlock",
+    "Comma separated list of the patterns to run");
+DEFINE_string(
+    bench_threads, "1,2,4,8",
+    "Comma separated list of the numbers of threads to run each pattern with");
+DEFINE_uint64(
+    bench_ops, 1000000,
+    "Number of operations (increments, stores or loads) done by each thread");
+DEFINE_int32(
+    bench_repetitions, 3,
+    "Number of times each pattern is run with each number of threads; the "
+    "fastest run is reported, as the one least disturbed by the rest of the "
+    "system");
+DEFINE_string(
+    bench_output, "",
+    "File to write the JSON results to (default = stdout)");
+
+// size of a cache line on the machines we run on (x86-64 and most ARM cores)
+constexpr std::size_t kCacheLineBytes = 64;
+
+/**
+ * Outcome of one run of a pattern.
+ */
+struct PatternResult {
+  // from the moment all threads were released until the last one finished
+  double seconds = 0;
+
+  // failed checks (lost increments, torn snapshots)
+  uint64_t errors = 0;
+};
+
+/**
+ * A pattern, see the list at the top.
+ */
+struct Pattern {
+  std::string name;
+  std::function<PatternResult(const int numThreads, const uint64_t numOps)>
+      run;
+};
+
+/**
+ * Minimal test-and-test-and-set spinlock, usable with std::lock_guard.
+ *
+ * Waiting threads spin on a plain load, which is served from their own cache
+ * until the lock is released, instead of hammering the cache line with
+ * exchanges.
+ */
+class SpinLock {
+ public:
+  void lock() {
+    while (locked_.exchange(true, std::memory_order_acquire)) {
+      while (locked_.load(std::memory_order_relaxed)) {
+        cpuRelax();
+      }
+    }
+  }
+
+  void unlock() {
+    locked_.store(false, std::memory_order_release);
+  }
+
+  /**
+   * Tell the CPU we're spinning, so that it can save power and give way to the
+   * other hardware thread of the core.
+   */
+  static void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+
+ private:
+  std::atomic<bool> locked_{false};
+};
+
+/**
+ * Progress counters published by one thread and read by the others, shaped
+ * like the server's ClientRequestProgress (which is published through a
+ * SeqLock).
+ *
+ * The writer sets every field to the same value, so that a reader can tell a
+ * torn snapshot (one mixing two stores) from a consistent one.
+ */
+struct BenchProgress {
+  uint64_t offset = 0;
+  uint64_t bytesTransferred = 0;
+  uint64_t bytesToTransfer = 0;
+  uint64_t compressedBytesSent = 0;
+};
+
+/**
+ * Per-thread counters for the sharded patterns: packed next to each other (8
+ * to a cache line), or each padded out to a cache line of its own.
+ */
+struct PackedCounter {
+  std::atomic<uint64_t> value{0};
+};
+struct alignas(kCacheLineBytes) PaddedCounter {
+  std::atomic<uint64_t> value{0};
+};
+static_assert(sizeof(PackedCounter) == sizeof(uint64_t), "packed counter");
+static_assert(sizeof(PaddedCounter) == kCacheLineBytes, "padded counter");
+
+std::vector<uint64_t> parseList(const std::string& list, const char* flag);
+std::vector<Pattern> getPatterns();
+double runThreads(
+    const int numThreads,
+    const std::function<void(const int threadIndex)>& body);
+template <typename Lock>
+PatternResult runLockedCounter(const int numThreads, const uint64_t numOps);
+PatternResult runAtomicCounter(const int numThreads, const uint64_t numOps);
+template <typename Counter>
+PatternResult runShardedCounter(const int numThreads, const uint64_t numOps);
+PatternResult runMutexSnapshot(const int numThreads, const uint64_t numOps);
+PatternResult runSeqLockSnapshot(const int numThreads, const uint64_t numOps);
+bool isTorn(const BenchProgress& progress);
+
+int main(int argc, char *argv[]) {
+  FLAGS_logtostderr = true;
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_bench_ops == 0 || FLAGS_bench_repetitions <= 0) {
+    LOG(FATAL) << "--bench_ops and --bench_repetitions must be positive";
+  }
+  const auto threadCounts = parseList(FLAGS_bench_threads, "--bench_threads");
+
+  // run the patterns in the order they were listed
+  std::vector<std::string> patternNames;
+  boost::split(patternNames, FLAGS_bench_patterns, boost::is_any_of(","));
+  const auto patterns = getPatterns();
+  std::vector<std::string> resultsJson;
+  uint64_t totalErrors = 0;
+  for (const auto& patternName : patternNames) {
+    const auto pattern = std::find_if(
+        patterns.begin(), patterns.end(),
+        [&patternName](const Pattern& p) { return p.name == patternName; });
+    if (pattern == patterns.end()) {
+      LOG(FATAL) << "Unknown pattern \"" << patternName << "\"";
+    }
+
+    for (const auto numThreads : threadCounts) {
+      PatternResult best;
+      for (int i = 0; i < FLAGS_bench_repetitions; i++) {
+        const auto result = pattern->run(numThreads, FLAGS_bench_ops);
+        if (i == 0 || result.seconds < best.seconds) {
+          best.seconds = result.seconds;
+        }
+        best.errors += result.errors;
+      }
+      if (best.errors > 0) {
+        LOG(ERROR)
+            << pattern->name << " with " << numThreads << " threads failed "
+            << best.errors << " checks";
+      }
+      totalErrors += best.errors;
+
+      // ns_per_op is the time one operation takes as seen by a thread, and
+      // ops_per_second the throughput of all threads together
+      const auto seconds = std::max(best.seconds, 1e-9);
+      std::ostringstream json;
+      json << std::fixed << std::setprecision(3)
+           << "    {\"pattern\": \"" << pattern->name << "\""
+           << ", \"threads\": " << numThreads
+           << ", \"seconds\": " << seconds
+           << ", \"ns_per_op\": " << seconds * 1e9 / FLAGS_bench_ops
+           << ", \"ops_per_second\": "
+           << numThreads * FLAGS_bench_ops / seconds
+           << ", \"errors\": " << best.errors << "}";
+      resultsJson.push_back(json.str());
+    }
+  }
+
+  // write the results as JSON
+  std::ostringstream json;
+  json
+      << "{\n"
+      << "  \"ops_per_thread\": " << FLAGS_bench_ops << ",\n"
+      << "  \"repetitions\": " << FLAGS_bench_repetitions << ",\n"
+      << "  \"hardware_threads\": " << std::thread::hardware_concurrency()
+      << ",\n"
+      << "  \"results\": [\n"
+      << boost::algorithm::join(resultsJson, ",\n") << "\n"
+      << "  ]\n"
+      << "}\n";
+  if (FLAGS_bench_output.empty()) {
+    std::cout << json.str();
+  } else {
+    std::ofstream output(FLAGS_bench_output);
+    output << json.str();
+    if (not output) {
+      LOG(FATAL) << "Unable to write to file \"" << FLAGS_bench_output << "\"";
+    }
+  }
+  return totalErrors == 0 ? 0 : 1;
+}
+
+/**
+ * Parse a comma separated list of positive numbers passed to flag.
+ */
+std::vector<uint64_t> parseList(const std::string& list, const char* flag) {
+  std::vector<std::string> fields;
+  boost::split(fields, list, boost::is_any_of(","));
+  std::vector<uint64_t> values;
+  for (const auto& field : fields) {
+    try {
+      std::size_t pos = 0;
+      const auto value = std::stoull(field, &pos);
+      if (pos != field.size() || value == 0) {
+        throw std::invalid_argument(field);
+      }
+      values.push_back(value);
+    } catch (const std::exception&) {
+      LOG(FATAL) << "Invalid value \"" << field << "\" for " << flag;
+    }
+  }
+  return values;
+}
+
+/**
+ * Return all of the patterns, see the list at the top.
+ */
+std::vector<Pattern> getPatterns() {
+  return {
+      {"mutex", runLockedCounter<std::mutex>},
+      {"spinlock", runLockedCounter<SpinLock>},
+      {"atomic", runAtomicCounter},
+      {"sharded_packed", runShardedCounter<PackedCounter>},
+      {"sharded_padded", runShardedCounter<PaddedCounter>},
+      {"snapshot_mutex", runMutexSnapshot},
+      {"snapshot_seqlock", runSeqLockSnapshot},
+  };
+}
+
+/**
+ * Run body on numThreads threads (passing each its index, starting at 0), and
+ * return the seconds from the moment they were all released until the last
+ * one finished.
+ *
+ * The threads are released together once all of them have started, so that
+ * the time it takes to create them isn't measured, and they all contend from
+ * the first operation on.
+ */
+double runThreads(
+    const int numThreads,
+    const std::function<void(const int threadIndex)>& body) {
+  std::atomic<int> numReady(0);
+  std::atomic<bool> go(false);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < numThreads; i++) {
+    threads.emplace_back([&, i]() {
+      numReady++;
+      while (not go.load(std::memory_order_acquire)) {
+        SpinLock::cpuRelax();
+      }
+      body(i);
+    });
+  }
+  while (numReady.load() < numThreads) {
+    std::this_thread::yield();
+  }
+
+  const auto startTime = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - startTime;
+  return elapsed.count();
+}
+
+/**
+ * Every thread increments one shared counter numOps times, holding a Lock
+ * (std::mutex or SpinLock) for each increment.
+ */
+template <typename Lock>
+PatternResult runLockedCounter(const int numThreads, const uint64_t numOps) {
+  Lock lock;
+  uint64_t counter = 0;
+  PatternResult result;
+  result.seconds = runThreads(numThreads, [&](const int) {
+    for (uint64_t i = 0; i < numOps; i++) {
+      std::lock_guard<Lock> guard(lock);
+      counter++;
+    }
+  });
+  result.errors = counter == numThreads * numOps ? 0 : 1;
+  return result;
+}
+
+/**
+ * Every thread increments one shared atomic counter numOps times (as the
+ * server hands out client IDs).
+ *
+ * The increments are relaxed: the counter doesn't order any other memory, so
+ * what's measured is the cost of sharing its cache line.
+ */
+PatternResult runAtomicCounter(const int numThreads, const uint64_t numOps) {
+  std::atomic<uint64_t> counter(0);
+  PatternResult result;
+  result.seconds = runThreads(numThreads, [&](const int) {
+    for (uint64_t i = 0; i < numOps; i++) {
+      counter.fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+  result.errors = counter.load() == numThreads * numOps ? 0 : 1;
+  return result;
+}
+
+/**
+ * Every thread increments a Counter of its own numOps times, and the counters
+ * are added up at the end.
+ *
+ * Only one thread writes each counter, so an increment is a plain load and
+ * store (as in ServerMetrics::increment) rather than a locked read-modify-
+ * write; whether the counters share cache lines depends on Counter's size.
+ */
+template <typename Counter>
+PatternResult runShardedCounter(const int numThreads, const uint64_t numOps) {
+  std::vector<Counter> counters(numThreads);
+  PatternResult result;
+  result.seconds = runThreads(numThreads, [&](const int threadIndex) {
+    auto& counter = counters[threadIndex].value;
+    for (uint64_t i = 0; i < numOps; i++) {
+      counter.store(
+          counter.load(std::memory_order_relaxed) + 1,
+          std::memory_order_relaxed);
+    }
+  });
+  uint64_t total = 0;
+  for (const auto& counter : counters) {
+    total += counter.value.load();
+  }
+  result.errors = total == numThreads * numOps ? 0 : 1;
+  return result;
+}
+
+/**
+ * Thread 0 publishes numOps new values of a BenchProgress under a mutex,
+ * while the other threads each copy it out numOps times under the same mutex.
+ */
+PatternResult runMutexSnapshot(const int numThreads, const uint64_t numOps) {
+  std::mutex mutex;
+  BenchProgress progress;
+  std::atomic<uint64_t> tornSnapshots(0);
+  PatternResult result;
+  result.seconds = runThreads(numThreads, [&](const int threadIndex) {
+    for (uint64_t i = 1; i <= numOps; i++) {
+      if (threadIndex == 0) {
+        std::lock_guard<std::mutex> guard(mutex);
+        progress.offset = progress.bytesTransferred =
+            progress.bytesToTransfer = progress.compressedBytesSent = i;
+      } else {
+        BenchProgress snapshot;
+        {
+          std::lock_guard<std::mutex> guard(mutex);
+          snapshot = progress;
+        }
+        if (isTorn(snapshot)) {
+          tornSnapshots++;
+        }
+      }
+    }
+  });
+  result.errors = tornSnapshots.load();
+  return result;
+}
+
+/**
+ * Thread 0 publishes numOps new values of a BenchProgress through a SeqLock,
+ * while the other threads each load a snapshot of it numOps times.
+ */
+PatternResult runSeqLockSnapshot(const int numThreads, const uint64_t numOps) {
+  SeqLock<BenchProgress> progress;
+  std::atomic<uint64_t> tornSnapshots(0);
+  PatternResult result;
+  result.seconds = runThreads(numThreads, [&](const int threadIndex) {
+    for (uint64_t i = 1; i <= numOps; i++) {
+      if (threadIndex == 0) {
+        BenchProgress value;
+        value.offset = value.bytesTransferred = value.bytesToTransfer =
+            value.compressedBytesSent = i;
+        progress.store(value);
+      } else if (isTorn(progress.load())) {
+        tornSnapshots++;
+      }
+    }
+  });
+  result.errors = tornSnapshots.load();
+  return result;
+}
+
+/**
+ * Return whether a snapshot mixes fields from different stores.
+ */
+bool isTorn(const BenchProgress& progress) {
+  return progress.bytesTransferred != progress.offset ||
+         progress.bytesToTransfer != progress.offset ||
+         progress.compressedBytesSent != progress.offset;
+}